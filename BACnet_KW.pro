@@ -23,8 +23,14 @@ SOURCES += main.cpp \
     bacnetvirtuallinklayer.cpp \
     bacnetnetworklayer.cpp \
     bacnetbbmdhandler.cpp \
+    bacnetbroadcastfilter.cpp \
     bacnetbipaddress.cpp \
     bacnetudptransportlayer.cpp \
+    bacnetudpreceiveworker.cpp \
+    bacnetpcapfile.cpp \
+    bacnetpcapreplaytransportlayer.cpp \
+    bacnetloopbacknetwork.cpp \
+    bacnetloopbacktransportlayer.cpp \
     bacnetbiptransportlayer.cpp \
     bacnetaddress.cpp \
     bacnetrouter.cpp \
@@ -42,6 +48,7 @@ SOURCES += main.cpp \
     datamodel/cdm.cpp \
     bacnettsm.cpp \
     bacnetreadpropertyack.cpp \ # bacnetreadpropertyservice.cpp \
+    bacnetreadpropertymultipleack.cpp \
     bacnetcommon.cpp \
     bacnetobjectinternalsupport.cpp \
     #bacnetexternalobjects.cpp \
@@ -73,16 +80,20 @@ SOURCES += main.cpp \
     covsubscriptionstimehandler.cpp \
     discoverywrapper.cpp \
     invokeidgenerator.cpp \
+    timingwheel.cpp \
     routingtable.cpp \
     \
     internal/internalsubscribecovrequesthandler.cpp \
     internal/internalwprequesthandler.cpp \
+    internal/internalwpmrequesthandler.cpp \
     internal/internalunconfirmedrequesthandler.cpp \
     internal/internalwhoisrequesthandler.cpp \
     internal/internalwhohasrequesthandler.cpp \
     internal/internalobjectshandler.cpp \
+    internal/internaldeviceregistry.cpp \
     internal/internalsubscribecovservicehandler.cpp \
     internal/internalrprequesthandler.cpp \
+    internal/internalrpmrequesthandler.cpp \
     internal/bacnetobject2.cpp \
     internal/deviceobject.cpp \
     internal/bacnetproperty.cpp \
@@ -92,14 +103,18 @@ SOURCES += main.cpp \
     \
     external/externalservicehandler.cpp \
     external/bacnetwritepropertyservicehandler.cpp \
+    external/bacnetwritepropertymultipleservicehandler.cpp \
     external/bacnetreadpropertyservicehandler.cpp \
+    external/bacnetreadpropertymultipleservicehandler.cpp \
     external/externalobjectshandler.cpp \
     \
     applayer/writepropertyservicedata.cpp \
+    applayer/writepropertymultipleservicedata.cpp \
     applayer/whoisservicedata.cpp \
     applayer/whohasservicedata.cpp \
     applayer/subscribecovservicedata.cpp \
     applayer/readpropertyservicedata.cpp \
+    applayer/readpropertymultipleservicedata.cpp \
     applayer/ihaveservicedata.cpp \
     applayer/remoteobjectstodevicemapper.cpp \
     applayer/iamservicedata.cpp \
@@ -142,8 +157,14 @@ SOURCES += main.cpp \
 HEADERS += bacnetvirtuallinklayer.h \
     bacnetnetworklayer.h \
     bacnetbbmdhandler.h \
+    bacnetbroadcastfilter.h \
     bacnetbipaddress.h \
     bacnetudptransportlayer.h \
+    bacnetudpreceiveworker.h \
+    bacnetpcapfile.h \
+    bacnetpcapreplaytransportlayer.h \
+    bacnetloopbacknetwork.h \
+    bacnetloopbacktransportlayer.h \
     bacnetcommon.h \
     bacnettransportlayer.h \
     bacnetbiptransportlayer.h \
@@ -163,6 +184,7 @@ HEADERS += bacnetvirtuallinklayer.h \
     asynchsetter.h \
     bacnettsm.h \
     bacnetreadpropertyack.h \
+    bacnetreadpropertymultipleack.h \
     datamodel/cdm.h \
     bacnetservice.h \ # bacneterrorack.h \
 # bacnetreadpropertyservice.h \
@@ -198,6 +220,7 @@ HEADERS += bacnetvirtuallinklayer.h \
     covsubscriptionstimehandler.h \
     discoverywrapper.h \
     invokeidgenerator.h \
+    timingwheel.h \
     routingtable.h \
     \
     internal/internalconfirmedrequesthandler.h \
@@ -205,10 +228,13 @@ HEADERS += bacnetvirtuallinklayer.h \
     internal/internalwhoisrequesthandler.h \
     internal/internalwhohasrequesthandler.h \
     internal/internalwprequesthandler.h \
+    internal/internalwpmrequesthandler.h \
     internal/internalsubscribecovrequesthandler.h \
     internal/internalsubscribecovservicehandler.h \
     internal/internalobjectshandler.h \
+    internal/internaldeviceregistry.h \
     internal/internalrprequesthandler.h \
+    internal/internalrpmrequesthandler.h \
     internal/bacnetobject2.h \
     internal/deviceobject.h \
     internal/bacnetproperty.h \
@@ -219,14 +245,18 @@ HEADERS += bacnetvirtuallinklayer.h \
     external/externalservicehandler.h \
     external/externalconfirmedservicehandler.h \
     external/bacnetwritepropertyservicehandler.h \
+    external/bacnetwritepropertymultipleservicehandler.h \
     external/externalobjectshandler.h \
     external/bacnetreadpropertyservicehandler.h \
+    external/bacnetreadpropertymultipleservicehandler.h \
     \
     applayer/writepropertyservicedata.h \
+    applayer/writepropertymultipleservicedata.h \
     applayer/whoisservicedata.h \
     applayer/whohasservicedata.h \
     applayer/subscribecovservicedata.h \
     applayer/readpropertyservicedata.h \
+    applayer/readpropertymultipleservicedata.h \
     applayer/ihaveservicedata.h \
     applayer/remoteobjectstodevicemapper.h \
     applayer/iamservicedata.h \
@@ -0,0 +1,16 @@
+# -------------------------------------------------
+# Multi-node simulator harness - the same sources as the gateway,
+# but with its own main() (simulator/bacnetsimulatormain.cpp).
+# -------------------------------------------------
+include(BACnet_KW.pro)
+
+TARGET = BACnet_Sim
+
+INCLUDEPATH += simulator
+
+SOURCES -= main.cpp
+SOURCES += simulator/bacnetsimulatormain.cpp \
+    simulator/bacnetsimulator.cpp \
+    simulator/bacnetsimloadgenerator.cpp
+HEADERS += simulator/bacnetsimulator.h \
+    simulator/bacnetsimloadgenerator.h
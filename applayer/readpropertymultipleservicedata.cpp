@@ -0,0 +1,152 @@
+#include "readpropertymultipleservicedata.h"
+
+#include "bacnetcoder.h"
+#include "bacnettagparser.h"
+
+using namespace Bacnet;
+
+ReadPropertyMultipleServiceData::ReadPropertyMultipleServiceData()
+{
+}
+
+void ReadPropertyMultipleServiceData::append(ObjectIdStruct objId, BacnetPropertyNS::Identifier propertyId, quint32 arrayIndex)
+{
+    references.append(ReadPropertyServiceData(objId, propertyId, arrayIndex));
+}
+
+qint32 ReadPropertyMultipleServiceData::fromRaw(quint8 *serviceData, quint16 bufferLength)
+{
+    BacnetTagParser bParser(serviceData, bufferLength);
+
+    qint16 ret;
+    qint32 consumedBytes(0);
+    bool convOkOrCtxt;
+
+    references.clear();
+    while (bParser.hasNext()) {
+        //parse object identifier
+        ret = bParser.parseNext();
+        ObjectIdStruct objId = bParser.toObjectId(&convOkOrCtxt);
+        if (ret < 0 || !bParser.isContextTag(0))
+            return -1;
+        consumedBytes += ret;
+
+        //list of property references
+        ret = bParser.parseNext();
+        if (ret < 0 || !bParser.isOpeningTag(1))
+            return -2;
+        consumedBytes += ret;
+
+        //array index tag is of the same number as closing tag of the list, so we can't peek - reference is appended, when the next token is known
+        int refsCount(0);
+        BacnetPropertyNS::Identifier propertyId(BacnetPropertyNS::UndefinedProperty);
+        quint32 arrayIndex(ArrayIndexNotPresent);
+        forever {
+            ret = bParser.parseNext();
+            if (ret <= 0)
+                return -3;
+            consumedBytes += ret;
+
+            bool closesList = bParser.isClosingTag(1);
+            if ( (closesList || bParser.isContextTag(0)) && (BacnetPropertyNS::UndefinedProperty != propertyId) ) {
+                append(objId, propertyId, arrayIndex);
+                ++refsCount;
+                propertyId = BacnetPropertyNS::UndefinedProperty;
+                arrayIndex = ArrayIndexNotPresent;
+            }
+
+            if (closesList) {
+                break;
+            } else if (bParser.isContextTag(0)) {
+                propertyId = (BacnetPropertyNS::Identifier)bParser.toUInt(&convOkOrCtxt);
+                if (!convOkOrCtxt)
+                    return -4;
+            } else if (bParser.isContextTag(1) && (BacnetPropertyNS::UndefinedProperty != propertyId) &&
+                       (ArrayIndexNotPresent == arrayIndex)) {//OPTIONAL array index
+                arrayIndex = bParser.toUInt(&convOkOrCtxt);
+                if (!convOkOrCtxt)
+                    return -5;
+            } else
+                return -5;
+        }
+
+        //list of property references may not be empty
+        if (0 == refsCount)
+            return -BacnetRejectNS::ReasonMissingRequiredParameter;
+    }
+
+    if (references.isEmpty())
+        return -BacnetRejectNS::ReasonMissingRequiredParameter;
+
+    return consumedBytes;
+}
+
+qint32 ReadPropertyMultipleServiceData::toRaw(quint8 *startPtr, quint16 bufferLength)
+{
+    Q_CHECK_PTR(startPtr);
+    Q_ASSERT(!references.isEmpty());
+    quint8 *actualPtr(startPtr);
+    quint16 leftLength(bufferLength);
+    qint32 ret;
+
+    for (int i = 0; i < references.count(); ++i) {
+        ReadPropertyServiceData &ref = references[i];
+        bool objectStarts = (0 == i) || (objIdToNum(references.at(i - 1).objId) != objIdToNum(ref.objId));
+
+        if (objectStarts) {
+            //close previous object's list of references
+            if (0 != i) {
+                ret = BacnetCoder::closingTagToRaw(actualPtr, leftLength, 1);
+                if (ret <= 0) {
+                    qDebug("%s : cannot encode closing tag: %d", __PRETTY_FUNCTION__, ret);
+                    return -1;
+                }
+                actualPtr += ret;
+                leftLength -= ret;
+            }
+
+            ret = BacnetCoder::objectIdentifierToRaw(actualPtr, leftLength, ref.objId, true, 0);
+            if (ret <= 0) {
+                qDebug("%s : cannot encode objId: %d", __PRETTY_FUNCTION__, ret);
+                return -1;
+            }
+            actualPtr += ret;
+            leftLength -= ret;
+
+            ret = BacnetCoder::openingTagToRaw(actualPtr, leftLength, 1);
+            if (ret <= 0) {
+                qDebug("%s : cannot encode opening tag: %d", __PRETTY_FUNCTION__, ret);
+                return -1;
+            }
+            actualPtr += ret;
+            leftLength -= ret;
+        }
+
+        ret = BacnetCoder::uintToRaw(actualPtr, leftLength, ref.propertyId, true, 0);
+        if (ret <= 0) {
+            qDebug("%s : cannot encode propId: %d", __PRETTY_FUNCTION__, ret);
+            return -1;
+        }
+        actualPtr += ret;
+        leftLength -= ret;
+
+        if (ArrayIndexNotPresent != ref.arrayIndex) {
+            ret = BacnetCoder::uintToRaw(actualPtr, leftLength, ref.arrayIndex, true, 1);
+            if (ret <= 0) {
+                qDebug("%s : cannot encode arrayIndex: %d", __PRETTY_FUNCTION__, ret);
+                return -1;
+            }
+            actualPtr += ret;
+            leftLength -= ret;
+        }
+    }
+
+    ret = BacnetCoder::closingTagToRaw(actualPtr, leftLength, 1);
+    if (ret <= 0) {
+        qDebug("%s : cannot encode closing tag: %d", __PRETTY_FUNCTION__, ret);
+        return -1;
+    }
+    actualPtr += ret;
+
+    return actualPtr - startPtr;
+}
@@ -0,0 +1,32 @@
+#ifndef READPROPERTYMULTIPLESERVICEDATA_H
+#define READPROPERTYMULTIPLESERVICEDATA_H
+
+#include "bacnetcommon.h"
+#include "bacnetservicedata.h"
+#include "readpropertyservicedata.h"
+
+namespace Bacnet {
+
+    /**
+      ReadPropertyMultiple request data. Property references are kept flat - consecutive references of the same object are
+      encoded as one ReadAccessSpecification (and parsed specifications are flattened the same way).
+      */
+    class ReadPropertyMultipleServiceData:
+            public BacnetServiceData
+    {
+    public:
+        ReadPropertyMultipleServiceData();
+
+        void append(ObjectIdStruct objId, BacnetPropertyNS::Identifier propertyId, quint32 arrayIndex = Bacnet::ArrayIndexNotPresent);
+
+    public://overridden BacnetServiceData methods
+        virtual qint32 fromRaw(quint8 *serviceData, quint16 bufferLength);
+        virtual qint32 toRaw(quint8 *startPtr, quint16 bufferLength);
+
+    public:
+        QList<ReadPropertyServiceData> references;
+    };
+
+}
+
+#endif // READPROPERTYMULTIPLESERVICEDATA_H
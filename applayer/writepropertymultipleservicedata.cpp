@@ -0,0 +1,133 @@
+#include "writepropertymultipleservicedata.h"
+
+#include "bacnetcoder.h"
+#include "bacnettagparser.h"
+
+using namespace Bacnet;
+
+WritePropertyMultipleServiceData::WritePropertyMultipleServiceData()
+{
+}
+
+void WritePropertyMultipleServiceData::append(ObjectIdentifier &objId, BacnetPropertyNS::Identifier propertyId,
+                                              BacnetDataInterfaceShared writeValue, quint32 arrayIndex)
+{
+    WritePropertyServiceData write;
+    write._objectId = objId;
+    write._propValue = PropertyValue(propertyId, writeValue, arrayIndex);
+    writes.append(write);
+}
+
+qint32 WritePropertyMultipleServiceData::fromRaw(quint8 *serviceData, quint16 bufferLength)
+{
+    BacnetTagParser bParser(serviceData, bufferLength);
+
+    qint32 ret;
+    qint32 consumedBytes(0);
+    bool isContext;
+
+    writes.clear();
+    while (bParser.hasNext()) {
+        //parse object identifier
+        ObjectIdentifier objId;
+        ret = objId.fromRaw(bParser, 0);
+        if (ret <= 0)
+            return -1;
+        consumedBytes += ret;
+
+        //list of properties
+        ret = bParser.parseNext();
+        if (ret < 0 || !bParser.isOpeningTag(1))
+            return -2;
+        consumedBytes += ret;
+
+        //property values start with context tag 0, so it's safe to peek - closing tag of the list is of number 1
+        int valuesCount(0);
+        while ( (0 == bParser.nextTagNumber(&isContext)) && isContext ) {
+            WritePropertyServiceData write;
+            write._objectId = objId;
+            ret = write._propValue.fromRawSpecific(bParser, objId.type(), 0);
+            if (ret <= 0) {
+                qDebug("%s : couldn't parse property value!", __PRETTY_FUNCTION__);
+                return -3;
+            }
+            consumedBytes += ret;
+            writes.append(write);
+            ++valuesCount;
+        }
+
+        ret = bParser.parseNext();
+        if (ret < 0 || !bParser.isClosingTag(1))
+            return -4;
+        consumedBytes += ret;
+
+        //list of properties may not be empty
+        if (0 == valuesCount)
+            return -BacnetRejectNS::ReasonMissingRequiredParameter;
+    }
+
+    if (writes.isEmpty())
+        return -BacnetRejectNS::ReasonMissingRequiredParameter;
+
+    return consumedBytes;
+}
+
+qint32 WritePropertyMultipleServiceData::toRaw(quint8 *startPtr, quint16 bufferLength)
+{
+    Q_CHECK_PTR(startPtr);
+    Q_ASSERT(!writes.isEmpty());
+    quint8 *actualPtr(startPtr);
+    quint16 leftLength(bufferLength);
+    qint32 ret;
+
+    for (int i = 0; i < writes.count(); ++i) {
+        WritePropertyServiceData &write = writes[i];
+        bool objectStarts = (0 == i) || (writes.at(i - 1)._objectId.objectIdNum() != write._objectId.objectIdNum());
+
+        if (objectStarts) {
+            //close previous object's list of properties
+            if (0 != i) {
+                ret = BacnetCoder::closingTagToRaw(actualPtr, leftLength, 1);
+                if (ret <= 0) {
+                    qDebug("%s : cannot encode closing tag: %d", __PRETTY_FUNCTION__, ret);
+                    return -1;
+                }
+                actualPtr += ret;
+                leftLength -= ret;
+            }
+
+            ret = write._objectId.toRaw(actualPtr, leftLength, 0);
+            if (ret <= 0) {
+                qDebug("%s : cannot encode objId: %d", __PRETTY_FUNCTION__, ret);
+                return -1;
+            }
+            actualPtr += ret;
+            leftLength -= ret;
+
+            ret = BacnetCoder::openingTagToRaw(actualPtr, leftLength, 1);
+            if (ret <= 0) {
+                qDebug("%s : cannot encode opening tag: %d", __PRETTY_FUNCTION__, ret);
+                return -1;
+            }
+            actualPtr += ret;
+            leftLength -= ret;
+        }
+
+        ret = write._propValue.toRaw(actualPtr, leftLength, 0);
+        if (ret <= 0) {
+            qDebug("%s : couldn't encode property value: %d", __PRETTY_FUNCTION__, ret);
+            return -1;
+        }
+        actualPtr += ret;
+        leftLength -= ret;
+    }
+
+    ret = BacnetCoder::closingTagToRaw(actualPtr, leftLength, 1);
+    if (ret <= 0) {
+        qDebug("%s : cannot encode closing tag: %d", __PRETTY_FUNCTION__, ret);
+        return -1;
+    }
+    actualPtr += ret;
+
+    return actualPtr - startPtr;
+}
@@ -0,0 +1,34 @@
+#ifndef WRITEPROPERTYMULTIPLESERVICEDATA_H
+#define WRITEPROPERTYMULTIPLESERVICEDATA_H
+
+#include "bacnetcommon.h"
+#include "bacnetservicedata.h"
+#include "writepropertyservicedata.h"
+
+namespace Bacnet {
+
+    /**
+      WritePropertyMultiple request data. Writes are kept flat - consecutive writes to the same object are encoded as one
+      WriteAccessSpecification (and parsed specifications are flattened the same way). Order of writes is preserved, since
+      it's the order they are to be executed in.
+      */
+    class WritePropertyMultipleServiceData:
+            public BacnetServiceData
+    {
+    public:
+        WritePropertyMultipleServiceData();
+
+        void append(ObjectIdentifier &objId, BacnetPropertyNS::Identifier propertyId,
+                    BacnetDataInterfaceShared writeValue, quint32 arrayIndex = Bacnet::ArrayIndexNotPresent);
+
+    public://overridden BacnetServiceData methods
+        virtual qint32 fromRaw(quint8 *serviceData, quint16 bufferLength);
+        virtual qint32 toRaw(quint8 *startPtr, quint16 bufferLength);
+
+    public:
+        QList<WritePropertyServiceData> writes;
+    };
+
+}
+
+#endif // WRITEPROPERTYMULTIPLESERVICEDATA_H
@@ -124,6 +124,15 @@ bool BacnetAddress::operator ==(const BacnetAddress &other) const
         return false;
 }
 
+uint qHash(const BacnetAddress &address)
+{
+    const quint8 *macPtr = address.macPtr();
+    uint hash = address.macAddrLength();
+    for (int i = 0; i < address.macAddrLength(); ++i)
+        hash = hash * 31 + macPtr[i];
+    return hash;
+}
+
 #include <QStringList>
 
 static const char *MacSeparator = ":";
@@ -139,4 +139,7 @@ private:
     qint8 _macAddrLength;
 };
 
+//! Hashes MAC address only - consistently with BacnetAddress::operator ==().
+uint qHash(const BacnetAddress &address);
+
 #endif // BACNETADDRESS_H
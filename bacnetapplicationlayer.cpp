@@ -18,6 +18,7 @@ using namespace Bacnet;
 
 BacnetApplicationLayerHandler::BacnetApplicationLayerHandler(BacnetNetworkLayerHandler *networkHndlr, QObject *parent):
     QObject(parent),
+    _receivedFrame(0),
     _networkHndlr(networkHndlr),
     _internalHandler(new InternalObjectsHandler(this)),
     _externalHandler(new ExternalObjectsHandler(this)),
@@ -26,18 +27,18 @@ BacnetApplicationLayerHandler::BacnetApplicationLayerHandler(BacnetNetworkLayerH
     _objectDeviceMapper(DefaultMapperElementsSize)
 {
     Q_CHECK_PTR(networkHndlr);
-    _timer.start(TimerInterval_ms, this);
 }
 
 BacnetApplicationLayerHandler::~BacnetApplicationLayerHandler()
 {
+    foreach (TimingWheel::TimerId timer, _discoveryTimers)
+        TimingWheel::instance()->cancel(timer);
 }
 
-QList<Bacnet::BacnetDeviceObject*> BacnetApplicationLayerHandler::devices()
+const QVector<Bacnet::BacnetDeviceObject*> &BacnetApplicationLayerHandler::devices()
 {
     Q_CHECK_PTR(_internalHandler);
     return _internalHandler->devices();
-    //return _internalHandler->devices();
 }
 
 void BacnetApplicationLayerHandler::setNetworkHandler(BacnetNetworkLayerHandler *networkHndlr)
@@ -49,7 +50,7 @@ void BacnetApplicationLayerHandler::setNetworkHandler(BacnetNetworkLayerHandler
 void BacnetApplicationLayerHandler::processConfirmedRequest(BacnetAddress &remoteSource, BacnetAddress &localDestination, quint8 *dataPtr, quint16 dataLength, BacnetConfirmedRequestData *crData)
 {
     InternalAddress destination = BacnetInternalAddressHelper::internalAddress(localDestination);
-    BacnetDeviceObject *device = _internalHandler->virtualDevices().value(destination);
+    BacnetDeviceObject *device = _internalHandler->virtualDevices().device(destination);
 
     InternalConfirmedRequestHandler *handler = ServiceFactory::createConfirmedHandler(remoteSource, localDestination, crData, device, this);
     //Q_CHECK_PTR(handler);
@@ -79,7 +80,7 @@ void BacnetApplicationLayerHandler::processConfirmedRequest(BacnetAddress &remot
 void BacnetApplicationLayerHandler::processUnconfirmedRequest(BacnetAddress &remoteSource, BacnetAddress &localDestination, quint8 *dataPtr, quint16 dataLength, BacnetUnconfirmedRequestData &ucrData)
 {
     InternalAddress destination = BacnetInternalAddressHelper::internalAddress(localDestination);
-    BacnetDeviceObject *device = _internalHandler->virtualDevices().value(destination);
+    BacnetDeviceObject *device = _internalHandler->virtualDevices().device(destination);
 
     //create appropriate handler. \note It takes ownership over ucrData!
 
@@ -106,6 +107,12 @@ void BacnetApplicationLayerHandler::processUnconfirmedRequest(BacnetAddress &rem
     }
 }
 
+int BacnetApplicationLayerHandler::loadPercent()
+{
+    Q_CHECK_PTR(_internalHandler);
+    return _internalHandler->pendingActionsCount() * 100 / PendingActionsCapacity;
+}
+
 void BacnetApplicationLayerHandler::processAbort(BacnetAddress &remoteSource, BacnetAddress &localDestination, ExternalConfirmedServiceHandler *serviceAct)
 {
     int idx = _awaitingConfirmedServices.indexOf(serviceAct);
@@ -263,7 +270,7 @@ bool BacnetApplicationLayerHandler::sendUnconfirmedWithDiscovery(const ObjectIdS
       type depends on the objId Num value)
     */
     UnconfirmedDiscoveryWrapper *udw = new UnconfirmedDiscoveryWrapper(objIdNum, source, data, serviceChoice);
-    _awaitingDiscoveries.insertMulti(objIdNum, udw);
+    awaitDiscovery_hlpr(objIdNum, udw);
     discover(objIdNum);
 
     return found;
@@ -274,7 +281,8 @@ void BacnetApplicationLayerHandler::sendUnconfirmed(const BacnetAddress &destina
     _tsm->sendUnconfirmed(destination, source, data, serviceChoice);
 }
 
-bool BacnetApplicationLayerHandler::send(const Bacnet::ObjectIdStruct &destinedObject, BacnetAddress &sourceAddress, ExternalConfirmedServiceHandler *serviceToSend)
+BacnetApplicationLayerHandler::SendResult BacnetApplicationLayerHandler::send(const Bacnet::ObjectIdStruct &destinedObject, BacnetAddress &sourceAddress,
+                                                                             ExternalConfirmedServiceHandler *serviceToSend)
 {
     bool found(false);
     quint32 objIdNum = objIdToNum(destinedObject);
@@ -284,29 +292,53 @@ bool BacnetApplicationLayerHandler::send(const Bacnet::ObjectIdStruct &destinedO
 
     Q_ASSERT(InvalidInstanceNumber != numToObjId(objIdNum).instanceNum);
     const mappingEntry &re = _devicesRoutingTable.findEntry(objIdNum, &found);//note that here objIdNum is id of the device
-    if (found) {
-        send(re.address, sourceAddress, serviceToSend);
-        return found;
-    }
+    if (found)
+        return send(re.address, sourceAddress, serviceToSend);
 
     /*being here means that either we have not sufficient information - if we had objectId, then objIdNum is pointing to it's device.
       Otherwise objIdNum is the object to be looked for itself. Create wrapper for a BacnetServiceData and send discovery request (whois or whohas -
       type depends on the objId Num value)
     */
     ConfirmedDiscoveryWrapper *cdw = new ConfirmedDiscoveryWrapper(objIdNum, sourceAddress, serviceToSend);
-    _awaitingDiscoveries.insertMulti(objIdNum, cdw);
+    awaitDiscovery_hlpr(objIdNum, cdw);
     discover(objIdNum);
 
-    return found;
+    return RequestQueued;
 }
 
-bool BacnetApplicationLayerHandler::send(const BacnetAddress &destination, BacnetAddress &sourceAddress, ExternalConfirmedServiceHandler *serviceToSend)
+bool BacnetApplicationLayerHandler::remoteDevice(ObjIdNum objectId, ObjIdNum *deviceId, int *maxApduLength)
+{
+    Q_CHECK_PTR(deviceId);
+    Q_CHECK_PTR(maxApduLength);
+    bool found(true);
+    ObjIdNum devObjIdNum(objectId);
+    if (BacnetObjectTypeNS::Device != numToObjId(objectId).objectType)
+        devObjIdNum = _objectDeviceMapper.findEntry(objectId, &found);
+    if (!found)
+        return false;
+
+    const mappingEntry &re = _devicesRoutingTable.findEntry(devObjIdNum, &found);
+    if (!found)
+        return false;
+
+    *deviceId = devObjIdNum;
+    *maxApduLength = re.maxApduLengthAccepted;
+    return true;
+}
+
+BacnetApplicationLayerHandler::SendResult BacnetApplicationLayerHandler::send(const BacnetAddress &destination, BacnetAddress &sourceAddress,
+                                                                             ExternalConfirmedServiceHandler *serviceToSend)
 {
     _awaitingConfirmedServices.append(serviceToSend);
-    return _tsm->send(destination, sourceAddress, serviceToSend);
+    if (_tsm->send(destination, sourceAddress, serviceToSend))
+        return RequestSent;
+
+    //TSM has forgotten it already - nothing will be answered
+    _awaitingConfirmedServices.removeAll(serviceToSend);
+    return RequestFailed;
 }
 
-void BacnetApplicationLayerHandler::indication(quint8 *data, quint16 length, BacnetAddress &srcAddr, BacnetAddress &destAddr)
+void BacnetApplicationLayerHandler::indication(quint8 *data, quint16 length, BacnetAddress &srcAddr, BacnetAddress &destAddr, Buffer *frame)
 {
     //is it really intended for us?
     Bacnet::BacnetDeviceObject *device(0);
@@ -322,7 +354,7 @@ void BacnetApplicationLayerHandler::indication(quint8 *data, quint16 length, Bac
         if (_externalHandler->isRegisteredAddress(destination)) {
             device = 0;
         } else {
-            device = _internalHandler->virtualDevices().value(destination);
+            device = _internalHandler->virtualDevices().device(destination);
             if (0 == device) {//device not found, drop request!
                 qDebug("Device %d is not found!", destination);
                 return;
@@ -331,7 +363,9 @@ void BacnetApplicationLayerHandler::indication(quint8 *data, quint16 length, Bac
     }
 
     //tell Transaction State Machine to take care of the packet. If the packet is meaningful to the AppLayer, it will be returned (its part) by TSM.
+    _receivedFrame = frame;
     _tsm->receive(srcAddr, destAddr, data, length);
+    _receivedFrame = 0;
 }
 
 void BacnetApplicationLayerHandler::discover(quint32 objectId, bool forceToHave)
@@ -354,7 +388,33 @@ void BacnetApplicationLayerHandler::discover(quint32 objectId, bool forceToHave)
     }
 
     if (forceToHave)
-        _awaitingDiscoveries.insertMulti(objectId, 0);
+        awaitDiscovery_hlpr(objectId, 0);
+}
+
+void BacnetApplicationLayerHandler::awaitDiscovery_hlpr(ObjIdNum objectId, DiscoveryWrapper *wrapper)
+{
+    _awaitingDiscoveries.insertMulti(objectId, wrapper);
+    TimingWheel::TimerId &timer = _discoveryTimers[objectId];
+    if (TimingWheel::InvalidTimerId == timer)
+        timer = TimingWheel::instance()->arm(DiscoveryTimeout_ms, this, objectId);
+}
+
+bool BacnetApplicationLayerHandler::finishDiscovery_hlpr(ObjIdNum objectId, BacnetAddress &responderAddress)
+{
+    QList<DiscoveryWrapper*> wrappers = _awaitingDiscoveries.values(objectId);
+    if (wrappers.isEmpty())
+        return false;
+    _awaitingDiscoveries.remove(objectId);
+    TimingWheel::instance()->cancel(_discoveryTimers.take(objectId));
+
+    foreach (DiscoveryWrapper *wrapper, wrappers) {
+        //it could be zero, when the appliaction layer was called to resolve address of the object without any data to be send.
+        if (0 != wrapper) {
+            wrapper->discoveryFinished(this, responderAddress);
+            delete wrapper;//the wrapper is not needed anymore. The data will be deleted along (if the wrapper didn't do something other with it already).
+        }
+    }
+    return true;
 }
 
 void BacnetApplicationLayerHandler::registerObject(ObjectIdentifier &devId, ObjectIdentifier &objId)
@@ -371,32 +431,17 @@ void BacnetApplicationLayerHandler::registerObjectFromDiscovery(BacnetAddress &d
     Q_ASSERT(numToObjId(devNum).objectType == devId.type());
     qDebug("%s : Gotten response from device 0x%x, ovject 0x%x of name %s", __PRETTY_FUNCTION__, devNum, objNum, qPrintable(objName));
 
-    bool isResponseForUs(false);
-
-    QHash<ObjIdNum, DiscoveryWrapper*>::Iterator it = _awaitingDiscoveries.begin();
-    QHash<ObjIdNum, DiscoveryWrapper*>::Iterator itEnd = _awaitingDiscoveries.end();
-
-    while (it != itEnd) {
-        if ( (it.key() == devNum) || (it.key() == objNum) ) { //it is a request issued as a response to our who-has request
-            if (it.key() == objNum)
-                isResponseForUs = true;
-            if (0 != it.value()) //it could be zero, when the appliaction layer was called to resolve address of the object without any data to be send.
-                (*it)->discoveryFinished(this, devAddress);
-            it = _awaitingDiscoveries.erase(it);
-            delete it.value();//the wrapper is not needed anymore. The data will be deleted along (if the wrapper didn't do something other with it already).
-        } else
-            ++it;
-    }
+    //it is a response to our who-has request, if anything waited for the object
+    bool isResponseForUs = finishDiscovery_hlpr(objNum, devAddress);
+    finishDiscovery_hlpr(devNum, devAddress);
 
     _objectDeviceMapper.addOrUpdatemappingEntry(objNum, devNum, isResponseForUs);
     /**
       If device was not in the devices list, add it. However, remember we don't have full information about the device - we insert some predicted defaults, which could be ok.
       To correct it, issue who-is and for a time being use those defaults.
       */
-    if (!_devicesRoutingTable.addOrUpdatemappingEntry(devAddress, devNum, ApduMaxSize, SegmentedNOT, true, false)) {
-        _awaitingDiscoveries.insertMulti(devNum, 0);
-        discover(devNum);
-    }
+    if (!_devicesRoutingTable.addOrUpdatemappingEntry(devAddress, devNum, ApduMaxSize, SegmentedNOT, true, false))
+        discover(devNum, true);
 }
 
 void BacnetApplicationLayerHandler::registerDeviceFromDiscovery(BacnetAddress &devAddress, Bacnet::ObjectIdentifier &devId, quint32 maxApduSize, BacnetSegmentation segmentationType, quint32 vendorId)
@@ -404,22 +449,8 @@ void BacnetApplicationLayerHandler::registerDeviceFromDiscovery(BacnetAddress &d
     ObjIdNum devNum = devId.objectIdNum();
     qDebug("%s : Gotten response from device 0x%x, and vendor id 0x%x", __PRETTY_FUNCTION__, devNum, vendorId);
 
-    bool isResponseForUs(false);
-
-    QHash<ObjIdNum, DiscoveryWrapper*>::Iterator it = _awaitingDiscoveries.begin();
-    QHash<ObjIdNum, DiscoveryWrapper*>::Iterator itEnd = _awaitingDiscoveries.end();
-
-    while (it != itEnd) {
-        if (it.key() == devNum) { //it is a request issued as a response to our who-is request
-            if (it.key() == devNum)
-                isResponseForUs = true;
-            if (0 != it.value()) //it could be zero, when the appliaction layer was called to resolve address of the object without any data to be send.
-                (*it)->discoveryFinished(this, devAddress);
-            it = _awaitingDiscoveries.erase(it);
-            delete it.value();
-        } else
-            ++it;
-    }
+    //it is a response to our who-is request, if anything waited for the device
+    bool isResponseForUs = finishDiscovery_hlpr(devNum, devAddress);
 
     _devicesRoutingTable.addOrUpdatemappingEntry(devAddress, devNum, maxApduSize, segmentationType, true, isResponseForUs);//force update, since this is for sure fine quality information!
 }
@@ -441,27 +472,26 @@ InternalObjectsHandler *BacnetApplicationLayerHandler::internalHandler()
     return _internalHandler;
 }
 
-void BacnetApplicationLayerHandler::timerEvent(QTimerEvent *)
+void BacnetApplicationLayerHandler::timerExpired(quintptr cookie)
 {
-    //Check discovery services
-    QHash<ObjIdNum, DiscoveryWrapper*>::Iterator it = _awaitingDiscoveries.begin();
-    QHash<ObjIdNum, DiscoveryWrapper*>::Iterator itEnd = _awaitingDiscoveries.end();
+    ObjIdNum objectId = cookie;
+    _discoveryTimers.remove(objectId);
+    QList<DiscoveryWrapper*> wrappers = _awaitingDiscoveries.values(objectId);
+    _awaitingDiscoveries.remove(objectId);
 
+    //the ones which want to wait longer are queued again - timer is armed again along
     DiscoveryWrapper::Action action;
-    while (it != itEnd) {
-        if (0 != it.value()) { //there is some service pending for it.
-            qDebug("%s : Confirmed request timeout (InvokeId: %d)", __PRETTY_FUNCTION__, it.key());
-            action = (*it)->handleTimeout(this);
+    foreach (DiscoveryWrapper *wrapper, wrappers) {
+        if (0 != wrapper) { //there is some service pending for it.
+            qDebug("%s : Discovery timeout (object id: 0x%x)", __PRETTY_FUNCTION__, objectId);
+            action = wrapper->handleTimeout(this);
             if (DiscoveryWrapper::DeleteMe == action) {
-                delete (*it);
-                it = _awaitingDiscoveries.erase(it);
+                delete wrapper;
             } else {
                 Q_ASSERT(DiscoveryWrapper::LeaveMeInQueue == action);
-                ++it;
+                awaitDiscovery_hlpr(objectId, wrapper);
             }
-        } else { //that was us (app layer), who called it.
-            it = _awaitingDiscoveries.erase(it);
-        }
+        } //otherwise that was us (app layer), who called it.
     }
 }
 
@@ -10,9 +10,11 @@
 #include "remoteobjectstodevicemapper.h"
 #include "bacnettsm2.h"
 #include "externalconfirmedservicewrapper.h"
+#include "timingwheel.h"
 
 class BacnetAddress;
 class BacnetNetworkLayerHandler;
+class Buffer;
 
 namespace Bacnet {
 class ExternalObjectsHandler;
@@ -25,7 +27,8 @@ class Error;
 class ObjectIdentifier;
 
 class BacnetApplicationLayerHandler:
-        public QObject
+        public QObject,
+        public TimingWheelClient
 {
     Q_OBJECT
 public:
@@ -43,8 +46,18 @@ public:
       \param - sourceAddr - is used by some requests/responses to localize the other device;
       \param - destAddr - not specified by BACnet but if application layer is supposed to act as a collection of
       devices we need to have information which device is being called.
+      \param - frame - pooled buffer, the data lies in (0 if data doesn't come from the pool). \sa receivedFrame()
       */
-    void indication(quint8 *data, quint16 length, BacnetAddress &srcAddr, BacnetAddress &destAddr);
+    void indication(quint8 *data, quint16 length, BacnetAddress &srcAddr, BacnetAddress &destAddr, Buffer *frame = 0);
+
+    /**
+      Returns the buffer, which currently processed request was received into, or 0 if there is none (e.g. data didn't come from the
+      buffers pool). It's valid only during the \sa indication() call - handlers that need request data longer may copy the Buffer
+      (which only increases its reference counter) instead of copying data itself.
+      */
+    inline Buffer *receivedFrame() {return _receivedFrame;}
+    //! Used by TSM, when it passes reassembled segmented APDU - it lies in the segmentation buffer, not in the last frame received.
+    inline void setReceivedFrame(Buffer *frame) {_receivedFrame = frame;}
 
     void processConfirmedRequest(BacnetAddress &remoteSource, BacnetAddress &localDestination, quint8 *dataPtr, quint16 dataLength, BacnetConfirmedRequestData *crData);
     void processUnconfirmedRequest(BacnetAddress &remoteSource, BacnetAddress &localDestination, quint8 *dataPtr, quint16 dataLength, BacnetUnconfirmedRequestData &ucrData);
@@ -60,8 +73,18 @@ public:
     bool sendUnconfirmedWithDiscovery(const ObjectIdStruct &destinedObject, BacnetAddress &source, BacnetServiceData *data, quint8 serviceChoice);
 
     void sendUnconfirmed(const BacnetAddress &destination, BacnetAddress &source, BacnetServiceData &data, quint8 serviceChoice);
-    bool send(const ObjectIdStruct &destinedObject, BacnetAddress &sourceAddress, ExternalConfirmedServiceHandler *serviceToSend);
-    bool send(const BacnetAddress &destination, BacnetAddress &sourceAddress, ExternalConfirmedServiceHandler *serviceToSend);
+
+    //! What happened to the confirmed request given to \sa send().
+    enum SendResult {
+        //! Given to TSM - it's sent, or waits for a room in the peer's window.
+        RequestSent,
+        //! Destination device is not known yet - request is sent, when discovery finishes. The handler is ours in both cases.
+        RequestQueued,
+        //! Request couldn't be sent - the handler is given back to the caller.
+        RequestFailed
+    };
+    SendResult send(const ObjectIdStruct &destinedObject, BacnetAddress &sourceAddress, ExternalConfirmedServiceHandler *serviceToSend);
+    SendResult send(const BacnetAddress &destination, BacnetAddress &sourceAddress, ExternalConfirmedServiceHandler *serviceToSend);
     inline void sendAck(BacnetAddress &remoteDestination, BacnetAddress &localSource, BacnetServiceData *data, BacnetConfirmedRequestData *reqData) {_tsm->sendAck(remoteDestination, localSource, data, reqData);}
     inline void sendReject(BacnetAddress &remoteDestination, BacnetAddress &localSource, BacnetRejectNS::RejectReason reason, quint8 invokeId) {_tsm->sendReject(remoteDestination, localSource, reason, invokeId);}
     inline void sendError(BacnetAddress &remoteDestination, BacnetAddress &localSource, quint8 invokeId, BacnetServicesNS::BacnetErrorChoice errorChoice, Error &error) {_tsm->sendError(remoteDestination, localSource, invokeId, errorChoice, error);}
@@ -70,7 +93,15 @@ public:
 
     InternalObjectsHandler *internalHandler();
     ExternalObjectsHandler *externalHandler();
-    QList<BacnetDeviceObject*> devices();
+    //! Virtual devices, sorted by instance number.
+    const QVector<BacnetDeviceObject*> &devices();
+
+    /**
+      Returns how many actions requests to our virtual devices wait for (e.g. properties read from CDM), in percents of
+      PendingActionsCapacity (may exceed 100 - it's not a limit). Used by network layer to detect congestion.
+      \note Our own requests waiting for answers don't count - holding the peers off would only delay the answers.
+      */
+    int loadPercent();
 
 private:
     /** Sends discovery request for objectId.
@@ -80,21 +111,37 @@ private:
     friend class ConfirmedDiscoveryWrapper;
     void discover(quint32 objectId, bool forceToHave = false);
     QHash<ObjIdNum, DiscoveryWrapper*> _awaitingDiscoveries;
+    //! Each object looked for has one timer, shared by all the wrappers waiting for it. Object id is the cookie.
+    QHash<ObjIdNum, TimingWheel::TimerId> _discoveryTimers;
+    static const int DiscoveryTimeout_ms = 1000;
+    //! Queues wrapper (may be 0) waiting for the object to be discovered and arms the timer of the object, if it's not armed yet.
+    void awaitDiscovery_hlpr(ObjIdNum objectId, DiscoveryWrapper *wrapper);
+    //! Hands responder address over to all the wrappers waiting for the object. Returns false, if nothing was waiting for it.
+    bool finishDiscovery_hlpr(ObjIdNum objectId, BacnetAddress &responderAddress);
 public:
     //! These two registration functions are used to write configuration data about external devices (address, their object ids), which have  the highest priority when searched.
     void registerObject(ObjectIdentifier &devId, ObjectIdentifier &objId);
     void registerDevice(BacnetAddress &devAddress, Bacnet::ObjectIdentifier &devId, quint32 maxApduSize, BacnetSegmentation segmentationType);
 
+    /**
+      Looks up the remote device the object lives in. Returns false, if it's not known yet (the object or its device wasn't discovered
+      nor configured) - deviceId and maxApduLength are left untouched then.
+      */
+    bool remoteDevice(ObjIdNum objectId, ObjIdNum *deviceId, int *maxApduLength);
+
     //! These two functions are meant to be used with Discovery (I-Am and Who-Has) requests.
     void registerObjectFromDiscovery(BacnetAddress &devAddress, ObjectIdentifier &devId, ObjectIdentifier &objId, QString &objName);
     void registerDeviceFromDiscovery(BacnetAddress &devAddress, ObjectIdentifier &devId, quint32 maxApduSize, BacnetSegmentation segmentationType, quint32 vendorId);
 
 private:
+    Buffer *_receivedFrame;
     QList<ExternalConfirmedServiceHandler*> _awaitingConfirmedServices;
+    static const int PendingActionsCapacity = 256;
     void cleanUpService(BacnetAddress &remoteSource, BacnetAddress &localDestination, quint8 action, int idx);
 
-protected:
-    void timerEvent(QTimerEvent *);
+public://TimingWheelClient interface
+    //! Discovery of the object (cookie) timed out.
+    void timerExpired(quintptr cookie);
 
 protected:
     BacnetNetworkLayerHandler *_networkHndlr;
@@ -105,8 +152,6 @@ public:
     Bacnet::BacnetTSM2 *_tsm;
 
 private:
-    static const int TimerInterval_ms = 1000;
-    QBasicTimer _timer;
     static const int DefaultDynamicElementsSize = 100;
     RoutingTable _devicesRoutingTable;
     static const int DefaultMapperElementsSize = 100;
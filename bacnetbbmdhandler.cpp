@@ -1,5 +1,7 @@
 #include "bacnetbbmdhandler.h"
 
+#include <QTimerEvent>
+
 #include "bacnetudptransportlayer.h"
 #include "helpercoder.h"
 #include "bacnetbipaddress.h"
@@ -8,10 +10,16 @@
 #error "IPv6 is not handled in this file"
 #endif
 
-BacnetBbmdHandler::BacnetBbmdHandler(BacnetBvllHandler *bvllHandler):
-        _bvllHndlr(bvllHandler)
+BacnetBbmdHandler::BacnetBbmdHandler(BacnetBvllHandler *bvllHandler, QObject *parent):
+        QObject(parent),
+        _maxFdCount(DefaultMaxForeignDevicesCount),
+        _currentTick(0),
+        _bvllHndlr(bvllHandler),
+        _fanOutSize(0)
 {
     Q_ASSERT(0 != _bvllHndlr);
+    resetFanOutStatistics();
+    _clock.start();
 }
 
 bool BacnetBbmdHandler::setBroadcastTableFromRaw(quint8 *data, quint16 length)
@@ -38,6 +46,7 @@ bool BacnetBbmdHandler::setBroadcastTableFromRaw(quint8 *data, quint16 length)
         Q_ASSERT(BacnetBipAddressHelper::BipMaskLength == sizeof(quint32));
         fieldStart += HelperCoder::uint32FromRaw(fieldStart, &(_bbmdTable[i].mask));
     }
+    updateBdtDestinations_hlpr();
 
     return true;
 }
@@ -70,110 +79,295 @@ bool BacnetBbmdHandler::setBroatcastTableToRaw(quint8 *data, quint16 maxLength)
     return true;
 }
 
+void BacnetBbmdHandler::addBroadcastTableEntry(const BacnetAddress &address, quint32 mask)
+{
+    BbmdTableEntry entry;
+    entry.address = address;
+    entry.mask = mask;
+    _bbmdTable.append(entry);
+    updateBdtDestinations_hlpr();
+}
+
+void BacnetBbmdHandler::updateBdtDestinations_hlpr()
+{
+    _bdtDestinations.resize(_bbmdTable.count());
+    for (int i = 0; i < _bbmdTable.count(); ++i) {
+        const BbmdTableEntry &entry = _bbmdTable.at(i);
+        BdtDestination &dest = _bdtDestinations[i];
+        dest.bbmdIpAddress = BacnetBipAddressHelper::ipAddress(entry.address).toIPv4Address();
+        dest.port = BacnetBipAddressHelper::ipPort(entry.address);
+        /*Calculate address we send message to:
+          J.4.5: "The B/IP address to which the Forwarded-NPDU message is sent
+          is formed by inverting the broadcast distribution mask in the BDT entry
+          and logically ORing it with the BBMD address of the same entry."
+         */
+        dest.destIpAddress = dest.bbmdIpAddress | ~entry.mask;
+    }
+}
+
 void BacnetBbmdHandler::processForwardedMessage(quint8 *data, quint16 length, BacnetAddress &srcAddr)
 {
     Q_ASSERT(0 != data);
-    BacnetAddress myAddress;
-    //get my ip and port from the transport layer and translate it to BacnetAddress
-    BacnetBipAddressHelper::setMacAddress(_bvllHndlr->address(), _bvllHndlr->port(), &myAddress);
+    qint64 startTime_ns = _clock.nsecsElapsed();
+    _fanOutSize = 0;
+
+    quint32 myIpAddress = _bvllHndlr->address().toIPv4Address();
+    quint16 myPort = _bvllHndlr->port();
     //look the BDT for the entries with my BacnetIpAddress
-    foreach (BbmdTableEntry entry, _bbmdTable) {
+    foreach (const BdtDestination &dest, _bdtDestinations) {
         //if entry is found, check how other devices forward data to me
-        if (entry.address == myAddress) {
+        if ( (dest.bbmdIpAddress == myIpAddress) && (dest.port == myPort) ) {
             /*is unicast used to broadcast?
             J.4.3.2 : If messages are to be distributed on the remote IP subnet by sending
-            the message directly to the remote BBMD, the broadcast distribution mask shall be all 1's.
+            the message directly to the remote BBMD, the broadcast distribution mask shall be all 1's (so the destination is BBMD itself).
             */
-            if ( entry.mask == (quint32)0xffffffff ) {
+            if (dest.destIpAddress == dest.bbmdIpAddress) {
                 //forward the message to our subnet, since no device has received it yet
-                _bvllHndlr->send(data, length, QHostAddress::Broadcast, _bvllHndlr->port());
+                addFanOut_hlpr(QHostAddress(QHostAddress::Broadcast).toIPv4Address(), myPort);
             }
             break;
         }
     }
 
     //we have written to our local network. if needed. But still we have to pass this frame to all FDs except source.
-    #warning "Sending to entries in FDT (and entire FDT handling) not implemented"
-    Q_UNUSED(srcAddr);
+    addFdsFanOut_hlpr(srcAddr);
+    sendFanOut_hlpr(data, length, startTime_ns);
+}
+
+void BacnetBbmdHandler::processBroadcastToNetwork(quint8 *data, quint16 length, BacnetAddress &srcAddr)
+{
+    Q_ASSERT(0 != data);
+    qint64 startTime_ns = _clock.nsecsElapsed();
+    _fanOutSize = 0;
+
+    //forward it locally
+    //! \note remember that we won't get replication, since our UDP layer discards all messages received from itself
+    addFanOut_hlpr(QHostAddress(QHostAddress::Broadcast).toIPv4Address(), _bvllHndlr->port());
+    addBbmdsFanOut_hlpr(true);
+    //pass this frame to all FDs except source, too.
+    addFdsFanOut_hlpr(srcAddr);
+    sendFanOut_hlpr(data, length, startTime_ns);
+}
+
+void BacnetBbmdHandler::processOriginalBroadcast(quint8 *data, quint16 length, BacnetAddress &srcAddr)
+{
+    Q_ASSERT(data);
+    qint64 startTime_ns = _clock.nsecsElapsed();
+    _fanOutSize = 0;
+
+    addBbmdsFanOut_hlpr(true);
+    addFdsFanOut_hlpr(srcAddr);
+    sendFanOut_hlpr(data, length, startTime_ns);
+}
+
+void BacnetBbmdHandler::addFanOut_hlpr(quint32 ipAddress, quint16 port)
+{
+    if (_fanOutSize == _fanOut.count())
+        _fanOut.resize(qMax(2 * _fanOutSize, (int)BacnetUdpTransportLayerHandler::UdpBatchSize));
+    BacnetUdpTransportLayerHandler::OutgoingDatagram &dgram = _fanOut[_fanOutSize++];
+    dgram.destAddr.setAddress(ipAddress);
+    dgram.destPort = port;
 }
 
-void BacnetBbmdHandler::sendToBbmds(quint8 *data, quint16 length, bool excludeMyself)
+void BacnetBbmdHandler::addBbmdsFanOut_hlpr(bool excludeMyself)
 {
-    BacnetAddress myAddress;
-    //get my ip and port from the transport layer and translate it to BacnetBipAddress
-    BacnetBipAddressHelper::setMacAddress(_bvllHndlr->address(), _bvllHndlr->port(), &myAddress);
+    quint32 myIpAddress = _bvllHndlr->address().toIPv4Address();
+    quint16 myPort = _bvllHndlr->port();
     //look-up the BDT entries and send to all except from me
-    QHostAddress toSendAddress;
-    quint32 mask_helper, addr_helper;//two helpers for calculations
-    foreach (BbmdTableEntry entry, _bbmdTable) {
-        if (!excludeMyself || !(entry.address == myAddress)) {
-            mask_helper = entry.mask;
-            addr_helper = BacnetBipAddressHelper::ipAddress(entry.address).toIPv4Address();
-            /*Calculate address we send message to:
-              J.4.5: "The B/IP address to which the Forwarded-NPDU message is sent
-              is formed by inverting the broadcast distribution mask in the BDT entry
-              and logically ORing it with the BBMD address of the same entry."
-             */
-            mask_helper = ~mask_helper;//negate mask
-            addr_helper |= mask_helper;//logical OR
-
-            //resulting ip address
-            toSendAddress.setAddress(addr_helper);
-            //send to the calculated address
-            _bvllHndlr->send(data, length, toSendAddress,BacnetBipAddressHelper::ipPort(entry.address));
+    foreach (const BdtDestination &dest, _bdtDestinations) {
+        if (excludeMyself && (dest.bbmdIpAddress == myIpAddress) && (dest.port == myPort))
+            continue;
+        addFanOut_hlpr(dest.destIpAddress, dest.port);
+    }
+}
+
+void BacnetBbmdHandler::addFdsFanOut_hlpr(const BacnetAddress &excludedAddr)
+{
+    quint64 excludedKey(0);
+    bool hasExcluded = (BacnetBipAddressHelper::BipAddrLength == excludedAddr.macAddrLength());
+    if (hasExcluded)
+        excludedKey = fdKey(BacnetBipAddressHelper::ipAddress(excludedAddr).toIPv4Address(), BacnetBipAddressHelper::ipPort(excludedAddr));
+
+    for (int i = 0; i < _fdTable.count(); ++i) {
+        const FdTableEntry &entry = _fdTable.at(i);
+        if (hasExcluded && (fdKey(entry.ipAddress, entry.port) == excludedKey))
+            continue;
+        addFanOut_hlpr(entry.ipAddress, entry.port);
+    }
+}
+
+void BacnetBbmdHandler::sendFanOut_hlpr(quint8 *data, quint16 length, qint64 startTime_ns)
+{
+    if (0 == _fanOutSize)
+        return;
+    //all the destinations get the very same frame
+    for (int i = 0; i < _fanOutSize; ++i) {
+        _fanOut[i].data = data;
+        _fanOut[i].length = length;
+    }
+    int sentCount = _bvllHndlr->sendBatch(_fanOut.constData(), _fanOutSize);
+
+    qint64 time_ns = _clock.nsecsElapsed() - startTime_ns;
+    ++_fanOutStats.fanOutsCount;
+    _fanOutStats.datagramsCount += _fanOutSize;
+    _fanOutStats.droppedCount += (_fanOutSize - sentCount);
+    _fanOutStats.maxFanOutSize = qMax(_fanOutStats.maxFanOutSize, _fanOutSize);
+    _fanOutStats.totalTime_ns += time_ns;
+    _fanOutStats.maxTime_ns = qMax(_fanOutStats.maxTime_ns, time_ns);
+}
+
+BacnetBbmdHandler::FanOutStatistics BacnetBbmdHandler::fanOutStatistics()
+{
+    return _fanOutStats;
+}
+
+void BacnetBbmdHandler::resetFanOutStatistics()
+{
+    memset(&_fanOutStats, 0, sizeof(_fanOutStats));
+}
+
+void BacnetBbmdHandler::setMaxForeignDevicesCount(int count)
+{
+    Q_ASSERT(count >= 0);
+    if (count > MaxForeignDevicesCount) {
+        qDebug("%s : FDT limited to %d entries (asked for %d)", __PRETTY_FUNCTION__, MaxForeignDevicesCount, count);
+        count = MaxForeignDevicesCount;
+    }
+    _maxFdCount = count;
+}
+
+bool BacnetBbmdHandler::registerForeignDevice(const QHostAddress &address, quint16 port, quint16 timeToLive)
+{
+    quint32 ipAddress = address.toIPv4Address();
+    quint64 key = fdKey(ipAddress, port);
+    quint32 expiryTick = _currentTick + timeToLive + FdGracePeriod_s;
+
+    QHash<quint64, int>::Iterator it = _fdIndex.find(key);
+    if (_fdIndex.end() != it) {
+        //renewal - entry stays where it is, only expiry moves
+        FdTableEntry &entry = _fdTable[it.value()];
+        entry.timeToLive = timeToLive;
+        entry.expiryTick = expiryTick;
+    } else {
+        if (_fdTable.count() >= _maxFdCount) {
+            qDebug("%s : FDT is full, %s:%d not registered!", __PRETTY_FUNCTION__, qPrintable(address.toString()), port);
+            return false;
         }
+        FdTableEntry entry;
+        entry.ipAddress = ipAddress;
+        entry.port = port;
+        entry.timeToLive = timeToLive;
+        entry.expiryTick = expiryTick;
+        _fdIndex.insert(key, _fdTable.count());
+        _fdTable.append(entry);
     }
+
+    scheduleExpiry_hlpr(key, expiryTick);
+    if (!_wheelTimer.isActive())
+        _wheelTimer.start(WheelTick_ms, this);
+    return true;
 }
 
-void BacnetBbmdHandler::processBroadcastToNetwork(quint8 *data, quint16 length, BacnetAddress &srcAddr)
+bool BacnetBbmdHandler::deleteForeignDevice(const QHostAddress &address, quint16 port)
+{
+    QHash<quint64, int>::Iterator it = _fdIndex.find(fdKey(address.toIPv4Address(), port));
+    if (_fdIndex.end() == it)
+        return false;
+    //its wheel item becomes stale and is dropped when its slot comes
+    removeFd_hlpr(it.value());
+    return true;
+}
+
+bool BacnetBbmdHandler::isForeignDevice(const QHostAddress &address, quint16 port)
+{
+    return _fdIndex.contains(fdKey(address.toIPv4Address(), port));
+}
+
+int BacnetBbmdHandler::foreignDevicesCount()
+{
+    return _fdTable.count();
+}
+
+quint16 BacnetBbmdHandler::expectedForeignDeviceTableRawSize()
+{
+    //B/IP address, time-to-live and time remaining
+    return _fdTable.count() * (BacnetBipAddressHelper::BipAddrLength + 2 + 2);
+}
+
+quint16 BacnetBbmdHandler::setForeignDeviceTableToRaw(quint8 *data, quint16 maxLength)
 {
     Q_ASSERT(0 != data);
+    const quint16 entrySize = BacnetBipAddressHelper::BipAddrLength + 2 + 2;
+    int entriesCount = qMin(_fdTable.count(), maxLength / entrySize);
+    if (entriesCount < _fdTable.count())
+        qDebug("%s : FDT doesn't fit, %d of %d entries written", __PRETTY_FUNCTION__, entriesCount, _fdTable.count());
 
-    //forward it locally
-    //! \note remember that we won't get replication, since our UDP layer discards all messages received from itself
-    _bvllHndlr->send(data, length, QHostAddress(QHostAddress::Broadcast), _bvllHndlr->port());
+    quint8 *fieldStart = data;
+    for (int i = 0; i < entriesCount; ++i) {
+        const FdTableEntry &entry = _fdTable.at(i);
+        fieldStart += BacnetBipAddressHelper::ipAddrToRaw(QHostAddress(entry.ipAddress), entry.port, fieldStart);
+        fieldStart += HelperCoder::uin16ToRaw(entry.timeToLive, fieldStart);
+        quint32 remaining = entry.expiryTick - _currentTick;
+        fieldStart += HelperCoder::uin16ToRaw(qMin(remaining, (quint32)0xffff), fieldStart);
+    }
+    return fieldStart - data;
+}
 
-    sendToBbmds(data, length, true);
+void BacnetBbmdHandler::scheduleExpiry_hlpr(quint64 key, quint32 expiryTick)
+{
+    WheelItem item;
+    item.key = key;
+    item.expiryTick = expiryTick;
+    _wheel[expiryTick & (WheelSize - 1)].append(item);
+}
+
+void BacnetBbmdHandler::removeFd_hlpr(int idx)
+{
+    Q_ASSERT( (idx >= 0) && (idx < _fdTable.count()) );
+    const FdTableEntry &entry = _fdTable.at(idx);
+    _fdIndex.remove(fdKey(entry.ipAddress, entry.port));
 
-    //Message is now sent to BBMDs. But still we have to pass this frame to all FDs except source.
-    #warning "Sending to entries in FDT (and entire FDT handling) not implemented"
-    Q_UNUSED(srcAddr);
+    //keep the table dense - move the last entry in place of the removed one
+    int lastIdx = _fdTable.count() - 1;
+    if (idx != lastIdx) {
+        _fdTable[idx] = _fdTable.at(lastIdx);
+        const FdTableEntry &moved = _fdTable.at(idx);
+        _fdIndex[fdKey(moved.ipAddress, moved.port)] = idx;
+    }
+    _fdTable.resize(lastIdx);
 }
 
-void BacnetBbmdHandler::processOriginalBroadcast(quint8 *data, quint16 length, BacnetAddress &srcAddr)
+void BacnetBbmdHandler::timerEvent(QTimerEvent *event)
 {
-    Q_ASSERT(data);
-    sendToBbmds(data, length, true);
-
-    //Message is now sent to BBMDs. But still we have to pass this frame to all FDs except source.
-    #warning "Sending to entries in FDT (and entire FDT handling) not implemented"
-    Q_UNUSED(srcAddr);
-}
-
-//void BacnetBbmdHandler::processRegisterFD(quint8 *data, quint16 length, BacnetBipAddress &srcAddr)
-//{
-//    Q_ASSERT(length == 2);
-//    quint16 ttl = qFromBigEndian(*(quint16*)data);
-//    bool done = false;
-//    for (QVector<FdTableEntry>::iterator it = _fdTable.begin(); it != _fdTable.end();  it++) {
-//        if (it->address.isEqual(srcAddr)) {
-//            it->timeToLiveLeft = ttl + 30;//additional time added of "fixed grace period" as stated in J.5.2.3
-//            done = true;
-//            break;
-//        }
-//    }
-
-//    if (!done) {//was not found in already existing FDs
-//        if (_fdTable.count() >= MAX_FD_NUM) {
-//            qDebug("BacnetAddress::processRegisterFD() : FD not added!");
-//            _bvllHndlr->sendShortResult(BacnetBvllHandler::Register_Foreign_Device_NAK, srcAddr.ipAddress(), srcAddr.ipPort());
-//        }
-//        else {
-//            qDebug("BacnetAddress : registers new FD: %s : %d", qPrintable(srcAddr.ipAddress().toString()), srcAddr.ipPort());
-//            FdTableEntry newFdEntry;
-//            newFdEntry.address = srcAddr;
-//            newFdEntry.timeToLiveLeft = ttl + 30;//same as above
-//            _fdTable.append(newFdEntry);
-//        }
-//    }
-//}
+    if (event->timerId() != _wheelTimer.timerId()) {
+        QObject::timerEvent(event);
+        return;
+    }
+
+    ++_currentTick;
+    QVector<WheelItem> &slot = _wheel[_currentTick & (WheelSize - 1)];
+    //items of later rounds stay, stale and expired ones are dropped
+    int keptCount(0);
+    for (int i = 0; i < slot.count(); ++i) {
+        const WheelItem &item = slot.at(i);
+        if (item.expiryTick != _currentTick) {
+            if (item.expiryTick > _currentTick)
+                slot[keptCount++] = item;
+            continue;
+        }
+        QHash<quint64, int>::Iterator it = _fdIndex.find(item.key);
+        if ( (_fdIndex.end() != it) && (_fdTable.at(it.value()).expiryTick == _currentTick) ) {
+            const FdTableEntry &entry = _fdTable.at(it.value());
+            qDebug("BacnetBbmdHandler : FD %s:%d expired", qPrintable(QHostAddress(entry.ipAddress).toString()), entry.port);
+            removeFd_hlpr(it.value());
+        }
+    }
+    slot.resize(keptCount);
+
+    if (_fdTable.isEmpty()) {
+        //nothing to expire - all that is left in the wheel is stale
+        _wheelTimer.stop();
+        for (int i = 0; i < WheelSize; ++i)
+            _wheel[i].clear();
+    }
+}
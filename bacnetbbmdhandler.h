@@ -1,15 +1,17 @@
 #ifndef BACNETBBMDHANDLER_H
 #define BACNETBBMDHANDLER_H
 
+#include <QObject>
 #include <QVector>
+#include <QHash>
+#include <QBasicTimer>
+#include <QElapsedTimer>
 #include <QtGlobal>
 #include <QHostAddress>
 
 #include "bacnetvirtuallinklayer.h"
 #include "bacnetbipaddress.h"
-
-//fix that there can be no more than 5 foreign devices
-#define MAX_FD_NUM 5
+#include "bacnetudptransportlayer.h"
 
 struct BbmdTableEntry
 {
@@ -21,15 +23,39 @@ struct BbmdTableEntry
 
 struct FdTableEntry
 {
-    //again concretized, no need for abstractness
-    BacnetAddress address;
-    quint16 timeToLiveLeft;
+    //again concretized, no need for abstractness - kept raw, since it's looked up and sent to very often
+    quint32 ipAddress;
+    quint16 port;
+    //! Time-to-live the device registered with (without grace period) - needed for Read-Foreign-Device-Table-Ack.
+    quint16 timeToLive;
+    //! Tick (\sa BacnetBbmdHandler::_currentTick) at which the entry expires.
+    quint32 expiryTick;
 };
 
-class BacnetBbmdHandler
+/**
+  BBMD functionality - holds BDT and FDT and distributes broadcasts among them.
+
+  Foreign Device Table is meant to hold thousands of entries:
+  - entries are kept in a dense vector (so that broadcasts fan-out is a plain loop over it) and indexed with a hash keyed by B/IP address,
+  thus registration, renewal and deletion are O(1) (deleted entry is swapped with the last one);
+  - expiry is driven by a timing wheel with one second ticks - each entry is put into the slot of its expiry tick, and only that slot
+  is looked at, when the tick comes. Renewal doesn't remove entry from its old slot - stale slot items are recognized (their tick doesn't match
+  the entry one) and dropped, when their slot is processed.
+
+  Each broadcast is distributed with one fan-out: the Forwarded-NPDU frame is encoded once (by BVLL) and all its destinations (local subnet,
+  BDT and FDT entries) are collected and given to \sa BacnetUdpTransportLayerHandler::sendBatch() at once. Fan-out sizes and durations are counted.
+  */
+class BacnetBbmdHandler:
+        public QObject
 {
+    Q_OBJECT
 public:
-    BacnetBbmdHandler(BacnetBvllHandler *bvllHandler);
+    BacnetBbmdHandler(BacnetBvllHandler *bvllHandler, QObject *parent = 0);
+
+    //! Default and absolute limits of FDT size. The latter is what BVLL length field could carry - Read-Foreign-Device-Table-Ack
+    //! is anyway limited to what fits into one frame.
+    static const int DefaultMaxForeignDevicesCount = 4096;
+    static const int MaxForeignDevicesCount = (0xffff - 4) / 10;
 
     //! Udpdates/initializes new BDT table. If succeeds, return Successcufll Completion code, otherwise NAK.
     bool setBroadcastTableFromRaw(quint8 *data, quint16 length);
@@ -40,10 +66,12 @@ public:
     //! Returns the size of the actual BDT array
     quint16 expectedBroatcastTableRawSize();
 
+    //! Adds entry to BDT (used when BDT is configured, not written by other device). Mask is in host byte order.
+    void addBroadcastTableEntry(const BacnetAddress &address, quint32 mask);
+
     /**
       Checks if the message (of type Forwarded-NPDU) is to be broadcasted locally or not.
-      If positive, does so using bvlHnldlr functions.
-      \todo forward to all FDs except source
+      If positive, does so using bvlHnldlr functions. Then it's forwarded to all FDs except source.
       */
     void processForwardedMessage(quint8 *data, quint16 length, BacnetAddress &srcAddr);
 
@@ -53,7 +81,6 @@ public:
       # sends to all BBMDs (excludes itself!)
       # forwards to all Foreign Devices (if one of them has srcAddr, it is omitted (no replications))
       \warning data is already formed Forward-NPDU frame
-      \todo forwarding to Foreign Devices is not implemented
       */
     void processBroadcastToNetwork(quint8 *data, quint16 length, BacnetAddress &srcAddr);
 
@@ -65,25 +92,114 @@ public:
       */
     void processOriginalBroadcast(quint8 *data, quint16 length, BacnetAddress &srcAddr);
 
+    //! Sets how many foreign devices may be registered at most (further registrations are NAKed).
+    void setMaxForeignDevicesCount(int count);
+
     /**
-      \note maybe it's better pass entire frame received, not only the data
-      \warning data points to the registration field! which contains time-to-live parameter. The address itself corresponds to FD.
+      Registers new foreign device or renews the registration of existing one.
+      \param timeToLive - as requested by the device; fixed grace period is added to it (J.5.2.3).
+      \returns false if FDT is full.
       */
-//    void processRegisterFD(quint8 *data, quint16 length, BacnetBipAddress &srcAddr);
+    bool registerForeignDevice(const QHostAddress &address, quint16 port, quint16 timeToLive);
+
+    //! Removes foreign device from FDT. Returns false, if there was no such entry.
+    bool deleteForeignDevice(const QHostAddress &address, quint16 port);
+
+    //! Checks whether device is registered (Distribute-Broadcast-To-Network is accepted only from them).
+    bool isForeignDevice(const QHostAddress &address, quint16 port);
 
+    //! Returns the size of the FDT data in Read-Foreign-Device-Table-Ack
+    quint16 expectedForeignDeviceTableRawSize();
+
+    /**
+      Writes FDT contents (address, time-to-live and time remaining) into the array starting at data pointer.
+      Only whole entries that fit into maxLength are written - the rest of the table is left out.
+      \returns number of bytes written.
+      */
+    quint16 setForeignDeviceTableToRaw(quint8 *data, quint16 maxLength);
+
+    int foreignDevicesCount();
+
+    //! Statistics of broadcast distribution.
+    struct FanOutStatistics {
+        //! Number of fan-outs done (one per broadcast distributed).
+        quint64 fanOutsCount;
+        //! Number of datagrams given to the transport layer by all the fan-outs.
+        quint64 datagramsCount;
+        //! Number of datagrams transport layer couldn't send nor queue.
+        quint64 droppedCount;
+        //! The biggest number of destinations of a single fan-out.
+        int maxFanOutSize;
+        //! Time spent on fan-outs (collecting destinations and sending).
+        qint64 totalTime_ns;
+        qint64 maxTime_ns;
+    };
+    FanOutStatistics fanOutStatistics();
+    void resetFanOutStatistics();
+
+protected:
+    void timerEvent(QTimerEvent *);
 
 private:
+    //! Adds destination to the fan-out being collected.
+    void addFanOut_hlpr(quint32 ipAddress, quint16 port);
+    //! Adds all the BDT entries to the fan-out. If excludeMyself is true, our own entry (\sa BacnetBvllHandler::address()) is omitted.
+    void addBbmdsFanOut_hlpr(bool excludeMyself = true);
     /**
-      Helper function, that sends data of length length to all devices in the BDT table.
-      If excludeMyself is true. this will not be sent to the host device (its parameters
-      are taken from \sa _transportHndlr).
+      Adds all the registered foreign devices to the fan-out.
+      \param excludedAddr - device to be omitted (originator of the broadcast); if it's not a B/IP address, nothing is omitted.
       */
-    void sendToBbmds(quint8 *data, quint16 length, bool excludeMyself = true);
+    void addFdsFanOut_hlpr(const BacnetAddress &excludedAddr);
+    //! Sends data to all the destinations collected since the fan-out started (startTime_ns, from _clock) and updates statistics.
+    void sendFanOut_hlpr(quint8 *data, quint16 length, qint64 startTime_ns);
+    //! Recalculates _bdtDestinations after BDT changed.
+    void updateBdtDestinations_hlpr();
+
+    static inline quint64 fdKey(quint32 ipAddress, quint16 port) {return ((quint64)ipAddress << 16) | port;}
+    //! Puts entry into the slot of its expiry tick.
+    void scheduleExpiry_hlpr(quint64 key, quint32 expiryTick);
+    void removeFd_hlpr(int idx);
 
 private:
+    //! Fixed grace period added to time-to-live of each registration (J.5.2.3).
+    static const int FdGracePeriod_s = 30;
+    static const int WheelTick_ms = 1000;
+    //! Power of 2, so that slot is found by masking.
+    static const int WheelSize = 256;
+
     QVector<BbmdTableEntry> _bbmdTable;
+    //! BDT in the form used for fan-outs - no need to decode addresses with each broadcast.
+    struct BdtDestination {
+        //! Address of the BBMD itself - to find our own entry.
+        quint32 bbmdIpAddress;
+        //! J.4.5: inverted distribution mask ORed with BBMD address.
+        quint32 destIpAddress;
+        quint16 port;
+    };
+    QVector<BdtDestination> _bdtDestinations;
+
+    //! Registered devices - dense, order doesn't matter.
     QVector<FdTableEntry> _fdTable;
+    //! Maps fdKey() to index in _fdTable.
+    QHash<quint64, int> _fdIndex;
+    int _maxFdCount;
+
+    struct WheelItem {
+        quint64 key;
+        quint32 expiryTick;
+    };
+    QVector<WheelItem> _wheel[WheelSize];
+    //! Seconds since the timer was started. Advanced by the timer only when FDT is not empty.
+    quint32 _currentTick;
+    QBasicTimer _wheelTimer;
+
     BacnetBvllHandler *_bvllHndlr;
+
+    //! Destinations of the current fan-out. Entries are reused (only _fanOutSize of them are valid), so that QHostAddresses aren't reallocated.
+    QVector<BacnetUdpTransportLayerHandler::OutgoingDatagram> _fanOut;
+    int _fanOutSize;
+    FanOutStatistics _fanOutStats;
+    QElapsedTimer _clock;
 };
 
 #endif // BACNETBBMDHANDLER_H
@@ -21,8 +21,17 @@ void BacnetBipTransportLayer::sendNpdu(Buffer *buffToSend, Bacnet::NetworkPriori
     _bvllHndlr->sendNpdu(buffToSend, prio, destAddress, srcAddress);
 }
 
+int BacnetBipTransportLayer::loadPercent()
+{
+    return _transportHndlr->loadPercent();
+}
+
 BacnetUdpTransportLayerHandler *BacnetBipTransportLayer::transportLayer()
 {
     return _transportHndlr;
 }
 
+BacnetBvllHandler *BacnetBipTransportLayer::bvllHandler()
+{
+    return _bvllHndlr;
+}
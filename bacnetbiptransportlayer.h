@@ -20,8 +20,10 @@ public:
       */
     virtual void sendNpdu(Buffer *buffToSend, Bacnet::NetworkPriority prio = Bacnet::PriorityNormal,
                           const BacnetAddress *destAddress = 0, const BacnetAddress *srcAddress = 0);
+    virtual int loadPercent();
 
     BacnetUdpTransportLayerHandler *transportLayer();
+    BacnetBvllHandler *bvllHandler();
 
 private:
     BacnetUdpTransportLayerHandler *_transportHndlr;
@@ -0,0 +1,155 @@
+#include "bacnetbroadcastfilter.h"
+
+static const quint64 FnvOffsetBasis = Q_UINT64_C(0xcbf29ce484222325);
+static const quint64 FnvPrime       = Q_UINT64_C(0x100000001b3);
+
+BacnetBroadcastFilter::BacnetBroadcastFilter():
+    _dedupWindow_ns((qint64)DefaultDedupWindow_ms * 1000000),
+    _rate(0),
+    _burstSize(0),
+    _lastCleanup_ns(0)
+{
+    resetStatistics();
+    _clock.start();
+}
+
+void BacnetBroadcastFilter::setDedupWindow(int window_ms)
+{
+    Q_ASSERT(window_ms >= 0);
+    _dedupWindow_ns = (qint64)window_ms * 1000000;
+    if (0 == _dedupWindow_ns) {
+        _seen.clear();
+        _seenOrder.clear();
+    }
+}
+
+void BacnetBroadcastFilter::setRateLimit(int broadcastsPerSecond, int burstSize)
+{
+    Q_ASSERT( (broadcastsPerSecond >= 0) && (burstSize >= 0) );
+    _rate = broadcastsPerSecond;
+    _burstSize = (0 == burstSize) ? broadcastsPerSecond : burstSize;
+    _buckets.clear();
+}
+
+bool BacnetBroadcastFilter::accept(quint32 origIpAddress, quint16 origPort, const quint8 *npdu, quint16 npduLength)
+{
+    Q_ASSERT(0 != npdu);
+    qint64 now_ns = _clock.nsecsElapsed();
+
+    //duplicates first - they shouldn't use originator's tokens
+    if ( (_dedupWindow_ns > 0) && isDuplicate_hlpr(broadcastKey(origIpAddress, origPort, npdu, npduLength), now_ns) ) {
+        ++_stats.duplicatesCount;
+        reportSuppressed_hlpr();
+        return false;
+    }
+
+    if ( (_rate > 0) && isRateLimited_hlpr(((quint64)origIpAddress << 16) | origPort, now_ns) ) {
+        ++_stats.rateLimitedCount;
+        reportSuppressed_hlpr();
+        return false;
+    }
+
+    ++_stats.acceptedCount;
+    return true;
+}
+
+bool BacnetBroadcastFilter::isDuplicate_hlpr(quint64 key, qint64 now_ns)
+{
+    //forget what expired
+    while (!_seenOrder.isEmpty() && (_seenOrder.head().expiryTime_ns <= now_ns)) {
+        SeenItem item = _seenOrder.dequeue();
+        QHash<quint64, qint64>::Iterator it = _seen.find(item.key);
+        if ( (_seen.end() != it) && (it.value() == item.expiryTime_ns) )
+            _seen.erase(it);
+    }
+
+    if (_seen.contains(key))
+        return true;
+
+    //when full (distinct broadcasts flood), new ones are just not remembered - rate limit takes care of such sources
+    if (_seen.count() < MaxCachedCount) {
+        SeenItem item;
+        item.key = key;
+        item.expiryTime_ns = now_ns + _dedupWindow_ns;
+        _seen.insert(key, item.expiryTime_ns);
+        _seenOrder.enqueue(item);
+    }
+    return false;
+}
+
+bool BacnetBroadcastFilter::isRateLimited_hlpr(quint64 sourceKey, qint64 now_ns)
+{
+    if ( (_buckets.count() > BucketsCleanupSize) && (now_ns - _lastCleanup_ns > (qint64)BucketsCleanupInterval_ms * 1000000) )
+        cleanupBuckets_hlpr(now_ns);
+
+    QHash<quint64, TokenBucket>::Iterator it = _buckets.find(sourceKey);
+    if (_buckets.end() == it) {
+        TokenBucket bucket;
+        bucket.tokens = _burstSize;
+        bucket.lastUpdate_ns = now_ns;
+        it = _buckets.insert(sourceKey, bucket);
+    } else {
+        //refill with what was earned since the last broadcast
+        it->tokens = qMin((double)_burstSize, it->tokens + (now_ns - it->lastUpdate_ns) * _rate / 1e9);
+        it->lastUpdate_ns = now_ns;
+    }
+
+    if (it->tokens < 1)
+        return true;
+    it->tokens -= 1;
+    return false;
+}
+
+void BacnetBroadcastFilter::cleanupBuckets_hlpr(qint64 now_ns)
+{
+    _lastCleanup_ns = now_ns;
+    QHash<quint64, TokenBucket>::Iterator it = _buckets.begin();
+    while (it != _buckets.end()) {
+        if (it->tokens + (now_ns - it->lastUpdate_ns) * _rate / 1e9 >= _burstSize)
+            it = _buckets.erase(it);
+        else
+            ++it;
+    }
+}
+
+quint64 BacnetBroadcastFilter::broadcastKey(quint32 origIpAddress, quint16 origPort, const quint8 *npdu, quint16 npduLength)
+{
+    quint64 hash = FnvOffsetBasis;
+    for (int i = 0; i < 4; ++i) {
+        hash ^= (quint8)(origIpAddress >> (8 * i));
+        hash *= FnvPrime;
+    }
+    hash ^= (quint8)origPort;
+    hash *= FnvPrime;
+    hash ^= (quint8)(origPort >> 8);
+    hash *= FnvPrime;
+    for (int i = 0; i < npduLength; ++i) {
+        hash ^= npdu[i];
+        hash *= FnvPrime;
+    }
+    return hash;
+}
+
+void BacnetBroadcastFilter::reportSuppressed_hlpr()
+{
+    quint64 suppressedCount = _stats.duplicatesCount + _stats.rateLimitedCount;
+    if (1 == (suppressedCount % ReportEveryCount))
+        qDebug("BacnetBroadcastFilter : %llu broadcasts suppressed (%llu duplicates, %llu rate limited), %llu accepted",
+               suppressedCount, _stats.duplicatesCount, _stats.rateLimitedCount, _stats.acceptedCount);
+}
+
+BacnetBroadcastFilter::Statistics BacnetBroadcastFilter::statistics()
+{
+    _stats.cachedCount = _seen.count();
+    _stats.sourcesCount = _buckets.count();
+    return _stats;
+}
+
+void BacnetBroadcastFilter::resetStatistics()
+{
+    _stats.acceptedCount = 0;
+    _stats.duplicatesCount = 0;
+    _stats.rateLimitedCount = 0;
+    _stats.cachedCount = 0;
+    _stats.sourcesCount = 0;
+}
@@ -0,0 +1,90 @@
+#ifndef BACNETBROADCASTFILTER_H
+#define BACNETBROADCASTFILTER_H
+
+#include <QHash>
+#include <QQueue>
+#include <QElapsedTimer>
+
+/**
+  Broadcast storm suppression, used by \sa BacnetBvllHandler before the NPDU is decoded by the network layer:
+  - deduplication - the same broadcast (originator B/IP address and NPDU contents) re-broadcasted by several BBMDs reaches us a few times.
+  Only the first copy seen within the dedup window is accepted. Cache entries expire in order they were added, so expiry costs O(1) per datagram;
+  - rate limit - each originator may send at most rate broadcasts per second (with bursts up to burst size), the rest is dropped. It's
+  token bucket per source; buckets of sources that went quiet are removed from time to time.
+  Both are counted (\sa statistics()), and suppression is reported with qDebug every ReportEveryCount suppressed broadcasts.
+  */
+class BacnetBroadcastFilter
+{
+public:
+    BacnetBroadcastFilter();
+
+    /**
+      Copies re-broadcasted by BBMDs come within milliseconds of each other, while retries of the same request (e.g. Who-Is, which
+      doesn't change between tries) come seconds apart - the window has to be short enough to let the retries through.
+      */
+    static const int DefaultDedupWindow_ms = 50;
+
+    //! Sets how long the broadcast is remembered. 0 turns deduplication off.
+    void setDedupWindow(int window_ms);
+    //! Sets per source limit of broadcasts per second and the burst size (if 0, it's equal to rate). Rate 0 (default) turns limiting off.
+    void setRateLimit(int broadcastsPerSecond, int burstSize = 0);
+
+    /**
+      Returns true, if the broadcast should be processed; false, if it's a duplicate or exceeds originator limit.
+      \param npdu - NPDU part of the broadcast (BVLL header differs between copies, so it's not taken into account).
+      */
+    bool accept(quint32 origIpAddress, quint16 origPort, const quint8 *npdu, quint16 npduLength);
+
+    struct Statistics {
+        quint64 acceptedCount;
+        quint64 duplicatesCount;
+        quint64 rateLimitedCount;
+        //! Number of broadcasts remembered now.
+        int cachedCount;
+        //! Number of sources with rate limit bucket.
+        int sourcesCount;
+    };
+    Statistics statistics();
+    void resetStatistics();
+
+private:
+    bool isDuplicate_hlpr(quint64 key, qint64 now_ns);
+    bool isRateLimited_hlpr(quint64 sourceKey, qint64 now_ns);
+    //! Removes buckets, that are full again (their sources didn't send anything for a while).
+    void cleanupBuckets_hlpr(qint64 now_ns);
+    //! FNV-1a of originator address and NPDU.
+    static quint64 broadcastKey(quint32 origIpAddress, quint16 origPort, const quint8 *npdu, quint16 npduLength);
+    void reportSuppressed_hlpr();
+
+private:
+    static const int MaxCachedCount = 16384;
+    static const int BucketsCleanupSize = 1024;
+    static const int BucketsCleanupInterval_ms = 1000;
+    static const int ReportEveryCount = 1000;
+
+    QElapsedTimer _clock;
+
+    qint64 _dedupWindow_ns;
+    //! Broadcast key -> time it expires.
+    QHash<quint64, qint64> _seen;
+    struct SeenItem {
+        quint64 key;
+        qint64 expiryTime_ns;
+    };
+    //! The same as _seen, but in order of expiry (which is the order of adding).
+    QQueue<SeenItem> _seenOrder;
+
+    int _rate;
+    int _burstSize;
+    struct TokenBucket {
+        double tokens;
+        qint64 lastUpdate_ns;
+    };
+    //! Source key (ip << 16 | port) -> its bucket.
+    QHash<quint64, TokenBucket> _buckets;
+    qint64 _lastCleanup_ns;
+
+    Statistics _stats;
+};
+
+#endif // BACNETBROADCASTFILTER_H
@@ -1,33 +1,54 @@
 #include "bacnetbuffermanager.h"
 
-class BufferWrapper {
-public:
-    BufferWrapper(quint16 buffSize):
-            refCount(0),
-            buff(&refCount, buffSize)
-    {
-        buff._buffer = new quint8[buffSize];
-    }
+#include <QMutexLocker>
+#include <string.h>
+
+BufferWrapper::BufferWrapper(quint16 buffSize, quint8 sizeClass):
+        refCount(0),
+        buff(this, buffSize),
+        sizeClass(sizeClass)
+{
+    buff._buffer = new quint8[buffSize];
+}
 
-    quint8 refCount;
-    Buffer buff;
-};
+BufferWrapper::~BufferWrapper()
+{
+    delete []buff._buffer;
+    buff._buffer = 0;
+    buff._wrapper = 0;//don't let template release us
+}
 
-BacnetBufferManager *BacnetBufferManager::_instance = 0;
-Buffer BacnetBufferManager::_nullBuff;
+QAtomicPointer<BacnetBufferManager> BacnetBufferManager::_instance(0);
 
 BacnetBufferManager::BacnetBufferManager()
 {
-    _buffersList.reserve(NominalElementsCount);
+    memset(_statistics, 0, sizeof(_statistics));
+    _maxElementsCount[SmallBuffer] = MaxElementsCount;
+    _maxElementsCount[LargeBuffer] = MaxElementsCount;
+    _maxElementsCount[SegmentationBuffer] = MaxSegmentationElementsCount;
+
+    _buffersList.reserve(NominalElementsCount + NominalSmallElementsCount);
     for (int i = 0; i < NominalElementsCount; i++) {
-        _buffersList.append(new BufferWrapper(MaximumBufferSize));
+        BufferWrapper *wrapper = new BufferWrapper(LargeBufferSize, LargeBuffer);
+        _buffersList.append(wrapper);
+        _freeLists[LargeBuffer].append(wrapper);
     }
+    for (int i = 0; i < NominalSmallElementsCount; i++) {
+        BufferWrapper *wrapper = new BufferWrapper(SmallBufferSize, SmallBuffer);
+        _buffersList.append(wrapper);
+        _freeLists[SmallBuffer].append(wrapper);
+    }
+    _statistics[LargeBuffer].allocatedCount = NominalElementsCount;
+    _statistics[SmallBuffer].allocatedCount = NominalSmallElementsCount;
 }
 
 BacnetBufferManager *BacnetBufferManager::instance()
 {
     if (0 == _instance) {
-        _instance = new BacnetBufferManager();
+        //the first caller may not be alone, when receive workers are running - only one instance is to survive
+        BacnetBufferManager *newInstance = new BacnetBufferManager();
+        if (!_instance.testAndSetOrdered(0, newInstance))
+            delete newInstance;
     }
 
     return _instance;
@@ -41,6 +62,8 @@ quint16 BacnetBufferManager::offsetForLayer(RequestingLayer reqLayer)
         return OffsetForAPDU;
     case (NetworkLayer):
         return OffsetForNPDU;
+    case (TransportLayerRx):
+        return RxHeadroom;
     case (TransportLayer):
         //fall through - transport layer is the last one, so we don't need to prepend anything further
     default:
@@ -48,23 +71,103 @@ quint16 BacnetBufferManager::offsetForLayer(RequestingLayer reqLayer)
     }
 }
 
-Buffer &BacnetBufferManager::getBuffer(RequestingLayer reqLayer)
+quint16 BacnetBufferManager::sizeOfClass_hlpr(SizeClass sizeClass)
+{
+    switch (sizeClass)
+    {
+    case (SmallBuffer):
+        return SmallBufferSize;
+    case (SegmentationBuffer):
+        return SegmentationBufferSize;
+    case (LargeBuffer):
+        //fall through
+    default:
+        return LargeBufferSize;
+    }
+}
+
+BufferWrapper *BacnetBufferManager::takeWrapper_hlpr(SizeClass sizeClass)
+{
+    //has to be called with _mutex locked
+    Statistics &stats = _statistics[sizeClass];
+    BufferWrapper *wrapper(0);
+    if (!_freeLists[sizeClass].isEmpty()) {
+        wrapper = _freeLists[sizeClass].takeLast();//the most recently used one - it's probably still in cache
+    } else if (stats.allocatedCount < _maxElementsCount[sizeClass]) {
+        wrapper = new BufferWrapper(sizeOfClass_hlpr(sizeClass), sizeClass);
+        _buffersList.append(wrapper);
+        ++stats.allocatedCount;
+    } else {
+        ++stats.exhaustedCount;
+        return 0;
+    }
+
+    ++stats.requestsCount;
+    ++stats.inUseCount;
+    if (stats.inUseCount > stats.highWaterMark)
+        stats.highWaterMark = stats.inUseCount;
+    return wrapper;
+}
+
+Buffer BacnetBufferManager::getBuffer(RequestingLayer reqLayer, quint16 bodySize)
 {
-    QList<BufferWrapper*>::iterator it = _buffersList.begin();
-    for ( ; it != _buffersList.end(); ++it) {
-        if (0 == (*it)->refCount) {
-
-            //fill some informative user values
-            Buffer &bRef = (*it)->buff;//we don't invoke copy constructor here, or assignment
-            quint16 bodyOffset = offsetForLayer(reqLayer);
-            bRef.setBodyPtr(bRef.bufferStart() + bodyOffset);
-            bRef.setBodyLength(bRef.buffLength() -  bodyOffset);
-
-            return (*it)->buff;
-        }
+    quint16 bodyOffset = offsetForLayer(reqLayer);
+    SizeClass sizeClass = LargeBuffer;
+    if (bodyOffset + bodySize <= SmallBufferSize)
+        sizeClass = SmallBuffer;
+    else if (bodyOffset + bodySize > LargeBufferSize)
+        sizeClass = SegmentationBuffer;
+    Q_ASSERT(bodyOffset + bodySize <= sizeOfClass_hlpr(sizeClass));
+
+    BufferWrapper *wrapper(0);
+    {
+        QMutexLocker locker(&_mutex);
+        wrapper = takeWrapper_hlpr(sizeClass);
+        //no small ones left? Take large one rather than fail.
+        if ( (0 == wrapper) && (SmallBuffer == sizeClass) )
+            wrapper = takeWrapper_hlpr(LargeBuffer);
+    }
+
+    if (0 == wrapper) {
+        qDebug("%s : buffers pool exhausted!", __PRETTY_FUNCTION__);
+        return Buffer();
     }
-    //we have run out of free buffers - what to do?
-    //! \todo we could increase number of buffers - that's why MaxElementsCount is defined
-    //or, (we do it so far), return Buffer instance with empty buffer!
-    return _nullBuff;
+
+    Q_ASSERT(0 == wrapper->refCount);
+    //this copy is counted
+    Buffer buffer(wrapper->buff);
+    //fill some informative user values
+    buffer.setBodyPtr(buffer.bufferStart() + bodyOffset);
+    buffer.setBodyLength(buffer.buffLength() - bodyOffset);
+    return buffer;
+}
+
+void BacnetBufferManager::release(BufferWrapper *wrapper)
+{
+    Q_CHECK_PTR(wrapper);
+    QMutexLocker locker(&_mutex);
+    Q_ASSERT(!_freeLists[wrapper->sizeClass].contains(wrapper));
+    _freeLists[wrapper->sizeClass].append(wrapper);
+    --_statistics[wrapper->sizeClass].inUseCount;
+}
+
+void BacnetBufferManager::setMaxElementsCount(SizeClass sizeClass, int maxCount)
+{
+    Q_ASSERT(sizeClass < SizeClassesCount);
+    QMutexLocker locker(&_mutex);
+    _maxElementsCount[sizeClass] = maxCount;
+}
+
+int BacnetBufferManager::maxElementsCount(SizeClass sizeClass)
+{
+    Q_ASSERT(sizeClass < SizeClassesCount);
+    QMutexLocker locker(&_mutex);
+    return _maxElementsCount[sizeClass];
+}
+
+BacnetBufferManager::Statistics BacnetBufferManager::statistics(SizeClass sizeClass)
+{
+    Q_ASSERT(sizeClass < SizeClassesCount);
+    QMutexLocker locker(&_mutex);
+    return _statistics[sizeClass];
 }
@@ -2,69 +2,157 @@
 #define BACNETBUFFERMANAGER_H
 
 #include <QList>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QAtomicPointer>
 
 #include "bacnetcommon.h"
 #include "buffer.h"
 
-class BufferWrapper;
+/**
+  Pool element - memory block along with its reference counter. The Buffer instance it holds is only a template, which is
+  copied by users (and the copies are what is counted).
+  */
+class BufferWrapper {
+public:
+    BufferWrapper(quint16 buffSize, quint8 sizeClass);
+    ~BufferWrapper();
+
+    QAtomicInt refCount;
+    Buffer buff;
+    //! \sa BacnetBufferManager::SizeClass
+    quint8 sizeClass;
+};
+
 class BacnetBufferManager
 {
 public:
+    /**
+      Buffers are of two size classes - most of APDUs we send are just a few bytes long (rejects, aborts, simple acks, network messages),
+      so there is no point in taking entire frame-size block for them. Segmented APDUs are reassembled (or prepared to be sent) in
+      one block, which is much bigger than a frame - there are only a few of them and they are not allocated until needed.
+      */
+    enum SizeClass {
+        SmallBuffer,
+        LargeBuffer,
+        SegmentationBuffer,
+
+        SizeClassesCount
+    };
+
     enum {
-        NominalElementsCount = 4,
-        MaxElementsCount = NominalElementsCount,
+        //! Receive path reads datagrams in batches straight into pooled buffers (see BacnetUdpTransportLayerHandler) - leave some for sending, too.
+        NominalElementsCount = 32,
+        NominalSmallElementsCount = 32,
+        //! Default cap for each size class; pool grows on demand up to this number. \sa setMaxElementsCount()
+        MaxElementsCount = 1024,
+        //! Default cap for segmentation buffers - each of them is ~47kB.
+        MaxSegmentationElementsCount = 32
     };
 
     enum MemoryManagerConsts {
 
         /**
-          Memory manager allocates constant size frames - they are of the maximum size that can be
-          received/sent via the lowest layer. When receive, we don't have to take care of bytes placement.
-          However, when sending data, we have to know at what place to insert e.g. application data,
-          so that all the information from lower layers have place to be inserted as well. We could put
-          them at the beginnging and move by the lower layers, but this is time-consuming. Here we choose
-          worst-case scenario (each lower layer takes would taken maximum bytes it can) and start placing upper
-          layer data at the offset, resulting from taking into consideration space that lower layers could
-          fill - this is not so memory efficient, but well performing and still no memory fragmentation and
-          allocation is needed afterwards.
+          Lower layers prepend their headers (\sa Buffer::prepend()), so only the headroom is reserved - the headers are written just
+          in front of the body, not at fixed offsets. BVLL reserves space for the longest header it prepends to NPDU: Forwarded-NPDU one
+          (function code, length and originator B/IP address).
           */
+        BvllHeadroom = Bacnet::BvllMaxHeaderSize + 6 /*originator B/IP address*/,
+        MaximumBufferSize = Bacnet::NpduMaxSize + BvllHeadroom,
+        /**
+          Received datagrams are not read at the buffer start, but this far from it. When the NPDU is routed to other port, its NPCI
+          is rewritten in place and may grow by SNET, SLEN and SADR - it still has to leave BvllHeadroom for the egress BVLL header,
+          even if ingress one was the shortest (Original-Unicast-NPDU). \sa BacnetNetworkLayerHandler::routeNpdu_hlpr()
+          */
+        RxHeadroom = BvllHeadroom - Bacnet::BvllMaxHeaderSize + 2 /*SNET*/ + 1 /*SLEN*/ + Bacnet::BacnetBipAddrSize,
+        //! Large buffers hold the biggest frame to be sent, or the biggest datagram received (after RxHeadroom).
+        LargeBufferSize = MaximumBufferSize + RxHeadroom,
+        OffsetForNPDU = BvllHeadroom,
+        OffsetForAPDU = (OffsetForNPDU + Bacnet::NpduMaxHeaderSize),
 
-        MaximumBufferSize = Bacnet::BvllMaxSize,
-        OffsetForNPDU = (MaximumBufferSize - Bacnet::NpduMaxSize),
-        OffsetForAPDU = (OffsetForNPDU + Bacnet::NpduMaxHeaderSize)
+        //! Small buffers have the same headroom as the large ones, and place for 64 bytes of APDU at least.
+        SmallBufferSize = 128,
+        SmallBufferMinApduSize = 64,
+
+        //! Segmented APDU may consist of this many segments at most (\sa BacnetTSM2) - what doesn't fit, is aborted with buffer-overflow.
+        SegmentedApduMaxSegments = 32,
+        //! Service data of the entire segmented APDU (PCI is not stored).
+        SegmentedApduMaxSize = SegmentedApduMaxSegments * Bacnet::ApduMaxSize,
+        //! Service data is encoded first and APCI is prepended to it, when it fits into one APDU - the longest is the segmented request's one.
+        ApciHeadroom = 6,
+        SegmentationBufferSize = OffsetForAPDU + ApciHeadroom + SegmentedApduMaxSize
     };
 
     enum RequestingLayer {
         ApplicationLayer,
         NetworkLayer,
-        TransportLayer
+        TransportLayer,
+        //! Transport layer receive path - body starts at RxHeadroom.
+        TransportLayerRx
     };
 
     static BacnetBufferManager *instance();
 
     /**
-      This function returns the vacant Buffer instance from the pool of Buffers.
-      \note The Buffer::bodyLength()
-      \warning When there is no more vacant isntances, this function returns an empty buffer which is invalid.
+      This function returns the vacant Buffer instance from the pool of Buffers. The returned Buffer is already counted as a user of the memory -
+      when it (and all its copies) get destroyed, memory goes back to the pool.
+      \param reqLayer - layer, which requests the buffer - body pointer is set accordingly to \sa offsetForLayer()
+      \param bodySize - number of bytes the requester is going to write into the body (from the layer offset). If it fits into the small
+      buffer, the small one is given. By default the large one is returned. If it doesn't fit into the large one, segmentation buffer
+      is returned (\sa SegmentedApduMaxSize).
+      \note The Buffer::bodyLength() is set to all the space from the offset till the end of the buffer.
+      \warning When there is no more vacant isntances and the pool can't grow anymore, this function returns an empty buffer which is invalid.
       It's a user responsibility to check for validitidy - \sa Buffer::isValid()
+      \note Thread safe.
       */
-    Buffer &getBuffer(RequestingLayer reqLayer);
+    Buffer getBuffer(RequestingLayer reqLayer, quint16 bodySize = MaximumBufferSize);
 
     /**
       Returns nominal offsets for each layer. For instance, when we want to get offset for APDU in the buffer,
       call offsetForLayer(ApplicationLayer).
       */
     static quint16 offsetForLayer(RequestingLayer reqLayer);
+
+    //! Sets the maximum number of buffers of given size class, the pool may grow to. Already allocated buffers are never freed.
+    void setMaxElementsCount(SizeClass sizeClass, int maxCount);
+    int maxElementsCount(SizeClass sizeClass);
+
+    //! Pool statistics, so that its size can be adjusted.
+    struct Statistics {
+        //! Number of buffers allocated so far.
+        int allocatedCount;
+        //! Number of buffers being used now.
+        int inUseCount;
+        //! The highest number of buffers used at the same time.
+        int highWaterMark;
+        //! Number of times getBuffer() returned invalid buffer, since the cap was reached.
+        quint64 exhaustedCount;
+        //! Number of successful getBuffer() calls.
+        quint64 requestsCount;
+    };
+    Statistics statistics(SizeClass sizeClass);
+
 private:
+    friend class Buffer;
+    //! Called by the last Buffer instance using the memory.
+    void release(BufferWrapper *wrapper);
+
+    BufferWrapper *takeWrapper_hlpr(SizeClass sizeClass);
+    static quint16 sizeOfClass_hlpr(SizeClass sizeClass);
 
 private:
     // Prevent others from creating an instance - SingletonPattern
     BacnetBufferManager();
 
-    static BacnetBufferManager *_instance;
+    static QAtomicPointer<BacnetBufferManager> _instance;
 
+    QMutex _mutex;
+    //! All buffers ever allocated - we own them.
     QList<BufferWrapper*> _buffersList;
-    static Buffer _nullBuff;
+    //! Free buffers of each size class.
+    QList<BufferWrapper*> _freeLists[SizeClassesCount];
+    int _maxElementsCount[SizeClassesCount];
+    Statistics _statistics[SizeClassesCount];
 };
 
 #endif // BACNETBUFFERMANAGER_H
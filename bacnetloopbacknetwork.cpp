@@ -0,0 +1,206 @@
+#include "bacnetloopbacknetwork.h"
+
+#include "bacnetbuffermanager.h"
+
+static const quint32 GlobalBroadcastAddress = 0xffffffff;
+
+BacnetLoopbackNetwork *BacnetLoopbackNetwork::_instance = 0;
+
+BacnetLoopbackNetwork *BacnetLoopbackNetwork::instance()
+{
+    //simulations are single threaded, no need to guard it
+    if (0 == _instance)
+        _instance = new BacnetLoopbackNetwork();
+    return _instance;
+}
+
+BacnetLoopbackNetwork::BacnetLoopbackNetwork():
+    _deliveryScheduled(false),
+    _droppedCount(0)
+{
+    _clock.start();
+}
+
+bool BacnetLoopbackNetwork::addSegment(const QString &name, const QHostAddress &network, int prefixLength)
+{
+    Q_ASSERT( (prefixLength >= 0) && (prefixLength <= 32) );
+    foreach (const Segment &segment, _segments) {
+        if (segment.name == name) {
+            qDebug("%s : segment %s already exists!", __PRETTY_FUNCTION__, qPrintable(name));
+            return false;
+        }
+    }
+
+    Segment segment;
+    segment.name = name;
+    segment.mask = (0 == prefixLength) ? 0 : (0xffffffff << (32 - prefixLength));
+    segment.network = network.toIPv4Address() & segment.mask;
+    _segments.append(segment);
+    return true;
+}
+
+bool BacnetLoopbackNetwork::attach(BacnetLoopbackEndpoint *endpoint, const QString &name, const QString &segmentName, const QHostAddress &address, quint16 port)
+{
+    Q_CHECK_PTR(endpoint);
+    int segmentIdx(-1);
+    for (int i = 0; i < _segments.count(); ++i) {
+        if (_segments.at(i).name == segmentName) {
+            segmentIdx = i;
+            break;
+        }
+    }
+    if (segmentIdx < 0) {
+        qDebug("%s : no segment %s!", __PRETTY_FUNCTION__, qPrintable(segmentName));
+        return false;
+    }
+
+    quint32 ipAddress = address.toIPv4Address();
+    foreach (const Attachment &attachment, _attachments) {
+        if ( (0 != attachment.endpoint) && (attachment.ipAddress == ipAddress) && (attachment.port == port) ) {
+            qDebug("%s : %s:%d is already taken!", __PRETTY_FUNCTION__, qPrintable(address.toString()), port);
+            return false;
+        }
+    }
+    Q_ASSERT(_attachments.count() < 0xffff);
+
+    Attachment attachment;
+    attachment.endpoint = endpoint;
+    attachment.name = name;
+    attachment.segmentIdx = segmentIdx;
+    attachment.ipAddress = ipAddress;
+    attachment.port = port;
+    _attachments.append(attachment);
+    return true;
+}
+
+void BacnetLoopbackNetwork::detach(BacnetLoopbackEndpoint *endpoint)
+{
+    int idx = attachmentIdx(endpoint);
+    if (idx >= 0)
+        _attachments[idx].endpoint = 0;
+}
+
+int BacnetLoopbackNetwork::attachmentIdx(BacnetLoopbackEndpoint *endpoint)
+{
+    for (int i = 0; i < _attachments.count(); ++i) {
+        if (_attachments.at(i).endpoint == endpoint)
+            return i;
+    }
+    return -1;
+}
+
+void BacnetLoopbackNetwork::send(BacnetLoopbackEndpoint *from, const quint8 *data, quint16 length, const QHostAddress &destAddr, quint16 destPort)
+{
+    int fromIdx = attachmentIdx(from);
+    Q_ASSERT(fromIdx >= 0);
+    if (fromIdx < 0)
+        return;
+
+    //one copy is shared by all the receivers
+    Buffer frame = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::TransportLayerRx, length);
+    if (!frame.isValid() || (frame.bodyLength() < length)) {
+        ++_droppedCount;
+        return;
+    }
+    memcpy(frame.bodyPtr(), data, length);
+    frame.setBodyLength(length);
+
+    quint32 destIp = destAddr.toIPv4Address();
+    bool delivered(false);
+    for (int i = 0; i < _attachments.count(); ++i) {
+        const Attachment &attachment = _attachments.at(i);
+        if ( (0 == attachment.endpoint) || (i == fromIdx) || (attachment.port != destPort) )
+            continue;
+
+        const Segment &segment = _segments.at(attachment.segmentIdx);
+        bool isReceiver;
+        if (GlobalBroadcastAddress == destIp)
+            isReceiver = (attachment.segmentIdx == _attachments.at(fromIdx).segmentIdx);
+        else if ( (segment.network | ~segment.mask) == destIp )//directed broadcast
+            isReceiver = true;
+        else
+            isReceiver = (attachment.ipAddress == destIp);
+
+        if (isReceiver) {
+            enqueue_hlpr(fromIdx, i, frame);
+            delivered = true;
+        }
+    }
+
+    if (!delivered)
+        ++_droppedCount;
+}
+
+void BacnetLoopbackNetwork::enqueue_hlpr(int fromIdx, int toIdx, const Buffer &frame)
+{
+    PendingDatagram pending;
+    pending.fromIdx = fromIdx;
+    pending.toIdx = toIdx;
+    pending.frame = frame;
+    pending.sentTime_ns = _clock.nsecsElapsed();
+    _pending.enqueue(pending);
+
+    if (!_deliveryScheduled) {
+        _deliveryScheduled = true;
+        QMetaObject::invokeMethod(this, "deliverPending", Qt::QueuedConnection);
+    }
+}
+
+void BacnetLoopbackNetwork::deliverPending()
+{
+    _deliveryScheduled = false;
+
+    //deliver in chunks, so that timers of the stacks may run in between
+    for (int i = 0; (i < DeliveryChunkSize) && !_pending.isEmpty(); ++i) {
+        PendingDatagram pending = _pending.dequeue();
+        const Attachment &from = _attachments.at(pending.fromIdx);
+        BacnetLoopbackEndpoint *receiver = _attachments.at(pending.toIdx).endpoint;
+        if (0 == receiver) {//detached in the meantime
+            ++_droppedCount;
+            continue;
+        }
+
+        QHostAddress srcAddr(from.ipAddress);
+        receiver->deliverDatagram(pending.frame, srcAddr, from.port);
+        qint64 latency_ns = _clock.nsecsElapsed() - pending.sentTime_ns;
+
+        quint32 key = ((quint32)pending.fromIdx << 16) | pending.toIdx;
+        QHash<quint32, HopStatistics>::Iterator it = _hopStatistics.find(key);
+        if (_hopStatistics.end() == it) {
+            HopStatistics stats;
+            stats.fromName = from.name;
+            stats.toName = _attachments.at(pending.toIdx).name;
+            stats.datagramsCount = 0;
+            stats.bytesCount = 0;
+            stats.totalLatency_ns = 0;
+            stats.maxLatency_ns = 0;
+            it = _hopStatistics.insert(key, stats);
+        }
+        ++(it->datagramsCount);
+        it->bytesCount += pending.frame.bodyLength();
+        it->totalLatency_ns += latency_ns;
+        if (latency_ns > it->maxLatency_ns)
+            it->maxLatency_ns = latency_ns;
+    }
+
+    if (!_pending.isEmpty() && !_deliveryScheduled) {
+        _deliveryScheduled = true;
+        QMetaObject::invokeMethod(this, "deliverPending", Qt::QueuedConnection);
+    }
+}
+
+QList<BacnetLoopbackNetwork::HopStatistics> BacnetLoopbackNetwork::hopStatistics()
+{
+    return _hopStatistics.values();
+}
+
+void BacnetLoopbackNetwork::resetStatistics()
+{
+    _hopStatistics.clear();
+    _droppedCount = 0;
+}
+
+quint64 BacnetLoopbackNetwork::droppedCount()
+{
+    return _droppedCount;
+}
@@ -0,0 +1,109 @@
+#ifndef BACNETLOOPBACKNETWORK_H
+#define BACNETLOOPBACKNETWORK_H
+
+#include <QObject>
+#include <QHostAddress>
+#include <QQueue>
+#include <QElapsedTimer>
+
+#include "buffer.h"
+
+/**
+  Anything that may be attached to \sa BacnetLoopbackNetwork and receive datagrams from it.
+  */
+class BacnetLoopbackEndpoint
+{
+public:
+    virtual ~BacnetLoopbackEndpoint() {}
+    //! Called by the network, when datagram is delivered. Frame may be kept (it's pooled buffer), but mustn't be modified - it's shared with other receivers of broadcasts.
+    virtual void deliverDatagram(Buffer &frame, const QHostAddress &srcAddr, quint16 srcPort) = 0;
+};
+
+/**
+  In-memory IP network, that connects several gateway stacks (or load generators) living in one process. Each endpoint is attached
+  to a segment (IP subnet) with its address and port:
+  - unicast datagrams are delivered to the endpoint with destination address and port (on any segment - it's "routed" IP);
+  - global broadcasts (255.255.255.255) go to all the endpoints of sender's segment with destination port;
+  - directed broadcasts go to all the endpoints of the segment, whose broadcast address it is.
+  Delivery is never done within send() call - datagrams are queued and delivered from the event loop, so stacks are not re-entered.
+  For each hop (sender -> receiver) number of datagrams and latency (from send till the receiver is done with it) are gathered.
+  */
+class BacnetLoopbackNetwork:
+        public QObject
+{
+    Q_OBJECT
+public:
+    static BacnetLoopbackNetwork *instance();
+
+    //! Adds subnet segment. Returns false, if the name is already used.
+    bool addSegment(const QString &name, const QHostAddress &network, int prefixLength);
+
+    /**
+      Attaches endpoint to the segment. Returns false, if there is no such segment or address and port are already taken.
+      \param name - used in statistics only.
+      */
+    bool attach(BacnetLoopbackEndpoint *endpoint, const QString &name, const QString &segmentName, const QHostAddress &address, quint16 port);
+    void detach(BacnetLoopbackEndpoint *endpoint);
+
+    //! Queues datagram for delivery. Data is copied.
+    void send(BacnetLoopbackEndpoint *from, const quint8 *data, quint16 length, const QHostAddress &destAddr, quint16 destPort);
+
+    struct HopStatistics {
+        QString fromName;
+        QString toName;
+        quint64 datagramsCount;
+        quint64 bytesCount;
+        qint64 totalLatency_ns;
+        qint64 maxLatency_ns;
+    };
+    QList<HopStatistics> hopStatistics();
+    void resetStatistics();
+
+    //! Number of datagrams that had no receiver or couldn't be copied.
+    quint64 droppedCount();
+
+private slots:
+    void deliverPending();
+
+private:
+    BacnetLoopbackNetwork();
+    int attachmentIdx(BacnetLoopbackEndpoint *endpoint);
+    void enqueue_hlpr(int fromIdx, int toIdx, const Buffer &frame);
+
+private:
+    static BacnetLoopbackNetwork *_instance;
+    static const int DeliveryChunkSize = 1024;
+
+    struct Segment {
+        QString name;
+        quint32 network;
+        quint32 mask;
+    };
+    QVector<Segment> _segments;
+
+    //! Detached endpoints stay with 0 endpoint, so that indexes (used in statistics) don't change.
+    struct Attachment {
+        BacnetLoopbackEndpoint *endpoint;
+        QString name;
+        int segmentIdx;
+        quint32 ipAddress;
+        quint16 port;
+    };
+    QVector<Attachment> _attachments;
+
+    struct PendingDatagram {
+        int fromIdx;
+        int toIdx;
+        Buffer frame;
+        qint64 sentTime_ns;
+    };
+    QQueue<PendingDatagram> _pending;
+    bool _deliveryScheduled;
+
+    QElapsedTimer _clock;
+    //! Key is (fromIdx << 16) | toIdx.
+    QHash<quint32, HopStatistics> _hopStatistics;
+    quint64 _droppedCount;
+};
+
+#endif // BACNETLOOPBACKNETWORK_H
@@ -0,0 +1,58 @@
+#include "bacnetloopbacktransportlayer.h"
+
+#include "bacnetvirtuallinklayer.h"
+#include "buffer.h"
+
+BacnetLoopbackTransportLayer::BacnetLoopbackTransportLayer():
+    _transportHndlr(new BacnetUdpTransportLayerHandler()),
+    _bvllHndlr(new BacnetBvllHandler(_transportHndlr))
+{
+    _transportHndlr->setDatagramSink(this);
+    _transportHndlr->setBvlc(_bvllHndlr);
+    _bvllHndlr->setTransportProxy(this);
+}
+
+BacnetLoopbackTransportLayer::~BacnetLoopbackTransportLayer()
+{
+    BacnetLoopbackNetwork::instance()->detach(this);
+    delete _bvllHndlr;
+    delete _transportHndlr;
+}
+
+bool BacnetLoopbackTransportLayer::attach(const QString &name, const QString &segmentName, const QHostAddress &address, quint16 port)
+{
+    _transportHndlr->setAddress(address, port);
+    return BacnetLoopbackNetwork::instance()->attach(this, name, segmentName, address, port);
+}
+
+void BacnetLoopbackTransportLayer::setNetworkLayer(BacnetNetworkLayerHandler *networkHndlr)
+{
+    _bvllHndlr->setNetworkLayer(networkHndlr);
+}
+
+void BacnetLoopbackTransportLayer::sendNpdu(Buffer *buffToSend, Bacnet::NetworkPriority prio,
+                                            const BacnetAddress *destAddress, const BacnetAddress *srcAddress)
+{
+    _bvllHndlr->sendNpdu(buffToSend, prio, destAddress, srcAddress);
+}
+
+void BacnetLoopbackTransportLayer::datagramSent(const quint8 *data, quint16 length, const QHostAddress &destAddr, quint16 destPort)
+{
+    BacnetLoopbackNetwork::instance()->send(this, data, length, destAddr, destPort);
+}
+
+void BacnetLoopbackTransportLayer::deliverDatagram(Buffer &frame, const QHostAddress &srcAddr, quint16 srcPort)
+{
+    QHostAddress src(srcAddr);
+    _transportHndlr->injectDatagram(frame.bodyPtr(), frame.bodyLength(), src, srcPort, &frame);
+}
+
+BacnetUdpTransportLayerHandler *BacnetLoopbackTransportLayer::transportLayer()
+{
+    return _transportHndlr;
+}
+
+BacnetBvllHandler *BacnetLoopbackTransportLayer::bvllHandler()
+{
+    return _bvllHndlr;
+}
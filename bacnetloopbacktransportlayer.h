@@ -0,0 +1,44 @@
+#ifndef BACNETLOOPBACKTRANSPORTLAYER_H
+#define BACNETLOOPBACKTRANSPORTLAYER_H
+
+#include "bacnettransportlayer.h"
+#include "bacnetudptransportlayer.h"
+#include "bacnetloopbacknetwork.h"
+
+class BacnetBvllHandler;
+
+/**
+  B/IP port attached to the in-memory \sa BacnetLoopbackNetwork instead of a socket. Everything above UDP (BVLL, BBMD, network layer
+  and up) is the same as with \sa BacnetBipTransportLayer, so several gateway stacks may be connected within one process - e.g. to
+  load-test routing and BBMD without several machines.
+  */
+class BacnetLoopbackTransportLayer:
+        public BacnetTransportLayerHandler,
+        public BacnetUdpDatagramSink,
+        public BacnetLoopbackEndpoint
+{
+public:
+    BacnetLoopbackTransportLayer();
+    virtual ~BacnetLoopbackTransportLayer();
+
+    //! Sets our address and attaches us to the segment of loopback network. Returns false, if attaching failed.
+    bool attach(const QString &name, const QString &segmentName, const QHostAddress &address, quint16 port);
+
+    virtual void setNetworkLayer(BacnetNetworkLayerHandler *networkHndlr);
+    virtual void sendNpdu(Buffer *buffToSend, Bacnet::NetworkPriority prio = Bacnet::PriorityNormal,
+                          const BacnetAddress *destAddress = 0, const BacnetAddress *srcAddress = 0);
+
+    //! Implementation of BacnetUdpDatagramSink - passes datagram to the loopback network.
+    virtual void datagramSent(const quint8 *data, quint16 length, const QHostAddress &destAddr, quint16 destPort);
+    //! Implementation of BacnetLoopbackEndpoint - passes datagram up the stack.
+    virtual void deliverDatagram(Buffer &frame, const QHostAddress &srcAddr, quint16 srcPort);
+
+    BacnetUdpTransportLayerHandler *transportLayer();
+    BacnetBvllHandler *bvllHandler();
+
+private:
+    BacnetUdpTransportLayerHandler *_transportHndlr;
+    BacnetBvllHandler *_bvllHndlr;
+};
+
+#endif // BACNETLOOPBACKTRANSPORTLAYER_H
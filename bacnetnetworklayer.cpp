@@ -4,18 +4,42 @@
 #include "bacnetnpci.h"
 #include "helpercoder.h"
 #include "bacnetbuffermanager.h"
+#include "bacnetpci.h"
 
 
 #define REAL_APP_LAYER_NUM -1
 
 BacnetNetworkLayerHandler::BacnetNetworkLayerHandler():
+    _pendingCount(0),
+    _pendingTimeout_ns((qint64)DefaultPendingRouteTimeout_ms * 1000000),
+    _maxPendingPerNetwork(DefaultMaxPendingPerNetwork),
+    _nextPendingDeadline_ns(0),
+    _pendingTimer(TimingWheel::InvalidTimerId),
+    _busyLoad_percent(DefaultBusyLoad_percent),
+    _availableLoad_percent(DefaultAvailableLoad_percent),
+    _nextCongestionCheck_ns(0),
+    _congestionTimer(TimingWheel::InvalidTimerId),
     _virtualAppLayer(0)
 {
+    Route noRoute;
+    noRoute.portIdx = NoRoute;
+    noRoute.nextHopIdx = DirectRoute;
+    _routes.fill(noRoute, NetworksCount);
+    resetRoutingStatistics();
+    resetPendingRouteStatistics();
+    resetCongestionStatistics();
+    _clock.start();
+}
+
+BacnetNetworkLayerHandler::~BacnetNetworkLayerHandler()
+{
+    TimingWheel::instance()->cancel(_pendingTimer);
+    TimingWheel::instance()->cancel(_congestionTimer);
 }
 
 void BacnetNetworkLayerHandler::sendRejectMessageToNetwork(RejectMessageToRouterReason rejReason, quint16 dnet, BacnetAddress &dlSenderAddress, BacnetTransportLayerHandler *port)
 {
-    Buffer buffer = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::NetworkLayer);
+    Buffer buffer = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::NetworkLayer, Bacnet::NpduMaxHeaderSize + 3);
     Q_ASSERT(buffer.isValid());
     //! \todo return
     if (!buffer.isValid()) {
@@ -73,95 +97,171 @@ qint32 BacnetNetworkLayerHandler::processIAmRouterToNetwork(quint8 *actualBytePt
     //! \note optimization required? Think not, since used not often
     updateRoutingTableIndirectAccess(port, nets, srcAddress);
 
+    //someone may be waiting for these routes
+    if (!_pendingRoutes.isEmpty()) {
+        foreach (TNetworkNum net, nets)
+            flushPendingRoute_hlpr(net);
+    }
+
     return length;
 }
 
-qint16 BacnetNetworkLayerHandler::porrId(BacnetTransportLayerHandler *port)
+int BacnetNetworkLayerHandler::portIdx(BacnetTransportLayerHandler *port)
 {
-    QHash<TPortId, BacnetTransportLayerHandler*>::Iterator it = _allPorts.begin();
-    while (it != _allPorts.end()) {
-        if (port == it.value())
-            return it.key();
-        ++it;
+    return _portIdxByPtr.value(port, -1);
+}
+
+int BacnetNetworkLayerHandler::portIdx(TPortId portId)
+{
+    for (int i = 0; i < _ports.count(); ++i) {
+        if (_ports.at(i).portId == portId)
+            return i;
     }
+    return -1;
+}
 
-    Q_ASSERT(false);//this shouldn't ever ahappen!
-    return InvalidPortId;
+qint16 BacnetNetworkLayerHandler::porrId(BacnetTransportLayerHandler *port)
+{
+    int idx = portIdx(port);
+    Q_ASSERT(idx >= 0);//this shouldn't ever ahappen!
+    if (idx < 0)
+        return InvalidPortId;
+    return _ports.at(idx).portId;
 }
 
 qint32 BacnetNetworkLayerHandler::portDirectNetNum(BacnetTransportLayerHandler *port)
 {
-    QHash<TNetworkNum, RoutingEntry>::Iterator it = _routingTable.begin();
-    for (; it != _routingTable.end(); ++it) {
-        if (it->port == port)
-            return it.key();
-    }
-
-    Q_ASSERT(false);//this shouldn't ever ahappen!
-    return -1;
+    int idx = portIdx(port);
+    Q_ASSERT( (idx >= 0) && (_ports.at(idx).directNet >= 0) );//this shouldn't ever ahappen!
+    if (idx < 0)
+        return -1;
+    return _ports.at(idx).directNet;
 }
 
 void BacnetNetworkLayerHandler::updateRoutingTableIndirectAccess(TPortId portId, QVector<TNetworkNum> &indirectRouterNets, BacnetAddress &routerAddress)
 {
-    if (_allPorts.contains(portId))
-        updateRoutingTableIndirectAccess(_allPorts[portId], indirectRouterNets, routerAddress);
+    int idx = portIdx(portId);
+    if (idx >= 0)
+        updateRoutingTableIndirectAccess(_ports.at(idx).port, indirectRouterNets, routerAddress);
 }
 
 void BacnetNetworkLayerHandler::setPortDirectNetwork(TPortId portId, TNetworkNum networkNum)
 {
-    BacnetTransportLayerHandler *port = _allPorts.value(portId);
-    if (0 == port) {
+    int idx = portIdx(portId);
+    if (idx < 0) {
         qDebug("%s : Couldn't set network (%d) for port (%d) : no such port!", __PRETTY_FUNCTION__, networkNum, portId);
         return;
     }
 
-    //check if port was not used, buy some other network
-    QHash<TNetworkNum, RoutingEntry>::Iterator rtIt = _routingTable.begin();
-    while (rtIt != _routingTable.end()) {
-        if (port == rtIt->port) {
-            _routingTable.erase(rtIt);
-            break;
-        }
-        ++rtIt;
-    }
-
-    RoutingEntry &rentry = _routingTable[networkNum];//if doesn't contain, operator[] creates element
-    rentry.indirectNetworkAccess.clear();
-    rentry.port = port;
-    rentry.portId = portId;
+    //port could be used by some other network - forget all its routes
+    clearPortRoutes_hlpr(idx);
+    setRoute_hlpr(networkNum, idx, DirectRoute);
 }
 
 void BacnetNetworkLayerHandler::updateRoutingTableIndirectAccess(BacnetTransportLayerHandler *port, QVector<TNetworkNum> &indirectRouterNets, BacnetAddress &routerAddress)
 {
-    //iterate over evey port to check there is no other entry to the network! Shouln't be. If so, delete!
-    QHash<quint16, RoutingEntry>::Iterator reIt = _routingTable.begin();
-    QHash<quint16, RoutingEntry>::Iterator reItEnd = _routingTable.end();
-    for (; reIt != reItEnd; ++reIt) {
-        if (reIt->port == port) {
-            //this is where we want to insert given data
-            for (int i = 0; i < indirectRouterNets.count(); ++i) {
-                reIt->indirectNetworkAccess.insert(indirectRouterNets[i], routerAddress);
-            }
-        } else {
-            //this is where we want to remove data, if duplicated
-            for (int i = 0; i < indirectRouterNets.count(); ++i) {
-                reIt->indirectNetworkAccess.remove(indirectRouterNets[i]);
-            }
-        }
+    int idx = portIdx(port);
+    if (idx < 0)
+        return;
+
+    quint16 nextHopIdx = acquireNextHop_hlpr(routerAddress);
+    for (int i = 0; i < indirectRouterNets.count(); ++i) {
+        TNetworkNum net = indirectRouterNets.at(i);
+        //directly connected networks are never overridden by what routers say
+        const Route &route = _routes.at(net);
+        if ( (NoRoute != route.portIdx) && (DirectRoute == route.nextHopIdx) )
+            continue;
+        //the path is taken over by this port (and the previous one, if any, is removed)
+        ++_nextHops[nextHopIdx].routesCount;
+        setRoute_hlpr(net, idx, nextHopIdx);
     }
+    //we held it, so that it's not reused in the meantime
+    releaseNextHop_hlpr(nextHopIdx);
 }
 
 void BacnetNetworkLayerHandler::rmNetworkIndirectAccess(BacnetTransportLayerHandler *port, quint16 net)
 {
-    //remove all entreis (of course, should be only one)
-    QHash<quint16, RoutingEntry>::Iterator reIt = _routingTable.begin();
-    QHash<quint16, RoutingEntry>::Iterator reItEnd = _routingTable.end();
-    for (; reIt!= reItEnd; ++reIt) {
-        if (reIt->port == port) {
-            reIt->indirectNetworkAccess.remove(net);
-            return;
+    const Route &route = _routes.at(net);
+    if ( (NoRoute != route.portIdx) && (DirectRoute != route.nextHopIdx) && (route.portIdx == portIdx(port)) )
+        clearRoute_hlpr(net);
+}
+
+void BacnetNetworkLayerHandler::setRoute_hlpr(TNetworkNum net, int portIdx, quint16 nextHopIdx)
+{
+    Q_ASSERT( (portIdx >= 0) && (portIdx < _ports.count()) );
+    clearRoute_hlpr(net);
+
+    Route &route = _routes[net];
+    route.portIdx = portIdx;
+    route.nextHopIdx = nextHopIdx;
+    PortEntry &portEntry = _ports[portIdx];
+    if (DirectRoute == nextHopIdx) {
+        Q_ASSERT(portEntry.directNet < 0);
+        portEntry.directNet = net;
+    } else {
+        portEntry.indirectNets.insert(net);
+    }
+}
+
+void BacnetNetworkLayerHandler::clearRoute_hlpr(TNetworkNum net)
+{
+    Route &route = _routes[net];
+    if (NoRoute == route.portIdx)
+        return;
+
+    PortEntry &portEntry = _ports[route.portIdx];
+    if (DirectRoute == route.nextHopIdx) {
+        portEntry.directNet = -1;
+    } else {
+        portEntry.indirectNets.remove(net);
+        releaseNextHop_hlpr(route.nextHopIdx);
+    }
+    route.portIdx = NoRoute;
+    route.nextHopIdx = DirectRoute;
+}
+
+void BacnetNetworkLayerHandler::clearPortRoutes_hlpr(int portIdx)
+{
+    PortEntry &portEntry = _ports[portIdx];
+    if (portEntry.directNet >= 0)
+        clearRoute_hlpr(portEntry.directNet);
+    //copy, since clearRoute_hlpr() removes from the set
+    QSet<TNetworkNum> indirectNets = portEntry.indirectNets;
+    foreach (TNetworkNum net, indirectNets)
+        clearRoute_hlpr(net);
+    Q_ASSERT(_ports.at(portIdx).indirectNets.isEmpty());
+}
+
+quint16 BacnetNetworkLayerHandler::acquireNextHop_hlpr(const BacnetAddress &routerAddress)
+{
+    //there are only a few routers on the ports, so linear search is fine (and it's done only on updates)
+    int freeIdx(-1);
+    for (int i = 0; i < _nextHops.count(); ++i) {
+        NextHop &nextHop = _nextHops[i];
+        if (0 == nextHop.routesCount) {
+            if (freeIdx < 0)
+                freeIdx = i;
+        } else if (nextHop.address == routerAddress) {
+            ++nextHop.routesCount;
+            return i;
         }
     }
+
+    if (freeIdx < 0) {
+        Q_ASSERT(_nextHops.count() < DirectRoute);
+        freeIdx = _nextHops.count();
+        _nextHops.resize(freeIdx + 1);
+    }
+    NextHop &nextHop = _nextHops[freeIdx];
+    nextHop.address = routerAddress;
+    nextHop.routesCount = 1;
+    return freeIdx;
+}
+
+void BacnetNetworkLayerHandler::releaseNextHop_hlpr(quint16 nextHopIdx)
+{
+    Q_ASSERT( (nextHopIdx < _nextHops.count()) && (_nextHops.at(nextHopIdx).routesCount > 0) );
+    --_nextHops[nextHopIdx].routesCount;
 }
 
 //const BacnetTransportLayerHandler *BacnetNetworkLayerHandler::findAddrPortDestination(const BacnetAddress &destAddr, const BacnetAddress *&routedDlDest)
@@ -254,7 +354,7 @@ qint32 BacnetNetworkLayerHandler::processInitializeRoutingTable(quint8 *actualBy
         //we assume that id for the port is it's number in a hash
         //this is not a good idea, since Qt docs say - With QHash, the items are arbitrarily ordered.
         quint8 *numberOfPorst = buffPtr;
-        *numberOfPorst = _routingTable.count();
+        *numberOfPorst = 0;
         ++buffPtr;
 
         //encode entry for virtual network (SNG)
@@ -272,14 +372,16 @@ qint32 BacnetNetworkLayerHandler::processInitializeRoutingTable(quint8 *actualBy
             ++buffPtr;
         }
 
-        //encode routing table
-        QHash<quint16, RoutingEntry>::Iterator portIt = _routingTable.begin();
-        for (; portIt != _routingTable.end(); ++portIt) {
+        //encode routing table - ports with directly connected networks
+        foreach (const PortEntry &portEntry, _ports) {
+            if (portEntry.directNet < 0)
+                continue;
             if (buffLength - (buffPtr - buffer.bodyPtr()) < 4) return BufferToSmall;//we need 4 bytes to encode it
+            (*numberOfPorst) += 1;
             //encode Connected DNET
-            buffPtr += HelperCoder::uin16ToRaw(portIt.key(), buffPtr);
+            buffPtr += HelperCoder::uin16ToRaw(portEntry.directNet, buffPtr);
             //encode portId
-            *buffPtr = portIt->portId;
+            *buffPtr = portEntry.portId;
             ++buffPtr;
             //encode port info length - we send no info, so length is 0
             *buffPtr = 0;
@@ -307,7 +409,7 @@ qint32 BacnetNetworkLayerHandler::processRejectMessageToNetwork(quint8 *actualBy
     const char *reason;
     ++dataPtr;
     quint16 dnet;
-    dataPtr += HelperCoder::uint16FromRaw(actualBytePtr, &dnet);
+    dataPtr += HelperCoder::uint16FromRaw(dataPtr, &dnet);
 
     switch (reasonCode) {
     case (OtherError):
@@ -319,6 +421,8 @@ qint32 BacnetNetworkLayerHandler::processRejectMessageToNetwork(quint8 *actualBy
         break;
     case (RouterBusy):
         reason = "Router is busy";
+        //hold what we have for this network, as if it announced itself busy
+        _peerBusyUntil_ns.insert(dnet, _clock.nsecsElapsed() + (qint64)PeerBusyTimeout_ms * 1000000);
         break;
     case (UnknownNetworkMessage):
         reason = "Unknown message";
@@ -338,12 +442,9 @@ void BacnetNetworkLayerHandler::broadcastAvailableNetworks()
 {
     QList<TNetworkNum> networksAccessible;
 
-    QHash<TPortId, BacnetTransportLayerHandler*>::Iterator portIt = _allPorts.begin();
-    QHash<TPortId, BacnetTransportLayerHandler*>::Iterator portItEnd = _allPorts.end();
-
-    for (; portIt != portItEnd; ++portIt) {
-        networksAccessible = networksAccessibleExcludePort_helper(portIt.value());
-        sendIAmRouterToNetwork_helper(networksAccessible, portIt.value());
+    foreach (const PortEntry &portEntry, _ports) {
+        networksAccessible = networksAccessibleExcludePort_helper(portEntry.port);
+        sendIAmRouterToNetwork_helper(networksAccessible, portEntry.port);
     }
 }
 
@@ -353,12 +454,12 @@ QList<BacnetNetworkLayerHandler::TNetworkNum> BacnetNetworkLayerHandler::network
     //firts, show access to our virtual network...
     networksToReturn.append(_virtualNetNum);
     //...and for all the others
-    QHash<TNetworkNum, RoutingEntry>::Iterator reIt = _routingTable.begin();
-    QHash<TNetworkNum, RoutingEntry>::Iterator endIt = _routingTable.end();
-    for (; reIt != endIt; ++reIt) {
-        if (reIt->port != port) {//add routing information, exclude that connected to port where the message came from
-            networksToReturn.append(reIt.key());
-            networksToReturn.append(reIt->indirectNetworkAccess.keys());
+    foreach (const PortEntry &portEntry, _ports) {
+        if (portEntry.port != port) {//add routing information, exclude that connected to port where the message came from
+            if (portEntry.directNet >= 0)
+                networksToReturn.append(portEntry.directNet);
+            foreach (TNetworkNum net, portEntry.indirectNets)
+                networksToReturn.append(net);
         }
     }
 
@@ -395,27 +496,19 @@ qint32 BacnetNetworkLayerHandler::processWhoIsRouterToNetwork(quint8 *actualByte
         if (reqDnet == _virtualNetNum) { //is this our application layer?
             networksToReturn.append(reqDnet);
         } else { //so we are looking for some other layer
-            QHash<TNetworkNum, RoutingEntry>::Iterator reIt = _routingTable.begin();
-            QHash<TNetworkNum, RoutingEntry>::Iterator endIt = _routingTable.end();
-            for (; reIt != endIt; ++reIt) {
-                if ( (port != reIt->port) && //we don't want to investigate information from the same port
-                     ((reIt.key() == reqDnet) ||    //network directly connected
-                     (reIt->indirectNetworkAccess.contains(reqDnet))) ) { // network indirectly connected
-                    networksToReturn.append(reqDnet);
-                    break;
-                }
-            }
+            const Route &route = _routes.at(reqDnet);
+            //we don't want to investigate information from the same port
+            if ( (NoRoute != route.portIdx) && (_ports.at(route.portIdx).port != port) )
+                networksToReturn.append(reqDnet);
 
             if (networksToReturn.isEmpty()) {
                 //being here, means we have no access to the network - send  who-is-router-request on all ports other than the one message came from
-                Buffer buffer = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::NetworkLayer);
+                Buffer buffer = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::NetworkLayer, Bacnet::NpduMaxHeaderSize + 2);
                 prepareBufferWhoIsRouterToNetwork_hlpr(&buffer, reqDnet, &npci, &dlSrcAddress);
 
-                QHash<TPortId, BacnetTransportLayerHandler*>::Iterator portIt = _allPorts.begin();
-                QHash<TPortId, BacnetTransportLayerHandler*>::Iterator portEndIt = _allPorts.end();
-                for (; portIt != portEndIt; ++portIt) {
-                    if (port != portIt.value())
-                        sendBuffer(&buffer, Bacnet::PriorityNormal, portIt.value());
+                foreach (const PortEntry &portEntry, _ports) {
+                    if (port != portEntry.port)
+                        sendBuffer(&buffer, Bacnet::PriorityNormal, portEntry.port);
                 }
             }
         }
@@ -455,12 +548,17 @@ void BacnetNetworkLayerHandler::prepareBufferWhoIsRouterToNetwork_hlpr(Buffer *b
 void BacnetNetworkLayerHandler::sendWhoIsRouterToNetwork(qint32 network, BacnetTransportLayerHandler *port)
 {
     Q_CHECK_PTR(port);
-    Buffer buffer = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::NetworkLayer);
+    Buffer buffer = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::NetworkLayer, Bacnet::NpduMaxHeaderSize + 2);
     prepareBufferWhoIsRouterToNetwork_hlpr(&buffer, network, 0, 0);
     sendBuffer(&buffer, Bacnet::PriorityNormal, port);
 }
 
 void BacnetNetworkLayerHandler::sendIAmRouterToNetwork_helper(QList<TNetworkNum> &networks, BacnetTransportLayerHandler *port)
+{
+    sendNetworksList_hlpr(BacnetNpci::IAmRouterToNetwork, networks, port);
+}
+
+void BacnetNetworkLayerHandler::sendNetworksList_hlpr(BacnetNpci::BacnetNetworkMessageType msgType, const QList<TNetworkNum> &networks, BacnetTransportLayerHandler *port)
 {
     //we have some networks to send
     //get the buffer to stuff
@@ -476,7 +574,7 @@ void BacnetNetworkLayerHandler::sendIAmRouterToNetwork_helper(QList<TNetworkNum>
     quint8 *buffPtr = buffer.bodyPtr();
 
     BacnetNpci npci;
-    npci.setNetworkMessage(BacnetNpci::IAmRouterToNetwork);
+    npci.setNetworkMessage(msgType);
     npci.setExpectingReply(false);//this is a response
     npci.setNetworkPriority(Bacnet::PriorityNormal);
 
@@ -485,7 +583,7 @@ void BacnetNetworkLayerHandler::sendIAmRouterToNetwork_helper(QList<TNetworkNum>
 
     //after npci is set, fill the buffer with the list of available networks
     Q_ASSERT( (buffer.bodyLength() - (buffPtr - buffer.bodyPtr())) >= (uint)(sizeof(quint16)*networks.count()));//assert we have enough place in the buffer
-    QList<TNetworkNum>::iterator netIt = networks.begin();
+    QList<TNetworkNum>::const_iterator netIt = networks.begin();
     for (; netIt != networks.end(); ++netIt) {
         buffPtr += HelperCoder::uin16ToRaw(*netIt, buffPtr);
     }
@@ -494,13 +592,14 @@ void BacnetNetworkLayerHandler::sendIAmRouterToNetwork_helper(QList<TNetworkNum>
     buffer.setBodyLength(buffPtr - buffer.bodyPtr());
 
     //lets send it
-    /*who are we going to sent it to? - 6.6.3.2 says that we should send it with MAC broadcast,
-    what means - send it with local broadcast - null pointer is enough*/
+    /*who are we going to sent it to? - 6.6.3.2 says that we should send it with MAC broadcast (and so say 6.6.3.6 and 6.6.3.7 about
+    router busy and available messages), what means - send it with local broadcast - null pointer is enough*/
     sendBuffer(&buffer, Bacnet::PriorityNormal, port);
 }
 
-BacnetTransportLayerHandler *BacnetNetworkLayerHandler::findDestinationForAddress(const BacnetAddress *destAddr, BacnetAddress *&dlAddress)
+BacnetTransportLayerHandler *BacnetNetworkLayerHandler::findDestinationForAddress(const BacnetAddress *destAddr, BacnetAddress &nextHopAddress, bool &viaRouter)
 {
+    viaRouter = false;
     //first try to find direct network
     Q_ASSERT(destAddr->hasNetworkNumber());
     TNetworkNum dNet = destAddr->networkNumber();
@@ -509,32 +608,21 @@ BacnetTransportLayerHandler *BacnetNetworkLayerHandler::findDestinationForAddres
         Q_ASSERT(dNet != _virtualNetNum);
         return 0;
     }
-    QHash<TNetworkNum, RoutingEntry>::Iterator rIt = _routingTable.find(dNet);
-    QHash<TNetworkNum, RoutingEntry>::Iterator rItEnd = _routingTable.end();
-
-    if (rIt != rItEnd) {//got found
-        dlAddress = 0;
-        return rIt->port;
-    } else {//not found, try indirect network addresses
-        QHash<TNetworkNum, BacnetAddress>::Iterator indirectIt;
-        for (rIt = _routingTable.begin(); rIt != rItEnd; ++rIt) {
-            indirectIt = rIt->indirectNetworkAccess.find(dNet);
-            if (indirectIt != rIt->indirectNetworkAccess.end()) {
-                dlAddress = &(indirectIt.value());//it's safe to return pointer - we don't add elements within some time locality - reference will not get changed.
-                return rIt->port;
-            }
-        }
+    const Route &route = _routes.at(dNet);
+    if (NoRoute != route.portIdx) {//got found
+        viaRouter = (DirectRoute != route.nextHopIdx);
+        //copied - _nextHops may be reallocated, when a route is learned while the frame is being sent
+        if (viaRouter)
+            nextHopAddress = _nextHops.at(route.nextHopIdx).address;
+        return _ports.at(route.portIdx).port;
     }
 
     //we couldn't find neither port nor address. We should issue who is router to network to every port and wait
-    Buffer buffer = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::NetworkLayer);
+    Buffer buffer = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::NetworkLayer, Bacnet::NpduMaxHeaderSize + 2);
     prepareBufferWhoIsRouterToNetwork_hlpr(&buffer, dNet, 0, 0);
 
-    QHash<TPortId, BacnetTransportLayerHandler*>::Iterator reIt = _allPorts.begin();
-    QHash<TPortId, BacnetTransportLayerHandler*>::Iterator endIt = _allPorts.end();
-    for (; reIt != endIt; ++reIt) {
-            sendBuffer(&buffer, Bacnet::PriorityNormal, reIt.value());
-    }
+    foreach (const PortEntry &portEntry, _ports)
+        sendBuffer(&buffer, Bacnet::PriorityNormal, portEntry.port);
 
     return 0;
 }
@@ -546,16 +634,37 @@ void BacnetNetworkLayerHandler::sendApdu(Buffer *apduBuffer, bool dataExpectingR
     Q_CHECK_PTR(srcAddr);
 
     BacnetAddress *dlAddress(0);
+    BacnetAddress nextHopAddress;
     BacnetTransportLayerHandler *portToBeSentTo(0);
 
+    checkCongestion_hlpr();
+
     if ((0 == destAddr) || destAddr->isGlobalBroadcast()) {
         //send to all ports
     } else {
         Q_ASSERT(!destAddr->isLocalBraodacst());//the applayer should never invoke local broadcasts - would be insane
         Q_ASSERT(destAddr->hasNetworkNumber());
-        portToBeSentTo = findDestinationForAddress(destAddr, dlAddress);
+        //route is being discovered already (or network is busy) - just wait with the others
+        if (_pendingRoutes.contains(destAddr->networkNumber())) {
+            queuePendingApdu_hlpr(apduBuffer, dataExpectingReply, destAddr, srcAddr, prio);
+            return;
+        }
+        //router on the path asked us to hold on - wait for Router-Available-To-Network
+        if (!_peerBusyUntil_ns.isEmpty() && isPeerBusy_hlpr(destAddr->networkNumber())) {
+            if (queuePendingApdu_hlpr(apduBuffer, dataExpectingReply, destAddr, srcAddr, prio))
+                ++_congestionStats.deferredCount;
+            else
+                qDebug("%s : network %d is busy and too many APDUs wait for it. Discards message!", __PRETTY_FUNCTION__, destAddr->networkNumber());
+            return;
+        }
+        bool viaRouter(false);
+        portToBeSentTo = findDestinationForAddress(destAddr, nextHopAddress, viaRouter);
+        if (viaRouter)
+            dlAddress = &nextHopAddress;
         if (0 == portToBeSentTo) {
-            qDebug("%s : can't find port for network number %d. Discards message, who-is-router-to-network issued!", __PRETTY_FUNCTION__, destAddr->networkNumber());
+            if ( (destAddr->networkNumber() == _virtualNetNum) ||
+                 !queuePendingApdu_hlpr(apduBuffer, dataExpectingReply, destAddr, srcAddr, prio) )
+                qDebug("%s : can't find port for network number %d. Discards message, who-is-router-to-network issued!", __PRETTY_FUNCTION__, destAddr->networkNumber());
             return;
         }
     }
@@ -563,9 +672,6 @@ void BacnetNetworkLayerHandler::sendApdu(Buffer *apduBuffer, bool dataExpectingR
     /*Being here we have either port == NULL, meaning message has to be distributed to all endpoints (except application, of course), or port != NULL
       and we send there just one message.
       */
-    quint8 *startByte = apduBuffer->bufferStart() + BacnetBufferManager::offsetForLayer(BacnetBufferManager::NetworkLayer);
-    quint8 *dataPtr = startByte;
-
     BacnetNpci npci;
     npci.setApduMessage();
     npci.setExpectingReply(dataExpectingReply);
@@ -579,38 +685,398 @@ void BacnetNetworkLayerHandler::sendApdu(Buffer *apduBuffer, bool dataExpectingR
     if (0 != dlAddress)
         npci.setDestAddress(*destAddr);
 
-    qint8 total = npci.setToRaw(dataPtr);
+    //NPCI is encoded aside (we don't know its size in advance) and prepended just in front of APDU
+    quint8 npciData[Bacnet::NpduMaxHeaderSize];
+    qint8 total = npci.setToRaw(npciData);
     if (total < 0) {
         qDebug("%s : Problem on encoding APDU (%d)", __PRETTY_FUNCTION__, total);
         return;
     }
-    dataPtr += total;
+    Q_ASSERT(total <= Bacnet::NpduMaxHeaderSize);
 
-    //shift npdu header so that it gets stitched
-    quint16 shiftSpread = apduBuffer->bodyPtr() - dataPtr;
-    quint8 *dest = startByte + shiftSpread;
-
-    HelperCoder::printArray(startByte, dataPtr - startByte, "Network stitch:");
-
-    //remember to include the network address of the source
-    memmove(dest, startByte, total);
-    apduBuffer->setBodyPtr(dest);
-    apduBuffer->setBodyLength(total + apduBuffer->bodyLength());
+    quint8 *dest = apduBuffer->prepend(total);
+    if (0 == dest) {
+        qDebug("%s : Not enough headroom (%d) for NPCI of size %d", __PRETTY_FUNCTION__, apduBuffer->headroom(), total);
+        return;
+    }
+    memcpy(dest, npciData, total);
+    HelperCoder::printArray(dest, total, "Network header:");
 
     if (0 != portToBeSentTo) //we have port specified
         sendBuffer(apduBuffer, prio, portToBeSentTo, 0 != dlAddress ? dlAddress : destAddr);
     else {
-        total = apduBuffer->bodyLength();
-        dest = apduBuffer->bodyPtr();
-        foreach (BacnetTransportLayerHandler *port, _allPorts) {
-            sendBuffer(apduBuffer, prio, port, 0 != dlAddress ? dlAddress : destAddr);
+        quint16 npduLength = apduBuffer->bodyLength();
+        foreach (const PortEntry &portEntry, _ports) {
+            sendBuffer(apduBuffer, prio, portEntry.port, 0 != dlAddress ? dlAddress : destAddr);
             //function sendBuffer may change body pointer and body lenght values.
             apduBuffer->setBodyPtr(dest);
-            apduBuffer->setBodyLength(total);
+            apduBuffer->setBodyLength(npduLength);
+        }
+    }
+}
+
+bool BacnetNetworkLayerHandler::queuePendingApdu_hlpr(Buffer *apduBuffer, bool dataExpectingReply, const BacnetAddress *destAddr,
+                                                      const BacnetAddress *srcAddr, Bacnet::NetworkPriority prio)
+{
+    qint64 now_ns = _clock.nsecsElapsed();
+    QHash<TNetworkNum, PendingRoute>::Iterator it = _pendingRoutes.find(destAddr->networkNumber());
+    if (_pendingRoutes.end() == it) {
+        if (_pendingRoutes.count() >= MaxPendingNetworks) {
+            ++_pendingStats.overflowCount;
+            return false;
+        }
+        it = _pendingRoutes.insert(destAddr->networkNumber(), PendingRoute());
+        it->discoveryStart_ns = now_ns;
+        it->heldByBusy = false;
+    }
+
+    PendingApdu pending;
+    //it's only a reference - body pointer and length of our copy stay as they are now
+    pending.apduBuffer = *apduBuffer;
+    pending.dataExpectingReply = dataExpectingReply;
+    pending.destAddr = *destAddr;
+    pending.srcAddr = *srcAddr;
+    pending.prio = prio;
+    pending.deadline_ns = now_ns + _pendingTimeout_ns;
+
+    //network announced busy is waited for as long as it holds us off - timer wakes us up, when the busy period ends
+    qint64 wakeUp_ns = pending.deadline_ns;
+    if (!_peerBusyUntil_ns.isEmpty() && isPeerBusy_hlpr(destAddr->networkNumber())) {
+        it->heldByBusy = true;
+        wakeUp_ns = _peerBusyUntil_ns.value(destAddr->networkNumber());
+    }
+
+    //TSM retries the request, while it still waits for the route - the retry takes the place (and the deadline) of the waiting copy
+    int invokeId = confirmedRequestInvokeId_hlpr(pending.apduBuffer);
+    if (invokeId >= 0) {
+        QQueue<PendingApdu>::Iterator apduIt = it->apdus.begin();
+        for (; apduIt != it->apdus.end(); ++apduIt) {
+            if ( (apduIt->destAddr == pending.destAddr) && (apduIt->srcAddr == pending.srcAddr) &&
+                 (confirmedRequestInvokeId_hlpr(apduIt->apduBuffer) == invokeId) ) {
+                pending.deadline_ns = apduIt->deadline_ns;
+                *apduIt = pending;
+                ++_pendingStats.replacedCount;
+                return true;
+            }
+        }
+    }
+
+    if (it->apdus.count() >= _maxPendingPerNetwork) {
+        ++_pendingStats.overflowCount;
+        //empty entry would make the next APDUs wait for nothing
+        if (it->apdus.isEmpty())
+            _pendingRoutes.erase(it);
+        return false;
+    }
+    it->apdus.enqueue(pending);
+
+    if ( (0 == _pendingCount) || (wakeUp_ns < _nextPendingDeadline_ns) ) {
+        _nextPendingDeadline_ns = wakeUp_ns;
+        armPendingTimer_hlpr(now_ns);
+    }
+    ++_pendingCount;
+    return true;
+}
+
+int BacnetNetworkLayerHandler::confirmedRequestInvokeId_hlpr(Buffer &apduBuffer)
+{
+    //PDU type and flags, max segments and max APDU, invoke id
+    static const int InvokeIdOffset = 2;
+    static const quint8 SegmentedMessageFlag = 0x08;
+    if (apduBuffer.bodyLength() <= InvokeIdOffset)
+        return -1;
+    quint8 *apdu = apduBuffer.bodyPtr();
+    //segments of the request share the invoke id - they are not retries of each other
+    if ( (BacnetPci::TypeConfirmedRequest != BacnetPci::pduType(apdu)) || (apdu[0] & SegmentedMessageFlag) )
+        return -1;
+    return apdu[InvokeIdOffset];
+}
+
+void BacnetNetworkLayerHandler::armPendingTimer_hlpr(qint64 now_ns)
+{
+    qint64 timeout_ms = (_nextPendingDeadline_ns - now_ns + 999999) / 1000000;
+    TimingWheel::instance()->restart(_pendingTimer, (int)qBound((qint64)1, timeout_ms, (qint64)TimingWheel::MaxTimeout_ms),
+                                     this, PendingTimerCookie);
+}
+
+void BacnetNetworkLayerHandler::timerExpired(quintptr cookie)
+{
+    if (CongestionTimerCookie == cookie) {
+        _congestionTimer = TimingWheel::InvalidTimerId;
+        checkCongestion_hlpr(true);
+        return;
+    }
+    _pendingTimer = TimingWheel::InvalidTimerId;
+    if (_pendingCount > 0)
+        expirePendingApdus_hlpr();
+}
+
+void BacnetNetworkLayerHandler::flushPendingRoute_hlpr(TNetworkNum net)
+{
+    QHash<TNetworkNum, PendingRoute>::Iterator it = _pendingRoutes.find(net);
+    if (_pendingRoutes.end() == it)
+        return;
+    //taken out first - sendApdu() must not queue them again
+    PendingRoute route = it.value();
+    _pendingRoutes.erase(it);
+    _pendingCount -= route.apdus.count();
+
+    qint64 now_ns = _clock.nsecsElapsed();
+    if (route.heldByBusy) {
+        //route was known all the time - they waited for the network only
+        _congestionStats.releasedCount += route.apdus.count();
+        while (!route.apdus.isEmpty()) {
+            PendingApdu pending = route.apdus.dequeue();
+            sendApdu(&pending.apduBuffer, pending.dataExpectingReply, &pending.destAddr, &pending.srcAddr, pending.prio);
         }
+        return;
+    }
+
+    qint64 latency_ns = now_ns - route.discoveryStart_ns;
+    ++_pendingStats.resolutionsCount;
+    _pendingStats.totalResolutionLatency_ns += latency_ns;
+    if (latency_ns > _pendingStats.maxResolutionLatency_ns)
+        _pendingStats.maxResolutionLatency_ns = latency_ns;
+
+    while (!route.apdus.isEmpty()) {
+        PendingApdu pending = route.apdus.dequeue();
+        if (pending.deadline_ns <= now_ns) {
+            ++_pendingStats.expiredCount;
+            continue;
+        }
+        ++_pendingStats.resolvedCount;
+        sendApdu(&pending.apduBuffer, pending.dataExpectingReply, &pending.destAddr, &pending.srcAddr, pending.prio);
     }
 }
 
+void BacnetNetworkLayerHandler::expirePendingApdus_hlpr()
+{
+    qint64 now_ns = _clock.nsecsElapsed();
+    if (now_ns < _nextPendingDeadline_ns) {
+        armPendingTimer_hlpr(now_ns);
+        return;
+    }
+
+    //6.6.3.6 - network held busy is considered available again after PeerBusyTimeout_ms; what waited for it goes on the known route
+    QList<TNetworkNum> availableNets;
+    QHash<TNetworkNum, PendingRoute>::Iterator it = _pendingRoutes.begin();
+    for (; it != _pendingRoutes.end(); ++it) {
+        if (it->heldByBusy && !isPeerBusy_hlpr(it.key()))
+            availableNets.append(it.key());
+    }
+    //taken out of the loop - sending may change _pendingRoutes
+    foreach (TNetworkNum net, availableNets) {
+        qDebug("%s : network %d is considered available again, held APDUs sent.", __PRETTY_FUNCTION__, net);
+        flushPendingRoute_hlpr(net);
+    }
+
+    qint64 nextDeadline_ns(0);
+    it = _pendingRoutes.begin();
+    while (it != _pendingRoutes.end()) {
+        //nothing expires while the network holds us off - we wake up, when it's over
+        if (!_peerBusyUntil_ns.isEmpty() && isPeerBusy_hlpr(it.key())) {
+            qint64 busyUntil_ns = _peerBusyUntil_ns.value(it.key());
+            if ( (0 == nextDeadline_ns) || (busyUntil_ns < nextDeadline_ns) )
+                nextDeadline_ns = busyUntil_ns;
+            ++it;
+            continue;
+        }
+
+        QQueue<PendingApdu> &apdus = it->apdus;
+        while (!apdus.isEmpty() && (apdus.head().deadline_ns <= now_ns)) {
+            apdus.dequeue();
+            --_pendingCount;
+            ++_pendingStats.expiredCount;
+        }
+        if (apdus.isEmpty()) {
+            //nobody answered - next APDU to this network starts new discovery
+            qDebug("%s : no route to network %d discovered in time, APDUs dropped.", __PRETTY_FUNCTION__, it.key());
+            it = _pendingRoutes.erase(it);
+            continue;
+        }
+        if ( (0 == nextDeadline_ns) || (apdus.head().deadline_ns < nextDeadline_ns) )
+            nextDeadline_ns = apdus.head().deadline_ns;
+        ++it;
+    }
+    _nextPendingDeadline_ns = nextDeadline_ns;
+    if (_pendingCount > 0)
+        armPendingTimer_hlpr(now_ns);
+}
+
+void BacnetNetworkLayerHandler::setPendingRouteLimits(int timeout_ms, int maxPerNetwork)
+{
+    Q_ASSERT( (timeout_ms > 0) && (maxPerNetwork >= 0) );
+    _pendingTimeout_ns = (qint64)timeout_ms * 1000000;
+    _maxPendingPerNetwork = maxPerNetwork;
+}
+
+BacnetNetworkLayerHandler::PendingRouteStatistics BacnetNetworkLayerHandler::pendingRouteStatistics()
+{
+    _pendingStats.queuedCount = _pendingCount;
+    _pendingStats.networksCount = _pendingRoutes.count();
+    return _pendingStats;
+}
+
+void BacnetNetworkLayerHandler::resetPendingRouteStatistics()
+{
+    _pendingStats.queuedCount = 0;
+    _pendingStats.networksCount = 0;
+    _pendingStats.resolvedCount = 0;
+    _pendingStats.expiredCount = 0;
+    _pendingStats.overflowCount = 0;
+    _pendingStats.replacedCount = 0;
+    _pendingStats.resolutionsCount = 0;
+    _pendingStats.totalResolutionLatency_ns = 0;
+    _pendingStats.maxResolutionLatency_ns = 0;
+}
+
+void BacnetNetworkLayerHandler::setCongestionThresholds(int busyLoad_percent, int availableLoad_percent)
+{
+    Q_ASSERT( (busyLoad_percent > 0) && (availableLoad_percent < busyLoad_percent) );
+    _busyLoad_percent = busyLoad_percent;
+    _availableLoad_percent = qMin(availableLoad_percent, busyLoad_percent - 1);
+}
+
+void BacnetNetworkLayerHandler::checkCongestion_hlpr(bool force)
+{
+    qint64 now_ns = _clock.nsecsElapsed();
+    if (!force && (now_ns < _nextCongestionCheck_ns))
+        return;
+    _nextCongestionCheck_ns = now_ns + (qint64)CongestionCheckInterval_ms * 1000000;
+
+    //buffers are shared by all the networks
+    BacnetBufferManager *bufferManager = BacnetBufferManager::instance();
+    int commonLoad = bufferManager->statistics(BacnetBufferManager::LargeBuffer).inUseCount * 100 /
+            qMax(1, bufferManager->maxElementsCount(BacnetBufferManager::LargeBuffer));
+
+    QSet<TNetworkNum> busyNets;
+    //application layer counts for the virtual network only - its load is the work requests to our devices wait for
+    if (0 != _virtualAppLayer)
+        updateBusyNets_hlpr(qMax(commonLoad, _virtualAppLayer->loadPercent()), _virtualNetNum, busyNets);
+    foreach (const PortEntry &portEntry, _ports) {
+        int load = qMax(commonLoad, portEntry.port->loadPercent());
+        if (portEntry.directNet >= 0)
+            updateBusyNets_hlpr(load, portEntry.directNet, busyNets);
+        foreach (TNetworkNum net, portEntry.indirectNets)
+            updateBusyNets_hlpr(load, net, busyNets);
+    }
+
+    //while busy, load is checked even if traffic stops - otherwise Router-Available-To-Network might never be sent
+    if (busyNets.isEmpty())
+        TimingWheel::instance()->cancel(_congestionTimer);
+    else
+        TimingWheel::instance()->restart(_congestionTimer, CongestionCheckInterval_ms, this, CongestionTimerCookie);
+
+    if (busyNets == _busyNets)
+        return;
+    QSet<TNetworkNum> changed = busyNets;
+    changed.subtract(_busyNets);
+    if (!changed.isEmpty()) {
+        qDebug("%s : overloaded, %d networks announced busy.", __PRETTY_FUNCTION__, changed.count());
+        announceNetworks_hlpr(BacnetNpci::RouterBusyToNetwork, changed);
+        ++_congestionStats.busyAnnouncementsCount;
+    }
+    changed = _busyNets;
+    changed.subtract(busyNets);
+    if (!changed.isEmpty()) {
+        announceNetworks_hlpr(BacnetNpci::RouterAvailableToNetwork, changed);
+        ++_congestionStats.availableAnnouncementsCount;
+    }
+    _busyNets = busyNets;
+}
+
+void BacnetNetworkLayerHandler::updateBusyNets_hlpr(int load_percent, TNetworkNum net, QSet<TNetworkNum> &busyNets)
+{
+    //hysteresis - otherwise we would flap between busy and available around the threshold
+    if ( (load_percent >= _busyLoad_percent) || ( (load_percent > _availableLoad_percent) && _busyNets.contains(net) ) )
+        busyNets.insert(net);
+}
+
+void BacnetNetworkLayerHandler::announceNetworks_hlpr(BacnetNpci::BacnetNetworkMessageType msgType, const QSet<TNetworkNum> &networks)
+{
+    foreach (const PortEntry &portEntry, _ports) {
+        //networks behind the port are not announced on it - traffic for them doesn't go through us
+        QList<TNetworkNum> portNetworks;
+        foreach (TNetworkNum net, networks) {
+            const Route &route = _routes.at(net);
+            if ( (NoRoute == route.portIdx) || (_ports.at(route.portIdx).port != portEntry.port) )
+                portNetworks.append(net);
+        }
+        if (!portNetworks.isEmpty())
+            sendNetworksList_hlpr(msgType, portNetworks, portEntry.port);
+    }
+}
+
+bool BacnetNetworkLayerHandler::isPeerBusy_hlpr(TNetworkNum net)
+{
+    QHash<TNetworkNum, qint64>::Iterator it = _peerBusyUntil_ns.find(net);
+    if (_peerBusyUntil_ns.end() == it)
+        return false;
+    if (it.value() <= _clock.nsecsElapsed()) {
+        _peerBusyUntil_ns.erase(it);
+        return false;
+    }
+    return true;
+}
+
+QList<BacnetNetworkLayerHandler::TNetworkNum> BacnetNetworkLayerHandler::networksFromList_hlpr(quint8 *actualBytePtr, quint16 length, BacnetAddress &srcAddress,
+                                                                                              BacnetTransportLayerHandler *port)
+{
+    QList<TNetworkNum> nets;
+    quint16 net;
+    for (int i = 0; i + 1 < length; i += 2) {
+        HelperCoder::uint16FromRaw(actualBytePtr + i, &net);
+        nets.append(net);
+    }
+    if (nets.isEmpty()) {
+        //all the networks the router leads to
+        int idx = portIdx(port);
+        if (idx < 0)
+            return nets;
+        foreach (TNetworkNum indirectNet, _ports.at(idx).indirectNets) {
+            if (_nextHops.at(_routes.at(indirectNet).nextHopIdx).address == srcAddress)
+                nets.append(indirectNet);
+        }
+    }
+    return nets;
+}
+
+qint32 BacnetNetworkLayerHandler::processRouterBusyToNetwork(quint8 *actualBytePtr, quint16 length, BacnetAddress &srcAddress, BacnetTransportLayerHandler *port)
+{
+    qint64 busyUntil_ns = _clock.nsecsElapsed() + (qint64)PeerBusyTimeout_ms * 1000000;
+    foreach (TNetworkNum net, networksFromList_hlpr(actualBytePtr, length, srcAddress, port))
+        _peerBusyUntil_ns.insert(net, busyUntil_ns);
+    return length;
+}
+
+qint32 BacnetNetworkLayerHandler::processRouterAvailableToNetwork(quint8 *actualBytePtr, quint16 length, BacnetAddress &srcAddress, BacnetTransportLayerHandler *port)
+{
+    foreach (TNetworkNum net, networksFromList_hlpr(actualBytePtr, length, srcAddress, port)) {
+        //what was held for the network goes now
+        if (_peerBusyUntil_ns.remove(net) > 0)
+            flushPendingRoute_hlpr(net);
+    }
+    return length;
+}
+
+BacnetNetworkLayerHandler::CongestionStatistics BacnetNetworkLayerHandler::congestionStatistics()
+{
+    _congestionStats.busyNetworksCount = _busyNets.count();
+    _congestionStats.peerBusyNetworksCount = _peerBusyUntil_ns.count();
+    return _congestionStats;
+}
+
+void BacnetNetworkLayerHandler::resetCongestionStatistics()
+{
+    _congestionStats.busyNetworksCount = 0;
+    _congestionStats.peerBusyNetworksCount = 0;
+    _congestionStats.busyAnnouncementsCount = 0;
+    _congestionStats.availableAnnouncementsCount = 0;
+    _congestionStats.rejectedCount = 0;
+    _congestionStats.deferredCount = 0;
+    _congestionStats.releasedCount = 0;
+}
+
 void BacnetNetworkLayerHandler::sendBuffer(Buffer *bufferToSend, Bacnet::NetworkPriority priority, BacnetTransportLayerHandler *port, const BacnetAddress *dlDestinationAddress)
 {
     Buffer::printArray(bufferToSend->bodyPtr(), bufferToSend->bodyLength(), "Network sends:");
@@ -618,9 +1084,135 @@ void BacnetNetworkLayerHandler::sendBuffer(Buffer *bufferToSend, Bacnet::Network
     port->sendNpdu(bufferToSend, priority, dlDestinationAddress);
 }
 
-void BacnetNetworkLayerHandler::readNpdu(quint8 *npdu, quint16 length, BacnetAddress &dlSrcAddress, BacnetTransportLayerHandler *port)
+void BacnetNetworkLayerHandler::routeNpdu_hlpr(BacnetNpci &npci, quint8 *payload, quint16 payloadLength, BacnetAddress &dlSrcAddress,
+                                               BacnetTransportLayerHandler *port, Buffer *frame)
+{
+    int ingressIdx = portIdx(port);
+    if ( (ingressIdx < 0) || (_ports.at(ingressIdx).directNet < 0) ) {
+        qDebug("%s : ingress port has no network number, can't route!", __PRETTY_FUNCTION__);
+        ++_routingStats.droppedCount;
+        return;
+    }
+    //6.5.4 - each router decreases hop count; message, that would leave with 0, is discarded
+    if (npci.hopCount() <= 1) {
+        ++_routingStats.droppedCount;
+        return;
+    }
+
+    BacnetNpci fwdNpci(npci);
+    //the first router on the path tells where the message comes from, so that answers can find their way back
+    if (!fwdNpci.isSourceSpecified()) {
+        BacnetAddress srcAddr(dlSrcAddress);
+        srcAddr.setNetworkNum(_ports.at(ingressIdx).directNet);
+        fwdNpci.setSrcAddress(srcAddr);
+    }
+
+    //egress port -1 means all the ports except ingress one; dlDest 0 means local broadcast
+    int egressIdx(-1);
+    const BacnetAddress *dlDest(0);
+    BacnetAddress nextHopAddress;
+    BacnetAddress destAddr(npci.destAddress());
+    if (!destAddr.isGlobalBroadcast()) {
+        const Route &route = _routes.at(destAddr.networkNumber());
+        if (NoRoute == route.portIdx) {
+            //ask other ports for the router; this message is lost - requester will repeat it
+            Buffer buffer = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::NetworkLayer, Bacnet::NpduMaxHeaderSize + 2);
+            prepareBufferWhoIsRouterToNetwork_hlpr(&buffer, destAddr.networkNumber(), 0, 0);
+            foreach (const PortEntry &portEntry, _ports) {
+                if (port != portEntry.port)
+                    sendBuffer(&buffer, Bacnet::PriorityNormal, portEntry.port);
+            }
+            ++_routingStats.droppedCount;
+            return;
+        }
+        if (route.portIdx == ingressIdx) {
+            //we would send it back where it came from
+            ++_routingStats.droppedCount;
+            return;
+        }
+        //6.6.3.5 - tell the sender we can't take it now, rather than dropping silently
+        if ( _busyNets.contains(destAddr.networkNumber()) ||
+             (!_peerBusyUntil_ns.isEmpty() && isPeerBusy_hlpr(destAddr.networkNumber())) ) {
+            sendRejectMessageToNetwork(RouterBusy, destAddr.networkNumber(), dlSrcAddress, port);
+            ++_congestionStats.rejectedCount;
+            ++_routingStats.droppedCount;
+            return;
+        }
+        egressIdx = route.portIdx;
+        if (DirectRoute == route.nextHopIdx) {
+            //last hop - DNET, DADR and hop count are not sent to the destination network (DADR of length 0 is the remote broadcast)
+            fwdNpci.clearDestAddress();
+            dlDest = destAddr.isRemoteBroadcast() ? 0 : &destAddr;
+        } else {
+            //copied, as in findDestinationForAddress()
+            nextHopAddress = _nextHops.at(route.nextHopIdx).address;
+            dlDest = &nextHopAddress;
+        }
+    }
+
+    //NPCI length changes, so it's encoded aside, as in sendApdu()
+    quint8 npciData[Bacnet::NpduMaxHeaderSize];
+    qint8 npciLength = fwdNpci.setToRaw(npciData);
+    if (npciLength < 0) {
+        qDebug("%s : Problem on encoding NPCI (%d)", __PRETTY_FUNCTION__, npciLength);
+        ++_routingStats.droppedCount;
+        return;
+    }
+    Q_ASSERT(npciLength <= Bacnet::NpduMaxHeaderSize);
+
+    Buffer fwdBuffer;
+    quint8 *npduStart = payload - npciLength;
+    if ( (0 != frame) && frame->isValid() && !frame->isShared() &&
+         (npduStart >= frame->bufferStart() + BacnetBufferManager::BvllHeadroom) ) {
+        //old NPCI (and BVLL header, if NPCI grew) is overwritten - nobody needs them anymore
+        fwdBuffer = *frame;
+    } else {
+        fwdBuffer = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::NetworkLayer, npciLength + payloadLength);
+        if (!fwdBuffer.isValid() || (fwdBuffer.bodyLength() < npciLength + payloadLength)) {
+            qDebug("%s : no buffer to route the message, dropped.", __PRETTY_FUNCTION__);
+            ++_routingStats.droppedCount;
+            return;
+        }
+        npduStart = fwdBuffer.bodyPtr();
+        memcpy(npduStart + npciLength, payload, payloadLength);
+        ++_routingStats.copiedCount;
+    }
+    memcpy(npduStart, npciData, npciLength);
+    quint16 npduLength = npciLength + payloadLength;
+    fwdBuffer.setBodyPtr(npduStart);
+    fwdBuffer.setBodyLength(npduLength);
+
+    if (egressIdx >= 0) {
+        sendBuffer(&fwdBuffer, npci.networkPriority(), _ports.at(egressIdx).port, dlDest);
+        ++_routingStats.forwardedCount;
+    } else {
+        foreach (const PortEntry &portEntry, _ports) {
+            if (port == portEntry.port)
+                continue;
+            sendBuffer(&fwdBuffer, npci.networkPriority(), portEntry.port);
+            ++_routingStats.forwardedCount;
+            fwdBuffer.setBodyPtr(npduStart);
+            fwdBuffer.setBodyLength(npduLength);
+        }
+    }
+}
+
+BacnetNetworkLayerHandler::RoutingStatistics BacnetNetworkLayerHandler::routingStatistics()
+{
+    return _routingStats;
+}
+
+void BacnetNetworkLayerHandler::resetRoutingStatistics()
+{
+    _routingStats.forwardedCount = 0;
+    _routingStats.copiedCount = 0;
+    _routingStats.droppedCount = 0;
+}
+
+void BacnetNetworkLayerHandler::readNpdu(quint8 *npdu, quint16 length, BacnetAddress &dlSrcAddress, BacnetTransportLayerHandler *port, Buffer *frame)
 {
     Buffer::printArray(npdu, length, "NPDU data: ");
+    checkCongestion_hlpr();
     quint8 *actualBytePtr = npdu;
     quint16 leftLength = length;
     qint32 ret(0);
@@ -642,6 +1234,13 @@ void BacnetNetworkLayerHandler::readNpdu(quint8 *npdu, quint16 length, BacnetAdd
 
     HelperCoder::printArray(actualBytePtr, leftLength, "From transport to net:");
 
+    //we are a router - messages for other networks are passed on and don't reach our layers (except for global broadcasts)
+    if (npci.isDestinationSpecified() && (npci.destAddress().networkNumber() != _virtualNetNum)) {
+        routeNpdu_hlpr(npci, actualBytePtr, leftLength, dlSrcAddress, port, frame);
+        if (!npci.destAddress().isGlobalBroadcast())
+            return;
+    }
+
     ret = 0;
     if (npci.isNetworkLayerMessage()) {
         switch (npci.networkMessageType())
@@ -663,10 +1262,10 @@ void BacnetNetworkLayerHandler::readNpdu(quint8 *npdu, quint16 length, BacnetAdd
             ret = processRejectMessageToNetwork(actualBytePtr, leftLength, port);
             break;
         case (BacnetNpci::RouterBusyToNetwork):
-            //same as above
+            ret = processRouterBusyToNetwork(actualBytePtr, leftLength, dlSrcAddress, port);
             break;
         case (BacnetNpci::RouterAvailableToNetwork):
-            //same as above
+            ret = processRouterAvailableToNetwork(actualBytePtr, leftLength, dlSrcAddress, port);
             break;
         case (BacnetNpci::InitializeRoutingTable):
             ret = processInitializeRoutingTable(actualBytePtr, leftLength, dlSrcAddress, port);
@@ -708,15 +1307,11 @@ void BacnetNetworkLayerHandler::readNpdu(quint8 *npdu, quint16 length, BacnetAdd
         if (destination.isAddrInitialized()) {
             //was to be remote message - check network numbers
             if (destination.isGlobalBroadcast()) {
-#warning "Ports are not included - send to applayer and to other ports"
+                //other ports got it already - \sa routeNpdu_hlpr()
                 appHndlr = _virtualAppLayer;
-                //! \todo distribute to other ports!
             } else if (destination.isRemoteBroadcast()) {
                 if (destination.networkNumber() == _virtualNetNum)
                     appHndlr = _virtualAppLayer;
-                else {
-                    //! \todo Iterate over ports and check if there is no network directly connected to send to
-                }
             } else if (destination.networkNumber() == _virtualNetNum)
                 appHndlr = _virtualAppLayer;
         } else {
@@ -734,7 +1329,7 @@ void BacnetNetworkLayerHandler::readNpdu(quint8 *npdu, quint16 length, BacnetAdd
         if (0 != appHndlr) {
             appHndlr->indication(actualBytePtr, leftLength,
                                  npci.srcAddress().isAddrInitialized() ? npci.srcAddress() : dlSrcAddress,
-                                 npci.destAddress());
+                                 npci.destAddress(), frame);
         }
         //else discard
     }
@@ -746,25 +1341,29 @@ void BacnetNetworkLayerHandler::addPorts(QHash<TPortId, BacnetTransportLayerHand
     QList<BacnetTransportLayerHandler*> portsToDelete;
     for (; addedIt != transportHndlrs.end(); ++addedIt) {
         //find if port is not already there
-        if (_allPorts.contains(addedIt.key()) && //if we already have such a portId...
-                _allPorts[addedIt.key()] != addedIt.value()) { //...and corresponding port instance is not the same
+        int idx = portIdx(addedIt.key());
+        if ( (idx >= 0) && //if we already have such a portId...
+                (_ports.at(idx).port != addedIt.value()) ) { //...and corresponding port instance is not the same
             //mark port instance as to be deleted
-            portsToDelete.append(_allPorts[addedIt.key()]);
-            _allPorts[addedIt.key()] = addedIt.value();
+            PortEntry &portEntry = _ports[idx];
+            portsToDelete.append(portEntry.port);
+            _portIdxByPtr.remove(portEntry.port);
+            portEntry.port = addedIt.value();
+            _portIdxByPtr.insert(portEntry.port, idx);
 
             //clear all the routing info corresponding to port
-            QHash<TNetworkNum, RoutingEntry>::Iterator rIt = _routingTable.begin();
-            while (rIt != _routingTable.end()) {
-                if (rIt->portId == addedIt.key())
-                    rIt = _routingTable.erase(rIt);
-                else
-                    ++rIt;
-            }
-        } else { //the portId is new
+            clearPortRoutes_hlpr(idx);
+        } else if (idx < 0) { //the portId is new
             //it may be the case we are reusing a port and have it already in portsToDelete.
             //! \todo what if the port is reassigned?
             portsToDelete.removeOne(addedIt.value());
-            _allPorts.insert(addedIt.key(), addedIt.value());
+            Q_ASSERT(_ports.count() <= 0xff);
+            PortEntry portEntry;
+            portEntry.portId = addedIt.key();
+            portEntry.port = addedIt.value();
+            portEntry.directNet = -1;
+            _portIdxByPtr.insert(portEntry.port, _ports.count());
+            _ports.append(portEntry);
         }
 
         (*addedIt)->setNetworkLayer(this);
@@ -2,18 +2,25 @@
 #define BACNETNETWORKLAYERHANDLER_H
 
 #include <QHash>
+#include <QSet>
+#include <QVector>
+#include <QQueue>
+#include <QElapsedTimer>
 
 #include "bacnetaddress.h"
 #include "bacnetnpci.h"
+#include "buffer.h"
+#include "timingwheel.h"
 
 
 namespace Bacnet {class BacnetApplicationLayerHandler;}
 class BacnetTransportLayerHandler;
-class Buffer;
-class BacnetNetworkLayerHandler
+class BacnetNetworkLayerHandler:
+        public TimingWheelClient
 {
 public:
     BacnetNetworkLayerHandler();
+    virtual ~BacnetNetworkLayerHandler();
 
     enum ErrorCodes {
         BufferNotValid = -1,
@@ -38,9 +45,14 @@ public:
       \param length - length of the buffer, expressed as number of bytes from npdu pointer;
       \param dlSrcAddress - address of the source of this information;
       \param port - pointer to the BacnetTransportLayerHandler which this message comes from (would be useful for routing capability).
+      \param frame - pooled buffer the npdu lies in (if any), passed further to the application layer.
       */
-    void readNpdu(quint8 *npdu, quint16 length, BacnetAddress &dlSrcAddress, BacnetTransportLayerHandler *port);
+    void readNpdu(quint8 *npdu, quint16 length, BacnetAddress &dlSrcAddress, BacnetTransportLayerHandler *port, Buffer *frame = 0);
 
+    /**
+      Sends APDU to the destination. If there is no route to the destination network, Who-Is-Router-To-Network is issued and the APDU waits
+      for the answer (\sa setPendingRouteLimits()) - it's sent as soon as the route is learnt, or dropped when it doesn't come in time.
+      */
     void sendApdu(Buffer *apduBuffer, bool dataExpectingReply, const BacnetAddress *destAddr,
                   const BacnetAddress *srcAddr, Bacnet::NetworkPriority prio = Bacnet::PriorityNormal);
 
@@ -66,6 +78,77 @@ public:
 
     void broadcastAvailableNetworks();
 
+    //! Router statistics - NPDUs passed between ports.
+    struct RoutingStatistics {
+        quint64 forwardedCount;
+        //! Forwarded ones, that couldn't be rewritten in the received frame (it was shared or not pooled) and were copied.
+        quint64 copiedCount;
+        //! No route, hop count exhausted, or no buffer.
+        quint64 droppedCount;
+    };
+    RoutingStatistics routingStatistics();
+    void resetRoutingStatistics();
+
+    static const int DefaultPendingRouteTimeout_ms = 2000;
+    static const int DefaultMaxPendingPerNetwork = 16;
+    /**
+      Sets how long outgoing APDUs may wait for route discovery and how many of them may wait for one network (the ones above are dropped).
+      APDUs held off by a busy network don't expire - they are sent on the known route when the network is available again
+      (Router-Available-To-Network comes or PeerBusyTimeout_ms passes). Expired ones are dropped on the \sa TimingWheel timer, armed
+      for the earliest deadline. Retry of the confirmed request (same destination and invoke id) replaces its waiting copy, instead
+      of taking another place in the queue.
+      */
+    void setPendingRouteLimits(int timeout_ms, int maxPerNetwork);
+
+    struct PendingRouteStatistics {
+        //! Number of APDUs waiting for routes now.
+        int queuedCount;
+        //! Number of networks being discovered now.
+        int networksCount;
+        //! APDUs sent after their route was learnt.
+        quint64 resolvedCount;
+        //! APDUs dropped, since route wasn't learnt in time.
+        quint64 expiredCount;
+        //! APDUs dropped, since too many were waiting.
+        quint64 overflowCount;
+        //! Waiting confirmed requests replaced by their retries.
+        quint64 replacedCount;
+        //! Number of discoveries answered - from the first APDU queued till I-Am-Router-To-Network.
+        quint64 resolutionsCount;
+        qint64 totalResolutionLatency_ns;
+        qint64 maxResolutionLatency_ns;
+    };
+    PendingRouteStatistics pendingRouteStatistics();
+    void resetPendingRouteStatistics();
+
+    static const int DefaultBusyLoad_percent = 80;
+    static const int DefaultAvailableLoad_percent = 50;
+    /**
+      Sets congestion thresholds. Network load is the load of the port it's behind (\sa BacnetTransportLayerHandler::loadPercent())
+      or buffers pool, whichever is higher - the virtual network takes the application layer load into account, too
+      (\sa BacnetApplicationLayerHandler::loadPercent()). When it reaches busyLoad, Router-Busy-To-Network is broadcast for
+      the network (on the other ports) and messages routed to it are rejected with RouterBusy reason. When it falls to availableLoad,
+      Router-Available-To-Network follows.
+      */
+    void setCongestionThresholds(int busyLoad_percent, int availableLoad_percent);
+
+    struct CongestionStatistics {
+        //! Networks we announced busy and not available yet.
+        int busyNetworksCount;
+        //! Networks other routers told us are busy.
+        int peerBusyNetworksCount;
+        quint64 busyAnnouncementsCount;
+        quint64 availableAnnouncementsCount;
+        //! Routed messages rejected, since their network was busy.
+        quint64 rejectedCount;
+        //! APDUs held, since their network was reported busy by other router.
+        quint64 deferredCount;
+        //! Held APDUs sent, when their network became available again.
+        quint64 releasedCount;
+    };
+    CongestionStatistics congestionStatistics();
+    void resetCongestionStatistics();
+
 private:
     /**
       Returns number of bytes used to process the message. If not successfully - negative.
@@ -81,6 +164,11 @@ private:
     qint32 processRejectMessageToNetwork(quint8 *actualBytePtr, quint16 length, BacnetTransportLayerHandler *port);
     qint32 processInitializeRoutingTable(quint8 *actualBytePtr, quint16 length, BacnetAddress &srcAddr, BacnetTransportLayerHandler *port);
     qint32 processIAmRouterToNetwork(quint8 *actualBytePtr, quint16 length, BacnetAddress &srcAddress, BacnetTransportLayerHandler *port);
+    //! Router-Busy-To-Network and Router-Available-To-Network - no networks listed means all the networks behind the router.
+    qint32 processRouterBusyToNetwork(quint8 *actualBytePtr, quint16 length, BacnetAddress &srcAddress, BacnetTransportLayerHandler *port);
+    qint32 processRouterAvailableToNetwork(quint8 *actualBytePtr, quint16 length, BacnetAddress &srcAddress, BacnetTransportLayerHandler *port);
+    //! Decodes networks list of the network message. If it's empty, returns the networks routed through router at srcAddress.
+    QList<TNetworkNum> networksFromList_hlpr(quint8 *actualBytePtr, quint16 length, BacnetAddress &srcAddress, BacnetTransportLayerHandler *port);
 
     void sendRejectMessageToNetwork(RejectMessageToRouterReason rejReason, quint16 dnet, BacnetAddress &dlSenderAddress, BacnetTransportLayerHandler *port);
 
@@ -89,6 +177,18 @@ private:
 
     //! Creates and sends networks vector to the port. If originAddr is specified, this address will be inserted into NPCI SRC fields.
     void sendIAmRouterToNetwork_helper(QList<TNetworkNum> &networks, BacnetTransportLayerHandler *port);
+    //! Broadcasts network message of msgType followed by the networks list on the port.
+    void sendNetworksList_hlpr(BacnetNpci::BacnetNetworkMessageType msgType, const QList<TNetworkNum> &networks, BacnetTransportLayerHandler *port);
+
+    /**
+      Routes the NPDU, which DNET is not our virtual network, to the egress port (or to all the ports but the ingress one, when
+      it's a global broadcast). Its NPCI is rebuilt (SNET/SADR added by the first router, hop count decreased, DNET removed when the destination
+      network is directly connected) and written in place, just in front of the payload in the received frame - the payload is neither copied
+      nor decoded. If the frame can't be modified (not pooled, shared or not enough headroom), NPDU is copied into a new buffer.
+      \param payload - APDU (or network message contents) following the NPCI.
+      */
+    void routeNpdu_hlpr(BacnetNpci &npci, quint8 *payload, quint16 payloadLength, BacnetAddress &dlSrcAddress,
+                        BacnetTransportLayerHandler *port, Buffer *frame);
 
     //! Used to send network messages, where dlDestination is already known (or 0, meainging b'cast) and port to which we want to send is known as well.
     void sendBuffer(Buffer *bufferToSend, Bacnet::NetworkPriority priority, BacnetTransportLayerHandler *port, const BacnetAddress *dlDestinationAddress = 0);
@@ -109,29 +209,142 @@ private:
 
     /** Returns the port, that should be able to reach the given address (based on network parameters). If netwrork in address is provided, but the route is not found,
         returns NULL port and issues who-is-router-to-network request to all ports available.
-        If the port is found and the network is not directly accessible (there is some intermediate router), it will also return pointer to the address of the next
-        router on path. Otherwise it's NULL as well.
+        If the port is found and the network is not directly accessible (there is some intermediate router), viaRouter is set and nextHopAddress
+        gets a copy of the address of the next router on path. Otherwise viaRouter is cleared.
       */
-    BacnetTransportLayerHandler *findDestinationForAddress(const BacnetAddress *destAddr, BacnetAddress *&dlAddress);
+    BacnetTransportLayerHandler *findDestinationForAddress(const BacnetAddress *destAddr, BacnetAddress &nextHopAddress, bool &viaRouter);
 
-    /** Each routing entry should consist of direct network number, port number and a list of pair (networks accessible through this port, router address).
-        \note we don't store direct network number in the entry RoutingEntry. It's already given as a hash key.
-       */
-    struct RoutingEntry {
-        TPortId portId;
-        BacnetTransportLayerHandler* port;
-        QHash<TNetworkNum, BacnetAddress> indirectNetworkAccess;
-    };
     static const quint8 AppLayerPortId = 0xff;
     static const quint8 InvalidPortId = -1;
-    //! This is a Bacnet routing table. If the value of network is negative, it means
-    QHash<TNetworkNum, RoutingEntry> _routingTable;
-    QHash<TPortId, BacnetTransportLayerHandler*> _allPorts;
+
+    /** Ports are kept in a dense vector - routing table refers to them with their index. Each port knows the networks it leads to, so
+        updates and queries concerning one port don't have to look at the whole routing table.
+      */
+    struct PortEntry {
+        TPortId portId;
+        BacnetTransportLayerHandler *port;
+        //! Directly connected network number, negative if not set.
+        qint32 directNet;
+        //! Networks reachable through routers behind this port.
+        QSet<TNetworkNum> indirectNets;
+    };
+    QVector<PortEntry> _ports;
+    QHash<BacnetTransportLayerHandler*, int> _portIdxByPtr;
+    //! Returns index of the port in _ports, -1 if not found.
+    int portIdx(BacnetTransportLayerHandler *port);
+    int portIdx(TPortId portId);
+
+    /** This is a Bacnet routing table - one slot per each possible DNET, so that route lookup is a single array access.
+        Next hop routers addresses are kept aside (\sa _nextHops) - there are few of them, and a slot stays small (the whole table is 256 kB).
+      */
+    struct Route {
+        //! Index in _ports, NoRoute if the network is unknown.
+        qint16 portIdx;
+        //! Index in _nextHops, DirectRoute if the network is directly connected to the port.
+        quint16 nextHopIdx;
+    };
+    static const int NetworksCount = 65536;
+    static const qint16 NoRoute = -1;
+    static const quint16 DirectRoute = 0xffff;
+    QVector<Route> _routes;
+
+    struct NextHop {
+        BacnetAddress address;
+        //! Number of routes using it - when 0, the slot may be reused.
+        int routesCount;
+    };
+    QVector<NextHop> _nextHops;
+
+    //! Routes net through the port (directly or via router at nextHopIdx), removing its previous route.
+    void setRoute_hlpr(TNetworkNum net, int portIdx, quint16 nextHopIdx);
+    void clearRoute_hlpr(TNetworkNum net);
+    //! Removes all the routes (direct and indirect) leading through the port.
+    void clearPortRoutes_hlpr(int portIdx);
+    //! Returns index of the router address in _nextHops (adding it, if necessary). The router is counted as used by one more route.
+    quint16 acquireNextHop_hlpr(const BacnetAddress &routerAddress);
+    void releaseNextHop_hlpr(quint16 nextHopIdx);
+
+    /** APDUs waiting for Who-Is-Router-To-Network answer, per destination network. Each network queue is FIFO with the same timeout,
+        so its head expires first.
+      */
+    struct PendingApdu {
+        Buffer apduBuffer;
+        bool dataExpectingReply;
+        BacnetAddress destAddr;
+        BacnetAddress srcAddr;
+        Bacnet::NetworkPriority prio;
+        qint64 deadline_ns;
+    };
+    struct PendingRoute {
+        qint64 discoveryStart_ns;
+        //! APDUs wait for the busy network, not for its route - they are sent, not dropped, when the busy period ends.
+        bool heldByBusy;
+        QQueue<PendingApdu> apdus;
+    };
+    QHash<TNetworkNum, PendingRoute> _pendingRoutes;
+    static const int MaxPendingNetworks = 64;
+    int _pendingCount;
+    qint64 _pendingTimeout_ns;
+    int _maxPendingPerNetwork;
+    //! The earliest deadline of all queued APDUs - nothing has to be checked before it.
+    qint64 _nextPendingDeadline_ns;
+    //! Armed for _nextPendingDeadline_ns, while anything is queued.
+    TimingWheel::TimerId _pendingTimer;
+    PendingRouteStatistics _pendingStats;
+    QElapsedTimer _clock;
+
+    //! Returns false, if APDU can't wait (queue is full). Doesn't issue Who-Is-Router-To-Network.
+    bool queuePendingApdu_hlpr(Buffer *apduBuffer, bool dataExpectingReply, const BacnetAddress *destAddr,
+                               const BacnetAddress *srcAddr, Bacnet::NetworkPriority prio);
+    //! Sends everything, that waited for the network.
+    void flushPendingRoute_hlpr(TNetworkNum net);
+    //! Drops APDUs that waited for route discovery too long and sends the ones, which network isn't busy anymore.
+    void expirePendingApdus_hlpr();
+    //! Arms _pendingTimer for _nextPendingDeadline_ns.
+    void armPendingTimer_hlpr(qint64 now_ns);
+    //! Returns invoke id of the unsegmented confirmed request in the buffer, -1 if it's anything else.
+    static int confirmedRequestInvokeId_hlpr(Buffer &apduBuffer);
+
+    enum TimerCookie {
+        PendingTimerCookie,
+        CongestionTimerCookie
+    };
+
+public://overridden from TimingWheelClient
+    //! Pending APDUs deadline, or congestion check while we are busy.
+    virtual void timerExpired(quintptr cookie);
+
+private:
+
+    static const int CongestionCheckInterval_ms = 100;
+    //! 6.6.3.6 - network reported busy by other router is considered available again after this time, even if Router-Available-To-Network doesn't come.
+    static const int PeerBusyTimeout_ms = 30000;
+    int _busyLoad_percent;
+    int _availableLoad_percent;
+    qint64 _nextCongestionCheck_ns;
+    //! Armed while any network is announced busy - load is checked even if no traffic comes, so that Router-Available-To-Network isn't late.
+    TimingWheel::TimerId _congestionTimer;
+    //! Networks we announced busy.
+    QSet<TNetworkNum> _busyNets;
+    //! Networks reported busy by other routers -> time we stop believing it.
+    QHash<TNetworkNum, qint64> _peerBusyUntil_ns;
+    CongestionStatistics _congestionStats;
+
+    //! Computes networks load and announces changes of their state. Does nothing more often than each CongestionCheckInterval_ms, unless forced.
+    void checkCongestion_hlpr(bool force = false);
+    //! Marks networks, which load is high, as busy - or keeps them busy, until the load falls to available threshold.
+    void updateBusyNets_hlpr(int load_percent, TNetworkNum net, QSet<TNetworkNum> &busyNets);
+    //! Broadcasts msgType for the networks on every port, except the ones they are behind.
+    void announceNetworks_hlpr(BacnetNpci::BacnetNetworkMessageType msgType, const QSet<TNetworkNum> &networks);
+    bool isPeerBusy_hlpr(TNetworkNum net);
+
     /**
         Network number of the application application layer.
       */
     quint16 _virtualNetNum;
     Bacnet::BacnetApplicationLayerHandler *_virtualAppLayer;
+
+    RoutingStatistics _routingStats;
 //    /**
 //      This hash stores information about routers that are connected to local network and are on the path to
 //      the concrete network. The information is colleted wiht BacnetNpci::IAmRouterToNetwork network message.
@@ -134,7 +134,7 @@ qint8 BacnetNpci::setToRaw(quint8 *outDataPtr)
         *actPtr = (quint8)_messageType;
         ++actPtr;
         if ((networkMessageType() > LastAshraeReserved))
-            *actPtr += HelperCoder::uin16ToRaw(_vendorId, actPtr);
+            actPtr += HelperCoder::uin16ToRaw(_vendorId, actPtr);
     }
 
     return (actPtr - outDataPtr);
@@ -200,3 +200,9 @@ void BacnetNpci::setSrcAddress(const BacnetAddress &addr)
     _controlOctet |= BitFields::Bit3;
     _srcAddr = addr;
 }
+
+void BacnetNpci::clearDestAddress()
+{
+    _controlOctet &= ~BitFields::Bit5;
+    _destAddr = BacnetAddress();
+}
@@ -61,6 +61,10 @@ public:
     void setDestAddress(const BacnetAddress &addr);
     BacnetAddress &srcAddress();
     void setSrcAddress(const BacnetAddress &addr);
+    //! Removes DNET, DADR and hop count - used by router, when message is passed to the destination network.
+    void clearDestAddress();
+    //! Hop count, as received (\sa setToRaw() writes it decreased).
+    inline quint8 hopCount() {return _hopCount;}
 
     inline bool isSane() {return ((BitFields::Bit6 & _controlOctet) | (BitFields::Bit4 & _controlOctet)) == 0;}
 
@@ -0,0 +1,374 @@
+#include "bacnetpcapfile.h"
+
+#include <QtEndian>
+
+//classic pcap
+static const quint32 PcapMagicMicro     = 0xa1b2c3d4;
+static const quint32 PcapMagicNano      = 0xa1b23c4d;
+static const int PcapGlobalHeaderSize   = 24;
+static const int PcapRecordHeaderSize   = 16;
+static const int PcapLinkTypeField      = 20;
+
+//pcapng
+static const quint32 PcapNgSectionHeaderBlock       = 0x0a0d0d0a;
+static const quint32 PcapNgInterfaceBlock           = 0x00000001;
+static const quint32 PcapNgObsoletePacketBlock      = 0x00000002;
+static const quint32 PcapNgSimplePacketBlock        = 0x00000003;
+static const quint32 PcapNgEnhancedPacketBlock      = 0x00000006;
+static const quint32 PcapNgByteOrderMagic           = 0x1a2b3c4d;
+static const int PcapNgBlockOverhead                = 12;//type, total length at the front and at the back
+static const quint16 PcapNgOptionEnd                = 0;
+static const quint16 PcapNgOptionTsResolution       = 9;
+
+//headers
+static const int EthernetHeaderSize     = 14;
+static const int EthernetTypeField      = 12;
+static const int VlanTagSize            = 4;
+static const int LinuxSllHeaderSize     = 16;
+static const int LinuxSllProtocolField  = 14;
+static const int NullHeaderSize         = 4;
+static const quint16 EtherTypeIpv4      = 0x0800;
+static const quint16 EtherTypeVlan      = 0x8100;
+static const quint16 EtherTypeQinQ      = 0x88a8;
+static const int Ipv4MinHeaderSize      = 20;
+static const quint8 IpProtocolUdp       = 17;
+static const int UdpHeaderSize          = 8;
+static const quint32 NullFamilyInet     = 2;
+
+static inline quint16 read16(const quint8 *ptr, bool bigEndian)
+{
+    return bigEndian ? qFromBigEndian<quint16>(ptr) : qFromLittleEndian<quint16>(ptr);
+}
+
+static inline quint32 read32(const quint8 *ptr, bool bigEndian)
+{
+    return bigEndian ? qFromBigEndian<quint32>(ptr) : qFromLittleEndian<quint32>(ptr);
+}
+
+//! Converts timestamp given in units (unitsPerSecond of them make a second) to microseconds, without overflowing.
+static inline qint64 toMicroseconds(quint64 timestamp, quint64 unitsPerSecond)
+{
+    quint64 seconds = timestamp / unitsPerSecond;
+    quint64 rest = timestamp % unitsPerSecond;
+    return (qint64)(seconds * 1000000 + (rest * 1000000) / unitsPerSecond);
+}
+
+bool BacnetPcapReader::load(const QString &fileName, QVector<UdpDatagram> &datagrams, quint16 udpPort, int *skippedCount)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qDebug("%s : can't open %s", __PRETTY_FUNCTION__, qPrintable(fileName));
+        return false;
+    }
+    //captures used for benchmarks are not that big - read it at once, so that file access doesn't disturb measurements later
+    QByteArray content = file.readAll();
+    const quint8 *data = (const quint8*)content.constData();
+
+    if (content.size() < 4) {
+        qDebug("%s : %s is too short", __PRETTY_FUNCTION__, qPrintable(fileName));
+        return false;
+    }
+
+    int skipped(0);
+    bool ok(false);
+    quint32 magic = qFromLittleEndian<quint32>(data);
+    if (PcapNgSectionHeaderBlock == magic)//the same in both byte orders
+        ok = loadPcapNg_hlpr(data, content.size(), datagrams, udpPort, skipped);
+    else
+        ok = loadPcap_hlpr(data, content.size(), datagrams, udpPort, skipped);
+
+    if (0 != skippedCount)
+        *skippedCount = skipped;
+    return ok;
+}
+
+bool BacnetPcapReader::loadPcap_hlpr(const quint8 *data, qint64 size, QVector<UdpDatagram> &datagrams, quint16 udpPort, int &skippedCount)
+{
+    if (size < PcapGlobalHeaderSize)
+        return false;
+
+    bool bigEndian;
+    bool nanoResolution;
+    quint32 magic = qFromLittleEndian<quint32>(data);
+    if ( (PcapMagicMicro == magic) || (PcapMagicNano == magic) ) {
+        bigEndian = false;
+    } else {
+        magic = qFromBigEndian<quint32>(data);
+        if ( (PcapMagicMicro != magic) && (PcapMagicNano != magic) ) {
+            qDebug("%s : unknown file format (magic 0x%x)", __PRETTY_FUNCTION__, magic);
+            return false;
+        }
+        bigEndian = true;
+    }
+    nanoResolution = (PcapMagicNano == magic);
+    int linkType = read32(data + PcapLinkTypeField, bigEndian);
+
+    UdpDatagram datagram;
+    qint64 offset = PcapGlobalHeaderSize;
+    while (offset + PcapRecordHeaderSize <= size) {
+        const quint8 *record = data + offset;
+        quint32 seconds = read32(record, bigEndian);
+        quint32 fraction = read32(record + 4, bigEndian);
+        quint32 capturedLength = read32(record + 8, bigEndian);
+        offset += PcapRecordHeaderSize;
+        if (offset + capturedLength > size) {
+            qDebug("%s : truncated record at the end of file", __PRETTY_FUNCTION__);
+            break;
+        }
+
+        datagram.timestamp_us = (qint64)seconds * 1000000 + (nanoResolution ? fraction / 1000 : fraction);
+        if ( extractUdp_hlpr(linkType, data + offset, capturedLength, datagram) &&
+             ( (0 == udpPort) || (udpPort == datagram.srcPort) || (udpPort == datagram.destPort) ) )
+            datagrams.append(datagram);
+        else
+            ++skippedCount;
+        offset += capturedLength;
+    }
+
+    return true;
+}
+
+bool BacnetPcapReader::loadPcapNg_hlpr(const quint8 *data, qint64 size, QVector<UdpDatagram> &datagrams, quint16 udpPort, int &skippedCount)
+{
+    //per interface (of the current section) link type and timestamp units
+    QVector<int> linkTypes;
+    QVector<quint64> unitsPerSecond;
+    bool bigEndian(false);
+
+    UdpDatagram datagram;
+    qint64 offset(0);
+    while (offset + PcapNgBlockOverhead <= size) {
+        const quint8 *block = data + offset;
+        if (PcapNgSectionHeaderBlock == qFromLittleEndian<quint32>(block)) {
+            //new section - byte order may change, interfaces are forgotten
+            if (offset + PcapNgBlockOverhead + 4 > size)
+                break;
+            bigEndian = (PcapNgByteOrderMagic == qFromBigEndian<quint32>(block + 8));
+            if (!bigEndian && (PcapNgByteOrderMagic != qFromLittleEndian<quint32>(block + 8))) {
+                qDebug("%s : corrupted section header", __PRETTY_FUNCTION__);
+                return false;
+            }
+            linkTypes.clear();
+            unitsPerSecond.clear();
+        }
+
+        quint32 blockType = read32(block, bigEndian);
+        quint32 blockLength = read32(block + 4, bigEndian);
+        if ( (blockLength < PcapNgBlockOverhead) || (offset + blockLength > size) ) {
+            qDebug("%s : truncated block at the end of file", __PRETTY_FUNCTION__);
+            break;
+        }
+        const quint8 *body = block + 8;
+        quint32 bodyLength = blockLength - PcapNgBlockOverhead;
+
+        switch (blockType) {
+        case (PcapNgInterfaceBlock): {
+                if (bodyLength < 8)
+                    break;
+                linkTypes.append(read16(body, bigEndian));
+                quint64 units(1000000);
+                //look for timestamp resolution among options
+                quint32 optOffset = 8;
+                while (optOffset + 4 <= bodyLength) {
+                    quint16 optCode = read16(body + optOffset, bigEndian);
+                    quint16 optLength = read16(body + optOffset + 2, bigEndian);
+                    if (PcapNgOptionEnd == optCode)
+                        break;
+                    if ( (PcapNgOptionTsResolution == optCode) && (optLength >= 1) && (optOffset + 5 <= bodyLength) ) {
+                        quint8 resolution = body[optOffset + 4];
+                        quint8 exponent = resolution & 0x7f;
+                        units = 1;
+                        if (resolution & 0x80)//power of 2
+                            units <<= qMin((int)exponent, 63);
+                        else//power of 10
+                            for (int i = 0; i < qMin((int)exponent, 19); ++i)
+                                units *= 10;
+                    }
+                    optOffset += 4 + ((optLength + 3) & ~3);
+                }
+                unitsPerSecond.append(units);
+                break;
+            }
+        case (PcapNgEnhancedPacketBlock):
+        case (PcapNgObsoletePacketBlock): {
+                if (bodyLength < 20)
+                    break;
+                int interfaceId = (PcapNgEnhancedPacketBlock == blockType) ? read32(body, bigEndian) : read16(body, bigEndian);
+                quint64 timestamp = ((quint64)read32(body + 4, bigEndian) << 32) | read32(body + 8, bigEndian);
+                quint32 capturedLength = qMin(read32(body + 12, bigEndian), bodyLength - 20);
+                if (interfaceId >= linkTypes.count()) {
+                    ++skippedCount;
+                    break;
+                }
+                datagram.timestamp_us = toMicroseconds(timestamp, unitsPerSecond.at(interfaceId));
+                if ( extractUdp_hlpr(linkTypes.at(interfaceId), body + 20, capturedLength, datagram) &&
+                     ( (0 == udpPort) || (udpPort == datagram.srcPort) || (udpPort == datagram.destPort) ) )
+                    datagrams.append(datagram);
+                else
+                    ++skippedCount;
+                break;
+            }
+        case (PcapNgSimplePacketBlock): {
+                //no timestamp, no interface id (it's always the first one) - take time of the previous one
+                if ( (bodyLength < 4) || linkTypes.isEmpty() )
+                    break;
+                quint32 capturedLength = qMin(read32(body, bigEndian), bodyLength - 4);
+                if ( extractUdp_hlpr(linkTypes.first(), body + 4, capturedLength, datagram) &&
+                     ( (0 == udpPort) || (udpPort == datagram.srcPort) || (udpPort == datagram.destPort) ) )
+                    datagrams.append(datagram);
+                else
+                    ++skippedCount;
+                break;
+            }
+        default:
+            //statistics, name resolution and others - not interesting
+            break;
+        }
+
+        offset += blockLength;
+    }
+
+    return true;
+}
+
+bool BacnetPcapReader::extractUdp_hlpr(int linkType, const quint8 *frame, quint32 length, UdpDatagram &datagram)
+{
+    //find IP header
+    quint32 offset(0);
+    switch (linkType) {
+    case (LinkTypeEthernet): {
+            if (length < (quint32)EthernetHeaderSize)
+                return false;
+            offset = EthernetTypeField;
+            quint16 etherType = qFromBigEndian<quint16>(frame + offset);
+            while ( ((EtherTypeVlan == etherType) || (EtherTypeQinQ == etherType)) && (offset + VlanTagSize + 2 <= length) ) {
+                offset += VlanTagSize;
+                etherType = qFromBigEndian<quint16>(frame + offset);
+            }
+            if (EtherTypeIpv4 != etherType)
+                return false;
+            offset += 2;
+            break;
+        }
+    case (LinkTypeLinuxSll): {
+            if ( (length < (quint32)LinuxSllHeaderSize) || (EtherTypeIpv4 != qFromBigEndian<quint16>(frame + LinuxSllProtocolField)) )
+                return false;
+            offset = LinuxSllHeaderSize;
+            break;
+        }
+    case (LinkTypeNull): {
+            //family is in the byte order of the capturing machine
+            if ( (length < (quint32)NullHeaderSize) ||
+                 ((NullFamilyInet != qFromLittleEndian<quint32>(frame)) && (NullFamilyInet != qFromBigEndian<quint32>(frame))) )
+                return false;
+            offset = NullHeaderSize;
+            break;
+        }
+    case (LinkTypeRaw):
+    case (LinkTypeIpv4):
+        offset = 0;
+        break;
+    default:
+        return false;
+    }
+
+    //IPv4
+    if (offset + Ipv4MinHeaderSize > length)
+        return false;
+    const quint8 *ip = frame + offset;
+    if ( ((ip[0] >> 4) != 4) || (IpProtocolUdp != ip[9]) )
+        return false;
+    quint16 fragmentField = qFromBigEndian<quint16>(ip + 6);
+    if (fragmentField & 0x3fff)//more fragments flag or fragment offset - we don't reassemble
+        return false;
+    quint32 ipHeaderLength = (ip[0] & 0x0f) * 4;
+    datagram.srcIpAddress = qFromBigEndian<quint32>(ip + 12);
+    datagram.destIpAddress = qFromBigEndian<quint32>(ip + 16);
+    offset += ipHeaderLength;
+
+    //UDP
+    if (offset + UdpHeaderSize > length)
+        return false;
+    const quint8 *udp = frame + offset;
+    datagram.srcPort = qFromBigEndian<quint16>(udp);
+    datagram.destPort = qFromBigEndian<quint16>(udp + 2);
+    quint16 udpLength = qFromBigEndian<quint16>(udp + 4);
+    if (udpLength < UdpHeaderSize)
+        return false;
+    offset += UdpHeaderSize;
+    quint32 payloadLength = qMin((quint32)(udpLength - UdpHeaderSize), length - offset);
+    datagram.payload = QByteArray((const char*)(frame + offset), payloadLength);
+    return true;
+}
+
+bool BacnetPcapWriter::open(const QString &fileName)
+{
+    _file.setFileName(fileName);
+    if (!_file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qDebug("%s : can't open %s", __PRETTY_FUNCTION__, qPrintable(fileName));
+        return false;
+    }
+
+    quint8 header[PcapGlobalHeaderSize];
+    qToLittleEndian<quint32>(PcapMagicMicro, header);
+    qToLittleEndian<quint16>(2, header + 4);//version 2.4
+    qToLittleEndian<quint16>(4, header + 6);
+    qToLittleEndian<quint32>(0, header + 8);//time zone
+    qToLittleEndian<quint32>(0, header + 12);//accuracy
+    qToLittleEndian<quint32>(0xffff, header + 16);//snap length
+    qToLittleEndian<quint32>(LinkTypeIpv4, header + PcapLinkTypeField);
+    return (_file.write((const char*)header, sizeof(header)) == sizeof(header));
+}
+
+void BacnetPcapWriter::close()
+{
+    _file.close();
+}
+
+bool BacnetPcapWriter::isOpen()
+{
+    return _file.isOpen();
+}
+
+void BacnetPcapWriter::writeUdp(qint64 timestamp_us, quint32 srcIpAddress, quint16 srcPort, quint32 destIpAddress, quint16 destPort, const quint8 *data, quint16 length)
+{
+    Q_ASSERT(_file.isOpen());
+    quint8 headers[PcapRecordHeaderSize + Ipv4MinHeaderSize + UdpHeaderSize];
+    quint32 packetLength = Ipv4MinHeaderSize + UdpHeaderSize + length;
+
+    //record header
+    quint8 *ptr = headers;
+    qToLittleEndian<quint32>(timestamp_us / 1000000, ptr);
+    qToLittleEndian<quint32>(timestamp_us % 1000000, ptr + 4);
+    qToLittleEndian<quint32>(packetLength, ptr + 8);
+    qToLittleEndian<quint32>(packetLength, ptr + 12);
+
+    //IPv4 header
+    ptr += PcapRecordHeaderSize;
+    ptr[0] = 0x45;
+    ptr[1] = 0;
+    qToBigEndian<quint16>(packetLength, ptr + 2);
+    qToBigEndian<quint16>(0, ptr + 4);//identification
+    qToBigEndian<quint16>(0x4000, ptr + 6);//don't fragment
+    ptr[8] = 64;//TTL
+    ptr[9] = IpProtocolUdp;
+    qToBigEndian<quint16>(0, ptr + 10);
+    qToBigEndian<quint32>(srcIpAddress, ptr + 12);
+    qToBigEndian<quint32>(destIpAddress, ptr + 16);
+    quint32 checksum(0);
+    for (int i = 0; i < Ipv4MinHeaderSize; i += 2)
+        checksum += qFromBigEndian<quint16>(ptr + i);
+    while (checksum >> 16)
+        checksum = (checksum & 0xffff) + (checksum >> 16);
+    qToBigEndian<quint16>(~checksum, ptr + 10);
+
+    //UDP header, checksum is optional in IPv4
+    ptr += Ipv4MinHeaderSize;
+    qToBigEndian<quint16>(srcPort, ptr);
+    qToBigEndian<quint16>(destPort, ptr + 2);
+    qToBigEndian<quint16>(UdpHeaderSize + length, ptr + 4);
+    qToBigEndian<quint16>(0, ptr + 6);
+
+    _file.write((const char*)headers, sizeof(headers));
+    _file.write((const char*)data, length);
+}
@@ -0,0 +1,65 @@
+#ifndef BACNETPCAPFILE_H
+#define BACNETPCAPFILE_H
+
+#include <QtCore>
+#include <QFile>
+
+/**
+  Reads BACnet/IP traffic out of capture files - both classic pcap (micro- and nanosecond variants, any endianness) and pcapng.
+  Supported link layers are Ethernet (with 802.1Q tags), Linux cooked capture, raw IPv4 and BSD loopback. Only unfragmented
+  IPv4/UDP datagrams are taken, everything else is skipped.
+  */
+class BacnetPcapReader
+{
+public:
+    struct UdpDatagram {
+        //! Capture timestamp in microseconds.
+        qint64 timestamp_us;
+        quint32 srcIpAddress;
+        quint16 srcPort;
+        quint32 destIpAddress;
+        quint16 destPort;
+        QByteArray payload;
+    };
+
+    /**
+      Reads all the UDP datagrams with source or destination port equal to udpPort (0 means any) from the file.
+      Returns false, if the file can't be read or its format is not known (datagrams read till the error are left in datagrams).
+      \param skippedCount - if not 0, number of packets that were not taken is stored there.
+      */
+    static bool load(const QString &fileName, QVector<UdpDatagram> &datagrams, quint16 udpPort = 0, int *skippedCount = 0);
+
+private:
+    enum LinkType {
+        LinkTypeNull        = 0,
+        LinkTypeEthernet    = 1,
+        LinkTypeRaw         = 101,
+        LinkTypeLinuxSll    = 113,
+        LinkTypeIpv4        = 228
+    };
+
+    static bool loadPcap_hlpr(const quint8 *data, qint64 size, QVector<UdpDatagram> &datagrams, quint16 udpPort, int &skippedCount);
+    static bool loadPcapNg_hlpr(const quint8 *data, qint64 size, QVector<UdpDatagram> &datagrams, quint16 udpPort, int &skippedCount);
+
+    //! Finds IPv4/UDP datagram in the captured frame. Returns false, if it's not there.
+    static bool extractUdp_hlpr(int linkType, const quint8 *frame, quint32 length, UdpDatagram &datagram);
+};
+
+/**
+  Writes UDP datagrams into classic pcap file (link type IPv4), so that it may be looked at with usual tools. IP and UDP headers
+  are made up from the addresses given.
+  */
+class BacnetPcapWriter
+{
+public:
+    bool open(const QString &fileName);
+    void close();
+    bool isOpen();
+
+    void writeUdp(qint64 timestamp_us, quint32 srcIpAddress, quint16 srcPort, quint32 destIpAddress, quint16 destPort, const quint8 *data, quint16 length);
+
+private:
+    QFile _file;
+};
+
+#endif // BACNETPCAPFILE_H
@@ -0,0 +1,198 @@
+#include "bacnetpcapreplaytransportlayer.h"
+
+#include <QCoreApplication>
+#include <QTimerEvent>
+
+#include "bacnetvirtuallinklayer.h"
+#include "bacnetbuffermanager.h"
+#include "buffer.h"
+
+BacnetPcapReplayTransportLayer::BacnetPcapReplayTransportLayer(QObject *parent):
+    QObject(parent),
+    _transportHndlr(new BacnetUdpTransportLayerHandler(this)),
+    _bvllHndlr(new BacnetBvllHandler(_transportHndlr)),
+    _nextIdx(0),
+    _repeatCount(1),
+    _repeatsDone(0),
+    _speed(1),
+    _quitWhenFinished(false),
+    _started(false),
+    _replayedCount(0),
+    _repliesCount(0),
+    _processingTotal_ns(0),
+    _processingMax_ns(0)
+{
+    //no network - everything the stack sends comes to us
+    _transportHndlr->setDatagramSink(this);
+    _transportHndlr->setBvlc(_bvllHndlr);
+    _bvllHndlr->setTransportProxy(this);
+}
+
+BacnetPcapReplayTransportLayer::~BacnetPcapReplayTransportLayer()
+{
+    delete _bvllHndlr;
+}
+
+bool BacnetPcapReplayTransportLayer::loadCapture(const QString &fileName)
+{
+    int skippedCount(0);
+    _datagrams.clear();
+    bool ok = BacnetPcapReader::load(fileName, _datagrams, _transportHndlr->port(), &skippedCount);
+    qDebug("%s : %d datagrams loaded from %s (%d packets skipped)", __PRETTY_FUNCTION__, _datagrams.count(), qPrintable(fileName), skippedCount);
+    return ok;
+}
+
+void BacnetPcapReplayTransportLayer::setAddress(const QHostAddress &address, quint16 port)
+{
+    _transportHndlr->setAddress(address, port);
+}
+
+void BacnetPcapReplayTransportLayer::setSpeed(double speed)
+{
+    Q_ASSERT(speed >= 0);
+    _speed = qMax(0.0, speed);
+}
+
+void BacnetPcapReplayTransportLayer::setRepeatCount(int count)
+{
+    Q_ASSERT(count > 0);
+    _repeatCount = qMax(1, count);
+}
+
+bool BacnetPcapReplayTransportLayer::setRepliesFile(const QString &fileName)
+{
+    return _repliesWriter.open(fileName);
+}
+
+void BacnetPcapReplayTransportLayer::setQuitWhenFinished(bool quit)
+{
+    _quitWhenFinished = quit;
+}
+
+void BacnetPcapReplayTransportLayer::start(int delay_ms)
+{
+    _started = false;
+    _timer.start(delay_ms, this);
+}
+
+void BacnetPcapReplayTransportLayer::setNetworkLayer(BacnetNetworkLayerHandler *networkHndlr)
+{
+    _bvllHndlr->setNetworkLayer(networkHndlr);
+}
+
+void BacnetPcapReplayTransportLayer::sendNpdu(Buffer *buffToSend, Bacnet::NetworkPriority prio,
+                                              const BacnetAddress *destAddress, const BacnetAddress *srcAddress)
+{
+    _bvllHndlr->sendNpdu(buffToSend, prio, destAddress, srcAddress);
+}
+
+void BacnetPcapReplayTransportLayer::datagramSent(const quint8 *data, quint16 length, const QHostAddress &destAddr, quint16 destPort)
+{
+    ++_repliesCount;
+    if (_repliesWriter.isOpen()) {
+        qint64 timestamp_us = _totalClock.isValid() ? (_totalClock.nsecsElapsed() / 1000) : 0;
+        if (!_datagrams.isEmpty())
+            timestamp_us += _datagrams.first().timestamp_us;
+        _repliesWriter.writeUdp(timestamp_us, _transportHndlr->address().toIPv4Address(), _transportHndlr->port(),
+                                destAddr.toIPv4Address(), destPort, data, length);
+    }
+}
+
+BacnetUdpTransportLayerHandler *BacnetPcapReplayTransportLayer::transportLayer()
+{
+    return _transportHndlr;
+}
+
+quint64 BacnetPcapReplayTransportLayer::replayedCount()
+{
+    return _replayedCount;
+}
+
+quint64 BacnetPcapReplayTransportLayer::repliesCount()
+{
+    return _repliesCount;
+}
+
+void BacnetPcapReplayTransportLayer::replayDatagram_hlpr(BacnetPcapReader::UdpDatagram &datagram)
+{
+    //what we sent in the capture is not replayed
+    if ( (datagram.srcIpAddress == _transportHndlr->address().toIPv4Address()) && (datagram.srcPort == _transportHndlr->port()) )
+        return;
+
+    quint16 length = datagram.payload.size();
+    QHostAddress srcAddr(datagram.srcIpAddress);
+    QElapsedTimer processingClock;
+
+    //copy into pooled buffer, as if it was read from the socket
+    Buffer frame = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::TransportLayerRx);
+    processingClock.start();
+    if (frame.isValid() && (frame.bodyLength() >= length)) {
+        memcpy(frame.bodyPtr(), datagram.payload.constData(), length);
+        frame.setBodyLength(length);
+        _transportHndlr->injectDatagram(frame.bodyPtr(), length, srcAddr, datagram.srcPort, &frame);
+    } else {
+        _transportHndlr->injectDatagram((quint8*)datagram.payload.data(), length, srcAddr, datagram.srcPort, 0);
+    }
+    qint64 processing_ns = processingClock.nsecsElapsed();
+
+    ++_replayedCount;
+    _processingTotal_ns += processing_ns;
+    if (processing_ns > _processingMax_ns)
+        _processingMax_ns = processing_ns;
+}
+
+void BacnetPcapReplayTransportLayer::timerEvent(QTimerEvent *event)
+{
+    if (event->timerId() != _timer.timerId()) {
+        QObject::timerEvent(event);
+        return;
+    }
+
+    if (!_started) {
+        //start delay elapsed
+        _started = true;
+        _nextIdx = 0;
+        _repeatsDone = 0;
+        _replayClock.start();
+        _totalClock.start();
+        _timer.start((0 == _speed) ? 0 : TimedReplayInterval_ms, this);
+        qDebug("%s : replay of %d datagrams started.", __PRETTY_FUNCTION__, _datagrams.count());
+    }
+
+    if (0 == _speed) {
+        //as fast as we can, but still let the event loop run (timers of upper layers) from time to time
+        for (int i = 0; (i < MaxRateChunkSize) && (_nextIdx < _datagrams.count()); ++i, ++_nextIdx)
+            replayDatagram_hlpr(_datagrams[_nextIdx]);
+    } else if (!_datagrams.isEmpty()) {
+        qint64 firstTimestamp_us = _datagrams.first().timestamp_us;
+        qint64 replayTime_us = (qint64)((_replayClock.nsecsElapsed() / 1000) * _speed);
+        while ( (_nextIdx < _datagrams.count()) && (_datagrams.at(_nextIdx).timestamp_us - firstTimestamp_us <= replayTime_us) ) {
+            replayDatagram_hlpr(_datagrams[_nextIdx]);
+            ++_nextIdx;
+        }
+    }
+
+    if (_nextIdx >= _datagrams.count()) {
+        if (++_repeatsDone < _repeatCount) {
+            _nextIdx = 0;
+            _replayClock.restart();
+        } else {
+            finish_hlpr();
+        }
+    }
+}
+
+void BacnetPcapReplayTransportLayer::finish_hlpr()
+{
+    _timer.stop();
+    qint64 total_ms = _totalClock.elapsed();
+    qDebug("Replay finished: %llu datagrams replayed, %llu sent by the stack, in %lld ms (%.1f datagrams/s).",
+           _replayedCount, _repliesCount, total_ms, (0 == total_ms) ? 0.0 : (1000.0 * _replayedCount / total_ms));
+    qDebug("Processing time per datagram: average %.1f us, max %.1f us.",
+           (0 == _replayedCount) ? 0.0 : (_processingTotal_ns / 1000.0 / _replayedCount), _processingMax_ns / 1000.0);
+
+    _repliesWriter.close();
+    emit finished();
+    if (_quitWhenFinished)
+        QMetaObject::invokeMethod(QCoreApplication::instance(), "quit", Qt::QueuedConnection);
+}
@@ -0,0 +1,104 @@
+#ifndef BACNETPCAPREPLAYTRANSPORTLAYER_H
+#define BACNETPCAPREPLAYTRANSPORTLAYER_H
+
+#include <QObject>
+#include <QBasicTimer>
+#include <QElapsedTimer>
+
+#include "bacnettransportlayer.h"
+#include "bacnetudptransportlayer.h"
+#include "bacnetpcapfile.h"
+
+class BacnetBvllHandler;
+
+/**
+  Transport layer, that doesn't talk to the network, but replays BACnet/IP traffic from a capture file (\sa BacnetPcapReader).
+  Datagrams are given to the whole stack (BVLL and up) the same way as the ones read from the socket, so it may be used
+  for repeatable throughput/latency benchmarks without a live network:
+  - with original timing (speed 1), N times faster (speed N) or as fast as possible (speed 0);
+  - datagrams sent by us in the capture (source equal to our address) are not replayed - they are what we are expected to answer;
+  - whatever the stack sends back is counted and optionally written to a pcap file.
+  When the replay is done, statistics are printed and \sa finished() is emitted.
+
+  Configured as a port of the transport layer, e.g.:
+  <port port-id="1" type="pcap-replay" address="192.168.1.10:47808" file="traffic.pcapng" speed="max" repeat="10" replies-file="replies.pcap" quit-when-done="true"/>
+  */
+class BacnetPcapReplayTransportLayer :
+        public QObject,
+        public BacnetTransportLayerHandler,
+        public BacnetUdpDatagramSink
+{
+    Q_OBJECT
+public:
+    BacnetPcapReplayTransportLayer(QObject *parent = 0);
+    virtual ~BacnetPcapReplayTransportLayer();
+
+    //! Reads the capture. Only datagrams to/from our port are taken, so \sa setAddress() has to be called first.
+    bool loadCapture(const QString &fileName);
+    //! Our address - frames from it are not replayed (they are the replies, which were captured).
+    void setAddress(const QHostAddress &address, quint16 port);
+    //! Replay speed: 1 - original timing, N - N times faster, 0 - as fast as possible.
+    void setSpeed(double speed);
+    //! How many times the capture is replayed.
+    void setRepeatCount(int count);
+    //! If set, all the sent datagrams are written there.
+    bool setRepliesFile(const QString &fileName);
+    //! If set, application quits when replay is done.
+    void setQuitWhenFinished(bool quit);
+
+    //! Starts the replay after delay_ms (lets the rest of the stack to be configured and do its startup traffic).
+    void start(int delay_ms);
+
+    virtual void setNetworkLayer(BacnetNetworkLayerHandler *networkHndlr);
+    virtual void sendNpdu(Buffer *buffToSend, Bacnet::NetworkPriority prio = Bacnet::PriorityNormal,
+                          const BacnetAddress *destAddress = 0, const BacnetAddress *srcAddress = 0);
+
+    //! Implementation of BacnetUdpDatagramSink - counts (and writes) the replies.
+    virtual void datagramSent(const quint8 *data, quint16 length, const QHostAddress &destAddr, quint16 destPort);
+
+    BacnetUdpTransportLayerHandler *transportLayer();
+
+    //statistics
+    quint64 replayedCount();
+    quint64 repliesCount();
+
+signals:
+    void finished();
+
+protected:
+    void timerEvent(QTimerEvent *);
+
+private:
+    //! Passes datagram to the stack and measures how long it took.
+    void replayDatagram_hlpr(BacnetPcapReader::UdpDatagram &datagram);
+    void finish_hlpr();
+
+private:
+    static const int MaxRateChunkSize = 256;
+    static const int TimedReplayInterval_ms = 1;
+
+    BacnetUdpTransportLayerHandler *_transportHndlr;
+    BacnetBvllHandler *_bvllHndlr;
+
+    QVector<BacnetPcapReader::UdpDatagram> _datagrams;
+    int _nextIdx;
+    int _repeatCount;
+    int _repeatsDone;
+    double _speed;
+    bool _quitWhenFinished;
+    BacnetPcapWriter _repliesWriter;
+
+    QBasicTimer _timer;
+    bool _started;
+    //! Runs since the current repeat started.
+    QElapsedTimer _replayClock;
+    //! Runs since the whole replay started.
+    QElapsedTimer _totalClock;
+
+    quint64 _replayedCount;
+    quint64 _repliesCount;
+    qint64 _processingTotal_ns;
+    qint64 _processingMax_ns;
+};
+
+#endif // BACNETPCAPREPLAYTRANSPORTLAYER_H
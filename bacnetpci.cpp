@@ -112,6 +112,30 @@ qint16 BacnetConfirmedRequestData::toRaw(quint8 *buffer, quint16 length)
     return (actualPtr - buffer);
 }
 
+quint16 BacnetConfirmedRequestData::maxApduLength(MaxLengthAccepted maxLength)
+{
+    switch (maxLength)
+    {
+    case (Length_UptToMinimumMessageSize):  return 50;
+    case (Length_128Octets):                return 128;
+    case (Length_206Octets):                return 206;
+    case (Length_480Octets):                return 480;
+    case (Length_1024Octets):               return 1024;
+    case (Length_1476Octets):               return 1476;
+    default:
+        //reserved values - be on the safe side
+        return 50;
+    }
+}
+
+int BacnetConfirmedRequestData::maxSegmentsCount(MaxSegmentsAccepted maxSegments)
+{
+    if ( (Segments_Unspecified == maxSegments) || (Segments_More64Segs == maxSegments) )
+        return 0;
+    //B'001' is two segments, B'010' - four and so on
+    return (1 << maxSegments);
+}
+
 qint16 BacnetUnconfirmedRequestData::fromRaw(quint8 *dataPtr, quint16 length)
 {
     Q_ASSERT(length >= 1);
@@ -270,6 +294,15 @@ qint16 BacnetComplexAckData::toRaw(quint8 *buffer, quint16 length)
     return (actualPtr - buffer);
 }
 
+BacnetSegmentedAckData::BacnetSegmentedAckData(quint8 origInvokeId, quint8 sequenceNumber, quint8 actualWindowSize, Acknowledgment negativeAck, bool sentByServer):
+    _negativeAck(negativeAck),
+    _sentByServer(sentByServer),
+    _origInvokeId(origInvokeId),
+    _seqNum(sequenceNumber),
+    _actualWindSize(actualWindowSize)
+{
+}
+
 qint16 BacnetSegmentedAckData::fromRaw(quint8 *dataPtr, quint16 length)
 {
     Q_ASSERT(length == 4);
@@ -286,6 +319,7 @@ qint16 BacnetSegmentedAckData::fromRaw(quint8 *dataPtr, quint16 length)
     _seqNum = *ptr;
     ++ptr;
     _actualWindSize = *ptr;
+    ++ptr;
 
     return (ptr - dataPtr);
 }
@@ -297,18 +331,19 @@ quint8 BacnetSegmentedAckData::pduType()
 
 qint16 BacnetSegmentedAckData::toRaw(quint8 *buffer, quint16 length)
 {
-    Q_ASSERT(length == 4);
-    if (length != 4)
-        return BacnetPci::InappropriateBufferSize;
+    Q_ASSERT(length >= 4);
+    if (length < 4)
+        return BacnetPci::BufferTooSmall;
 
-    _negativeAck = (Acknowledgment)(*buffer & BitFields::Bit1);
-    _sentByServer = *buffer & BitFields::Bit0;
+    *buffer = ( (0x0f & BacnetPci::TypeSemgmendAck) << 4 ) | _negativeAck;
+    if (_sentByServer)
+        *buffer |= BitFields::Bit0;
     ++buffer;
-    _origInvokeId = *buffer;
+    *buffer = _origInvokeId;
     ++buffer;
-    _seqNum = *buffer;
+    *buffer = _seqNum;
     ++buffer;
-    _actualWindSize = *buffer;
+    *buffer = _actualWindSize;
 
     return 4;
 }
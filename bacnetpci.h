@@ -43,15 +43,16 @@ class BacnetConfirmedRequestData:
         public BacnetPciData
 {
 public:
+    //! Encoded on three bits (B'000' - B'111').
     enum MaxSegmentsAccepted {
-        Segments_Unspecified     = 0x000,
-        Segments_TwoSegments     = 0x001,
-        Segments_FourSemgnets    = 0x010,
-        Segments_EightSegments   = 0x011,
-        Segments_SixteenSegs     = 0x100,
-        Segments_ThirtyTwoSegs   = 0x101,
-        Segments_SixtyFourSegs   = 0x110,
-        Segments_More64Segs      = 0x111
+        Segments_Unspecified     = 0x00,
+        Segments_TwoSegments     = 0x01,
+        Segments_FourSemgnets    = 0x02,
+        Segments_EightSegments   = 0x03,
+        Segments_SixteenSegs     = 0x04,
+        Segments_ThirtyTwoSegs   = 0x05,
+        Segments_SixtyFourSegs   = 0x06,
+        Segments_More64Segs      = 0x07
     };
 
     enum MaxLengthAccepted {
@@ -75,6 +76,20 @@ public:
     inline quint8 invokedId() {return _invokeId;}
 
     inline bool isSegmented() {return _segmented;}
+    inline bool moreFollows() {return _moreFollows;}
+    inline bool segmentedResponseAccepted() {return _segmentedRespAccepted;}
+    inline quint8 sequenceNumber() {return _sequenceNum;}
+    inline quint8 proposedWindowSize() {return _propWindowSize;}
+    inline MaxSegmentsAccepted maxSegmentsAccepted() {return _maxSegments;}
+    inline MaxLengthAccepted maxLengthAccepted() {return _maxResponses;}
+
+    //! Returns number of octets the requester accepts in a single APDU.
+    static quint16 maxApduLength(MaxLengthAccepted maxLength);
+    //! Returns number of segments the requester accepts, or 0 if it's unspecified or greater than 64 (no limit known).
+    static int maxSegmentsCount(MaxSegmentsAccepted maxSegments);
+
+    //! Length of the header, when segmented flag is set.
+    static const int SegmentedHeaderLength = 6;
 
 public://overridden from BacnetPciData
     virtual quint8 pduType();
@@ -139,6 +154,13 @@ public:
     qint16 fromRaw(quint8 *dataPtr, quint16 length);
     inline quint8 invokeId() {return _origInvokeId;}
     inline bool isSegmented() {return _segmented;}
+    inline bool moreFollows() {return _moreFollows;}
+    inline quint8 sequenceNumber() {return _seqNum;}
+    inline quint8 proposedWindowSize() {return _propWindSize;}
+    inline quint8 serviceAckChoice() {return _serviceAckChoice;}
+
+    //! Length of the header, when segmented flag is set.
+    static const int SegmentedHeaderLength = 5;
 
 public://overridden from BacnetPciData
     virtual quint8 pduType();
@@ -157,19 +179,25 @@ class BacnetSegmentedAckData:
         public BacnetPciData
 {
 public:
+    enum Acknowledgment {
+        SegmentOk = 0x00,
+        SegmentOutOfOrder = BitFields::Bit1
+    };
+
     BacnetSegmentedAckData() {}
+    BacnetSegmentedAckData(quint8 origInvokeId, quint8 sequenceNumber, quint8 actualWindowSize, Acknowledgment negativeAck, bool sentByServer);
     qint16 fromRaw(quint8 *dataPtr, quint16 length);
     inline quint8 invokeId() {return _origInvokeId;}
+    inline bool isNegative() {return (SegmentOutOfOrder == _negativeAck);}
+    inline bool isSentByServer() {return _sentByServer;}
+    //! Sequence number of the last segment received in order.
+    inline quint8 sequenceNumber() {return _seqNum;}
+    inline quint8 actualWindowSize() {return _actualWindSize;}
 
 public://overridden from BacnetPciData
     virtual quint8 pduType();
     virtual qint16 toRaw(quint8 *buffer, quint16 length);
 
-    enum Acknowledgment {
-        SegmentOk = 0x00,
-        SegmentOutOfOrder = BitFields::Bit1
-    };
-
 private:
     Acknowledgment _negativeAck;
     bool _sentByServer;
@@ -226,6 +254,7 @@ public:
     BacnetAbortData(quint8 originalInvokeId, quint8 abortReason, bool fromServer);
     qint16 fromRaw(quint8 *dataPtr, quint16 length);
     inline quint8 invokeId() {return _origInvokeId;}
+    inline bool isSentByServer() {return _sentByServer;}
 
 public://overridden from BacnetPciData
     virtual quint8 pduType();
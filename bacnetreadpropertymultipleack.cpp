@@ -0,0 +1,209 @@
+#include "bacnetreadpropertymultipleack.h"
+
+#include <QtCore>
+
+#include "bacnetcoder.h"
+#include "bacnettagparser.h"
+
+using namespace Bacnet;
+
+BacnetReadPropertyMultipleAck::ReadResult::ReadResult():
+    errorClass(BacnetErrorNS::ClassServices),
+    errorCode(BacnetErrorNS::CodeOther)
+{
+}
+
+BacnetReadPropertyMultipleAck::ReadResult::ReadResult(const ReadPropertyServiceData &reference, BacnetDataInterfaceShared data):
+    reference(reference),
+    data(data),
+    errorClass(BacnetErrorNS::ClassServices),
+    errorCode(BacnetErrorNS::CodeOther)
+{
+}
+
+BacnetReadPropertyMultipleAck::ReadResult::ReadResult(const ReadPropertyServiceData &reference, BacnetErrorNS::ErrorClass errorClass, BacnetErrorNS::ErrorCode errorCode):
+    reference(reference),
+    errorClass(errorClass),
+    errorCode(errorCode)
+{
+}
+
+BacnetReadPropertyMultipleAck::BacnetReadPropertyMultipleAck()
+{
+}
+
+qint32 BacnetReadPropertyMultipleAck::toRaw(quint8 *startPtr, quint16 buffLength)
+{
+    Q_CHECK_PTR(startPtr);
+    Q_ASSERT(!results.isEmpty());
+    quint8 *actualPtr(startPtr);
+    quint16 leftLength(buffLength);
+    qint32 ret;
+
+    for (int i = 0; i < results.count(); ++i) {
+        ReadResult &result = results[i];
+        bool objectStarts = (0 == i) || (objIdToNum(results.at(i - 1).reference.objId) != objIdToNum(result.reference.objId));
+
+        if (objectStarts) {
+            //close previous object's list of results
+            if (0 != i) {
+                ret = BacnetCoder::closingTagToRaw(actualPtr, leftLength, 1);
+                if (ret <= 0)
+                    return -1;
+                actualPtr += ret;
+                leftLength -= ret;
+            }
+
+            ret = BacnetCoder::objectIdentifierToRaw(actualPtr, leftLength, result.reference.objId, true, 0);
+            if (ret <= 0)
+                return -1;
+            actualPtr += ret;
+            leftLength -= ret;
+
+            ret = BacnetCoder::openingTagToRaw(actualPtr, leftLength, 1);
+            if (ret <= 0)
+                return -1;
+            actualPtr += ret;
+            leftLength -= ret;
+        }
+
+        ret = BacnetCoder::uintToRaw(actualPtr, leftLength, result.reference.propertyId, true, 2);
+        if (ret <= 0)
+            return -1;
+        actualPtr += ret;
+        leftLength -= ret;
+
+        if (ArrayIndexNotPresent != result.reference.arrayIndex) {
+            ret = BacnetCoder::uintToRaw(actualPtr, leftLength, result.reference.arrayIndex, true, 3);
+            if (ret <= 0)
+                return -1;
+            actualPtr += ret;
+            leftLength -= ret;
+        }
+
+        //either value (tagged 4) or error (tagged 5)
+        quint8 resultTag = result.hasError() ? 5 : 4;
+        ret = BacnetCoder::openingTagToRaw(actualPtr, leftLength, resultTag);
+        if (ret <= 0)
+            return -1;
+        actualPtr += ret;
+        leftLength -= ret;
+
+        if (result.hasError()) {
+            ret = BacnetCoder::uintToRaw(actualPtr, leftLength, result.errorClass, false, AppTags::Enumerated);
+            if (ret <= 0)
+                return -1;
+            actualPtr += ret;
+            leftLength -= ret;
+            ret = BacnetCoder::uintToRaw(actualPtr, leftLength, result.errorCode, false, AppTags::Enumerated);
+        } else
+            ret = result.data->toRaw(actualPtr, leftLength);
+        if (ret < 0) {
+            qDebug("%s : cannot encode result of property %d : %d", __PRETTY_FUNCTION__, result.reference.propertyId, ret);
+            return -1;
+        }
+        actualPtr += ret;
+        leftLength -= ret;
+
+        ret = BacnetCoder::closingTagToRaw(actualPtr, leftLength, resultTag);
+        if (ret <= 0)
+            return -1;
+        actualPtr += ret;
+        leftLength -= ret;
+    }
+
+    ret = BacnetCoder::closingTagToRaw(actualPtr, leftLength, 1);
+    if (ret <= 0)
+        return -1;
+    actualPtr += ret;
+
+    return actualPtr - startPtr;
+}
+
+qint32 BacnetReadPropertyMultipleAck::fromRaw(quint8 *startPtr, quint16 buffLength)
+{
+    BacnetTagParser bParser(startPtr, buffLength);
+
+    qint16 ret;
+    qint32 consumedBytes(0);
+    bool convOkOrCtxt;
+
+    results.clear();
+    while (bParser.hasNext()) {
+        ReadPropertyServiceData reference;
+
+        //parse object identifier
+        ret = bParser.parseNext();
+        reference.objId = bParser.toObjectId(&convOkOrCtxt);
+        if (ret < 0 || !bParser.isContextTag(0))
+            return -1;
+        consumedBytes += ret;
+
+        ret = bParser.parseNext();
+        if (ret < 0 || !bParser.isOpeningTag(1))
+            return -2;
+        consumedBytes += ret;
+
+        //results, until the list is closed
+        while (2 == bParser.nextTagNumber(&convOkOrCtxt)) {
+            ret = bParser.parseNext();
+            reference.propertyId = (BacnetPropertyNS::Identifier)bParser.toUInt(&convOkOrCtxt);
+            if (ret < 0 || !convOkOrCtxt)
+                return -3;
+            consumedBytes += ret;
+
+            //parse OPTIONAL array index
+            ret = bParser.nextTagNumber(&convOkOrCtxt);
+            if (3 == ret && convOkOrCtxt) {
+                ret = bParser.parseNext();
+                reference.arrayIndex = bParser.toUInt(&convOkOrCtxt);
+                if ( (ret < 0) || !convOkOrCtxt)
+                    return -4;
+                consumedBytes += ret;
+            } else {
+                reference.arrayIndex = ArrayIndexNotPresent;
+            }
+
+            ret = bParser.nextTagNumber(&convOkOrCtxt);
+            if (4 == ret) {
+                BacnetDataInterfaceShared data;
+                ret = BacnetTagParser::parseStructuredData(bParser, reference.objId.objectType, reference.propertyId,
+                                                           reference.arrayIndex, 4, data);
+                if (ret <= 0)
+                    return -5;
+                consumedBytes += ret;
+                results.append(ReadResult(reference, data));
+            } else if (5 == ret) {
+                ret = bParser.parseNext();
+                if (ret < 0 || !bParser.isOpeningTag(5))
+                    return -6;
+                consumedBytes += ret;
+
+                ret = bParser.parseNext();
+                BacnetErrorNS::ErrorClass errorClass = (BacnetErrorNS::ErrorClass)bParser.toEumerated(&convOkOrCtxt);
+                if ( (ret <= 0) || !convOkOrCtxt)
+                    return -6;
+                consumedBytes += ret;
+                ret = bParser.parseNext();
+                BacnetErrorNS::ErrorCode errorCode = (BacnetErrorNS::ErrorCode)bParser.toEumerated(&convOkOrCtxt);
+                if ( (ret <= 0) || !convOkOrCtxt)
+                    return -6;
+                consumedBytes += ret;
+
+                ret = bParser.parseNext();
+                if (ret < 0 || !bParser.isClosingTag(5))
+                    return -6;
+                consumedBytes += ret;
+                results.append(ReadResult(reference, errorClass, errorCode));
+            } else
+                return -7;
+        }
+
+        ret = bParser.parseNext();
+        if (ret < 0 || !bParser.isClosingTag(1))
+            return -8;
+        consumedBytes += ret;
+    }
+
+    return consumedBytes;
+}
@@ -0,0 +1,52 @@
+#ifndef BACNETREADPROPERTYMULTIPLEACK_H
+#define BACNETREADPROPERTYMULTIPLEACK_H
+
+#include "bacnetcommon.h"
+#include "bacnetservicedata.h"
+#include "readpropertyservicedata.h"
+#include "bacnetdata.h"
+
+namespace Bacnet {
+
+    /**
+      ReadPropertyMultiple ack data. Like the request (\sa ReadPropertyMultipleServiceData) results are kept flat - consecutive
+      results of the same object are encoded as one ReadAccessResult.
+      */
+    class BacnetReadPropertyMultipleAck:
+            public BacnetServiceData
+    {
+    public:
+        //! Value of the property read or - when data is null - the error it was read with.
+        class ReadResult
+        {
+        public:
+            ReadResult();
+            ReadResult(const ReadPropertyServiceData &reference, BacnetDataInterfaceShared data);
+            ReadResult(const ReadPropertyServiceData &reference, BacnetErrorNS::ErrorClass errorClass, BacnetErrorNS::ErrorCode errorCode);
+
+            inline bool hasError() const {return data.isNull();}
+
+        public:
+            ReadPropertyServiceData reference;
+            BacnetDataInterfaceShared data;
+            BacnetErrorNS::ErrorClass errorClass;
+            BacnetErrorNS::ErrorCode errorCode;
+        };
+
+    public:
+        BacnetReadPropertyMultipleAck();
+
+    public://overridden BacnetServiceData methods.
+        /**
+          \note When parsing fails, results parsed until then are left in the list - they are valid and may be used.
+          */
+        virtual qint32 fromRaw(quint8 *serviceData, quint16 bufferLength);
+        virtual qint32 toRaw(quint8 *startPtr, quint16 bufferLength);
+
+    public:
+        QList<ReadResult> results;
+    };
+
+}
+
+#endif // BACNETREADPROPERTYMULTIPLEACK_H
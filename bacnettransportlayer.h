@@ -24,6 +24,12 @@ public:
       */
     virtual void sendNpdu(Buffer *buffToSend, Bacnet::NetworkPriority prio = Bacnet::PriorityNormal,
                           const BacnetAddress *destAddress = 0, const BacnetAddress *srcAddress = 0) = 0;
+
+    /**
+      Returns how full port queues (receive and transmit) are, in percents. Used by network layer to detect congestion - \sa BacnetNetworkLayerHandler
+      announces itself busy for the networks behind the port. Ports without queues are never loaded.
+      */
+    virtual int loadPercent() {return 0;}
 };
 
 #endif // BACNETTRANSPORTLAYER_H
@@ -17,12 +17,23 @@ BacnetTSM2::BacnetTSM2(BacnetApplicationLayerHandler *appLayer, BacnetNetworkLay
     _appLayer(appLayer),
     _requestTimeout_ms(DefaultTimeout_ms),
     _requestRetriesCount(DefaultRetryCount),
-    _timerInterval_ms(DefaultTimerInterval_ms),
+    _maxPeerWindow(DefaultMaxPeerWindow),
+    _maxOutstandingRequests(DefaultMaxOutstandingRequests),
+    _maxPeerQueueLength(DefaultMaxPeerQueueLength),
+    _outstandingCount(0),
+    _segmentTimeout_ms(DefaultSegmentTimeout_ms),
     _netHandler(netLayer)
 {
     Q_CHECK_PTR(_appLayer);
     Q_CHECK_PTR(_netHandler);
-    _timer.start(_timerInterval_ms, this);
+    _clock.start();
+}
+
+BacnetTSM2::~BacnetTSM2()
+{
+    qDeleteAll(_outgoingSegmentations);
+    qDeleteAll(_incomingSegmentations);
+    qDeleteAll(_peerTransactions);
 }
 
 void BacnetTSM2::setAddress(InternalAddress &address)
@@ -35,50 +46,227 @@ InternalAddress &BacnetTSM2::myAddress()
     return _myRequestAddress;
 }
 
+void BacnetTSM2::setMaxPeerWindow(int window)
+{
+    _maxPeerWindow = qBound(1, window, 255);
+    //peers grown over the new limit get it at once, the others grow up to it
+    foreach (PeerTransactions *peer, _peerTransactions) {
+        if (peer->window > _maxPeerWindow)
+            peer->window = _maxPeerWindow;
+    }
+}
+
+void BacnetTSM2::setMaxOutstandingRequests(int count)
+{
+    _maxOutstandingRequests = qMax(1, count);
+    dispatchQueued_hlpr();
+}
+
+void BacnetTSM2::setMaxPeerQueueLength(int length)
+{
+    //requests queued already stay there - only new ones are refused
+    _maxPeerQueueLength = qMax(1, length);
+}
+
+Buffer BacnetTSM2::serviceDataBuffer_hlpr()
+{
+    /* Service data is encoded into the segmentation buffer and - when it fits into one APDU - sent from there, with no copying.
+       Big buffer is held till the frame is gone then; when the pool runs out, the large one is taken instead. */
+    Buffer buffer = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::ApplicationLayer, BacnetBufferManager::SegmentedApduMaxSize);
+    if (!buffer.isValid()) {
+        qDebug("%s : no segmentation buffer left, service data has to fit into one frame.", __PRETTY_FUNCTION__);
+        buffer = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::ApplicationLayer);
+    }
+    //leave room for APCI - when the data fits into one APDU, the buffer is sent as it is
+    if (buffer.isValid())
+        buffer.trimFront(BacnetBufferManager::ApciHeadroom);
+    return buffer;
+}
+
 bool BacnetTSM2::send_hlpr(const BacnetAddress &destination, BacnetAddress &sourceAddress, ExternalConfirmedServiceHandler *serviceToSend, quint8 invokeId)
 {
-    //get buffer
-    Buffer buffer = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::ApplicationLayer);
-    //write to buffer
-    Q_ASSERT(buffer.isValid());
-    quint8 *buffStart = buffer.bodyPtr();
-    quint16 buffLength = buffer.bodyLength();
+    //if it's a retry of segmented request, it's started over
+    dropSegmentations_hlpr(destination, invokeId, false);
+
+    //armed before anything may fail - then it's retried, when the timer expires
+    ConfirmedRequestEntry *entry = confirmedEntry_hlpr(destination, invokeId);
+    Q_CHECK_PTR(entry);
+    if (0 != entry) {
+        TimingWheel::instance()->restart(entry->timer, _peerTransactions.value(destination)->timeout(_requestTimeout_ms), entry);
+        //only the answer to the request sent once tells the round trip time
+        entry->sentAt_ms = (_requestRetriesCount == entry->retriesLeft) ? _clock.elapsed() : -1;
+    }
 
-    BacnetConfirmedRequestData reqData(BacnetConfirmedRequestData::Length_206Octets/*BacnetConfirmedRequestData::Length_1476Octets*/, invokeId, serviceToSend->serviceChoice());
-    qint32 ret = reqData.toRaw(buffStart, buffLength);
+    //service data goes first - only then we know, if it fits into one APDU
+    Buffer buffer = serviceDataBuffer_hlpr();
+    Q_ASSERT(buffer.isValid());
+    if (!buffer.isValid())
+        return false;
+    qint32 ret = serviceToSend->toRaw(buffer.bodyPtr(), buffer.bodyLength());
     Q_ASSERT(ret > 0);
     if (ret <= 0) {
-        qDebug("BacnetTSM2::send() : couldn't write to buffer (pci), %d.", ret);
+        qDebug("BacnetTSM2::send() : couldn't write to buffer, %d.", ret);
         return false;
     }
-    buffStart += ret;
-    buffLength -= ret;
-    ret = serviceToSend->toRaw(buffStart, buffLength);
+    quint16 serviceLength = ret;
+
+    quint8 pci[BacnetConfirmedRequestData::SegmentedHeaderLength];
+    BacnetConfirmedRequestData reqData(false, false, true, AcceptedSegments, AcceptedLength, invokeId, serviceToSend->serviceChoice());
+    ret = reqData.toRaw(pci, sizeof(pci));
     Q_ASSERT(ret > 0);
     if (ret <= 0) {
-        qDebug("BacnetTSM2::send() : couldn't write to buffer, %d.", ret);
+        qDebug("BacnetTSM2::send() : couldn't write to buffer (pci), %d.", ret);
         return false;
     }
-    buffStart += ret;
-    buffer.setBodyLength(buffStart - buffer.bodyPtr());
+
+    if (ret + serviceLength > ApduMaxSize) {
+        OutgoingSegmentation *segmentation = new OutgoingSegmentation(this, buffer, serviceLength, ApduMaxSize - BacnetConfirmedRequestData::SegmentedHeaderLength,
+                                                                      destination, sourceAddress, invokeId, serviceToSend->serviceChoice(), false);
+        //segment timers guard the transaction until all the segments are acknowledged
+        if (0 != entry) {
+            TimingWheel::instance()->cancel(entry->timer);
+            entry->timer = TimingWheel::InvalidTimerId;
+            entry->sentAt_ms = -1;
+        }
+        startSegmentation_hlpr(segmentation);
+        return true;
+    }
+
+    //service data stays where it was encoded, only PCI is put in front of it
+    buffer.setBodyLength(serviceLength);
+    memcpy(buffer.prepend(ret), pci, ret);
 
     HelperCoder::printArray(buffer.bodyPtr(), buffer.bodyLength(), "Request to be sent: ");
 
     _netHandler->sendApdu(&buffer, true, &destination, &sourceAddress);
-    Q_ASSERT(_confiremedEntriesList.contains(invokeId));
     return true;
 }
 
 bool BacnetTSM2::send(const BacnetAddress &destination, BacnetAddress &sourceAddress, ExternalConfirmedServiceHandler *serviceToSend)
+{
+    PeerTransactions *peer = peer_hlpr(destination);
+    //the ones queued before go first
+    if (peer->queued.isEmpty() && hasRoom_hlpr(peer))
+        return sendNow_hlpr(peer, serviceToSend, sourceAddress);
+
+    if (peer->queued.count() >= _maxPeerQueueLength) {
+        qDebug("%s : queue of the peer is full (%d requests), request refused.", __PRETTY_FUNCTION__, peer->queued.count());
+        return false;
+    }
+
+    //it waits no longer, than it would be retried, if sent now
+    QueuedRequest request;
+    request.handler = serviceToSend;
+    request.src = sourceAddress;
+    request.deadline_ms = _clock.elapsed() + (qint64)peer->timeout(_requestTimeout_ms) * _requestRetriesCount;
+    peer->queued.enqueue(request);
+    armQueueTimer_hlpr(peer, request.deadline_ms);
+    makeReady_hlpr(peer);
+    dispatchQueued_hlpr();
+    return true;
+}
+
+bool BacnetTSM2::sendNow_hlpr(PeerTransactions *peer, ExternalConfirmedServiceHandler *handler, BacnetAddress &source)
 {
     //generate invoke id.
-    int invokeId = queueConfirmedRequest(serviceToSend, destination, sourceAddress);
+    int invokeId = queueConfirmedRequest(handler, peer->address, source);
     if (invokeId < 0) {//can't generate
         qDebug("BacnetTSM2::send() : can't generate invoke id. Think about introducing another requesting object.");
         return false;
     }
 
-    return send_hlpr(destination, sourceAddress, serviceToSend, invokeId);
+    if (send_hlpr(peer->address, source, handler, invokeId))
+        return true;
+
+    //the request is over before it started - its timer mustn't retry it, since the caller completes the handler now
+    ConfirmedRequestEntry *entry = peer->entries.take(invokeId);
+    Q_CHECK_PTR(entry);
+    peer->generator.returnId(invokeId);
+    dropSegmentations_hlpr(peer->address, invokeId, false);
+    delete entry;//cancels the timer
+    requestDone_hlpr(peer, false);
+    return false;
+}
+
+bool BacnetTSM2::hasRoom_hlpr(PeerTransactions *peer)
+{
+    return (peer->entries.count() < peer->window) && (_outstandingCount < _maxOutstandingRequests);
+}
+
+void BacnetTSM2::makeReady_hlpr(PeerTransactions *peer)
+{
+    if (peer->ready || peer->queued.isEmpty() || (peer->entries.count() >= peer->window))
+        return;
+    peer->ready = true;
+    _readyPeers.append(peer);
+}
+
+void BacnetTSM2::dispatchQueued_hlpr()
+{
+    while (!_readyPeers.isEmpty() && (_outstandingCount < _maxOutstandingRequests)) {
+        PeerTransactions *peer = _readyPeers.takeFirst();
+        peer->ready = false;
+        if (!hasRoom_hlpr(peer) || peer->queued.isEmpty())
+            continue;
+
+        QueuedRequest request = peer->queued.dequeue();
+        if (!sendNow_hlpr(peer, request.handler, request.src)) {
+            //nobody waits for the return value anymore - the request is over
+            _appLayer->processTimeout(peer->address, request.src, request.handler);
+        }
+        //one request per turn - then the peer goes to the end of the line
+        makeReady_hlpr(peer);
+    }
+}
+
+void BacnetTSM2::requestDone_hlpr(PeerTransactions *peer, bool answered)
+{
+    --_outstandingCount;
+    Q_ASSERT(_outstandingCount >= 0);
+    if (answered && (peer->window < _maxPeerWindow)) {
+        ++(peer->answeredInWindow);
+        if (peer->answeredInWindow >= peer->window) {
+            ++(peer->window);
+            peer->answeredInWindow = 0;
+        }
+    }
+    makeReady_hlpr(peer);
+    dispatchQueued_hlpr();
+}
+
+void BacnetTSM2::armQueueTimer_hlpr(PeerTransactions *peer, qint64 deadline_ms)
+{
+    if ( (TimingWheel::InvalidTimerId != peer->queueTimer) && (peer->queueTimerDeadline_ms <= deadline_ms) )
+        return;
+    peer->queueTimerDeadline_ms = deadline_ms;
+    TimingWheel::instance()->restart(peer->queueTimer, qMax((qint64)1, deadline_ms - _clock.elapsed()), peer);
+}
+
+void BacnetTSM2::expireQueued_hlpr(PeerTransactions *peer)
+{
+    //queue is short (\sa _maxPeerQueueLength) and deadlines aren't ordered - peer's timeout changes, so it's scanned whole
+    qint64 now_ms = _clock.elapsed();
+    QList<QueuedRequest> expired;
+    qint64 nextDeadline_ms = -1;
+    QQueue<QueuedRequest>::Iterator it = peer->queued.begin();
+    while (it != peer->queued.end()) {
+        if (it->deadline_ms <= now_ms) {
+            expired.append(*it);
+            it = peer->queued.erase(it);
+            continue;
+        }
+        if ( (nextDeadline_ms < 0) || (it->deadline_ms < nextDeadline_ms) )
+            nextDeadline_ms = it->deadline_ms;
+        ++it;
+    }
+    //armed before handlers are completed - application layer may send another request at once
+    if (nextDeadline_ms >= 0)
+        armQueueTimer_hlpr(peer, nextDeadline_ms);
+
+    foreach (const QueuedRequest &request, expired) {
+        qDebug("%s : request waited for room in the peer's window too long, given up.", __PRETTY_FUNCTION__);
+        _appLayer->processTimeout(peer->address, request.src, request.handler);
+    }
 }
 
 void BacnetTSM2::sendReject(BacnetAddress &destination, BacnetAddress &source, BacnetRejectNS::RejectReason reason, quint8 invokeId)
@@ -86,7 +274,7 @@ void BacnetTSM2::sendReject(BacnetAddress &destination, BacnetAddress &source, B
     BacnetRejectData rejectData(invokeId, reason);
 
     //get buffer
-    Buffer buffer = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::ApplicationLayer);
+    Buffer buffer = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::ApplicationLayer, BacnetBufferManager::SmallBufferMinApduSize);
     //write to buffer
     Q_ASSERT(buffer.isValid());
     quint8 *buffStart = buffer.bodyPtr();
@@ -130,15 +318,8 @@ void BacnetTSM2::receive(BacnetAddress &remoteSource, BacnetAddress &localDestin
         }
 
         if (crData->isSegmented()) {
-#ifdef NO_SEGMENTATION_SUPPORTED
-            qDebug("%s : segmented confrequest received - cannot handle it (%d).", __PRETTY_FUNCTION__, ret);
-            sendAbort(remoteSource, localDestination, crData->invokedId(), BacnetAbortNS::ReasonSegmentationNotSupported, true);
-            delete crData;
-            return;
-#else
-#error "Not implemented";
+            receiveSegmentedRequest_hlpr(remoteSource, localDestination, crData, data + ret, dataLength - ret);
             return;
-#endif
         }
 
         _appLayer->processConfirmedRequest(remoteSource, localDestination, data + ret, dataLength - ret, crData);
@@ -187,14 +368,8 @@ void BacnetTSM2::receive(BacnetAddress &remoteSource, BacnetAddress &localDestin
         }
 
         if (cplxData.isSegmented()) {
-#ifdef NO_SEGMENTATION_SUPPORTED
-            qDebug("%s : segmented complex response received - cannot handle it (%d).", __PRETTY_FUNCTION__, ret);
-            sendAbort(remoteSource, localDestination, cplxData.invokeId(), BacnetAbortNS::ReasonSegmentationNotSupported, true);
+            receiveSegmentedAck_hlpr(remoteSource, localDestination, cplxData, data + ret, dataLength - ret);
             return;
-#else
-#error "Not implemented";
-            return;
-#endif
         }
 
         ExternalConfirmedServiceHandler *service = dequeueConfirmedRequest(remoteSource, localDestination, cplxData.invokeId());
@@ -209,24 +384,14 @@ void BacnetTSM2::receive(BacnetAddress &remoteSource, BacnetAddress &localDestin
     {
         /*upon reception update state machine and send back another segment
              */
-
-#ifdef NO_SEGMENTATION_SUPPORTED
         BacnetSegmentedAckData segData;
         qint32 ret = segData.fromRaw(data, dataLength);
         Q_ASSERT(ret > 0);
         if (ret <= 0) {
-            qDebug("%s : wrong complex ack data (%d)", __PRETTY_FUNCTION__, ret);
-            sendAbort(remoteSource, localDestination, segData.invokeId(), BacnetAbortNS::ReasonOther, true);
-        } else {
-            qDebug("%s : segment ack rcvd, which is wrong, since we didn;t start the transfer/reception (we don't support it)!", __PRETTY_FUNCTION__);
-            sendAbort(remoteSource, localDestination, segData.invokeId(), BacnetAbortNS::ReasonSegmentationNotSupported, true);
+            qDebug("%s : wrong segment ack data (%d)", __PRETTY_FUNCTION__, ret);
+            return;
         }
-        return;
-#else
-#error "Not implemented";
-        return;
-#endif
-
+        processSegmentAck_hlpr(remoteSource, segData);
         break;
     }
     case (BacnetPci::TypeError):
@@ -282,6 +447,12 @@ void BacnetTSM2::receive(BacnetAddress &remoteSource, BacnetAddress &localDestin
             return;
         }
 
+        if (!abrtData.isSentByServer()) {
+            //client gives up the transaction we serve - we may be still sending segments to it, or receiving them
+            dropSegmentations_hlpr(remoteSource, abrtData.invokeId(), true);
+            return;
+        }
+
         ExternalConfirmedServiceHandler *service = dequeueConfirmedRequest(remoteSource, localDestination, abrtData.invokeId());
         Q_CHECK_PTR(service);//this could fail, if there was a timeout for this service. Not an error, just here for the time being.
         if (0 != service)
@@ -296,18 +467,16 @@ void BacnetTSM2::receive(BacnetAddress &remoteSource, BacnetAddress &localDestin
 
 void BacnetTSM2::sendAck(BacnetAddress &destination, BacnetAddress &source, BacnetServiceData *data, BacnetConfirmedRequestData *reqData)
 {
-    //get buffer
-    Buffer buffer = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::ApplicationLayer);
-    //write to buffer
-    Q_ASSERT(buffer.isValid());
-    quint8 *actualPtr = buffer.bodyPtr();
-    quint16 buffLength = buffer.bodyLength();
-
     qint32 ret;
     Q_CHECK_PTR(reqData);
     if (0 == data) {//simple ACK
+        //get buffer - simple ACK fits into the small one
+        Buffer buffer = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::ApplicationLayer, BacnetBufferManager::SmallBufferMinApduSize);
+        Q_ASSERT(buffer.isValid());
+        if (!buffer.isValid())
+            return;
         BacnetSimpleAckData simpleAck(reqData->invokedId(), reqData->service());
-        ret = simpleAck.toRaw(actualPtr, buffLength);
+        ret = simpleAck.toRaw(buffer.bodyPtr(), buffer.bodyLength());
         if (ret <= 0) {
             qDebug("BacnetTSM2::sendAck() : Can't write to buff (%d)", ret);
             return;
@@ -318,37 +487,73 @@ void BacnetTSM2::sendAck(BacnetAddress &destination, BacnetAddress &source, Bacn
         return;
     }
 
-#ifdef NO_SEGMENTATION_SUPPORTED
+    //service data goes first - only then we know, if it fits into one APDU
+    Buffer serviceBuffer = serviceDataBuffer_hlpr();
+    Q_ASSERT(serviceBuffer.isValid());
+    if (!serviceBuffer.isValid())
+        return;
+    ret = data->toRaw(serviceBuffer.bodyPtr(), serviceBuffer.bodyLength());
+    Q_ASSERT(ret > 0);
+    if (ret < 0) {
+        qDebug("BacnetTSM2::sendAck() - can't encode %d", ret);
+        return;
+    }
+    quint16 serviceLength = ret;
+
+    quint8 pci[BacnetComplexAckData::SegmentedHeaderLength];
     BacnetComplexAckData complexAck(reqData->invokedId(), reqData->service(), 0, 0, false, false);
-    ret = complexAck.toRaw(actualPtr, buffLength);
+    ret = complexAck.toRaw(pci, sizeof(pci));
     Q_ASSERT(ret> 0);
     if (ret <= 0) {
         qDebug("BacnetTSM2::sendAck() : Can't write to buff (%d)", ret);
         return;
     }
-    actualPtr += ret;
-    buffLength -= ret;
-    ret = data->toRaw(actualPtr, buffLength);
-    Q_ASSERT(ret > 0);
-    if (ret < 0) {
-        qDebug("BacnetTSM2::sendAck() - can't encode %d", ret);
+
+    //requester tells what it accepts, but we don't send more than fits into our frame
+    quint16 maxApdu = qMin(BacnetConfirmedRequestData::maxApduLength(reqData->maxLengthAccepted()), (quint16)ApduMaxSize);
+    if (ret + serviceLength > maxApdu) {
+        sendSegmentedAck_hlpr(destination, source, serviceBuffer, serviceLength, reqData);
         return;
     }
-    actualPtr += ret;
-    buffer.setBodyLength(actualPtr - buffer.bodyPtr());
 
-    HelperCoder::printArray(buffer.bodyPtr(), buffer.bodyLength(), "TSM : Sending ack message with:");
-    _netHandler->sendApdu(&buffer, false, &destination, &source);
-#else
-#error "Not implemented, segmentation!"
-#endif
+    //service data stays where it was encoded, only PCI is put in front of it
+    serviceBuffer.setBodyLength(serviceLength);
+    memcpy(serviceBuffer.prepend(ret), pci, ret);
+
+    HelperCoder::printArray(serviceBuffer.bodyPtr(), serviceBuffer.bodyLength(), "TSM : Sending ack message with:");
+    _netHandler->sendApdu(&serviceBuffer, false, &destination, &source);
+}
+
+void BacnetTSM2::sendSegmentedAck_hlpr(BacnetAddress &destination, BacnetAddress &source, const Buffer &serviceData, quint16 length, BacnetConfirmedRequestData *reqData)
+{
+    quint8 invokeId = reqData->invokedId();
+    if (!reqData->segmentedResponseAccepted()) {
+        qDebug("%s : response doesn't fit into one APDU and requester doesn't accept segmented one - abort.", __PRETTY_FUNCTION__);
+        sendAbort(destination, source, invokeId, BacnetAbortNS::ReasonSegmentationNotSupported, true);
+        return;
+    }
+
+    quint16 maxApdu = qMin(BacnetConfirmedRequestData::maxApduLength(reqData->maxLengthAccepted()), (quint16)ApduMaxSize);
+    OutgoingSegmentation *segmentation = new OutgoingSegmentation(this, serviceData, length, maxApdu - BacnetComplexAckData::SegmentedHeaderLength,
+                                                                  destination, source, invokeId, reqData->service(), true);
+    int maxSegments = BacnetConfirmedRequestData::maxSegmentsCount(reqData->maxSegmentsAccepted());
+    if ( (maxSegments > 0) && (segmentation->segmentsCount > maxSegments) ) {
+        qDebug("%s : response takes %d segments, requester accepts %d only - abort.", __PRETTY_FUNCTION__, segmentation->segmentsCount, maxSegments);
+        sendAbort(destination, source, invokeId, BacnetAbortNS::ReasonBufferOverflow, true);
+        delete segmentation;
+        return;
+    }
+
+    //requester retried, since our previous answer didn't come on time - start it over
+    dropSegmentations_hlpr(destination, invokeId, true);
+    startSegmentation_hlpr(segmentation);
 }
 
 void BacnetTSM2::sendAbort(BacnetAddress &remoteDestination, BacnetAddress &localSsource, quint8 invokeId, BacnetAbortNS::AbortReason abortReason, bool fromServer)
 {
     BacnetAbortData abort(invokeId, abortReason, fromServer);
     //get buffer
-    Buffer buffer = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::ApplicationLayer);
+    Buffer buffer = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::ApplicationLayer, BacnetBufferManager::SmallBufferMinApduSize);
     //write to buffer
     Q_ASSERT(buffer.isValid());
     quint8 *actualPtr = buffer.bodyPtr();
@@ -431,42 +636,130 @@ void BacnetTSM2::sendUnconfirmed(const BacnetAddress &destination, BacnetAddress
     _netHandler->sendApdu(&buffer, false, &destination, &source);
 }
 
-Bacnet::BacnetTSM2::ConfirmedRequestEntry::ConfirmedRequestEntry(ExternalConfirmedServiceHandler *handler, int timeout_ms, int retriesNum, const BacnetAddress &destination, const BacnetAddress &source):
+Bacnet::BacnetTSM2::ConfirmedRequestEntry::ConfirmedRequestEntry(BacnetTSM2 *tsm, ExternalConfirmedServiceHandler *handler, quint8 invokeId, int retriesNum,
+                                                                 const BacnetAddress &destination, const BacnetAddress &source):
+    tsm(tsm),
     handler(handler),
-    timeLeft_ms(timeout_ms),
+    invokeId(invokeId),
+    timer(TimingWheel::InvalidTimerId),
     retriesLeft(retriesNum),
+    sentAt_ms(-1),
     dst(destination),
     src(source)
 {
 }
 
-void Bacnet::BacnetTSM2::timerEvent(QTimerEvent *)
+Bacnet::BacnetTSM2::ConfirmedRequestEntry::~ConfirmedRequestEntry()
 {
-    QHash<int, ConfirmedRequestEntry>::Iterator it = _confiremedEntriesList.begin();
-    QHash<int, ConfirmedRequestEntry>::Iterator itEnd = _confiremedEntriesList.end();
+    TimingWheel::instance()->cancel(timer);
+}
 
-    while (it != itEnd) {
-        it->timeLeft_ms -= _requestTimeout_ms;
-        if (it->timeLeft_ms < 0) {
-            --(it->retriesLeft);
-            if (it->retriesLeft > 0) {//resend
-                it->timeLeft_ms = _requestTimeout_ms;
-                send_hlpr(it->dst, it->src, it->handler, it.key());
-            } else {
-                qDebug("%s : Processing service timeout for InvokeId: %d", __PRETTY_FUNCTION__, it.key());
-                _appLayer->processTimeout(it->dst, it->src, it->handler);
-                _generator.returnId(it.key());
-                it = _confiremedEntriesList.erase(it);
-                continue;//called to avoid ++it
-            }
-        }
-        ++it;
+void Bacnet::BacnetTSM2::ConfirmedRequestEntry::timerExpired(quintptr cookie)
+{
+    Q_UNUSED(cookie);
+    timer = TimingWheel::InvalidTimerId;
+    tsm->requestTimeout_hlpr(this);
+}
+
+Bacnet::BacnetTSM2::PeerTransactions::PeerTransactions(BacnetTSM2 *tsm, const BacnetAddress &address, int window):
+    tsm(tsm),
+    address(address),
+    queueTimer(TimingWheel::InvalidTimerId),
+    queueTimerDeadline_ms(0),
+    window(window),
+    answeredInWindow(0),
+    ready(false),
+    srtt8_ms(0),
+    rttvar4_ms(0),
+    samplesCount(0),
+    backoffShift(0)
+{
+}
+
+Bacnet::BacnetTSM2::PeerTransactions::~PeerTransactions()
+{
+    TimingWheel::instance()->cancel(queueTimer);
+    qDeleteAll(entries);
+}
+
+void Bacnet::BacnetTSM2::PeerTransactions::timerExpired(quintptr cookie)
+{
+    Q_UNUSED(cookie);
+    queueTimer = TimingWheel::InvalidTimerId;
+    tsm->expireQueued_hlpr(this);
+}
+
+void Bacnet::BacnetTSM2::PeerTransactions::addRttSample(int rtt_ms)
+{
+    if (0 == samplesCount) {
+        //SRTT = R, RTTVAR = R/2
+        srtt8_ms = rtt_ms << 3;
+        rttvar4_ms = rtt_ms << 1;
+    } else {
+        //SRTT += (R - SRTT)/8, RTTVAR += (|R - SRTT| - RTTVAR)/4
+        int error = rtt_ms - (srtt8_ms >> 3);
+        srtt8_ms += error;
+        if (error < 0)
+            error = -error;
+        rttvar4_ms += error - (rttvar4_ms >> 2);
+    }
+    ++samplesCount;
+    backoffShift = 0;
+}
+
+int Bacnet::BacnetTSM2::PeerTransactions::timeout(int defaultTimeout_ms) const
+{
+    //RTO = SRTT + 4*RTTVAR (the latter is at least a clock tick)
+    qint64 timeout_ms = defaultTimeout_ms;
+    if (samplesCount > 0)
+        timeout_ms = qBound((int)MinTimeout_ms, (srtt8_ms >> 3) + qMax(1, rttvar4_ms), (int)MaxTimeout_ms);
+    timeout_ms <<= backoffShift;
+    return (int)qMin(timeout_ms, (qint64)qMax((int)MaxTimeout_ms, defaultTimeout_ms));
+}
+
+void BacnetTSM2::requestTimeout_hlpr(ConfirmedRequestEntry *entry)
+{
+    //peer is slower than we thought - all its requests wait longer, until the answer to the one sent once is measured
+    PeerTransactions *peer = _peerTransactions.value(entry->dst);
+    Q_CHECK_PTR(peer);
+    if (peer->backoffShift < MaxBackoffShift)
+        ++(peer->backoffShift);
+    //and it may be overloaded - less requests are sent at once
+    peer->window = qMax(1, peer->window / 2);
+    peer->answeredInWindow = 0;
+
+    --(entry->retriesLeft);
+    if (entry->retriesLeft > 0) {//resend
+        send_hlpr(entry->dst, entry->src, entry->handler, entry->invokeId);
+        return;
     }
+
+    qDebug("%s : Processing service timeout for InvokeId: %d", __PRETTY_FUNCTION__, entry->invokeId);
+    peer->entries.remove(entry->invokeId);
+    peer->generator.returnId(entry->invokeId);
+    dropSegmentations_hlpr(entry->dst, entry->invokeId, false);
+
+    //entry goes first - application layer may want to send another request at once
+    BacnetAddress dst(entry->dst);
+    BacnetAddress src(entry->src);
+    ExternalConfirmedServiceHandler *handler = entry->handler;
+    delete entry;
+    requestDone_hlpr(peer, false);
+    _appLayer->processTimeout(dst, src, handler);
+}
+
+BacnetTSM2::PeerTransactions *BacnetTSM2::peer_hlpr(const BacnetAddress &address)
+{
+    PeerTransactions *&peer = _peerTransactions[address];
+    if (0 == peer)
+        peer = new PeerTransactions(this, address, _maxPeerWindow);
+    return peer;
 }
 
 int BacnetTSM2::queueConfirmedRequest(ExternalConfirmedServiceHandler *handler, const BacnetAddress &destination, const BacnetAddress &source)
 {
-    int invokeId = _generator.generateId();
+    PeerTransactions *peer = peer_hlpr(destination);
+    int invokeId = peer->generator.generateId();
 
 //#define EXT_COV_TEST
 #ifdef EXT_COV_TEST
@@ -484,29 +777,441 @@ int BacnetTSM2::queueConfirmedRequest(ExternalConfirmedServiceHandler *handler,
 
 
     if (invokeId < 0) {
-        qDebug("%s : cannot generate id!", __PRETTY_FUNCTION__);
+        qDebug("%s : cannot generate id - all of them are used for the peer!", __PRETTY_FUNCTION__);
         return invokeId;
     }
 
-    Q_ASSERT(!_confiremedEntriesList.contains(invokeId));
-    _confiremedEntriesList.insert(invokeId, ConfirmedRequestEntry(handler, _requestTimeout_ms, _requestRetriesCount, destination, source));
+    Q_ASSERT(!peer->entries.contains(invokeId));
+    //timer is armed, when the request is sent
+    peer->entries.insert(invokeId, new ConfirmedRequestEntry(this, handler, invokeId, _requestRetriesCount, destination, source));
+    ++_outstandingCount;
     return invokeId;
 }
 
+BacnetTSM2::ConfirmedRequestEntry *BacnetTSM2::confirmedEntry_hlpr(const BacnetAddress &peer, quint8 invokeId)
+{
+    PeerTransactions *transactions = _peerTransactions.value(peer);
+    if (0 == transactions)
+        return 0;
+    return transactions->entries.value(invokeId);
+}
+
 ExternalConfirmedServiceHandler *BacnetTSM2::dequeueConfirmedRequest(BacnetAddress &remoteSource, BacnetAddress &localDestination, quint8 invokeId)
 {
     ExternalConfirmedServiceHandler *handler(0);
-    QHash<int, ConfirmedRequestEntry>::Iterator it = _confiremedEntriesList.find(invokeId);
-    if (it == _confiremedEntriesList.end()) {
+    PeerTransactions *peer = _peerTransactions.value(remoteSource);
+    ConfirmedRequestEntry *entry = (0 != peer) ? peer->entries.value(invokeId) : 0;
+    if (0 == entry) {
         qDebug("%s : Response for 0x%x requested, and TSM has none.", __PRETTY_FUNCTION__, invokeId);
     } else {
-        ConfirmedRequestEntry &entry = it.value();
-        if ( (remoteSource == entry.dst) && (localDestination == entry.src) ) {//this is response to our request, indeed.
-            handler = entry.handler;
-            _confiremedEntriesList.erase(it);
+        if (localDestination == entry->src) {//this is response to our request, indeed.
+            if (entry->sentAt_ms >= 0)
+                peer->addRttSample((int)(_clock.elapsed() - entry->sentAt_ms));
+            handler = entry->handler;
+            peer->entries.remove(invokeId);
+            peer->generator.returnId(invokeId);
+            //transaction is over, even if we were still sending or receiving segments
+            dropSegmentations_hlpr(remoteSource, invokeId, false);
+            delete entry;
+            requestDone_hlpr(peer, true);
         }
-        _generator.returnId(invokeId);
     }
 
     return handler;
 }
+
+Bacnet::BacnetTSM2::OutgoingSegmentation::OutgoingSegmentation(BacnetTSM2 *tsm, const Buffer &serviceData, quint16 length, quint16 segmentSize,
+                                                               const BacnetAddress &destination, const BacnetAddress &source, quint8 invokeId,
+                                                               quint8 serviceChoice, bool server):
+    tsm(tsm),
+    data(serviceData),
+    length(length),
+    segmentSize(segmentSize),
+    segmentsCount((length + segmentSize - 1) / segmentSize),
+    dst(destination),
+    src(source),
+    invokeId(invokeId),
+    serviceChoice(serviceChoice),
+    server(server),
+    windowStart(0),
+    sentEnd(0),
+    windowSize(1),
+    timer(TimingWheel::InvalidTimerId),
+    retriesLeft(0)
+{
+    Q_ASSERT(segmentSize > 0);
+}
+
+Bacnet::BacnetTSM2::OutgoingSegmentation::~OutgoingSegmentation()
+{
+    TimingWheel::instance()->cancel(timer);
+}
+
+void Bacnet::BacnetTSM2::OutgoingSegmentation::timerExpired(quintptr cookie)
+{
+    Q_UNUSED(cookie);
+    timer = TimingWheel::InvalidTimerId;
+    tsm->outgoingSegmentsTimeout_hlpr(this);
+}
+
+Bacnet::BacnetTSM2::IncomingSegmentation::IncomingSegmentation(BacnetTSM2 *tsm, const Buffer &buffer, const BacnetAddress &remote, const BacnetAddress &local,
+                                                               quint8 invokeId, bool server, quint8 windowSize):
+    tsm(tsm),
+    data(buffer),
+    length(0),
+    remote(remote),
+    local(local),
+    invokeId(invokeId),
+    server(server),
+    crData(0),
+    expectedSeqNum(0),
+    windowSize(windowSize),
+    //the first segment is acknowledged at once - that's how sender learns the window size
+    segmentsInWindow(windowSize - 1),
+    timer(TimingWheel::InvalidTimerId)
+{
+    Q_ASSERT(windowSize > 0);
+}
+
+Bacnet::BacnetTSM2::IncomingSegmentation::~IncomingSegmentation()
+{
+    TimingWheel::instance()->cancel(timer);
+    delete crData;
+}
+
+void Bacnet::BacnetTSM2::IncomingSegmentation::timerExpired(quintptr cookie)
+{
+    Q_UNUSED(cookie);
+    timer = TimingWheel::InvalidTimerId;
+    tsm->incomingSegmentsTimeout_hlpr(this);
+}
+
+int BacnetTSM2::findOutgoing_hlpr(const BacnetAddress &peer, quint8 invokeId, bool server)
+{
+    for (int i = 0; i < _outgoingSegmentations.count(); ++i) {
+        OutgoingSegmentation *segmentation = _outgoingSegmentations.at(i);
+        if ( (segmentation->invokeId == invokeId) && (segmentation->server == server) && (segmentation->dst == peer) )
+            return i;
+    }
+    return -1;
+}
+
+int BacnetTSM2::findIncoming_hlpr(const BacnetAddress &peer, quint8 invokeId, bool server)
+{
+    for (int i = 0; i < _incomingSegmentations.count(); ++i) {
+        IncomingSegmentation *segmentation = _incomingSegmentations.at(i);
+        if ( (segmentation->invokeId == invokeId) && (segmentation->server == server) && (segmentation->remote == peer) )
+            return i;
+    }
+    return -1;
+}
+
+void BacnetTSM2::dropSegmentations_hlpr(const BacnetAddress &peer, quint8 invokeId, bool server)
+{
+    int idx = findOutgoing_hlpr(peer, invokeId, server);
+    if (idx >= 0)
+        delete _outgoingSegmentations.takeAt(idx);
+    idx = findIncoming_hlpr(peer, invokeId, server);
+    if (idx >= 0)
+        delete _incomingSegmentations.takeAt(idx);
+}
+
+void BacnetTSM2::startSegmentation_hlpr(OutgoingSegmentation *segmentation)
+{
+    Q_CHECK_PTR(segmentation);
+    qDebug("%s : sending %d octets in %d segments (invoke id %d).", __PRETTY_FUNCTION__, segmentation->length, segmentation->segmentsCount, segmentation->invokeId);
+    segmentation->retriesLeft = _requestRetriesCount;
+    _outgoingSegmentations.append(segmentation);
+    sendWindow_hlpr(*segmentation);
+}
+
+void BacnetTSM2::sendWindow_hlpr(OutgoingSegmentation &segmentation)
+{
+    int windowEnd = qMin(segmentation.windowStart + segmentation.windowSize, segmentation.segmentsCount);
+    for (; segmentation.sentEnd < windowEnd; ++segmentation.sentEnd) {
+        if (!sendSegment_hlpr(segmentation, segmentation.sentEnd))
+            break;//the rest is sent, when the timer expires
+    }
+    TimingWheel::instance()->restart(segmentation.timer, _segmentTimeout_ms, &segmentation);
+}
+
+bool BacnetTSM2::sendSegment_hlpr(OutgoingSegmentation &segmentation, int segmentIdx)
+{
+    Buffer buffer = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::ApplicationLayer);
+    if (!buffer.isValid()) {
+        qDebug("%s : no buffer for segment %d.", __PRETTY_FUNCTION__, segmentIdx);
+        return false;
+    }
+    quint8 *actualPtr = buffer.bodyPtr();
+    quint16 buffLength = buffer.bodyLength();
+
+    //sequence numbers are modulo 256
+    quint8 seqNum = (quint8)segmentIdx;
+    bool moreFollows = (segmentIdx < segmentation.segmentsCount - 1);
+    qint32 ret;
+    if (segmentation.server) {
+        BacnetComplexAckData header(segmentation.invokeId, segmentation.serviceChoice, seqNum, DefaultProposedWindowSize, true, moreFollows);
+        ret = header.toRaw(actualPtr, buffLength);
+    } else {
+        BacnetConfirmedRequestData header(true, moreFollows, true, AcceptedSegments, AcceptedLength, segmentation.invokeId,
+                                          (BacnetServicesNS::BacnetConfirmedServiceChoice)segmentation.serviceChoice, seqNum, DefaultProposedWindowSize);
+        ret = header.toRaw(actualPtr, buffLength);
+    }
+    Q_ASSERT(ret > 0);
+    if (ret <= 0) {
+        qDebug("%s : can't write segment header (%d)", __PRETTY_FUNCTION__, ret);
+        return false;
+    }
+    actualPtr += ret;
+
+    int offset = segmentIdx * segmentation.segmentSize;
+    int segmentLength = qMin((int)segmentation.segmentSize, segmentation.length - offset);
+    Q_ASSERT(segmentLength > 0);
+    memcpy(actualPtr, segmentation.data.bodyPtr() + offset, segmentLength);
+    actualPtr += segmentLength;
+    buffer.setBodyLength(actualPtr - buffer.bodyPtr());
+
+    //every segment is answered with Segment-ACK (or the following one is)
+    _netHandler->sendApdu(&buffer, true, &segmentation.dst, &segmentation.src);
+    return true;
+}
+
+void BacnetTSM2::processSegmentAck_hlpr(BacnetAddress &remoteSource, BacnetSegmentedAckData &segAck)
+{
+    //server acknowledges segments of our request, client - segments of our ack
+    int idx = findOutgoing_hlpr(remoteSource, segAck.invokeId(), !segAck.isSentByServer());
+    if (idx < 0) {
+        qDebug("%s : Segment-ACK for unknown transfer (invoke id %d), ignore it.", __PRETTY_FUNCTION__, segAck.invokeId());
+        return;
+    }
+    OutgoingSegmentation *segmentation = _outgoingSegmentations.at(idx);
+
+    //Segment-ACK carries the sequence number of the last segment received in order - that many segments were acknowledged now
+    int ackedCount = (quint8)(segAck.sequenceNumber() + 1 - (quint8)segmentation->windowStart);
+    if ( (0 == ackedCount) || (ackedCount > segmentation->sentEnd - segmentation->windowStart) ) {
+        //DuplicateACK_Received (clause 5.4.4) - nothing new was acknowledged. Receiver NAKs each segment following the lost one,
+        //so resending on each of them would send the window over and over - only the timer is restarted, it resends, if needed.
+        qDebug("%s : duplicated Segment-ACK (invoke id %d, seq %d).", __PRETTY_FUNCTION__, segAck.invokeId(), segAck.sequenceNumber());
+        TimingWheel::instance()->restart(segmentation->timer, _segmentTimeout_ms, segmentation);
+        return;
+    }
+
+    segmentation->windowStart += ackedCount;
+    segmentation->windowSize = qBound(1, (int)segAck.actualWindowSize(), 127);
+    segmentation->retriesLeft = _requestRetriesCount;
+    if (segmentation->windowStart >= segmentation->segmentsCount) {
+        _outgoingSegmentations.removeAt(idx);
+        if (!segmentation->server)
+            requestSegmentsDone_hlpr(segmentation->dst, segmentation->invokeId, true);
+        delete segmentation;
+        return;
+    }
+
+    //progress was made - whatever was sent and not acknowledged (negative ack), is sent again
+    segmentation->sentEnd = segmentation->windowStart;
+    sendWindow_hlpr(*segmentation);
+}
+
+void BacnetTSM2::requestSegmentsDone_hlpr(const BacnetAddress &peer, quint8 invokeId, bool success)
+{
+    ConfirmedRequestEntry *entry = confirmedEntry_hlpr(peer, invokeId);
+    if (0 == entry)
+        return;
+    //all segments acknowledged - wait for the answer now; otherwise request timeout handles it (the request is retried or given up)
+    TimingWheel::instance()->restart(entry->timer, success ? _peerTransactions.value(peer)->timeout(_requestTimeout_ms) : 0, entry);
+}
+
+BacnetTSM2::SegmentResult BacnetTSM2::receiveSegment_hlpr(IncomingSegmentation &segmentation, quint8 seqNum, bool moreFollows, quint8 *data, quint16 dataLength)
+{
+    TimingWheel::instance()->restart(segmentation.timer, IncomingSegmentTimeoutFactor * _segmentTimeout_ms, &segmentation);
+
+    if (seqNum != segmentation.expectedSeqNum) {
+        //lost or duplicated segment - tell sender what we've got in order
+        qDebug("%s : segment %d received, while %d expected (invoke id %d).", __PRETTY_FUNCTION__, seqNum, segmentation.expectedSeqNum, segmentation.invokeId);
+        sendSegmentAck_hlpr(segmentation, segmentation.expectedSeqNum - 1, true);
+        segmentation.segmentsInWindow = 0;
+        return SegmentationInProgress;
+    }
+
+    if (segmentation.length + dataLength > segmentation.data.bodyLength()) {
+        qDebug("%s : segmented APDU doesn't fit into the buffer (invoke id %d) - abort.", __PRETTY_FUNCTION__, segmentation.invokeId);
+        sendAbort(segmentation.remote, segmentation.local, segmentation.invokeId, BacnetAbortNS::ReasonBufferOverflow, segmentation.server);
+        return SegmentationFailed;
+    }
+    memcpy(segmentation.data.bodyPtr() + segmentation.length, data, dataLength);
+    segmentation.length += dataLength;
+    ++segmentation.expectedSeqNum;
+    ++segmentation.segmentsInWindow;
+
+    if (!moreFollows) {
+        sendSegmentAck_hlpr(segmentation, seqNum, false);
+        return SegmentationComplete;
+    }
+
+    if (segmentation.segmentsInWindow >= segmentation.windowSize) {
+        sendSegmentAck_hlpr(segmentation, seqNum, false);
+        segmentation.segmentsInWindow = 0;
+    }
+    return SegmentationInProgress;
+}
+
+void BacnetTSM2::sendSegmentAck_hlpr(IncomingSegmentation &segmentation, quint8 seqNum, bool negative)
+{
+    BacnetSegmentedAckData segAck(segmentation.invokeId, seqNum, segmentation.windowSize,
+                                  negative ? BacnetSegmentedAckData::SegmentOutOfOrder : BacnetSegmentedAckData::SegmentOk, segmentation.server);
+
+    Buffer buffer = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::ApplicationLayer, BacnetBufferManager::SmallBufferMinApduSize);
+    Q_ASSERT(buffer.isValid());
+    if (!buffer.isValid())
+        return;
+
+    qint32 ret = segAck.toRaw(buffer.bodyPtr(), buffer.bodyLength());
+    Q_ASSERT(ret > 0);
+    if (ret <= 0) {
+        qDebug("%s : can't write Segment-ACK (%d)", __PRETTY_FUNCTION__, ret);
+        return;
+    }
+    buffer.setBodyLength(ret);
+    _netHandler->sendApdu(&buffer, false, &segmentation.remote, &segmentation.local);
+}
+
+void BacnetTSM2::receiveSegmentedRequest_hlpr(BacnetAddress &remoteSource, BacnetAddress &localDestination, BacnetConfirmedRequestData *crData, quint8 *data, quint16 dataLength)
+{
+    IncomingSegmentation *segmentation(0);
+    int idx = findIncoming_hlpr(remoteSource, crData->invokedId(), true);
+    if (idx < 0) {
+        if (0 != crData->sequenceNumber()) {
+            qDebug("%s : segment %d received, while no transfer started - abort.", __PRETTY_FUNCTION__, crData->sequenceNumber());
+            sendAbort(remoteSource, localDestination, crData->invokedId(), BacnetAbortNS::ReasonInvalidApduInThisState, true);
+            delete crData;
+            return;
+        }
+        Buffer buffer = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::ApplicationLayer, BacnetBufferManager::SegmentedApduMaxSize);
+        if (!buffer.isValid()) {
+            qDebug("%s : no segmentation buffer left - abort.", __PRETTY_FUNCTION__);
+            sendAbort(remoteSource, localDestination, crData->invokedId(), BacnetAbortNS::ReasonBufferOverflow, true);
+            delete crData;
+            return;
+        }
+        quint8 windowSize = qBound(1, (int)crData->proposedWindowSize(), (int)DefaultProposedWindowSize);
+        segmentation = new IncomingSegmentation(this, buffer, remoteSource, localDestination, crData->invokedId(), true, windowSize);
+        //the first segment header describes the entire request
+        segmentation->crData = crData;
+        _incomingSegmentations.append(segmentation);
+        idx = _incomingSegmentations.count() - 1;
+    } else {
+        segmentation = _incomingSegmentations.at(idx);
+    }
+
+    SegmentResult result = receiveSegment_hlpr(*segmentation, crData->sequenceNumber(), crData->moreFollows(), data, dataLength);
+    if (segmentation->crData != crData)
+        delete crData;
+    if (SegmentationInProgress == result)
+        return;
+
+    _incomingSegmentations.removeAt(idx);
+    if (SegmentationComplete == result) {
+        //request lies in segmentation buffer now, not in the frame that was received
+        Buffer *rxFrame = _appLayer->receivedFrame();
+        _appLayer->setReceivedFrame(&segmentation->data);
+        _appLayer->processConfirmedRequest(segmentation->remote, segmentation->local, segmentation->data.bodyPtr(), segmentation->length, segmentation->crData);
+        _appLayer->setReceivedFrame(rxFrame);
+        //application layer took ownership over it
+        segmentation->crData = 0;
+    }
+    delete segmentation;
+}
+
+void BacnetTSM2::receiveSegmentedAck_hlpr(BacnetAddress &remoteSource, BacnetAddress &localDestination, BacnetComplexAckData &cplxData, quint8 *data, quint16 dataLength)
+{
+    quint8 invokeId = cplxData.invokeId();
+    ConfirmedRequestEntry *entry = confirmedEntry_hlpr(remoteSource, invokeId);
+    if ( (0 == entry) || !(localDestination == entry->src) ) {
+        qDebug("%s : segmented ack for unknown request (invoke id %d) - abort.", __PRETTY_FUNCTION__, invokeId);
+        sendAbort(remoteSource, localDestination, invokeId, BacnetAbortNS::ReasonInvalidApduInThisState, false);
+        return;
+    }
+
+    IncomingSegmentation *segmentation(0);
+    int idx = findIncoming_hlpr(remoteSource, invokeId, false);
+    if (idx < 0) {
+        if (0 != cplxData.sequenceNumber()) {
+            qDebug("%s : segment %d received, while no transfer started - abort.", __PRETTY_FUNCTION__, cplxData.sequenceNumber());
+            sendAbort(remoteSource, localDestination, invokeId, BacnetAbortNS::ReasonInvalidApduInThisState, false);
+            return;
+        }
+        Buffer buffer = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::ApplicationLayer, BacnetBufferManager::SegmentedApduMaxSize);
+        if (!buffer.isValid()) {
+            qDebug("%s : no segmentation buffer left - abort.", __PRETTY_FUNCTION__);
+            sendAbort(remoteSource, localDestination, invokeId, BacnetAbortNS::ReasonBufferOverflow, false);
+            ExternalConfirmedServiceHandler *service = dequeueConfirmedRequest(remoteSource, localDestination, invokeId);
+            if (0 != service)
+                _appLayer->processAbort(remoteSource, localDestination, service);
+            return;
+        }
+        quint8 windowSize = qBound(1, (int)cplxData.proposedWindowSize(), (int)DefaultProposedWindowSize);
+        segmentation = new IncomingSegmentation(this, buffer, remoteSource, localDestination, invokeId, false, windowSize);
+        _incomingSegmentations.append(segmentation);
+        idx = _incomingSegmentations.count() - 1;
+        //request is answered, don't resend it - segment timer watches the transaction from now on
+        TimingWheel::instance()->cancel(entry->timer);
+        entry->timer = TimingWheel::InvalidTimerId;
+        //the first segment tells the round trip time - the rest depends on the window
+        if (entry->sentAt_ms >= 0) {
+            _peerTransactions.value(remoteSource)->addRttSample((int)(_clock.elapsed() - entry->sentAt_ms));
+            entry->sentAt_ms = -1;
+        }
+    } else {
+        segmentation = _incomingSegmentations.at(idx);
+    }
+
+    SegmentResult result = receiveSegment_hlpr(*segmentation, cplxData.sequenceNumber(), cplxData.moreFollows(), data, dataLength);
+    if (SegmentationInProgress == result)
+        return;
+
+    _incomingSegmentations.removeAt(idx);
+    ExternalConfirmedServiceHandler *service = dequeueConfirmedRequest(remoteSource, localDestination, invokeId);
+    Q_CHECK_PTR(service);
+    if (0 != service) {
+        if (SegmentationComplete == result) {
+            //ack lies in segmentation buffer now, not in the frame that was received
+            Buffer *rxFrame = _appLayer->receivedFrame();
+            _appLayer->setReceivedFrame(&segmentation->data);
+            _appLayer->processAck(remoteSource, localDestination, segmentation->data.bodyPtr(), segmentation->length, service);
+            _appLayer->setReceivedFrame(rxFrame);
+        } else {
+            _appLayer->processAbort(remoteSource, localDestination, service);
+        }
+    }
+    delete segmentation;
+}
+
+void BacnetTSM2::outgoingSegmentsTimeout_hlpr(OutgoingSegmentation *segmentation)
+{
+    --(segmentation->retriesLeft);
+    if (segmentation->retriesLeft > 0) {
+        qDebug("%s : no Segment-ACK for invoke id %d, resend the window.", __PRETTY_FUNCTION__, segmentation->invokeId);
+        segmentation->sentEnd = segmentation->windowStart;
+        sendWindow_hlpr(*segmentation);
+        return;
+    }
+
+    qDebug("%s : segmented transfer for invoke id %d timed out.", __PRETTY_FUNCTION__, segmentation->invokeId);
+    _outgoingSegmentations.removeOne(segmentation);
+    if (!segmentation->server)
+        requestSegmentsDone_hlpr(segmentation->dst, segmentation->invokeId, false);
+    delete segmentation;
+}
+
+void BacnetTSM2::incomingSegmentsTimeout_hlpr(IncomingSegmentation *segmentation)
+{
+    qDebug("%s : segmented APDU with invoke id %d not completed in time, drop it.", __PRETTY_FUNCTION__, segmentation->invokeId);
+    _incomingSegmentations.removeOne(segmentation);
+    if (!segmentation->server) {
+        //we were waiting for the answer - it's not coming
+        ExternalConfirmedServiceHandler *service = dequeueConfirmedRequest(segmentation->remote, segmentation->local, segmentation->invokeId);
+        if (0 != service)
+            _appLayer->processTimeout(segmentation->remote, segmentation->local, service);
+    }
+    delete segmentation;
+}
@@ -2,7 +2,8 @@
 #define BACNETTSM2_H
 
 #include <QObject>
-#include <QBasicTimer>
+#include <QElapsedTimer>
+#include <QQueue>
 
 #include "bacnetaddress.h"
 #include "bacnetcommon.h"
@@ -10,8 +11,8 @@
 #include "bacnetinternaladdresshelper.h"
 #include "bacnetpci.h"
 #include "invokeidgenerator.h"
-
-#define NO_SEGMENTATION_SUPPORTED
+#include "buffer.h"
+#include "timingwheel.h"
 
 class BacnetSimpleAckData;
 class BacnetComplexAckData;
@@ -28,12 +29,27 @@ class AsynchronousBacnetTsmAction;
 class Error;
 class BacnetApplicationLayerHandler;
 
+/**
+  Transaction state machine. Both, requests we send and acks we send back may be segmented - when the APDU doesn't fit into maximum
+  APDU size, its service data is encoded into one pooled segmentation buffer (\sa BacnetBufferManager::SegmentationBuffer) and sent
+  window by window, as Segment-ACKs come. Segmented APDUs we receive are reassembled into such buffer, too - segments are copied
+  straight from the frames they came in, no other allocation is made.
+
+  Each transaction and segmented transfer arms its own timer on \sa TimingWheel - nothing is polled, timeouts are as precise as
+  configured ones.
+
+  Confirmed requests don't go out all at once - small controllers drop what they can't handle and we end up retrying. Each peer has
+  a window of requests in flight (halved on each timeout, grown by one with each window answered), the rest waits in its queue. When
+  gateway-wide limit is reached, too, peers with queued requests are served round-robin - one request each per turn. The queue is
+  bounded and queued requests wait no longer than they would be retried, once sent - an unresponsive peer doesn't pile them up.
+  */
 class BacnetTSM2:
         public QObject
 {
     Q_OBJECT
 public:
     explicit BacnetTSM2(BacnetApplicationLayerHandler *appLayer, BacnetNetworkLayerHandler *netLayer, QObject *parent = 0);
+    virtual ~BacnetTSM2();
 
 public://functions connected with parsing
     void receive(BacnetAddress &remoteSource, BacnetAddress &localDestination, quint8 *data, quint16 dataLength);
@@ -42,7 +58,15 @@ private:
     BacnetApplicationLayerHandler *_appLayer;
 
 public:
+    //! Sends the request or queues it, if there is no room in the peer's window. Returns false, if it couldn't be sent at once, nor
+    //! queued (peer's queue is full) - the caller completes the handler then.
     bool send(const BacnetAddress &destination, BacnetAddress &sourceAddress, ExternalConfirmedServiceHandler *serviceToSend);
+    //! Sets how many requests may be in flight to one peer (at most 255). Timeouts shrink peer's window, answers grow it back to that one.
+    void setMaxPeerWindow(int window);
+    //! Sets how many requests may be in flight gateway-wide.
+    void setMaxOutstandingRequests(int count);
+    //! Sets how many requests may wait for room in one peer's window. New ones are refused, when the queue is full.
+    void setMaxPeerQueueLength(int length);
 
     void sendAck(BacnetAddress &remoteDestination, BacnetAddress &localSource, BacnetServiceData *data, BacnetConfirmedRequestData *reqData);
     void sendReject(BacnetAddress &remoteDestination, BacnetAddress &localSource, BacnetRejectNS::RejectReason reason, quint8 invokeId);
@@ -56,38 +80,239 @@ public:
 
 private:
     bool send_hlpr(const BacnetAddress &destination, BacnetAddress &sourceAddress, ExternalConfirmedServiceHandler *serviceToSend, quint8 invokeId);
+    void sendSegmentedAck_hlpr(BacnetAddress &destination, BacnetAddress &source, const Buffer &serviceData, quint16 length, BacnetConfirmedRequestData *reqData);
+    //! Returns buffer, service data is encoded into before we know, if it fits into one APDU. It's segmentation one, unless all are in use.
+    //! Body starts \sa BacnetBufferManager::ApciHeadroom bytes in, so that APCI can be prepended and the buffer sent as it is.
+    static Buffer serviceDataBuffer_hlpr();
 
 
-protected:
-    void timerEvent(QTimerEvent *);
-
 private:
+    //! Timeout used for peers, which haven't answered yet (and the one, the measured ones are bounded with).
     static const int DefaultTimeout_ms = 1000;
+    static const int MinTimeout_ms = 50;
+    static const int MaxTimeout_ms = 10000;
+    //! Timeouts are doubled on each retry, that many times at most.
+    static const int MaxBackoffShift = 8;
     static const int DefaultRetryCount = 3;
     int _requestTimeout_ms;
     int _requestRetriesCount;
-    class ConfirmedRequestEntry
+    //! Requests are stamped with it, so that round trip time is measured.
+    QElapsedTimer _clock;
+    class ConfirmedRequestEntry:
+            public TimingWheelClient
     {
     public:
-        //invoke id is a key
-        ConfirmedRequestEntry(ExternalConfirmedServiceHandler *handler, int timeout_ms, int retriesNum, const BacnetAddress &destination, const BacnetAddress &source);
+        ConfirmedRequestEntry(BacnetTSM2 *tsm, ExternalConfirmedServiceHandler *handler, quint8 invokeId, int retriesNum,
+                              const BacnetAddress &destination, const BacnetAddress &source);
+        ~ConfirmedRequestEntry();
+
+        void timerExpired(quintptr cookie);
 
     public:
+        BacnetTSM2 *tsm;
         ExternalConfirmedServiceHandler *handler;
-        int timeLeft_ms;
+        quint8 invokeId;
+        //! Not armed, while request segments are being sent or segmented ack received - segment timers guard the transaction then.
+        TimingWheel::TimerId timer;
         int retriesLeft;
+        //! When the request was sent (\sa _clock), or -1 if its answer doesn't give RTT sample - it was retried or segmented.
+        qint64 sentAt_ms;
         BacnetAddress dst;
         BacnetAddress src;
     };
+    class PeerTransactions;
+    //! Returns transactions of the peer - they are created, when the peer is talked to for the first time.
+    PeerTransactions *peer_hlpr(const BacnetAddress &address);
     int queueConfirmedRequest(ExternalConfirmedServiceHandler *handler, const BacnetAddress &destination, const BacnetAddress &source);
-    QHash<int, ConfirmedRequestEntry> _confiremedEntriesList;
+    //! Returns entry of the request sent to the peer, or 0 if there is none.
+    ConfirmedRequestEntry *confirmedEntry_hlpr(const BacnetAddress &peer, quint8 invokeId);
+    //! Request wasn't answered on time - it's sent again, or given up, when it was the last retry.
+    void requestTimeout_hlpr(ConfirmedRequestEntry *entry);
+
+    //! Request waiting for room in the peer's window.
+    class QueuedRequest
+    {
+    public:
+        ExternalConfirmedServiceHandler *handler;
+        BacnetAddress src;
+        //! When it's given up, if still not sent (\sa _clock).
+        qint64 deadline_ms;
+    };
+
+    /**
+      Confirmed requests sent to one peer. Invoke ids have to be unique per peer only, so each one has its own space of 256 ids - the number
+      of requests in flight isn't limited gateway-wide. Peers are kept, once they were talked to - there are not that many devices.
+
+      Peer's request timeout is derived from its measured round trip time the way TCP does it (Jacobson/Karels, RFC 6298): local
+      controllers answer within milliseconds, while devices behind MS/TP routers take hundreds of them. Only answers to requests sent
+      once are measured (Karn's algorithm) - with a retry we can't tell, which one is answered.
+      */
+    class PeerTransactions:
+            public TimingWheelClient
+    {
+    public:
+        PeerTransactions(BacnetTSM2 *tsm, const BacnetAddress &address, int window);
+        ~PeerTransactions();
+
+        void addRttSample(int rtt_ms);
+        //! Timeout for the request to be sent now - defaultTimeout_ms is used until any RTT is measured.
+        int timeout(int defaultTimeout_ms) const;
+
+        //! Queue timer expired - queued requests past their deadlines are given up.
+        void timerExpired(quintptr cookie);
+
+    public:
+        BacnetTSM2 *tsm;
+        BacnetAddress address;
+        InvokeIdGenerator generator;
+        QHash<int, ConfirmedRequestEntry*> entries;
+        //! Requests waiting for room in the window, in order they came.
+        QQueue<QueuedRequest> queued;
+        //! Armed for the earliest deadline of the queued requests (or earlier - it's checked again then).
+        TimingWheel::TimerId queueTimer;
+        qint64 queueTimerDeadline_ms;
+        int window;
+        //! Answers counted towards growing the window by one.
+        int answeredInWindow;
+        //! Set when it's in \sa _readyPeers.
+        bool ready;
+        //! Smoothed RTT is kept multiplied by 8 and its deviation by 4, so that the gains (1/8 and 1/4) are exact in integers.
+        int srtt8_ms;
+        int rttvar4_ms;
+        quint32 samplesCount;
+        //! Each timeout doubles the peer's timeout, until the answer to request sent once comes.
+        int backoffShift;
+    };
+    QHash<BacnetAddress, PeerTransactions*> _peerTransactions;
+
+    static const int DefaultMaxPeerWindow = 4;
+    static const int DefaultMaxOutstandingRequests = 128;
+    static const int DefaultMaxPeerQueueLength = 64;
+    int _maxPeerWindow;
+    int _maxOutstandingRequests;
+    int _maxPeerQueueLength;
+    //! Number of confirmed requests in flight (sent and not answered, nor timed out), all the peers together.
+    int _outstandingCount;
+    //! Peers having requests queued and room in their windows, in the order they are served.
+    QList<PeerTransactions*> _readyPeers;
+
+    bool hasRoom_hlpr(PeerTransactions *peer);
+    //! Assigns invoke id to the request and sends it.
+    bool sendNow_hlpr(PeerTransactions *peer, ExternalConfirmedServiceHandler *handler, BacnetAddress &source);
+    //! Puts peer at the end of the line, if it has queued requests and room for them. \sa dispatchQueued_hlpr()
+    void makeReady_hlpr(PeerTransactions *peer);
+    //! Sends queued requests round-robin, as long as there is room gateway-wide.
+    void dispatchQueued_hlpr();
+    //! Called when request leaves the peer's window - it was answered or given up.
+    void requestDone_hlpr(PeerTransactions *peer, bool answered);
+    //! Arms peer's queue timer, unless it expires before the deadline anyway.
+    void armQueueTimer_hlpr(PeerTransactions *peer, qint64 deadline_ms);
+    //! Gives up queued requests, which waited too long, and arms the timer for the rest.
+    void expireQueued_hlpr(PeerTransactions *peer);
+
+private://segmentation
+    //! Window size we propose, when sending segments and the biggest one we accept, when receiving.
+    static const int DefaultProposedWindowSize = 8;
+    static const int DefaultSegmentTimeout_ms = 2000;
+    int _segmentTimeout_ms;
+    //! Receiver waits for a segment this many times longer than sender for Segment-ACK (sender retries in the meantime).
+    static const int IncomingSegmentTimeoutFactor = 4;
+    //! What we accept in segmented acks - it has to fit into segmentation buffer. \sa BacnetBufferManager::SegmentedApduMaxSegments
+    static const BacnetConfirmedRequestData::MaxSegmentsAccepted AcceptedSegments = BacnetConfirmedRequestData::Segments_ThirtyTwoSegs;
+    static const BacnetConfirmedRequestData::MaxLengthAccepted AcceptedLength = BacnetConfirmedRequestData::Length_1476Octets;
+
+    //! Segmented APDU we send - our confirmed request (we are a client) or complex ack (we are a server).
+    class OutgoingSegmentation:
+            public TimingWheelClient
+    {
+    public:
+        OutgoingSegmentation(BacnetTSM2 *tsm, const Buffer &serviceData, quint16 length, quint16 segmentSize, const BacnetAddress &destination,
+                             const BacnetAddress &source, quint8 invokeId, quint8 serviceChoice, bool server);
+        ~OutgoingSegmentation();
+
+        void timerExpired(quintptr cookie);
+
+    public:
+        BacnetTSM2 *tsm;
+        Buffer data;
+        quint16 length;
+        quint16 segmentSize;
+        int segmentsCount;
+        BacnetAddress dst;
+        BacnetAddress src;
+        quint8 invokeId;
+        quint8 serviceChoice;
+        bool server;
+        //! Index of the first segment, which is not acknowledged yet.
+        int windowStart;
+        //! Index of the segment following the last one sent.
+        int sentEnd;
+        //! Until the first Segment-ACK comes, it's one - only then we know the actual window size.
+        quint8 windowSize;
+        //! Waits for Segment-ACK of the window sent.
+        TimingWheel::TimerId timer;
+        int retriesLeft;
+    };
+    QList<OutgoingSegmentation*> _outgoingSegmentations;
+
+    //! Segmented APDU we receive - confirmed request (we are a server) or complex ack (we are a client).
+    class IncomingSegmentation:
+            public TimingWheelClient
+    {
+    public:
+        IncomingSegmentation(BacnetTSM2 *tsm, const Buffer &buffer, const BacnetAddress &remote, const BacnetAddress &local, quint8 invokeId,
+                             bool server, quint8 windowSize);
+        ~IncomingSegmentation();
+
+        void timerExpired(quintptr cookie);
+
+    public:
+        BacnetTSM2 *tsm;
+        Buffer data;
+        quint16 length;
+        BacnetAddress remote;
+        BacnetAddress local;
+        quint8 invokeId;
+        bool server;
+        //! Header of the first segment - owned, until handed over to the application layer (server only).
+        BacnetConfirmedRequestData *crData;
+        quint8 expectedSeqNum;
+        quint8 windowSize;
+        int segmentsInWindow;
+        //! Waits for the next segment.
+        TimingWheel::TimerId timer;
+    };
+    QList<IncomingSegmentation*> _incomingSegmentations;
+
+    enum SegmentResult {
+        SegmentationInProgress,
+        SegmentationComplete,
+        SegmentationFailed
+    };
+
+    int findOutgoing_hlpr(const BacnetAddress &peer, quint8 invokeId, bool server);
+    int findIncoming_hlpr(const BacnetAddress &peer, quint8 invokeId, bool server);
+    //! Starts sending given service data in segments. Takes ownership over segmentation.
+    void startSegmentation_hlpr(OutgoingSegmentation *segmentation);
+    //! Sends all the segments of the current window, not sent yet.
+    void sendWindow_hlpr(OutgoingSegmentation &segmentation);
+    bool sendSegment_hlpr(OutgoingSegmentation &segmentation, int segmentIdx);
+    void processSegmentAck_hlpr(BacnetAddress &remoteSource, BacnetSegmentedAckData &segAck);
+    //! Called when all the segments of our request are acknowledged, or when we gave up sending them.
+    void requestSegmentsDone_hlpr(const BacnetAddress &peer, quint8 invokeId, bool success);
 
-    QBasicTimer _timer;
-    static const int DefaultTimerInterval_ms = 250;
-    int _timerInterval_ms;
+    void receiveSegmentedRequest_hlpr(BacnetAddress &remoteSource, BacnetAddress &localDestination, BacnetConfirmedRequestData *crData, quint8 *data, quint16 dataLength);
+    void receiveSegmentedAck_hlpr(BacnetAddress &remoteSource, BacnetAddress &localDestination, BacnetComplexAckData &cplxData, quint8 *data, quint16 dataLength);
+    SegmentResult receiveSegment_hlpr(IncomingSegmentation &segmentation, quint8 seqNum, bool moreFollows, quint8 *data, quint16 dataLength);
+    void sendSegmentAck_hlpr(IncomingSegmentation &segmentation, quint8 seqNum, bool negative);
+    //! Drops segmented transfers of the transaction, which was aborted, or finished otherwise.
+    void dropSegmentations_hlpr(const BacnetAddress &peer, quint8 invokeId, bool server);
+    //! No Segment-ACK came for the window - it's sent again, or the transfer is given up.
+    void outgoingSegmentsTimeout_hlpr(OutgoingSegmentation *segmentation);
+    //! Segment didn't come - the transfer is dropped.
+    void incomingSegmentsTimeout_hlpr(IncomingSegmentation *segmentation);
 
 private:
-    InvokeIdGenerator _generator;
     InternalAddress _myRequestAddress;
     BacnetNetworkLayerHandler *_netHandler;
 };
@@ -0,0 +1,194 @@
+#include "bacnetudpreceiveworker.h"
+
+#include "bacnetudptransportlayer.h"
+#include "bacnetbuffermanager.h"
+
+#ifdef BACNET_UDP_BATCHED_IO
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#endif
+
+BacnetUdpReceiveWorker::BacnetUdpReceiveWorker(int socketDescriptor, bool ownsSocket, quint32 myIpAddress, bool acceptBroadcasts, BacnetUdpTransportLayerHandler *owner):
+    _head(0),
+    _tail(0),
+    _stopRequested(0),
+    _socketDescriptor(socketDescriptor),
+    _ownsSocket(ownsSocket),
+    _myIpAddress(myIpAddress),
+    _acceptBroadcasts(acceptBroadcasts),
+    _owner(owner),
+    _receivedCount(0),
+    _droppedCount(0)
+{
+    Q_ASSERT(0 == (QueueSize & (QueueSize - 1)));
+    Q_CHECK_PTR(_owner);
+}
+
+BacnetUdpReceiveWorker::~BacnetUdpReceiveWorker()
+{
+    stop();
+#ifdef BACNET_UDP_BATCHED_IO
+    if (_ownsSocket)
+        ::close(_socketDescriptor);
+#endif
+}
+
+void BacnetUdpReceiveWorker::stop()
+{
+    _stopRequested.fetchAndStoreOrdered(1);
+    wait();
+}
+
+quint64 BacnetUdpReceiveWorker::receivedCount()
+{
+    return (quint32)_receivedCount.fetchAndAddRelaxed(0);
+}
+
+quint64 BacnetUdpReceiveWorker::droppedCount()
+{
+    return (quint32)_droppedCount.fetchAndAddRelaxed(0);
+}
+
+#ifdef BACNET_UDP_BATCHED_IO
+void BacnetUdpReceiveWorker::run()
+{
+    pollfd pollData;
+    pollData.fd = _socketDescriptor;
+    pollData.events = POLLIN;
+
+    //we wake up from time to time to check, if we are not asked to finish
+    while (0 == _stopRequested.fetchAndAddOrdered(0)) {
+        pollData.revents = 0;
+        int ret = ::poll(&pollData, 1, StopCheckInterval_ms);
+        if (ret <= 0)
+            continue;
+
+        //drain what is there - owner is told after each batch (it's cheap, if it's already scheduled)
+        while (readBatch_hlpr() > 0)
+            _owner->workerHasData();
+    }
+}
+
+int BacnetUdpReceiveWorker::readBatch_hlpr()
+{
+    mmsghdr msgs[BatchSize];
+    iovec iovs[BatchSize];
+    sockaddr_in addrs[BatchSize];
+    char controls[BatchSize][CMSG_SPACE(sizeof(in_pktinfo))];
+    Buffer frames[BatchSize];
+
+    BacnetBufferManager *bufferManager = BacnetBufferManager::instance();
+    int slotsCount(0);
+    memset(msgs, 0, sizeof(msgs));
+    for (; slotsCount < BatchSize; ++slotsCount) {
+        frames[slotsCount] = bufferManager->getBuffer(BacnetBufferManager::TransportLayerRx);
+        if (!frames[slotsCount].isValid())
+            break;
+        iovs[slotsCount].iov_base = frames[slotsCount].bodyPtr();
+        iovs[slotsCount].iov_len = frames[slotsCount].bodyLength();
+        msghdr &hdr = msgs[slotsCount].msg_hdr;
+        hdr.msg_iov = &iovs[slotsCount];
+        hdr.msg_iovlen = 1;
+        hdr.msg_name = &addrs[slotsCount];
+        hdr.msg_namelen = sizeof(sockaddr_in);
+        hdr.msg_control = controls[slotsCount];
+        hdr.msg_controllen = sizeof(controls[slotsCount]);
+    }
+
+    if (0 == slotsCount) {
+        //no buffers - consume one datagram anyway, otherwise poll() would wake us up in the loop
+        quint8 dummy;
+        if (::recv(_socketDescriptor, &dummy, sizeof(dummy), MSG_DONTWAIT) >= 0)
+            _droppedCount.ref();
+        return 0;
+    }
+
+    int count = recvmmsg(_socketDescriptor, msgs, slotsCount, MSG_DONTWAIT, 0);
+    if (count <= 0)
+        return 0;
+
+    for (int i = 0; i < count; ++i) {
+        if (AF_INET != addrs[i].sin_family)
+            continue;
+
+        if (!_acceptBroadcasts) {
+            //find out the destination address - if it's not ours, it's a broadcast, which other worker passes on
+            bool isForUs(true);
+            for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != 0; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+                if ( (IPPROTO_IP == cmsg->cmsg_level) && (IP_PKTINFO == cmsg->cmsg_type) ) {
+                    in_pktinfo *pktInfo = (in_pktinfo*)CMSG_DATA(cmsg);
+                    isForUs = (ntohl(pktInfo->ipi_addr.s_addr) == _myIpAddress);
+                    break;
+                }
+            }
+            if (!isForUs)
+                continue;
+        }
+
+        frames[i].setBodyLength(msgs[i].msg_len);
+        if (putDatagram_hlpr(frames[i], ntohl(addrs[i].sin_addr.s_addr), ntohs(addrs[i].sin_port)))
+            _receivedCount.ref();
+        else
+            _droppedCount.ref();
+    }
+
+    return count;
+}
+#else
+void BacnetUdpReceiveWorker::run()
+{
+    //workers are never created on other platforms (\sa BacnetUdpTransportLayerHandler::setReceiveWorkersCount())
+    Q_ASSERT(false);
+}
+
+int BacnetUdpReceiveWorker::readBatch_hlpr()
+{
+    return 0;
+}
+#endif
+
+bool BacnetUdpReceiveWorker::putDatagram_hlpr(const Buffer &frame, quint32 srcIpAddress, quint16 srcPort)
+{
+    int tail = _tail.fetchAndAddOrdered(0);
+    int head = _head.fetchAndAddOrdered(0);
+    if ( ((tail + 1) & (QueueSize - 1)) == head )//full
+        return false;
+
+    ReceivedDatagram &slot = _queue[tail];
+    slot.frame = frame;
+    slot.srcIpAddress = srcIpAddress;
+    slot.srcPort = srcPort;
+
+    //publish - consumer sees the slot filled, since the store is ordered
+    _tail.fetchAndStoreOrdered((tail + 1) & (QueueSize - 1));
+    return true;
+}
+
+int BacnetUdpReceiveWorker::queueDepth()
+{
+    int head = _head.fetchAndAddOrdered(0);
+    int tail = _tail.fetchAndAddOrdered(0);
+    return (tail - head) & (QueueSize - 1);
+}
+
+bool BacnetUdpReceiveWorker::takeDatagram(ReceivedDatagram &datagram)
+{
+    int head = _head.fetchAndAddOrdered(0);
+    int tail = _tail.fetchAndAddOrdered(0);
+    if (head == tail)//empty
+        return false;
+
+    ReceivedDatagram &slot = _queue[head];
+    datagram.frame = slot.frame;
+    datagram.srcIpAddress = slot.srcIpAddress;
+    datagram.srcPort = slot.srcPort;
+    //give our reference back, before the slot is given to the producer
+    slot.frame = Buffer();
+
+    _head.fetchAndStoreOrdered((head + 1) & (QueueSize - 1));
+    return true;
+}
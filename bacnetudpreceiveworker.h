@@ -0,0 +1,85 @@
+#ifndef BACNETUDPRECEIVEWORKER_H
+#define BACNETUDPRECEIVEWORKER_H
+
+#include <QThread>
+#include <QAtomicInt>
+
+#include "buffer.h"
+
+class BacnetUdpTransportLayerHandler;
+
+/**
+  Receive worker - owns one of the SO_REUSEPORT sockets bound to the B/IP port and reads datagrams from it in its own thread.
+  Kernel distributes datagrams among such sockets by hashing the source address, so all the frames from one peer go through the
+  same worker and their order is kept.
+  Datagrams are read straight into pooled buffers and put into single-producer/single-consumer lock-free queue. The owner
+  (\sa BacnetUdpTransportLayerHandler) is notified with queued invocation and takes them in its own thread - the upper layers are
+  not thread safe, so they are always used from the owner thread.
+
+  \note Broadcasts are delivered by the kernel to every socket of the group - only the worker with acceptBroadcasts set passes them on
+  (\sa BacnetUdpTransportLayerHandler keeps broadcasts to its own socket, so none of its workers has it set).
+  */
+class BacnetUdpReceiveWorker:
+        public QThread
+{
+public:
+    //! Takes ownership over socketDescriptor, if ownsSocket is set.
+    BacnetUdpReceiveWorker(int socketDescriptor, bool ownsSocket, quint32 myIpAddress, bool acceptBroadcasts, BacnetUdpTransportLayerHandler *owner);
+    virtual ~BacnetUdpReceiveWorker();
+
+    //! Asks worker to finish and waits till it does.
+    void stop();
+
+    //! Has to be power of 2. One slot is always kept empty, to tell full queue from the empty one.
+    static const int QueueSize = 256;
+
+    struct ReceivedDatagram {
+        Buffer frame;
+        quint32 srcIpAddress;
+        quint16 srcPort;
+    };
+
+    /**
+      Takes the oldest datagram from the queue. Returns false, if queue is empty.
+      \note Has to be called from the owner thread only (single consumer).
+      */
+    bool takeDatagram(ReceivedDatagram &datagram);
+
+    //! Number of datagrams passed to the queue. Counters are 32-bit (atomic), so they wrap around.
+    quint64 receivedCount();
+    //! Number of datagrams dropped, since queue was full or there were no buffers.
+    quint64 droppedCount();
+    //! Number of datagrams waiting in the queue. May be called from any thread (it's only a snapshot, though).
+    int queueDepth();
+
+protected:
+    void run();
+
+private:
+    int readBatch_hlpr();
+    //! Producer side of the queue. Returns false, if queue is full.
+    bool putDatagram_hlpr(const Buffer &frame, quint32 srcIpAddress, quint16 srcPort);
+
+private:
+    static const int BatchSize = 16;
+    static const int StopCheckInterval_ms = 100;
+
+    ReceivedDatagram _queue[QueueSize];
+    //! Index of the next element to be taken - written by consumer only.
+    QAtomicInt _head;
+    //! Index of the next element to be put - written by producer only.
+    QAtomicInt _tail;
+    QAtomicInt _stopRequested;
+
+    int _socketDescriptor;
+    bool _ownsSocket;
+    quint32 _myIpAddress;
+    bool _acceptBroadcasts;
+    BacnetUdpTransportLayerHandler *_owner;
+
+    //written by worker thread only, read by the owner
+    QAtomicInt _receivedCount;
+    QAtomicInt _droppedCount;
+};
+
+#endif // BACNETUDPRECEIVEWORKER_H
@@ -3,15 +3,91 @@
 #include "bacnetcommon.h"
 #include "bacnetvirtuallinklayer.h"
 #include "buffer.h"
+#include "bacnetbuffermanager.h"
+#include "bacnetudpreceiveworker.h"
+
+#include <QTimerEvent>
+
+#ifdef BACNET_UDP_BATCHED_IO
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+/**
+  Structures used by recvmmsg()/sendmmsg(). Kept here, so that the header doesn't need to include system headers.
+  Each receive slot gets its own pooled buffer just before the call, so that the whole batch is read straight into
+  buffers upper layers may keep.
+  */
+struct BacnetUdpTransportLayerHandler::BatchIo {
+    mmsghdr rxMsgs[UdpBatchSize];
+    iovec rxIovs[UdpBatchSize];
+    sockaddr_in rxAddrs[UdpBatchSize];
+    Buffer rxFrames[UdpBatchSize];
+
+    mmsghdr txMsgs[UdpBatchSize];
+    iovec txIovs[UdpBatchSize];
+    sockaddr_in txAddrs[UdpBatchSize];
+};
+#endif
 
 BacnetUdpTransportLayerHandler::BacnetUdpTransportLayerHandler(QObject *parent) :
     QObject(parent),
+#ifdef BACNET_UDP_BATCHED_IO
+    _batchIo(new BatchIo()),
+#endif
+    _txQueuedCount(0),
+    _txQueueMaxDepth(DefaultTxQueueDepth),
+    _txQueueHighWaterMark(0),
+    _txDroppedCount(0),
+    _txRetriesCount(0),
+    _txPacingInterval_ms(0),
     _socket(new QUdpSocket(this)),
-    _bvllHndlr(0)
+    _bvllHndlr(0),
+    _rxCallsCount(0),
+    _rxDatagramsCount(0),
+    _txCallsCount(0),
+    _txDatagramsCount(0),
+    _sink(0),
+    _receiveWorkersCount(1),
+    _drainScheduled(0)
 {
     connect(_socket, SIGNAL(readyRead()), this, SLOT(readDatagrams()));
     //make space for _datagrams to be received
     _datagram.resize(Bacnet::BvllMaxSize);
+    _txClock.start();
+
+#ifdef BACNET_UDP_BATCHED_IO
+    //receive slots headers never change - set them up once (the data pointers are set when buffers are taken)
+    memset(_batchIo->rxMsgs, 0, sizeof(_batchIo->rxMsgs));
+    memset(_batchIo->txMsgs, 0, sizeof(_batchIo->txMsgs));
+    for (int i = 0; i < UdpBatchSize; ++i) {
+        _batchIo->rxMsgs[i].msg_hdr.msg_iov = &_batchIo->rxIovs[i];
+        _batchIo->rxMsgs[i].msg_hdr.msg_iovlen = 1;
+        _batchIo->rxMsgs[i].msg_hdr.msg_name = &_batchIo->rxAddrs[i];
+    }
+#endif
+}
+
+BacnetUdpTransportLayerHandler::~BacnetUdpTransportLayerHandler()
+{
+#ifdef BACNET_UDP_BATCHED_IO
+    stopWorkers_hlpr();
+    delete _batchIo;
+#endif
+}
+
+void BacnetUdpTransportLayerHandler::setReceiveWorkersCount(int count)
+{
+    Q_ASSERT(count > 0);
+    Q_ASSERT(_workers.isEmpty());
+#ifdef BACNET_UDP_BATCHED_IO
+    _receiveWorkersCount = qMax(1, count);
+#else
+    if (count > 1)
+        qDebug("%s : receive workers are not supported on this platform, reading in one thread.", __PRETTY_FUNCTION__);
+#endif
 }
 
 bool BacnetUdpTransportLayerHandler::setAddress(QHostAddress ip, quint16 port)
@@ -20,49 +96,564 @@ bool BacnetUdpTransportLayerHandler::setAddress(QHostAddress ip, quint16 port)
     _myPort = port;
     //will listen to the packets directed to the device/broadcasted with port port
     qDebug("%s : address set to %s:%d", __PRETTY_FUNCTION__, qPrintable(ip.toString()), port);
+    if (0 != _sink)//no network - nothing to bind
+        return true;
+#ifdef BACNET_UDP_BATCHED_IO
+    if (_receiveWorkersCount > 1)
+        return bindWorkers_hlpr(port);
+#endif
     return _socket->bind(port, QUdpSocket::ShareAddress);
 }
 
+#ifdef BACNET_UDP_BATCHED_IO
+bool BacnetUdpTransportLayerHandler::bindWorkers_hlpr(quint16 port)
+{
+    Q_ASSERT(_workers.isEmpty());
+
+    //one socket per worker, plus the one read and written by _socket in our thread
+    const int socketsCount = _receiveWorkersCount + 1;
+    QList<int> descriptors;
+    for (int i = 0; i < socketsCount; ++i) {
+        int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd < 0) {
+            qDebug("%s : socket() failed, errno %d", __PRETTY_FUNCTION__, errno);
+            break;
+        }
+        int on(1);
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        ::setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+        //we need destination address to tell broadcasts from unicasts
+        ::setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on));
+        if (::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+            qDebug("%s : SO_REUSEPORT not supported, errno %d", __PRETTY_FUNCTION__, errno);
+            ::close(fd);
+            break;
+        }
+
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        if (::bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+            qDebug("%s : bind() failed, errno %d", __PRETTY_FUNCTION__, errno);
+            ::close(fd);
+            break;
+        }
+        descriptors.append(fd);
+    }
+
+    if (descriptors.count() != socketsCount) {
+        //fall back to the single socket, read in our thread
+        foreach (int fd, descriptors)
+            ::close(fd);
+        qDebug("%s : can't set up %d receive workers, reading in one thread.", __PRETTY_FUNCTION__, _receiveWorkersCount);
+        _receiveWorkersCount = 1;
+        return _socket->bind(port, QUdpSocket::ShareAddress);
+    }
+
+    /* First socket is taken over by _socket - we send through it and read it in our thread, like without workers. Each descriptor
+       has exactly one reader, so no datagram is ever split between two recvmmsg() calls racing for it. */
+    if (!_socket->setSocketDescriptor(descriptors.first(), QUdpSocket::BoundState, QIODevice::ReadWrite)) {
+        qDebug("%s : can't take the socket over!", __PRETTY_FUNCTION__);
+        foreach (int fd, descriptors)
+            ::close(fd);
+        return false;
+    }
+
+    quint32 myIpAddress = _myAddress.toIPv4Address();
+    for (int i = 1; i < descriptors.count(); ++i) {
+        //kernel gives broadcasts to each socket - they are taken from _socket only
+        BacnetUdpReceiveWorker *worker = new BacnetUdpReceiveWorker(descriptors.at(i), true, myIpAddress, false, this);
+        _workers.append(worker);
+        worker->start();
+    }
+    return true;
+}
+
+void BacnetUdpTransportLayerHandler::stopWorkers_hlpr()
+{
+    qDeleteAll(_workers);
+    _workers.clear();
+}
+#endif
+
+void BacnetUdpTransportLayerHandler::workerHasData()
+{
+    if (_drainScheduled.testAndSetOrdered(0, 1))
+        QMetaObject::invokeMethod(this, "drainWorkers", Qt::QueuedConnection);
+}
+
+void BacnetUdpTransportLayerHandler::drainWorkers()
+{
+    Q_ASSERT(0 != _bvllHndlr);
+    //reset first - whatever is put after that, will schedule another call
+    _drainScheduled.fetchAndStoreOrdered(0);
+
+    BacnetUdpReceiveWorker::ReceivedDatagram datagram;
+    QHostAddress srcAddr;
+    bool gotAny(true);
+    //round robin over workers, so that one busy peer doesn't starve the others
+    while (gotAny) {
+        gotAny = false;
+        foreach (BacnetUdpReceiveWorker *worker, _workers) {
+            if (!worker->takeDatagram(datagram))
+                continue;
+            gotAny = true;
+            ++_rxDatagramsCount;
+            srcAddr.setAddress(datagram.srcIpAddress);
+            consumeDatagram_hlpr(datagram.frame.bodyPtr(), datagram.frame.bodyLength(), srcAddr, datagram.srcPort, &datagram.frame);
+        }
+    }
+    //don't keep the last one
+    datagram.frame = Buffer();
+}
+
+quint64 BacnetUdpTransportLayerHandler::workersDroppedCount()
+{
+    quint64 count(0);
+    foreach (BacnetUdpReceiveWorker *worker, _workers)
+        count += worker->droppedCount();
+    return count;
+}
+
+int BacnetUdpTransportLayerHandler::loadPercent()
+{
+    int load = _txQueuedCount * 100 / _txQueueMaxDepth;
+    foreach (BacnetUdpReceiveWorker *worker, _workers)
+        load = qMax(load, worker->queueDepth() * 100 / (BacnetUdpReceiveWorker::QueueSize - 1));
+    return qMin(load, 100);
+}
+
+void BacnetUdpTransportLayerHandler::setDatagramSink(BacnetUdpDatagramSink *sink)
+{
+    Q_ASSERT(_workers.isEmpty());
+    _sink = sink;
+}
+
+void BacnetUdpTransportLayerHandler::injectDatagram(quint8 *data, quint16 length, QHostAddress &srcAddr, quint16 srcPort, Buffer *frame)
+{
+    Q_ASSERT(0 != _bvllHndlr);
+    ++_rxDatagramsCount;
+    consumeDatagram_hlpr(data, length, srcAddr, srcPort, frame);
+}
+
 void BacnetUdpTransportLayerHandler::setBvlc(BacnetBvllHandler *bvllHndlr)
 {
     _bvllHndlr = bvllHndlr;
     Q_ASSERT(0 != _bvllHndlr);
 }
 
-void BacnetUdpTransportLayerHandler::readDatagrams()
+void BacnetUdpTransportLayerHandler::consumeDatagram_hlpr(quint8 *data, qint64 length, QHostAddress &srcAddr, quint16 srcPort, Buffer *frame)
+{
+    if ( (_myAddress == srcAddr) && (srcPort == _myPort) ) {
+        qDebug("BacnetUdpTransportLayerHandler:readDatagrams() : Discard message received from myself!");
+        return;
+    }
+    qDebug("Got message from %s, %d. My settings: %s, %d", qPrintable(srcAddr.toString()), srcPort,
+            qPrintable(_myAddress.toString()), _myPort);
+    //pass it to the higher layer if any data read
+    _bvllHndlr->consumeDatagram(data, length, srcAddr, srcPort, frame);
+}
+
+bool BacnetUdpTransportLayerHandler::readSingle_hlpr()
 {
-    Q_ASSERT(0 != _bvllHndlr);
     QHostAddress srcAddr;
     quint16 srcPort;
     qint64 length;
-    while (_socket->hasPendingDatagrams()) {
+
+    Buffer frame = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::TransportLayerRx);
+    if (!frame.isValid()) {
+        //pool is exhausted - use our own array. Upper layers won't be able to keep reference to it, but we don't loose the datagram.
         length = _socket->readDatagram(_datagram.data(), Bacnet::BvllMaxSize, &srcAddr, &srcPort);
-        if (length > 0) {
-            if ( (_myAddress == srcAddr) && (srcPort == _myPort) ) {
-                qDebug("BacnetUdpTransportLayerHandler:readDatagrams() : Discard message received from myself!");
+        ++_rxCallsCount;
+        if (length <= 0)
+            return false;
+        ++_rxDatagramsCount;
+        consumeDatagram_hlpr((quint8*)(_datagram.data()), length, srcAddr, srcPort, 0);
+        return true;
+    }
+
+    length = _socket->readDatagram((char*)frame.bodyPtr(), frame.bodyLength(), &srcAddr, &srcPort);
+    ++_rxCallsCount;
+    if (length <= 0)
+        return false;
+    ++_rxDatagramsCount;
+    frame.setBodyLength(length);
+    consumeDatagram_hlpr(frame.bodyPtr(), length, srcAddr, srcPort, &frame);
+    return true;
+}
+
+void BacnetUdpTransportLayerHandler::readDatagrams()
+{
+    Q_ASSERT(0 != _bvllHndlr);
+
+#ifdef BACNET_UDP_BATCHED_IO
+    /* The first datagram is always read by QUdpSocket. Qt disables the read notifier before emitting readyRead() and enables
+       it again only in readDatagram() - if we read everything directly from the descriptor, we would never get notified again.
+       The rest of what is pending is drained in batches. */
+    if (_socket->hasPendingDatagrams())
+        readSingle_hlpr();
+    while (readBatch_hlpr() > 0)
+        ;
+#else
+    while (_socket->hasPendingDatagrams())
+        readSingle_hlpr();
+#endif
+}
+
+#ifdef BACNET_UDP_BATCHED_IO
+int BacnetUdpTransportLayerHandler::readBatch_hlpr()
+{
+    //take as many buffers as we can (but no more than the batch size)
+    BacnetBufferManager *bufferManager = BacnetBufferManager::instance();
+    int slotsCount(0);
+    for (; slotsCount < UdpBatchSize; ++slotsCount) {
+        Buffer &frame = _batchIo->rxFrames[slotsCount];
+        frame = bufferManager->getBuffer(BacnetBufferManager::TransportLayerRx);
+        if (!frame.isValid())
+            break;
+        _batchIo->rxIovs[slotsCount].iov_base = frame.bodyPtr();
+        _batchIo->rxIovs[slotsCount].iov_len = frame.bodyLength();
+        //msg_namelen is value-result argument - has to be reset before each call
+        _batchIo->rxMsgs[slotsCount].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+    }
+
+    int count(0);
+    if (slotsCount > 0) {
+        count = recvmmsg(_socket->socketDescriptor(), _batchIo->rxMsgs, slotsCount, MSG_DONTWAIT, 0);
+        if ( (count < 0) && (EAGAIN != errno) && (EWOULDBLOCK != errno) )
+            qDebug("%s : recvmmsg() failed, errno %d", __PRETTY_FUNCTION__, errno);
+    } else if (_socket->hasPendingDatagrams()) {
+        //no buffers left in the pool, read one by one into our own array
+        return readSingle_hlpr() ? 1 : 0;
+    }
+
+    if (count > 0) {
+        ++_rxCallsCount;
+        _rxDatagramsCount += count;
+
+        //slots that got nothing are given back before anything is processed - answers need buffers, too
+        for (int i = count; i < slotsCount; ++i)
+            _batchIo->rxFrames[i] = Buffer();
+
+        QHostAddress srcAddr;
+        quint16 srcPort;
+        for (int i = 0; i < count; ++i) {
+            sockaddr_in &addr = _batchIo->rxAddrs[i];
+            if (AF_INET != addr.sin_family)//BIP is IPv4 only
                 continue;
-            }
-            qDebug("Got message from %s, %d. My settings: %s, %d", qPrintable(srcAddr.toString()), srcPort,
-                    qPrintable(_myAddress.toString()), _myPort);
-            //pass it to the higher layer if any data read
-            _bvllHndlr->consumeDatagram((quint8*)(_datagram.data()), length, srcAddr, srcPort);
+            srcAddr.setAddress(ntohl(addr.sin_addr.s_addr));
+            srcPort = ntohs(addr.sin_port);
+
+            Buffer &frame = _batchIo->rxFrames[i];
+            frame.setBodyLength(_batchIo->rxMsgs[i].msg_len);
+            consumeDatagram_hlpr(frame.bodyPtr(), frame.bodyLength(), srcAddr, srcPort, &frame);
+            frame = Buffer();
+        }
+    }
+
+    //give back our references - the buffers stay alive only if someone up there keeps them
+    for (int i = 0; i < slotsCount; ++i)//no-op for the ones already released
+        _batchIo->rxFrames[i] = Buffer();
+
+    return (count > 0) ? count : 0;
+}
+
+int BacnetUdpTransportLayerHandler::sendBatch_hlpr(const OutgoingDatagram *datagrams, int count)
+{
+    Q_ASSERT(count <= UdpBatchSize);
+    for (int i = 0; i < count; ++i) {
+        sockaddr_in &addr = _batchIo->txAddrs[i];
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(datagrams[i].destAddr.toIPv4Address());
+        addr.sin_port = htons(datagrams[i].destPort);
+
+        _batchIo->txIovs[i].iov_base = datagrams[i].data;
+        _batchIo->txIovs[i].iov_len = datagrams[i].length;
+
+        msghdr &hdr = _batchIo->txMsgs[i].msg_hdr;
+        hdr.msg_name = &addr;
+        hdr.msg_namelen = sizeof(sockaddr_in);
+        hdr.msg_iov = &_batchIo->txIovs[i];
+        hdr.msg_iovlen = 1;
+    }
+
+    int sent = sendmmsg(_socket->socketDescriptor(), _batchIo->txMsgs, count, MSG_DONTWAIT);
+    ++_txCallsCount;
+    if (sent < 0) {
+        qDebug("%s : sendmmsg() failed, errno %d", __PRETTY_FUNCTION__, errno);
+        return 0;
+    }
+    _txDatagramsCount += sent;
+    return sent;
+}
+#endif
+
+int BacnetUdpTransportLayerHandler::sendBatch(const QVector<OutgoingDatagram> &datagrams)
+{
+    return sendBatch(datagrams.constData(), datagrams.count());
+}
+
+int BacnetUdpTransportLayerHandler::sendBatch(const OutgoingDatagram *datagrams, int count)
+{
+    Q_ASSERT( (0 != datagrams) || (0 == count) );
+    int sentCount(0);
+    //when something is already waiting (or we pace), datagrams go one by one - each waits only if its destination has a backlog
+    if ( (_txQueuedCount > 0) || (_txPacingInterval_ms > 0) || (0 != _sink) ) {
+        for (int i = 0; i < count; ++i) {
+            const OutgoingDatagram &dgram = datagrams[i];
+            if (transmit_hlpr(dgram.data, dgram.length, dgram.destAddr, dgram.destPort, Bacnet::PriorityNormal))
+                ++sentCount;
+        }
+        return sentCount;
+    }
+
+#ifdef BACNET_UDP_BATCHED_IO
+    const OutgoingDatagram *dataPtr = datagrams;
+    int left = count;
+    while (left > 0) {
+        int chunk = qMin(left, (int)UdpBatchSize);
+        int sent = sendBatch_hlpr(dataPtr, chunk);
+        sentCount += sent;
+        if (sent != chunk) {
+            qDebug("%s : only %d of %d datagrams sent, rest is queued.", __PRETTY_FUNCTION__, sentCount, count);
+            break;
         }
+        dataPtr += chunk;
+        left -= chunk;
+    }
+    //socket is full - keep the rest for later
+    for (int i = sentCount; i < count; ++i) {
+        const OutgoingDatagram &dgram = datagrams[i];
+        if (enqueue_hlpr(dgram.data, dgram.length, dgram.destAddr, dgram.destPort, Bacnet::PriorityNormal))
+            ++sentCount;
     }
+#else
+    for (int i = 0; i < count; ++i) {
+        const OutgoingDatagram &dgram = datagrams[i];
+        ++_txCallsCount;
+        if (_socket->writeDatagram((char*)dgram.data, dgram.length, dgram.destAddr, dgram.destPort) == dgram.length) {
+            ++_txDatagramsCount;
+            ++sentCount;
+        } else if (enqueue_hlpr(dgram.data, dgram.length, dgram.destAddr, dgram.destPort, Bacnet::PriorityNormal)) {
+            ++sentCount;
+        }
+    }
+#endif
+    return sentCount;
 }
 
-bool BacnetUdpTransportLayerHandler::send(quint8 *data, qint64 length, QHostAddress destAddr, quint16 destPort)
+bool BacnetUdpTransportLayerHandler::send(quint8 *data, qint64 length, QHostAddress destAddr, quint16 destPort, Bacnet::NetworkPriority prio)
 {
-    return (_socket->writeDatagram((char*)data, length, destAddr, destPort) == length);
+    return transmit_hlpr(data, length, destAddr, destPort, prio);
 }
 
-void BacnetUdpTransportLayerHandler::sendBuffer(Buffer *buffer, QHostAddress &destAddr, quint16 destPort)
+void BacnetUdpTransportLayerHandler::sendBuffer(Buffer *buffer, QHostAddress &destAddr, quint16 destPort, Bacnet::NetworkPriority prio)
 {
     qDebug()<<"Data is being sent to"<<destAddr<<destPort;
     Buffer::printArray(buffer->bodyPtr(), buffer->bodyLength(), "Sending data:");
 
-    if (buffer->bodyLength() != _socket->writeDatagram((char*)buffer->bodyPtr(), buffer->bodyLength(), destAddr, destPort)) {
-        qDebug("I didn't manage to send the data! Need to implement resending!");
+    if (!transmit_hlpr(buffer->bodyPtr(), buffer->bodyLength(), destAddr, destPort, prio))
+        qDebug("%s : datagram dropped!", __PRETTY_FUNCTION__);
+}
+
+BacnetUdpTransportLayerHandler::TxQueueIdx BacnetUdpTransportLayerHandler::queueIdx(Bacnet::NetworkPriority prio)
+{
+    switch (prio) {
+    case (Bacnet::PriorityLifeSafety):
+        return LifeSafetyQueue;
+    case (Bacnet::PriorityCritical):
+        return CriticalQueue;
+    case (Bacnet::PriorityUrgent):
+        return UrgentQueue;
+    default:
+        return NormalQueue;
+    }
+}
+
+bool BacnetUdpTransportLayerHandler::transmit_hlpr(quint8 *data, quint16 length, const QHostAddress &destAddr, quint16 destPort, Bacnet::NetworkPriority prio)
+{
+    /* If anything is waiting for the same destination, we go to the end of the queue - otherwise its frames could be reordered.
+       Other destinations don't wait for the backlog (or pacing) of this one. */
+    quint64 destKey = destinationKey(destAddr, destPort);
+    if (!_txQueuedDestinations.contains(destKey)) {
+        if (isPacingReady_hlpr(destKey) && write_hlpr(data, length, destAddr, destPort)) {
+            if (_txPacingInterval_ms > 0)
+                _lastSentTimes[destKey] = _txClock.elapsed();
+            return true;
+        }
+    }
+
+    return enqueue_hlpr(data, length, destAddr, destPort, prio);
+}
+
+bool BacnetUdpTransportLayerHandler::write_hlpr(quint8 *data, quint16 length, const QHostAddress &destAddr, quint16 destPort)
+{
+    ++_txCallsCount;
+    if (0 != _sink)
+        _sink->datagramSent(data, length, destAddr, destPort);
+    else if (_socket->writeDatagram((char*)data, length, destAddr, destPort) != length)
+        return false;
+    ++_txDatagramsCount;
+    return true;
+}
+
+bool BacnetUdpTransportLayerHandler::enqueue_hlpr(quint8 *data, quint16 length, const QHostAddress &destAddr, quint16 destPort, Bacnet::NetworkPriority prio)
+{
+    int idx = queueIdx(prio);
+    if (_txQueuedCount >= _txQueueMaxDepth) {
+        //make room by dropping the newest of the least important ones - unless the new one is not more important
+        int victimIdx = NormalQueue;
+        while ( (victimIdx > idx) && _txQueues[victimIdx].isEmpty() )
+            --victimIdx;
+        ++_txDroppedCount;
+        if (victimIdx <= idx) {
+            qDebug("%s : transmit queue full (%d), datagram dropped.", __PRETTY_FUNCTION__, _txQueuedCount);
+            return false;
+        }
+        const QueuedDatagram &victim = _txQueues[victimIdx].last();
+        dequeued_hlpr(destinationKey(victim.destAddr, victim.destPort));
+        _txQueues[victimIdx].removeLast();
+    }
+
+    //the data pointed by caller is valid only during the call (or its buffer is reused for other ports) - has to be copied
+    Buffer frame = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::TransportLayer, length);
+    if (!frame.isValid() || (frame.buffLength() < length)) {
+        ++_txDroppedCount;
+        qDebug("%s : no buffer for the datagram, dropped.", __PRETTY_FUNCTION__);
+        return false;
     }
+    memcpy(frame.bufferStart(), data, length);
+    frame.setBodyPtr(frame.bufferStart());
+    frame.setBodyLength(length);
+
+    QueuedDatagram queued;
+    queued.frame = frame;
+    queued.destAddr = destAddr;
+    queued.destPort = destPort;
+    queued.retriesCount = 0;
+    _txQueues[idx].enqueue(queued);
+    ++_txQueuedCount;
+    ++_txQueuedDestinations[destinationKey(destAddr, destPort)];
+    if (_txQueuedCount > _txQueueHighWaterMark)
+        _txQueueHighWaterMark = _txQueuedCount;
+
+    if (!_txTimer.isActive())
+        _txTimer.start(TxRetryInterval_ms, this);
+    return true;
+}
+
+void BacnetUdpTransportLayerHandler::dequeued_hlpr(quint64 destKey)
+{
+    --_txQueuedCount;
+    QHash<quint64, int>::Iterator it = _txQueuedDestinations.find(destKey);
+    Q_ASSERT(_txQueuedDestinations.end() != it);
+    if ( (_txQueuedDestinations.end() != it) && (--it.value() <= 0) )
+        _txQueuedDestinations.erase(it);
+}
+
+bool BacnetUdpTransportLayerHandler::isPacingReady_hlpr(quint64 destKey)
+{
+    if (0 == _txPacingInterval_ms)
+        return true;
+    QHash<quint64, qint64>::Iterator it = _lastSentTimes.find(destKey);
+    if (_lastSentTimes.end() == it)
+        return true;
+    return (_txClock.elapsed() - it.value() >= _txPacingInterval_ms);
+}
+
+void BacnetUdpTransportLayerHandler::flushTxQueue_hlpr()
+{
+    //destinations, that have to wait in this pass - their later frames mustn't overtake the waiting ones
+    QSet<quint64> blockedDestinations;
+    qint64 now = _txClock.elapsed();
+
+    for (int idx = 0; idx < TxQueuesCount; ++idx) {
+        QQueue<QueuedDatagram> &queue = _txQueues[idx];
+        QQueue<QueuedDatagram>::Iterator it = queue.begin();
+        while (it != queue.end()) {
+            quint64 destKey = destinationKey(it->destAddr, it->destPort);
+            if (blockedDestinations.contains(destKey) || !isPacingReady_hlpr(destKey)) {
+                blockedDestinations.insert(destKey);
+                ++it;
+                continue;
+            }
+
+            if (!write_hlpr(it->frame.bodyPtr(), it->frame.bodyLength(), it->destAddr, it->destPort)) {
+                ++_txRetriesCount;
+                if (++(it->retriesCount) < TxMaxRetriesCount) {
+                    //only this destination waits for the next pass - the rest of the queues still get their chance
+                    blockedDestinations.insert(destKey);
+                    ++it;
+                    continue;
+                }
+                qDebug("%s : datagram couldn't be sent after %d tries, dropped.", __PRETTY_FUNCTION__, it->retriesCount);
+                ++_txDroppedCount;
+            } else if (_txPacingInterval_ms > 0) {
+                _lastSentTimes[destKey] = now;
+            }
+            it = queue.erase(it);
+            dequeued_hlpr(destKey);
+        }
+    }
+
+    //forget destinations we haven't sent to for a while, so that the table doesn't grow without bounds
+    if (_lastSentTimes.count() > PacingTableCleanupSize) {
+        QHash<quint64, qint64>::Iterator timeIt = _lastSentTimes.begin();
+        while (timeIt != _lastSentTimes.end()) {
+            if (now - timeIt.value() >= _txPacingInterval_ms)
+                timeIt = _lastSentTimes.erase(timeIt);
+            else
+                ++timeIt;
+        }
+    }
+}
+
+void BacnetUdpTransportLayerHandler::timerEvent(QTimerEvent *event)
+{
+    if (event->timerId() != _txTimer.timerId()) {
+        QObject::timerEvent(event);
+        return;
+    }
+
+    flushTxQueue_hlpr();
+    if (0 == _txQueuedCount)
+        _txTimer.stop();
+}
+
+void BacnetUdpTransportLayerHandler::setTxQueueDepth(int depth)
+{
+    Q_ASSERT(depth > 0);
+    _txQueueMaxDepth = qMax(1, depth);
+}
+
+void BacnetUdpTransportLayerHandler::setTxPacingInterval(int interval_ms)
+{
+    Q_ASSERT(interval_ms >= 0);
+    _txPacingInterval_ms = qMax(0, interval_ms);
+    if (0 == _txPacingInterval_ms)
+        _lastSentTimes.clear();
+}
+
+int BacnetUdpTransportLayerHandler::txQueueDepth()
+{
+    return _txQueuedCount;
+}
+
+int BacnetUdpTransportLayerHandler::txQueueHighWaterMark()
+{
+    return _txQueueHighWaterMark;
+}
+
+quint64 BacnetUdpTransportLayerHandler::txDroppedCount()
+{
+    return _txDroppedCount;
+}
+
+quint64 BacnetUdpTransportLayerHandler::txRetriesCount()
+{
+    return _txRetriesCount;
 }
 
 QHostAddress BacnetUdpTransportLayerHandler::address()
@@ -74,3 +665,17 @@ quint16 BacnetUdpTransportLayerHandler::port()
 {
     return _myPort;
 }
+
+double BacnetUdpTransportLayerHandler::averageRxBatchSize()
+{
+    if (0 == _rxCallsCount)
+        return 0;
+    return (double)_rxDatagramsCount / _rxCallsCount;
+}
+
+double BacnetUdpTransportLayerHandler::averageTxBatchSize()
+{
+    if (0 == _txCallsCount)
+        return 0;
+    return (double)_txDatagramsCount / _txCallsCount;
+}
@@ -3,8 +3,22 @@
 
 #include <QObject>
 #include <QUdpSocket>
+#include <QVector>
+#include <QQueue>
+#include <QBasicTimer>
+#include <QElapsedTimer>
 
 #include "bacnetbipaddress.h"
+#include "bacnetcommon.h"
+#include "buffer.h"
+
+/**
+  When defined, datagrams are read (and may be sent) in batches - up to UdpBatchSize of them per one system call
+  (recvmmsg()/sendmmsg()). It's available only on Linux, other platforms use one readDatagram()/writeDatagram() per frame.
+  */
+#if defined(Q_OS_LINUX)
+#define BACNET_UDP_BATCHED_IO
+#endif
 
 /**
   This class is to be used to take care of data transport.
@@ -12,13 +26,27 @@
   */
 
 class BacnetBvllHandler;
-class Buffer;
+class BacnetUdpReceiveWorker;
+
+/**
+  Interface of the object, that takes over all the datagrams sent by \sa BacnetUdpTransportLayerHandler, instead of the socket.
+  Used when there is no real network (e.g. capture replay or in-process simulations).
+  */
+class BacnetUdpDatagramSink
+{
+public:
+    virtual ~BacnetUdpDatagramSink() {}
+    //! Data is valid only during the call.
+    virtual void datagramSent(const quint8 *data, quint16 length, const QHostAddress &destAddr, quint16 destPort) = 0;
+};
+
 class BacnetUdpTransportLayerHandler :
         public QObject//inhertiance from QObject due to readDatagrams() slot
 {
     Q_OBJECT
 public:
     explicit BacnetUdpTransportLayerHandler(QObject *parent = 0);
+    virtual ~BacnetUdpTransportLayerHandler();
 
     /**
       This function has two uses:
@@ -28,14 +56,57 @@ public:
       */
     bool setAddress(QHostAddress ip, quint16 port);
 
+    /**
+      Makes handler work without the network - socket is not bound (\sa setAddress() only sets the address) and everything that
+      is to be sent is given to sink. Datagrams may still be fed from outside with \sa injectDatagram().
+      \note Has to be called before \sa setAddress(). Doesn't take ownership over sink.
+      */
+    void setDatagramSink(BacnetUdpDatagramSink *sink);
+
+    /**
+      Passes the datagram up, as if it was read from the socket (own datagrams are discarded the same way).
+      \param frame - pooled buffer data lies in, if any.
+      */
+    void injectDatagram(quint8 *data, quint16 length, QHostAddress &srcAddr, quint16 srcPort, Buffer *frame = 0);
+
+    /**
+      Sets number of threads reading datagrams from the port (default 1 - everything is done in the owner thread). When bigger than 1,
+      \sa setAddress() binds that many sockets to the same port (SO_REUSEPORT) and each gets its own \sa BacnetUdpReceiveWorker; one
+      more socket stays with us - it's used for sending and gets broadcasts, and its share of unicasts.
+      Only the recvmmsg() calls are parallelised - decoding (BVLL and up) is still done in our thread, so this helps when the system calls
+      are the bottleneck, not the protocol stack.
+      \note Has to be called before \sa setAddress(). Available on Linux only - elsewhere it's ignored.
+      */
+    void setReceiveWorkersCount(int count);
+
     //! Sets the instance of BVLL layer, which will all the datagrams be passed to.
     void setBvlc(BacnetBvllHandler *bvllHndlr);
 
-    //! Used by higher layers to send data over UDP
-    bool send(quint8 *data, qint64 length, QHostAddress destAddr, quint16 destPort);
+    /**
+      Used by higher layers to send data over UDP. If the socket can't take the datagram at the moment (or some are already waiting
+      for it), data is copied into the transmit queue and sent later. Returns false only if the datagram was dropped.
+      */
+    bool send(quint8 *data, qint64 length, QHostAddress destAddr, quint16 destPort, Bacnet::NetworkPriority prio = Bacnet::PriorityNormal);
 
     //! Newer version of above.
-    void sendBuffer(Buffer *buffer, QHostAddress &destAddr, quint16 destPort);
+    void sendBuffer(Buffer *buffer, QHostAddress &destAddr, quint16 destPort, Bacnet::NetworkPriority prio = Bacnet::PriorityNormal);
+
+    //! Single entry of the batch, that is sent with \sa sendBatch().
+    struct OutgoingDatagram {
+        quint8 *data;
+        quint16 length;
+        QHostAddress destAddr;
+        quint16 destPort;
+    };
+
+    /**
+      Sends all the datagrams with as few system calls as possible (sendmmsg() sends up to UdpBatchSize at once).
+      What socket doesn't take, is put into the transmit queue. Returns number of datagrams that were sent or queued (not dropped).
+      \note the data pointed by entries has to be valid only during the call.
+      */
+    int sendBatch(const QVector<OutgoingDatagram> &datagrams);
+    //! Same as above, for callers that keep (and reuse) their own array of entries.
+    int sendBatch(const OutgoingDatagram *datagrams, int count);
 
     /**
       Returns actual ip address of the device
@@ -48,8 +119,53 @@ public:
       */
     quint16 port();
 
+    /**
+      Returns average number of datagrams got with one read system call. If it's close to 1, batching doesn't give us anything
+      (traffic is low); under storms it should grow towards UdpBatchSize.
+      */
+    double averageRxBatchSize();
+    //! Same as above, but for the datagrams sent with \sa sendBatch().
+    double averageTxBatchSize();
+
+    /**
+      Sets the maximum number of datagrams waiting in the transmit queue (all priorities together). When it's full, datagram of the
+      lowest waiting priority is dropped (or the new one, if it's not more important than anything waiting).
+      */
+    void setTxQueueDepth(int depth);
+    /**
+      Sets the minimum interval between two datagrams sent to the same destination (address and port). 0 (default) turns pacing off.
+      It's meant for slow devices behind the port (e.g. MS/TP routers), which can't take bursts. Only the datagrams to the paced
+      destination wait in the queue - the others are sent at once.
+      */
+    void setTxPacingInterval(int interval_ms);
+
+    //! Number of datagrams currently waiting in the transmit queue.
+    int txQueueDepth();
+    //! The biggest number of datagrams that were waiting in the transmit queue at once.
+    int txQueueHighWaterMark();
+    //! Number of datagrams dropped, since the queue was full or they couldn't be sent after TxMaxRetriesCount tries.
+    quint64 txDroppedCount();
+    //! Number of times sending a queued datagram was tried again.
+    quint64 txRetriesCount();
+
+    //! Number of datagrams that workers couldn't pass to us (queue full or no buffers). Always 0, if there are no workers.
+    quint64 workersDroppedCount();
+
+    //! Fill level of the fullest queue (transmit one or any of the workers receive queues), in percents.
+    int loadPercent();
+
+    /**
+      Called by workers (from their threads) when they have put something into their queues. Schedules \sa drainWorkers()
+      in our thread, unless it's already scheduled.
+      */
+    void workerHasData();
+
 signals:
 
+protected:
+    //! Used to retry sending what is in the transmit queue.
+    void timerEvent(QTimerEvent *);
+
 private slots:
     /**
       This slot is used to read pending datagrams.
@@ -58,6 +174,84 @@ private slots:
       */
     void readDatagrams();
 
+    //! Takes datagrams from all the workers queues and passes them up.
+    void drainWorkers();
+
+private:
+    //! Sends datagram or puts it into the queue. Returns false, if it was dropped.
+    bool transmit_hlpr(quint8 *data, quint16 length, const QHostAddress &destAddr, quint16 destPort, Bacnet::NetworkPriority prio);
+    //! Tries to write datagram to the socket. Returns false, if socket didn't take it.
+    bool write_hlpr(quint8 *data, quint16 length, const QHostAddress &destAddr, quint16 destPort);
+    //! Copies the datagram into the pooled buffer and puts it at the end of the prio queue.
+    bool enqueue_hlpr(quint8 *data, quint16 length, const QHostAddress &destAddr, quint16 destPort, Bacnet::NetworkPriority prio);
+    //! Sends as much of the queued datagrams as socket and pacing let us, most important first.
+    void flushTxQueue_hlpr();
+    //! Returns true, if pacing lets us send to the destination now.
+    bool isPacingReady_hlpr(quint64 destKey);
+    //! Bookkeeping of the datagram taken out of the queue (sent or dropped).
+    void dequeued_hlpr(quint64 destKey);
+    inline quint64 destinationKey(const QHostAddress &destAddr, quint16 destPort) {return ((quint64)destAddr.toIPv4Address() << 16) | destPort;}
+
+    //! Passes datagram to the BVLL, unless it is our own one.
+    void consumeDatagram_hlpr(quint8 *data, qint64 length, QHostAddress &srcAddr, quint16 srcPort, Buffer *frame);
+
+    /**
+      Reads one datagram with QUdpSocket straight into the buffer taken from \sa BacnetBufferManager, so that upper layers may keep it
+      instead of copying. If the pool is exhausted, datagram is read into _datagram array. Returns true, if anything was read.
+      */
+    bool readSingle_hlpr();
+
+#ifdef BACNET_UDP_BATCHED_IO
+    //! Reads at most UdpBatchSize datagrams with one recvmmsg() call (each into its own pooled buffer) and passes them up. Returns number of datagrams read, 0 when nothing was pending.
+    int readBatch_hlpr();
+    int sendBatch_hlpr(const OutgoingDatagram *datagrams, int count);
+    struct BatchIo;
+    BatchIo *_batchIo;
+
+    //! Binds _receiveWorkersCount + 1 sockets to the port - the first one is taken by _socket, workers are started on the others.
+    bool bindWorkers_hlpr(quint16 port);
+    void stopWorkers_hlpr();
+#endif
+
+public:
+    static const int UdpBatchSize = 16;
+    static const int DefaultTxQueueDepth = 256;
+    static const int TxRetryInterval_ms = 5;
+    static const int TxMaxRetriesCount = 200;
+
+private:
+    //! Queues are kept in order of importance - LifeSafety first, Normal last.
+    enum TxQueueIdx {
+        LifeSafetyQueue = 0,
+        CriticalQueue,
+        UrgentQueue,
+        NormalQueue,
+        TxQueuesCount
+    };
+    static TxQueueIdx queueIdx(Bacnet::NetworkPriority prio);
+
+    struct QueuedDatagram {
+        Buffer frame;
+        QHostAddress destAddr;
+        quint16 destPort;
+        int retriesCount;
+    };
+    QQueue<QueuedDatagram> _txQueues[TxQueuesCount];
+    int _txQueuedCount;
+    //! Destination key -> number of its datagrams waiting in the queues. Datagrams to destinations not in here are sent at once.
+    QHash<quint64, int> _txQueuedDestinations;
+    int _txQueueMaxDepth;
+    int _txQueueHighWaterMark;
+    quint64 _txDroppedCount;
+    quint64 _txRetriesCount;
+    QBasicTimer _txTimer;
+
+    int _txPacingInterval_ms;
+    QElapsedTimer _txClock;
+    //! Destination key -> time (from _txClock) the last datagram was sent to it. Used only when pacing is on.
+    QHash<quint64, qint64> _lastSentTimes;
+    static const int PacingTableCleanupSize = 1024;
+
 private:
     QUdpSocket *_socket;
     QByteArray _datagram;
@@ -66,6 +260,18 @@ private:
 
     QHostAddress _myAddress;
     quint16 _myPort;
+
+    //statistics
+    quint64 _rxCallsCount;
+    quint64 _rxDatagramsCount;
+    quint64 _txCallsCount;
+    quint64 _txDatagramsCount;
+
+    BacnetUdpDatagramSink *_sink;
+
+    int _receiveWorkersCount;
+    QList<BacnetUdpReceiveWorker*> _workers;
+    QAtomicInt _drainScheduled;
 };
 
 #endif // BACNETUDPTRANSPORTLAYER_H
@@ -28,12 +28,17 @@ void BacnetBvllHandler::setBbmdHndlr(BacnetBbmdHandler *bbmdHandler)
     _bbmdHndlr = bbmdHandler;
 }
 
+BacnetBroadcastFilter &BacnetBvllHandler::broadcastFilter()
+{
+    return _broadcastFilter;
+}
+
 void BacnetBvllHandler::setTransportProxy(BacnetTransportLayerHandler *transportProxy)
 {
     _transportProxyPtr = transportProxy;
 }
 
-void BacnetBvllHandler::consumeDatagram(quint8 *data, quint32 length, QHostAddress srcAddr, quint64 srcPort)
+void BacnetBvllHandler::consumeDatagram(quint8 *data, quint32 length, QHostAddress srcAddr, quint64 srcPort, Buffer *frame)
 {
     //decode BVLL information
     //first assert there is enough data to encode this message
@@ -109,6 +114,15 @@ void BacnetBvllHandler::consumeDatagram(quint8 *data, quint32 length, QHostAddre
             BacnetAddress origDeviceAddress;
             quint8 *addrPtr = &data[Bvlc_Forwarded_AddressField];
             quint8 addrLength = BacnetBipAddressHelper::macAddressFromRaw(addrPtr, &origDeviceAddress);
+            //data passed to network layer is shorter than data carried by forwarded-NPDU by address length
+            quint8 *npduPtr = addrPtr + addrLength;
+            dataLength -= addrLength;
+
+            //copies of the same broadcast may come through several BBMDs
+            quint32 origIpAddress;
+            HelperCoder::uint32FromRaw(addrPtr, &origIpAddress);
+            if (!_broadcastFilter.accept(origIpAddress, BacnetBipAddressHelper::ipPort(origDeviceAddress), npduPtr, dataLength))
+                break;
 
             //do we support BBMD?
             if (0 != _bbmdHndlr) {
@@ -117,20 +131,33 @@ void BacnetBvllHandler::consumeDatagram(quint8 *data, quint32 length, QHostAddre
             }
 
             //pass it to network layer
-            //data passed to network layer is shorter than data carried by forwarded-NPDU by address length
-            quint8 *npduPtr = addrPtr + addrLength;
-            dataLength -= addrLength;
-            _networkHndlr->readNpdu(npduPtr, dataLength, origDeviceAddress, _transportProxyPtr);
+            _networkHndlr->readNpdu(npduPtr, dataLength, origDeviceAddress, _transportProxyPtr, frame);
 
             break;
         }
     case (Register_Foreign_Device): {
-            //! \todo add support if necessary
-            sendShortResult(Register_Foreign_Device_NAK, srcAddr, srcPort);
+            //only BBMD may accept registrations; data field is time-to-live
+            bool ok(false);
+            if ( (0 != _bbmdHndlr) && (dataLength >= 2) ) {
+                quint16 timeToLive;
+                HelperCoder::uint16FromRaw(&data[BvlcDataField], &timeToLive);
+                ok = _bbmdHndlr->registerForeignDevice(srcAddr, srcPort, timeToLive);
+            }
+            sendShortResult((ok ? Successful_Completion : Register_Foreign_Device_NAK), srcAddr, srcPort);
             break;
         }
     case (Read_Foreign_Device_Table): {
-            //! \todo add support if necessary
+            if (0 != _bbmdHndlr) {
+                //there is no segmentation in BVLL - the ack carries only as many entries as fit into one frame
+                quint16 dataSize = qMin(_bbmdHndlr->expectedForeignDeviceTableRawSize(),
+                                        (quint16)(Bacnet::BvllMaxSize - BvlcConstHeaderSize));
+                QByteArray resultData; resultData.resize(dataSize + BvlcConstHeaderSize);
+                quint8 *respFrame = (quint8*)resultData.data();
+                dataSize = _bbmdHndlr->setForeignDeviceTableToRaw(&respFrame[BvlcDataField], dataSize);
+                setHeadersFields(respFrame, Read_Foreign_Device_Table_Ack, dataSize);
+                send(respFrame, dataSize + BvlcConstHeaderSize, srcAddr, srcPort);
+                break;
+            }
             sendShortResult(Read_Foreign_Device_Table_NAK, srcAddr, srcPort);
             break;
         }
@@ -139,37 +166,43 @@ void BacnetBvllHandler::consumeDatagram(quint8 *data, quint32 length, QHostAddre
             break;
         }
     case (Delete_Foreign_Device_Table_Entry): {
-        //! \todo pass it to BVLL state machine, when we support FDT
-        if (0 != _bbmdHndlr) {
-            qDebug("%s : Not handled, do it if FD is to be implemented.", __PRETTY_FUNCTION__);
-            sendShortResult(Delete_Foreign_Device_Table_Entry_NAK, srcAddr, srcPort);
+            //data field is B/IP address of the entry to be deleted
+            bool ok(false);
+            if ( (0 != _bbmdHndlr) && (dataLength >= BacnetBipAddressHelper::BipAddrLength) ) {
+                BacnetAddress fdAddress;
+                BacnetBipAddressHelper::macAddressFromRaw(&data[BvlcDataField], &fdAddress);
+                ok = _bbmdHndlr->deleteForeignDevice(BacnetBipAddressHelper::ipAddress(fdAddress), BacnetBipAddressHelper::ipPort(fdAddress));
+            }
+            sendShortResult((ok ? Successful_Completion : Delete_Foreign_Device_Table_Entry_NAK), srcAddr, srcPort);
             break;
         }
-    }
     case (Distribute_Broadcast_To_Network): {
-        if (0 != _bbmdHndlr) {
-            BacnetAddress srcBipAddr;
-            BacnetBipAddressHelper::setMacAddress(srcAddr, srcPort, &srcBipAddr);
-            //get npdu data information (pointer to start & size)
-            quint8 *npdu = data + BvlcConstHeaderSize;
-            quint16 npduLength = dataLength;
-
-            //if we are BBMD, forward it to other BBMDS
-            //first create Forwarded-NPDU message
-            QByteArray forwardedMsg;
-            quint16 forwardedLength = createForwardedMsg(npdu, npduLength, forwardedMsg, srcAddr, srcPort);
-            quint8 *forwardedPtr = (quint8 *)forwardedMsg.data();
-
-            //this will send to all BBMDs except itself
-            _bbmdHndlr->processBroadcastToNetwork(forwardedPtr, forwardedLength, srcBipAddr);
-            /**
-             \note this is important to pass message to the upper layer. This message was sent locally, but we will not
-             receive it anymore, since our transport layer discards all the messages sent by oursleves.
-             */
-            //pass it to the netorowk layer, since we won't get the forwarded message (our transport layer blocks messages sent by ourself)
-            _networkHndlr->readNpdu(npdu, npduLength, srcBipAddr, _transportProxyPtr);
-
+        //J.4.5 - only registered foreign devices may ask us to distribute broadcasts
+        if ( (0 == _bbmdHndlr) || !_bbmdHndlr->isForeignDevice(srcAddr, srcPort) ) {
+            sendShortResult(Distribute_Broadcast_To_Network_NAK, srcAddr, srcPort);
+            break;
         }
+        //get npdu data information (pointer to start & size)
+        quint8 *npdu = data + BvlcConstHeaderSize;
+        quint16 npduLength = dataLength;
+        if (!_broadcastFilter.accept(srcAddr.toIPv4Address(), srcPort, npdu, npduLength))
+            break;
+        BacnetAddress srcBipAddr;
+        BacnetBipAddressHelper::setMacAddress(srcAddr, srcPort, &srcBipAddr);
+
+        //if we are BBMD, forward it to other BBMDS
+        //first create Forwarded-NPDU message
+        Buffer forwardedMsg = createForwardedMsg(npdu, npduLength, srcAddr, srcPort);
+
+        //this will send to local subnet, all BBMDs except itself and FDs
+        if (forwardedMsg.isValid())
+            _bbmdHndlr->processBroadcastToNetwork(forwardedMsg.bodyPtr(), forwardedMsg.bodyLength(), srcBipAddr);
+        /**
+         \note this is important to pass message to the upper layer. This message was sent locally, but we will not
+         receive it anymore, since our transport layer discards all the messages sent by oursleves.
+         */
+        //pass it to the netorowk layer, since we won't get the forwarded message (our transport layer blocks messages sent by ourself)
+        _networkHndlr->readNpdu(npdu, npduLength, srcBipAddr, _transportProxyPtr, frame);
         break;
     }
     case (Original_Unicast_NPDU): {
@@ -180,27 +213,28 @@ void BacnetBvllHandler::consumeDatagram(quint8 *data, quint32 length, QHostAddre
             quint8 *npdu = &data[BvlcConstHeaderSize];
             quint16 npduLength = dataLength;
             //pass it
-            _networkHndlr->readNpdu(npdu, npduLength, srcBipAddr, _transportProxyPtr);
+            _networkHndlr->readNpdu(npdu, npduLength, srcBipAddr, _transportProxyPtr, frame);
             break;
         }
     case (Original_Broadcast_NPDU): {
             //some device sent us a broadcast - forward it to BBMDs and FDs (if necessary) and pass to the upper layer
-            BacnetAddress srcBipAddr;
-            BacnetBipAddressHelper::setMacAddress(srcAddr, srcPort, &srcBipAddr);
             //prepare npdu infor
             quint8 *npdu = &data[BvlcConstHeaderSize];
             quint16 npduLength = dataLength;
+            if (!_broadcastFilter.accept(srcAddr.toIPv4Address(), srcPort, npdu, npduLength))
+                break;
+            BacnetAddress srcBipAddr;
+            BacnetBipAddressHelper::setMacAddress(srcAddr, srcPort, &srcBipAddr);
 
             //are we BBMD?
             if (0 != _bbmdHndlr) {
-                QByteArray forwardedMsg;
-                quint16 forwardedLength = createForwardedMsg(npdu, npduLength, forwardedMsg, srcAddr, srcPort);
-                quint8 *forwardedPtr = (quint8 *)forwardedMsg.data();
-                _bbmdHndlr->processOriginalBroadcast(forwardedPtr, forwardedLength, srcBipAddr);
+                Buffer forwardedMsg = createForwardedMsg(npdu, npduLength, srcAddr, srcPort);
+                if (forwardedMsg.isValid())
+                    _bbmdHndlr->processOriginalBroadcast(forwardedMsg.bodyPtr(), forwardedMsg.bodyLength(), srcBipAddr);
             }
 
             //pass it to the upper layer
-            _networkHndlr->readNpdu(npdu, npduLength, srcBipAddr, _transportProxyPtr);
+            _networkHndlr->readNpdu(npdu, npduLength, srcBipAddr, _transportProxyPtr, frame);
             break;
         }
     default:
@@ -230,18 +264,17 @@ quint8 BacnetBvllHandler::setHeadersFields(quint8 *data, BvlcFunction functionCo
 
 void BacnetBvllHandler::sendShortResult(BvlcResultCode result, QHostAddress destAddr, quint16 destPort)
 {
-    QByteArray respData;
     //BVLC-Result: Format - is constant length - 6 octets
-    respData.reserve(BvlcResultSize);
+    quint8 respData[BvlcResultSize];
 
     //fill headers
-    quint8 *fieldsPtr = (quint8*)respData.data();
+    quint8 *fieldsPtr = respData;
     fieldsPtr += setHeadersFields(fieldsPtr, BVLC_Result, BvlcResultSize - BvlcConstHeaderSize);
 
     //set result value
     fieldsPtr += HelperCoder::uin16ToRaw(result, fieldsPtr);
 
-    send((quint8*)respData.data(), BvlcResultSize, destAddr, destPort);
+    send(respData, BvlcResultSize, destAddr, destPort);
 }
 
 void BacnetBvllHandler::send(quint8 *data, quint16 length, QHostAddress destAddr, quint16 destPort)
@@ -250,6 +283,12 @@ void BacnetBvllHandler::send(quint8 *data, quint16 length, QHostAddress destAddr
     _transportHndlr->send(data, length, destAddr, destPort);
 }
 
+int BacnetBvllHandler::sendBatch(const BacnetUdpTransportLayerHandler::OutgoingDatagram *datagrams, int count)
+{
+    Q_ASSERT(0 != _transportHndlr);
+    return _transportHndlr->sendBatch(datagrams, count);
+}
+
 QHostAddress BacnetBvllHandler::address() {
     return _transportHndlr->address();
 }
@@ -258,38 +297,37 @@ quint16 BacnetBvllHandler::port() {
     return _transportHndlr->port();
 }
 
-quint8 BacnetBvllHandler::createForwardedMsg(quint8 *npduToForward, quint16 npduLength, QByteArray &forwardedMsg, QHostAddress srcAddr, quint16 srcPort)
+Buffer BacnetBvllHandler::createForwardedMsg(quint8 *npduToForward, quint16 npduLength, const QHostAddress &srcAddr, quint16 srcPort)
 {
     quint16 forwardedSize = npduLength + BvlcConstHeaderSize + BacnetBipAddressHelper::BipAddrLength;
-    forwardedMsg.reserve(forwardedSize);
-    quint8 *forwardMsgPtr = (quint8*)forwardedMsg.data();
-    quint8 *fieldsPtr = forwardMsgPtr;
+    Buffer forwardedMsg = BacnetBufferManager::instance()->getBuffer(BacnetBufferManager::TransportLayer, forwardedSize);
+    if (!forwardedMsg.isValid() || (forwardedMsg.bodyLength() < forwardedSize)) {
+        qDebug("%s : no buffer for Forwarded-NPDU!", __PRETTY_FUNCTION__);
+        return Buffer();
+    }
+    quint8 *fieldsPtr = forwardedMsg.bodyPtr();
     //fill in the message
     fieldsPtr += setHeadersFields(fieldsPtr, Forwarded_NPDU, forwardedSize - BvlcConstHeaderSize);
     //create source/originator address
-    BacnetAddress bIpAddress;
-    BacnetBipAddressHelper::setMacAddress(srcAddr, srcPort, &bIpAddress);
-    fieldsPtr += bIpAddress.macAddressToRaw(fieldsPtr);
+    fieldsPtr += BacnetBipAddressHelper::ipAddrToRaw(srcAddr, srcPort, fieldsPtr);
     //copy npdu
     memcpy(fieldsPtr, npduToForward, npduLength);
 
-    return forwardedSize;
+    forwardedMsg.setBodyLength(forwardedSize);
+    return forwardedMsg;
 }
 
 void BacnetBvllHandler::sendNpdu(Buffer *buffToSend, Bacnet::NetworkPriority prio,
                                  const BacnetAddress *destAddress, const BacnetAddress *srcAddress)
 {
-    Q_UNUSED(prio);
     Q_UNUSED(srcAddress);
-    /* get safe start byte for this layer - it is calculated basing on the maximum header sizes for each layer
-       We are sure that while creating correct header and inserting it's bytes we will not run onto bytes of NPDU
-       which currently are at buffToSend->bodyStart().
+    /* BVLL headers are prepended just in front of NPDU (buffers are given with enough headroom for the longest one - \sa BacnetBufferManager::BvllHeadroom).
+       Body is restored at the end, so that network layer may send the same buffer to other ports.
      */
     quint8 *originalBufferStartPtr = buffToSend->bodyPtr();
     quint16 originalBodyLength = buffToSend->bodyLength();
 
-    quint8 *startByte = buffToSend->bufferStart() + BacnetBufferManager::offsetForLayer(BacnetBufferManager::TransportLayer);
-    quint8 *dataPtr = startByte;
+    quint8 *dataPtr(0);
 
 
     /** From network layer invoked send NPDU
@@ -339,69 +377,46 @@ void BacnetBvllHandler::sendNpdu(Buffer *buffToSend, Bacnet::NetworkPriority pri
     if (0 == destAddress)
         destAddress = &_globBcastAddr;
     if (destAddress->isLocalBraodacst() || destAddress->isGlobalBroadcast() || destAddress->isRemoteBroadcast()) {
-        quint8 appendedSize(0);
         if (0 != _bbmdHndlr ) {
-            //send as forwarded-NPDU to all FDs and BBMDs. Remember buffer information, so that at the end of this case, we restore them.
-            //Forwarded-NPDU header without loosing information about NPDU position and size.
-            //create original broadcast and send it
-            dataPtr += setHeadersFields(dataPtr, Forwarded_NPDU,
-                                        buffToSend->bodyLength() + BacnetBipAddressHelper::BipAddrLength);
-            //set forwarded address
-            BacnetBipAddressHelper::ipAddrToRaw(address(), port(), dataPtr);
-
-            appendedSize = dataPtr - startByte;
-            //we have to stitch the data together - there is probably a gap between npdu and this bvll header            
-            Q_ASSERT(originalBufferStartPtr - dataPtr >= 0);//otherwise we overlap - this shouldn't happen
-            quint8 *finalBodyPtr = startByte + (originalBufferStartPtr - dataPtr);//shift from startByte about gap width
-            memmove(startByte, finalBodyPtr, appendedSize);//close the gap
-
-            BacnetAddress tmpAddr;
-            _bbmdHndlr->processOriginalBroadcast(finalBodyPtr, buffToSend->bodyLength() + appendedSize, tmpAddr);
-
-            //restore buffer body (of APDU data) information
+            //send as forwarded-NPDU to all FDs and BBMDs. Header is prepended in front of NPDU and removed afterwards.
+            dataPtr = buffToSend->prepend(BvlcConstHeaderSize + BacnetBipAddressHelper::BipAddrLength);
+            Q_CHECK_PTR(dataPtr);
+            if (0 != dataPtr) {
+                dataPtr += setHeadersFields(dataPtr, Forwarded_NPDU, originalBodyLength + BacnetBipAddressHelper::BipAddrLength);
+                //set forwarded address
+                BacnetBipAddressHelper::ipAddrToRaw(address(), port(), dataPtr);
+
+                BacnetAddress tmpAddr;
+                _bbmdHndlr->processOriginalBroadcast(buffToSend->bodyPtr(), buffToSend->bodyLength(), tmpAddr);
+            }
+
+            //restore buffer body (of NPDU data) information
             buffToSend->setBodyPtr(originalBufferStartPtr);
             buffToSend->setBodyLength(originalBodyLength);
         }
 
-
         //create original-broadcast and send it with local braodcast address
         //this time I can use original buffer.
-        dataPtr = startByte;
-        //qDebug("Network ptr 0x%p and apdu ptr 0x%p (No bbmd)", dataPtr, buffToSend->bodyPtr());
-        dataPtr += setHeadersFields(dataPtr, Original_Broadcast_NPDU, buffToSend->bodyLength());
-        appendedSize = dataPtr - startByte;
-        Q_ASSERT(buffToSend->bodyPtr() - dataPtr >= 0);//otherwise we overlap - this shouldn't happen
-        quint8 *finalBodyPtr = startByte + (buffToSend->bodyPtr() - dataPtr);//shift from startByte about gap width
-        memmove(startByte, finalBodyPtr, appendedSize);//close the gap
-
-        buffToSend->setBodyPtr(finalBodyPtr);
-        buffToSend->setBodyLength(buffToSend->bodyLength() + appendedSize);
-        QHostAddress broadcastAddr = QHostAddress::Broadcast;
-        _transportHndlr->sendBuffer(buffToSend, broadcastAddr, port());
-
+        dataPtr = buffToSend->prepend(BvlcConstHeaderSize);
+        Q_CHECK_PTR(dataPtr);
+        if (0 != dataPtr) {
+            setHeadersFields(dataPtr, Original_Broadcast_NPDU, originalBodyLength);
+            QHostAddress broadcastAddr = QHostAddress::Broadcast;
+            _transportHndlr->sendBuffer(buffToSend, broadcastAddr, port(), prio);
+        }
     } else {
         //create unicast and send it
-        dataPtr += setHeadersFields(dataPtr, Original_Unicast_NPDU, buffToSend->bodyLength());
-        quint8 appendedSize = dataPtr - startByte;
-        //we have to stitch the data together - there is probably a gap between npdu and this bvll header
-        Q_ASSERT(buffToSend->bodyPtr() - dataPtr >= 0);//otherwise we overlap - this shouldn't happen
-
-        printf("Encoded size is %d (0x%x)\n", buffToSend->bodyLength(), buffToSend->bodyLength());
-        HelperCoder::printArray(startByte, appendedSize, "BVLL stitch:");
+        dataPtr = buffToSend->prepend(BvlcConstHeaderSize);
+        Q_CHECK_PTR(dataPtr);
+        if (0 != dataPtr) {
+            setHeadersFields(dataPtr, Original_Unicast_NPDU, originalBodyLength);
+            Buffer::printArray(buffToSend->bodyPtr(), buffToSend->bodyLength(), "Bvll sends:");
 
-        quint8 *finalBodyPtr = startByte + (buffToSend->bodyPtr() - dataPtr);//shift from startByte about gap width
-        memmove(finalBodyPtr, startByte, appendedSize);//close the gap
+            QHostAddress destHost = BacnetBipAddressHelper::ipAddress(*destAddress);
+            quint64 destPort = BacnetBipAddressHelper::ipPort(*destAddress);
 
-
-        buffToSend->setBodyPtr(finalBodyPtr);
-        buffToSend->setBodyLength(buffToSend->bodyLength() + appendedSize);
-
-        Buffer::printArray(buffToSend->bodyPtr(), buffToSend->bodyLength(), "Bvll sends:");
-
-        QHostAddress destHost = BacnetBipAddressHelper::ipAddress(*destAddress);
-        quint64 destPort = BacnetBipAddressHelper::ipPort(*destAddress);
-
-        _transportHndlr->sendBuffer(buffToSend, destHost, destPort);
+            _transportHndlr->sendBuffer(buffToSend, destHost, destPort, prio);
+        }
     }
 
     //restore buffer data
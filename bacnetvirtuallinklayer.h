@@ -5,33 +5,34 @@
 #include <QHostAddress>
 
 #include "bacnettransportlayer.h"
+#include "bacnetudptransportlayer.h"
 #include "bacnetcommon.h"
+#include "bacnetbroadcastfilter.h"
+#include "buffer.h"
 
 class BacnetNetworkLayerHandler;
-class BacnetUdpTransportLayerHandler;
 class BacnetBbmdHandler;
-class Buffer;
 
 /**
-    \note The behaviour of Foreign Device is not implemented - most probably, it is easiest to exchange this Class,
-    because only Forwarded-NPDU (for reception & transmission) as well as Distribute-Broadcast-To-Network (broadcast write)
-    and Register-Foreign-Device with Result (registration is needed).
-
+    BVLL for BACnet/IP (Annex J). When BBMD handler is set, this node accepts Foreign Device registrations (Register-Foreign-Device,
+    Read-Foreign-Device-Table and Delete-Foreign-Device-Table-Entry) and distributes their Distribute-Broadcast-To-Network messages
+    (\sa BacnetBbmdHandler).
+    \note This node can't register itself as a Foreign Device with some other BBMD - BVLC-Result frames we get are ignored.
   */
 class BacnetBvllHandler
 {
 public:
     BacnetBvllHandler(BacnetUdpTransportLayerHandler *transportLayerHndlr);
 
-    //! BACnet BVLC result codes
+    //! BACnet BVLC result codes (J.2.1.1)
     enum BvlcResultCode{
-        Successful_Completion,
-        Write_Broadcast_Distribution_Table_NAK,
-        Read_Broadcast_Distribution_Table_NAK,
-        Register_Foreign_Device_NAK,
-        Read_Foreign_Device_Table_NAK,
-        Delete_Foreign_Device_Table_Entry_NAK,
-        Distribute_Broadcast_To_Network_NAK
+        Successful_Completion                   = 0x0000,
+        Write_Broadcast_Distribution_Table_NAK  = 0x0010,
+        Read_Broadcast_Distribution_Table_NAK   = 0x0020,
+        Register_Foreign_Device_NAK             = 0x0030,
+        Read_Foreign_Device_Table_NAK           = 0x0040,
+        Delete_Foreign_Device_Table_Entry_NAK   = 0x0050,
+        Distribute_Broadcast_To_Network_NAK     = 0x0060
     };
 
     //! According to BACnet specification, there are 12 BVLC functions
@@ -66,8 +67,12 @@ public:
         Bvlc_Forwarded_AddressField = BvlcDataField
     };
 
-    //! Used when reading the data from underlying transport layer.
-    void consumeDatagram(quint8 *data, quint32 datagramLength, QHostAddress srcAddr, quint64 srcPort);
+    /**
+      Used when reading the data from underlying transport layer.
+      \param frame - if the datagram was read into pooled buffer, this is the buffer data lies in. It's passed to upper layers, so that they can
+      keep a reference to it (instead of copying data). May be 0 - then data is valid only during the call.
+      */
+    void consumeDatagram(quint8 *data, quint32 datagramLength, QHostAddress srcAddr, quint64 srcPort, Buffer *frame = 0);
 
     /**
       Used to send data from network layer.
@@ -83,9 +88,17 @@ public:
 
     void setNetworkLayer(BacnetNetworkLayerHandler *networkHndlr);
 
+    /**
+      Broadcasts (Original-Broadcast-NPDU, Forwarded-NPDU and Distribute-Broadcast-To-Network) go through this filter before anything
+      else is done with them - duplicates and the ones over the originator limit are dropped. Use it to configure and read statistics.
+      */
+    BacnetBroadcastFilter &broadcastFilter();
+
 private:
     //! Helper function to send data to underlying transport layer.
     void send(quint8 *data, quint16 length, QHostAddress destAddr, quint16 destPort);
+    //! Same as above, for many destinations at once (\sa BacnetUdpTransportLayerHandler::sendBatch()). Returns number of datagrams not dropped.
+    int sendBatch(const BacnetUdpTransportLayerHandler::OutgoingDatagram *datagrams, int count);
 
     //! Get data from assigned transport layer about my ip address;
     QHostAddress address();
@@ -106,14 +119,14 @@ private:
     quint8 setHeadersFields(quint8 *data, BvlcFunction functionCode, quint16 addLength);
 
     /**
-      Helper function creating forwarded message from npdu. NPDU should be npduLength size.
+      Helper function creating forwarded message from npdu. NPDU should be npduLength size. Message is encoded once into a pooled buffer
+      and then sent to all the destinations by \sa BacnetBbmdHandler.
       \param npduToForward - pointer to an array with npdu data to forward;
-      \param forwardedMsg - array, where created message is stored;
       \param srcAddr - address of the originator of NPDU message;
       \param srcPort - port of the originator of NPDU message;
-      \returns number of bytes that forwardedMsg takes.
+      \returns buffer with the message as its body, invalid one if the pool is exhausted.
       */
-    quint8 createForwardedMsg(quint8 *npduToForward, quint16 npduLength, QByteArray &forwardedMsg, QHostAddress srcAddr, quint16 srcPort);
+    Buffer createForwardedMsg(quint8 *npduToForward, quint16 npduLength, const QHostAddress &srcAddr, quint16 srcPort);
 
 private:
     //! Holds the pointer to the network layer - should have.
@@ -127,6 +140,7 @@ private:
     BacnetTransportLayerHandler *_transportProxyPtr;
 
     BacnetAddress _globBcastAddr;
+    BacnetBroadcastFilter _broadcastFilter;
     friend class BacnetBbmdHandler;//encapsulation is broken! \todo think of it
 };
 
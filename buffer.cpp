@@ -1,8 +1,10 @@
 #include "buffer.h"
 #include <stdio.h>
 
+#include "bacnetbuffermanager.h"
+
 Buffer::Buffer():
-        _refCount(0),
+        _wrapper(0),
         _buffer(0),
         _buffLength(0),
         _bodyLength(0),
@@ -10,39 +12,49 @@ Buffer::Buffer():
 {}
 
 Buffer::~Buffer() {
-    if (0 != _refCount) {
-        --(*_refCount);
-    }
+    release();
+}
+
+void Buffer::release()
+{
+    //the last user gives the memory back to the pool
+    if ( (0 != _wrapper) && !_wrapper->refCount.deref() )
+        BacnetBufferManager::instance()->release(_wrapper);
+}
+
+int Buffer::refCount() const
+{
+    return (0 != _wrapper) ? (int)_wrapper->refCount : 0;
 }
 
 Buffer::Buffer(const Buffer &other):
-        _refCount(other._refCount),
+        _wrapper(other._wrapper),
         _buffer(other._buffer),
         _buffLength(other._buffLength),
         _bodyLength(other._bodyLength),
         _bodyPtr(other._bodyPtr)
 {
-    if (0 != _refCount)
-        ++(*_refCount);
+    if (0 != _wrapper)
+        _wrapper->refCount.ref();
 }
 
 const Buffer &Buffer::operator=(const Buffer &other) {
-    if (_buffer == other._buffer)//we are the same
+    if (this == &other)
         return *this;
-    else {
-        if (0 != _refCount)
-            --(*_refCount);
-
-        _buffer = other._buffer;
-        _buffLength = other._buffLength;
-        _bodyLength = other._bodyLength;
-        _refCount = other._refCount;
-        _bodyPtr = other._bodyPtr;
-
-        if (0 != other._refCount)
-            ++(*other._refCount);
-        return other;
-    }
+
+    //copies of the same memory may have different bodies (\sa prepend()) - body is always taken from the other one
+    //take the reference first - other may be owned by the same memory we release
+    if (0 != other._wrapper)
+        other._wrapper->refCount.ref();
+    release();
+
+    _buffer = other._buffer;
+    _buffLength = other._buffLength;
+    _bodyLength = other._bodyLength;
+    _wrapper = other._wrapper;
+    _bodyPtr = other._bodyPtr;
+
+    return *this;
 }
 
 quint8 *Buffer::bufferStart()
@@ -75,15 +87,58 @@ quint8 *Buffer::bodyPtr()
     return _bodyPtr;
 }
 
+quint16 Buffer::headroom()
+{
+    if (0 == _bodyPtr)
+        return 0;
+    return _bodyPtr - _buffer;
+}
+
+quint16 Buffer::tailroom()
+{
+    if (0 == _bodyPtr)
+        return 0;
+    return (_buffer + _buffLength) - (_bodyPtr + _bodyLength);
+}
+
+quint8 *Buffer::prepend(quint16 length)
+{
+    Q_ASSERT(headroom() >= length);
+    if (headroom() < length)
+        return 0;
+    _bodyPtr -= length;
+    _bodyLength += length;
+    return _bodyPtr;
+}
+
+quint8 *Buffer::append(quint16 length)
+{
+    Q_ASSERT(tailroom() >= length);
+    if (tailroom() < length)
+        return 0;
+    quint8 *appendPtr = _bodyPtr + _bodyLength;
+    _bodyLength += length;
+    return appendPtr;
+}
+
+void Buffer::trimFront(quint16 length)
+{
+    Q_ASSERT(_bodyLength >= length);
+    if (_bodyLength < length)
+        length = _bodyLength;
+    _bodyPtr += length;
+    _bodyLength -= length;
+}
+
 bool Buffer::isValid() const
 {
-    //true if _refCount is not pointing to nothing (to 0)
-    return (0 != _refCount);
+    //true if _wrapper is not pointing to nothing (to 0)
+    return (0 != _wrapper);
 }
 
 bool Buffer::isShared() const
 {
-    return (1 != (*_refCount));
+    return (1 != refCount());
 }
 
 void Buffer::printArray(const quint8 *ptr, int size, const char *pretext)
@@ -3,6 +3,7 @@
 
 #include <QtCore>
 
+class BufferWrapper;
 class Buffer {
 public:
     /**
@@ -13,7 +14,7 @@ public:
 
     /**
       Copy constructor of the other Buffer. What it does is increasing reference counter (used by \sa BufferManager
-      and point to the same array as the other Buffer instance.
+      and point to the same array as the other Buffer instance. The counter is atomic, so copies may live in different threads.
       \note The length and body start are copied, but since now they become idependent of each other!
       */
     Buffer(const Buffer &other);
@@ -26,7 +27,7 @@ public:
 
 
 #ifndef QT_NO_DEBUG
-    void seeRefCout() {qDebug("The refCount is %d", (0 != _refCount) ? *_refCount : 0);}
+    void seeRefCout() {qDebug("The refCount is %d", refCount());}
 #endif
 
     /**
@@ -52,6 +53,24 @@ public:
     void setBodyPtr(quint8 *bodyPtr);
     quint8 *bodyPtr();
 
+    //! Returns number of free bytes in front of the body - that much may be prepended.
+    quint16 headroom();
+    //! Returns number of free bytes after the body - that much may be appended.
+    quint16 tailroom();
+
+    /**
+      Extends the body towards the buffer start by length bytes and returns pointer to the new body start - that's where lower layer
+      should write its header. If there is not enough headroom, nothing is changed and 0 is returned.
+      */
+    quint8 *prepend(quint16 length);
+    /**
+      Extends the body at its end by length bytes and returns pointer to the first appended byte. If there is not enough tailroom,
+      nothing is changed and 0 is returned.
+      */
+    quint8 *append(quint16 length);
+    //! Removes length bytes from the front of the body (e.g. header that was prepended for one send only). Reverse of \sa prepend().
+    void trimFront(quint16 length);
+
     /**
       Returns true, if the memory for the buffer is allocated.
       */
@@ -65,11 +84,15 @@ public:
     static void printArray(const quint8 *ptr, int size, const char *pretext = "");
 
 private:
-    Buffer(quint8 *refCount, quint16 buffLength):
-            _refCount(refCount), _buffLength(buffLength){}
+    //! Creates template buffer, which is owned by the wrapper - it's not counted as a user of the memory.
+    Buffer(BufferWrapper *wrapper, quint16 buffLength):
+            _wrapper(wrapper), _buffer(0), _buffLength(buffLength), _bodyLength(0), _bodyPtr(0){}
+
+    int refCount() const;
+    void release();
 
-    //! \note This is a pointer, not an integer itself, since when we update it, we want to update globally.
-    quint8 *_refCount;
+    //! \note This is a pointer to the pool element, which holds the reference counter - when we update it, we want to update globally.
+    BufferWrapper *_wrapper;
     // A pointer to the internal buffer. \note These buffers are assigned internally by \sa DataManager
     quint8 *_buffer;
     // When allocated or copied, value of the length of the buffer is set here.
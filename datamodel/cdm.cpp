@@ -6,7 +6,6 @@
 #include "propertysubject.h"
 
 DataModel *DataModel::_instance = 0;
-const int DataModel::UNUSED_TIME_VALUE = std::numeric_limits<int>::min();
 
 DataModel::DataModel(QObject *parent):
     QObject(parent),
@@ -14,12 +13,12 @@ DataModel::DataModel(QObject *parent):
     _untakenProperties(0)
 {
     initiateAsynchIds();
-
-    startTimer(100*_internalTimeout_ms);
 }
 
 DataModel::~DataModel()
 {
+    for (int id = 0; id < MAX_ASYNCH_ID; ++id)
+        TimingWheel::instance()->cancel(_asynchIdStates[id].timer);
 }
 
 DataModel *DataModel::instance()
@@ -243,7 +242,7 @@ PropertyObserver *DataModel::createPropertyObserver(quint32 propId)
 void DataModel::initiateAsynchIds()
 {
     _asynchIdStates.reserve(MAX_ASYNCH_ID);
-    AsynchIdEntry nullEntry = {UNUSED_TIME_VALUE, 0, 0};
+    AsynchIdEntry nullEntry = {false, TimingWheel::InvalidTimerId, 0, 0};
     for (int i = 0; i < MAX_ASYNCH_ID; ++i) {
         _asynchIdStates.append(nullEntry);
     }
@@ -265,7 +264,8 @@ int DataModel::generateAsynchId()
 
     _asynchIdStates[id].subjectProperty = 0;
     _asynchIdStates[id].requestingObserver = 0;
-    _asynchIdStates[id].timeLeft = _internalTimeout_ms;
+    _asynchIdStates[id].inUse = true;
+    _asynchIdStates[id].timer = TimingWheel::instance()->arm(_internalTimeout_ms, this, id);
 
     ++id;
     return id;
@@ -313,26 +313,23 @@ void DataModel::releaseAsynchId(int id)
     setAsynchIdUnused(id);
 }
 
-void DataModel::timerEvent(QTimerEvent *)
+void DataModel::setAsynchIdUnused(int asynchId)
 {
-    for (int id = 0; id<MAX_ASYNCH_ID; ++id) {
-        if (!isAsynchIdUnused(id)) {
-            if (_asynchIdStates[id].timeLeft <= _internalTimeout_ms) {
-                if (_asynchIdStates[id].timeLeft < 0) {//the time this transaction is outstanding is within [_internalTimeout_ms, 2*_internalTimeout_ms). Time to clean!
-                    if (_asynchIdStates[id].subjectProperty != 0) {
-                        _asynchIdStates[id].subjectProperty;//timeout INTERNAL_TIMEOUT
-                    }
-                    if (_asynchIdStates[id].requestingObserver != 0) {
-                        _asynchIdStates[id].requestingObserver->asynchActionFinished(id, Property::InternalTimeout);//timeout INTERNAL_TIMEOUT
-                    }
-                    setAsynchIdUnused(id);
-                } else {//clean it next time
-                    _asynchIdStates[id].timeLeft = -1;//mark it to be cleaned next time
-                }
-            }
-        } else {//transaction relatively new
-            _asynchIdStates[id].timeLeft -= _internalTimeout_ms;
-        }
-    }
-    qDebug("Cleaning is started!");
+    AsynchIdEntry &entry = _asynchIdStates[asynchId];
+    entry.inUse = false;
+    TimingWheel::instance()->cancel(entry.timer);
+    entry.timer = TimingWheel::InvalidTimerId;
+}
+
+void DataModel::timerExpired(quintptr cookie)
+{
+    int id = cookie;
+    Q_ASSERT(id < MAX_ASYNCH_ID);
+    Q_ASSERT(!isAsynchIdUnused(id));
+    _asynchIdStates[id].timer = TimingWheel::InvalidTimerId;
+
+    qDebug("%s : asynchronous action %d not finished in time, clean it.", __PRETTY_FUNCTION__, id + 1);
+    if (0 != _asynchIdStates[id].requestingObserver)
+        _asynchIdStates[id].requestingObserver->asynchActionFinished(id + 1, Property::InternalTimeout);
+    setAsynchIdUnused(id);
 }
@@ -6,14 +6,16 @@
 #include <QVector>
 #include <QVariant>
 #include <QObject>
-#include <limits>
+
+#include "timingwheel.h"
 
 class Property;
 class PropertyOwner;
 class PropertySubject;
 class PropertyObserver;
 class DataModel:
-    public QObject
+    public QObject,
+    public TimingWheelClient
 {
     Q_OBJECT;
 public:
@@ -57,8 +59,9 @@ public:
     PropertyObserver *asynchActionRequester(int asynchId);
     PropertySubject *asynchActionSubject(int asynchId);
 
-protected:
-    void timerEvent(QTimerEvent *);
+public://TimingWheelClient interface
+    //! Asynchronous action (cookie is its index) wasn't finished on time.
+    void timerExpired(quintptr cookie);
 
 private:
     DataModel(QObject *parent = 0);
@@ -73,8 +76,8 @@ private:
 private:
     static DataModel *_instance;
 
-    //value given in 1/10 of second. Default timeout is 1 second.
-    static const int DEFAULT_TIMEOUT = 2000;
+    //! Asynchronous action is given up, when it's not finished within that time - it's a safety net only, lower layers have their own timeouts.
+    static const int DEFAULT_TIMEOUT = 200000;
     int _internalTimeout_ms;
 
     //! list containing PropertySubjects that have been created and taken.
@@ -87,21 +90,20 @@ private:
       */
     static const int MAX_ASYNCH_ID = 255;
 
-    /** The data model has to take care of stale transactions. If not, then some transactions may be never released. This
-        This list is created so that, the model checks if any transaction is not too old. If so, it calls
-        PropertyOwner::asynchOpertationDone() with TIMEOUT parameter and clears internal data used for
-        asynchId (_asynchIds bit and _asynchIdInfo entry).
+    /** The data model has to take care of stale transactions. If not, then some transactions may be never released. Each
+        used id has its timer armed on \sa TimingWheel - when it expires, PropertyObserver::asynchActionFinished() is called
+        with InternalTimeout and the id is released.
       */
     struct AsynchIdEntry {
-        int timeLeft;
+        bool inUse;
+        TimingWheel::TimerId timer;
         PropertySubject *subjectProperty;
         PropertyObserver *requestingObserver;
     };
     QVector<AsynchIdEntry> _asynchIdStates;
 
-    static const int UNUSED_TIME_VALUE;
-    inline bool isAsynchIdUnused(int asynchId) {return (UNUSED_TIME_VALUE == _asynchIdStates[asynchId].timeLeft);}
-    inline void setAsynchIdUnused(int asynchId) {_asynchIdStates[asynchId].timeLeft = UNUSED_TIME_VALUE;}
+    inline bool isAsynchIdUnused(int asynchId) {return !_asynchIdStates[asynchId].inUse;}
+    void setAsynchIdUnused(int asynchId);
 };
 
 #endif // CDM_H
@@ -44,7 +44,12 @@ DiscoveryWrapper::Action ConfirmedDiscoveryWrapper::handleTimeout(BacnetApplicat
 void ConfirmedDiscoveryWrapper::discoveryFinished(BacnetApplicationLayerHandler *appLayer, BacnetAddress &responderAddress)
 {
     Q_CHECK_PTR(appLayer);
-    appLayer->send(responderAddress, _sourceAddress, _serviceToSend);
+    if (BacnetApplicationLayerHandler::RequestFailed == appLayer->send(responderAddress, _sourceAddress, _serviceToSend)) {
+        //requester doesn't wait for the return value anymore - the request is over, as if it timed out
+        if (ExternalConfirmedServiceHandler::DeleteServiceHandler == _serviceToSend->handleTimeout())
+            delete _serviceToSend;
+    }
+    _serviceToSend = 0;
 }
 
 UnconfirmedDiscoveryWrapper::UnconfirmedDiscoveryWrapper(const ObjIdNum destinedObject, const BacnetAddress &source, BacnetServiceData *data, quint8 serviceChoice, int retryCount):
@@ -8,14 +8,20 @@ using namespace Bacnet;
 Error::Error(BacnetServicesNS::BacnetErrorChoice errorChoice):
     _errorChoice(errorChoice),
     errorClass(BacnetErrorNS::ClassNoError),
-    errorCode(BacnetErrorNS::CodeNoError)
+    errorCode(BacnetErrorNS::CodeNoError),
+    firstFailedObjectId(invalidObjIdNum()),
+    firstFailedPropertyId(BacnetPropertyNS::UndefinedProperty),
+    firstFailedArrayIndex(ArrayIndexNotPresent)
 {
 }
 
 Error::Error(BacnetServicesNS::BacnetErrorChoice errorChoice, BacnetErrorNS::ErrorClass errorClass, BacnetErrorNS::ErrorCode errorCode):
     _errorChoice(errorChoice),
     errorClass(errorClass),
-    errorCode(errorCode)
+    errorCode(errorCode),
+    firstFailedObjectId(invalidObjIdNum()),
+    firstFailedPropertyId(BacnetPropertyNS::UndefinedProperty),
+    firstFailedArrayIndex(ArrayIndexNotPresent)
 {
 }
 
@@ -30,9 +36,48 @@ void Error::setError(BacnetErrorNS::ErrorClass errorClass, BacnetErrorNS::ErrorC
     this->errorCode = errorCode;
 }
 
+void Error::setFirstFailedWrite(ObjIdNum objectId, BacnetPropertyNS::Identifier propertyId, quint32 arrayIndex)
+{
+    firstFailedObjectId = objectId;
+    firstFailedPropertyId = propertyId;
+    firstFailedArrayIndex = arrayIndex;
+}
+
 qint32 Error::appPartFromRaw(quint8 *errorData, quint16 bufferLength)
 {
     BacnetTagParser bParser(errorData, bufferLength);
+    if (BacnetServicesNS::WritePropertyMultiple != _errorChoice)
+        return classAndCodeFromRaw_hlpr(bParser);
+
+    //WritePropertyMultiple-Error is [0] error followed by [1] first failed write
+    qint32 total(0);
+    qint32 ret(0);
+
+    ret = bParser.parseNext();
+    if ( (ret <= 0) || !bParser.isOpeningTag(0) )
+        return -1;
+    total += ret;
+
+    ret = classAndCodeFromRaw_hlpr(bParser);
+    if (ret <= 0)
+        return -1;
+    total += ret;
+
+    ret = bParser.parseNext();
+    if ( (ret <= 0) || !bParser.isClosingTag(0) )
+        return -1;
+    total += ret;
+
+    ret = firstFailedWriteFromRaw_hlpr(bParser);
+    if (ret <= 0)
+        return -1;
+    total += ret;
+
+    return total;
+}
+
+qint32 Error::classAndCodeFromRaw_hlpr(BacnetTagParser &bParser)
+{
     bool convOk;
 
     qint32 total(0);
@@ -57,7 +102,89 @@ qint32 Error::appPartFromRaw(quint8 *errorData, quint16 bufferLength)
     return total;
 }
 
+qint32 Error::firstFailedWriteFromRaw_hlpr(BacnetTagParser &bParser)
+{
+    bool convOkOrCtxt;
+
+    qint32 total(0);
+    qint32 ret(0);
+
+    ret = bParser.parseNext();
+    if ( (ret <= 0) || !bParser.isOpeningTag(1) )
+        return -1;
+    total += ret;
+
+    ret = bParser.parseNext();
+    ObjectIdStruct objId = bParser.toObjectId(&convOkOrCtxt);
+    if ( (ret <= 0) || !bParser.isContextTag(0) || !convOkOrCtxt ) {
+        qDebug("%s : Cannot parse object of the failed write", __PRETTY_FUNCTION__);
+        return -1;
+    }
+    firstFailedObjectId = objIdToNum(objId);
+    total += ret;
+
+    ret = bParser.parseNext();
+    firstFailedPropertyId = (BacnetPropertyNS::Identifier)bParser.toUInt(&convOkOrCtxt);
+    if ( (ret <= 0) || !bParser.isContextTag(1) || !convOkOrCtxt ) {
+        qDebug("%s : Cannot parse property of the failed write", __PRETTY_FUNCTION__);
+        return -1;
+    }
+    total += ret;
+
+    //OPTIONAL array index
+    firstFailedArrayIndex = ArrayIndexNotPresent;
+    ret = bParser.nextTagNumber(&convOkOrCtxt);
+    if ( (2 == ret) && convOkOrCtxt ) {
+        ret = bParser.parseNext();
+        firstFailedArrayIndex = bParser.toUInt(&convOkOrCtxt);
+        if ( (ret <= 0) || !convOkOrCtxt )
+            return -1;
+        total += ret;
+    }
+
+    ret = bParser.parseNext();
+    if ( (ret <= 0) || !bParser.isClosingTag(1) )
+        return -1;
+    total += ret;
+
+    return total;
+}
+
 qint32 Error::appPartToRaw(quint8 *startPtr, quint16 bufferLength)
+{
+    if (BacnetServicesNS::WritePropertyMultiple != _errorChoice)
+        return classAndCodeToRaw_hlpr(startPtr, bufferLength);
+
+    qint32 ret(0);
+    quint8 *actualPtr(startPtr);
+
+    ret = BacnetCoder::openingTagToRaw(actualPtr, bufferLength, 0);
+    if (ret < 0)
+        return ret;
+    actualPtr += ret;
+    bufferLength -= ret;
+
+    ret = classAndCodeToRaw_hlpr(actualPtr, bufferLength);
+    if (ret < 0)
+        return ret;
+    actualPtr += ret;
+    bufferLength -= ret;
+
+    ret = BacnetCoder::closingTagToRaw(actualPtr, bufferLength, 0);
+    if (ret < 0)
+        return ret;
+    actualPtr += ret;
+    bufferLength -= ret;
+
+    ret = firstFailedWriteToRaw_hlpr(actualPtr, bufferLength);
+    if (ret < 0)
+        return ret;
+    actualPtr += ret;
+
+    return actualPtr - startPtr;
+}
+
+qint32 Error::classAndCodeToRaw_hlpr(quint8 *startPtr, quint16 bufferLength)
 {
     qint32 ret(0);
     quint8 *actualPtr(startPtr);
@@ -77,6 +204,46 @@ qint32 Error::appPartToRaw(quint8 *startPtr, quint16 bufferLength)
     return actualPtr - startPtr;
 }
 
+qint32 Error::firstFailedWriteToRaw_hlpr(quint8 *startPtr, quint16 bufferLength)
+{
+    qint32 ret(0);
+    quint8 *actualPtr(startPtr);
+
+    ret = BacnetCoder::openingTagToRaw(actualPtr, bufferLength, 1);
+    if (ret < 0)
+        return ret;
+    actualPtr += ret;
+    bufferLength -= ret;
+
+    ObjectIdStruct objId = numToObjId(firstFailedObjectId);
+    ret = BacnetCoder::objectIdentifierToRaw(actualPtr, bufferLength, objId, true, 0);
+    if (ret < 0)
+        return ret;
+    actualPtr += ret;
+    bufferLength -= ret;
+
+    ret = BacnetCoder::uintToRaw(actualPtr, bufferLength, firstFailedPropertyId, true, 1);
+    if (ret < 0)
+        return ret;
+    actualPtr += ret;
+    bufferLength -= ret;
+
+    if (ArrayIndexNotPresent != firstFailedArrayIndex) {
+        ret = BacnetCoder::uintToRaw(actualPtr, bufferLength, firstFailedArrayIndex, true, 2);
+        if (ret < 0)
+            return ret;
+        actualPtr += ret;
+        bufferLength -= ret;
+    }
+
+    ret = BacnetCoder::closingTagToRaw(actualPtr, bufferLength, 1);
+    if (ret < 0)
+        return ret;
+    actualPtr += ret;
+
+    return actualPtr - startPtr;
+}
+
 quint8 Bacnet::Error::errorChoice()
 {
     return _errorChoice;
@@ -4,6 +4,8 @@
 #include "bacnetcommon.h"
 namespace Bacnet {
 
+    class BacnetTagParser;
+
     class Error {
     public:
         Error(BacnetServicesNS::BacnetErrorChoice errorChoice/* = BacnetServicesNS::AcknowledgeAlarm*/);
@@ -15,13 +17,30 @@ namespace Bacnet {
         quint8 errorChoice();
         void setErrorChoice(BacnetServicesNS::BacnetErrorChoice  errorChoice);
 
+        /**
+          WritePropertyMultiple error tells also, which write failed first (the ones before it were done). It's encoded, only
+          when error choice is \sa BacnetServicesNS::WritePropertyMultiple.
+          */
+        void setFirstFailedWrite(ObjIdNum objectId, BacnetPropertyNS::Identifier propertyId, quint32 arrayIndex = ArrayIndexNotPresent);
+
         qint32 appPartFromRaw(quint8 *errorData, quint16 bufferLength);
         qint32 appPartToRaw(quint8 *startPtr, quint16 bufferLength);
 
+    private:
+        qint32 classAndCodeFromRaw_hlpr(BacnetTagParser &bParser);
+        qint32 classAndCodeToRaw_hlpr(quint8 *startPtr, quint16 bufferLength);
+        qint32 firstFailedWriteFromRaw_hlpr(BacnetTagParser &bParser);
+        qint32 firstFailedWriteToRaw_hlpr(quint8 *startPtr, quint16 bufferLength);
+
     public:
         BacnetServicesNS::BacnetErrorChoice _errorChoice;
         BacnetErrorNS::ErrorClass errorClass;
         BacnetErrorNS::ErrorCode errorCode;
+
+        //! Used with WritePropertyMultiple only. \sa setFirstFailedWrite()
+        ObjIdNum firstFailedObjectId;
+        BacnetPropertyNS::Identifier firstFailedPropertyId;
+        quint32 firstFailedArrayIndex;
     };
 
 }
@@ -0,0 +1,220 @@
+#include "bacnetreadpropertymultipleservicehandler.h"
+
+#include "bacnetreadpropertymultipleack.h"
+#include "readpropertymultipleservicedata.h"
+#include "bacnetdata.h"
+#include "error.h"
+#include "externalpropertymapping.h"
+#include "propertysubject.h"
+#include "property.h"
+#include "externalobjectreadstrategy.h"
+#include "externalobjectshandler.h"
+
+using namespace Bacnet;
+
+ReadPropertyMultipleServiceHandler::ReadPropertyMultipleServiceHandler(ReadPropertyMultipleServiceData *rpmData, const QList<ExternalPropertyMapping*> &mappings,
+                                                                       ObjIdNum deviceId, ExternalObjectsHandler *externalHandler):
+    _rpmData(rpmData),
+    _mappings(mappings),
+    _deviceId(deviceId),
+    _externalHandler(externalHandler),
+    _inFlight(true)
+{
+    Q_CHECK_PTR(_rpmData);
+    Q_CHECK_PTR(_externalHandler);
+    Q_ASSERT(_rpmData->references.count() == _mappings.count());
+}
+
+ReadPropertyMultipleServiceHandler::~ReadPropertyMultipleServiceHandler()
+{
+    //in case we are deleted without being answered
+    detach_hlpr();
+    delete _rpmData;
+}
+
+bool ReadPropertyMultipleServiceHandler::attach(int asynchId, ExternalPropertyMapping *propertyMapping)
+{
+    Q_CHECK_PTR(propertyMapping);
+    for (int i = 0; i < _mappings.count(); ++i) {
+        ExternalPropertyMapping *mapping = _mappings.at(i);
+        if ( (0 != mapping) && (mapping->objectId == propertyMapping->objectId) && (mapping->propertyId == propertyMapping->propertyId) &&
+             (mapping->propertyArrayIdx == propertyMapping->propertyArrayIdx) ) {
+            //requesters without asynch id (polling) just want the value to be updated - once is enough
+            if ( (mapping != propertyMapping) || (asynchId > 0) ) {
+                TWaiter waiter(asynchId, propertyMapping);
+                if ( (asynchId > 0) || !_attached.contains(i, waiter) )
+                    _attached.insert(i, waiter);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void ReadPropertyMultipleServiceHandler::detach_hlpr()
+{
+    if (_inFlight) {
+        _externalHandler->batchedReadFinished(this);
+        _inFlight = false;
+    }
+}
+
+void ReadPropertyMultipleServiceHandler::finishAttached_hlpr(int idx, const QVariant *value)
+{
+    foreach (const TWaiter &waiter, _attached.values(idx)) {
+        ExternalPropertyMapping *mapping = waiter.second;
+        if (0 != value) {
+            Q_CHECK_PTR(mapping->mappedProperty);
+            QVariant internalValue(*value);
+            if (waiter.first > 0) {
+                mapping->mappedProperty->setValueSilent(internalValue);
+                mapping->mappedProperty->asynchActionFinished(waiter.first, Property::ResultOk);
+            } else
+                mapping->mappedProperty->setValue(internalValue);
+        } else if (waiter.first > 0)
+            mapping->mappedProperty->asynchActionFinished(waiter.first, Property::UnknownError);
+
+        if (0 != mapping->readAccessStrategy)
+            mapping->readAccessStrategy->actionFinished((0 != value) ? ExternalObjectReadStrategy::FinishedOk : ExternalObjectReadStrategy::FinishedWithError);
+    }
+    _attached.remove(idx);
+}
+
+qint32 ReadPropertyMultipleServiceHandler::toRaw(quint8 *buffer, quint16 length)
+{
+    if (0 == _rpmData)
+        return -1;
+    return _rpmData->toRaw(buffer, length);
+}
+
+void ReadPropertyMultipleServiceHandler::finishWithError_hlpr()
+{
+    detach_hlpr();
+    for (int i = 0; i < _mappings.count(); ++i) {
+        ExternalPropertyMapping *mapping = _mappings.at(i);
+        if (0 == mapping)
+            continue;
+        _mappings[i] = 0;
+        if (0 != mapping->readAccessStrategy)
+            mapping->readAccessStrategy->actionFinished(ExternalObjectReadStrategy::FinishedWithError);
+        finishAttached_hlpr(i, 0);
+    }
+}
+
+void ReadPropertyMultipleServiceHandler::readSingly_hlpr()
+{
+    //detached first - the single reads mustn't be attached to us
+    detach_hlpr();
+    foreach (ExternalPropertyMapping *mapping, _mappings) {
+        //readProperty() of the read strategies is always the ReadProperty one
+        if ( (0 != mapping) && (0 != mapping->readAccessStrategy) )
+            mapping->readAccessStrategy->readProperty(mapping, _externalHandler, false);
+    }
+    //the ones attached wait for these reads
+    QMultiHash<int, TWaiter>::ConstIterator it = _attached.constBegin();
+    for (; it != _attached.constEnd(); ++it) {
+        const TWaiter &waiter = it.value();
+        if (_externalHandler->attachToPendingRead(waiter.second, waiter.first))
+            continue;
+        if (waiter.first > 0)
+            waiter.second->mappedProperty->asynchActionFinished(waiter.first, Property::UnknownError);
+        if (0 != waiter.second->readAccessStrategy)
+            waiter.second->readAccessStrategy->actionFinished(ExternalObjectReadStrategy::FinishedWithError);
+    }
+    _attached.clear();
+}
+
+ExternalConfirmedServiceHandler::ActionToExecute ReadPropertyMultipleServiceHandler::handleAck(quint8 *ackPtr, quint16 length)
+{
+    //waiters may want to read again, when notified - that has to be a new request
+    detach_hlpr();
+
+    BacnetReadPropertyMultipleAck ack;
+    qint32 ret = ack.fromRaw(ackPtr, length);
+    if (ret < 0)
+        qWarning("ReadPropertyMultipleServiceHandler::handleAck() - ack received, but problem on parsing %d (%d results parsed)", ret, ack.results.count());
+
+    //results are supposed to be in order of references, but we don't rely on it - look for the reference from the last one matched
+    int doneCount(0);
+    int searchIdx(0);
+    foreach (const BacnetReadPropertyMultipleAck::ReadResult &result, ack.results) {
+        ObjIdNum objId = objIdToNum(result.reference.objId);
+        int idx(-1);
+        for (int i = 0; i < _mappings.count(); ++i) {
+            int candidate = (searchIdx + i) % _mappings.count();
+            ExternalPropertyMapping *mapping = _mappings.at(candidate);
+            if ( (0 != mapping) && (mapping->objectId == objId) && (mapping->propertyId == result.reference.propertyId) &&
+                 (mapping->propertyArrayIdx == result.reference.arrayIndex) ) {
+                idx = candidate;
+                break;
+            }
+        }
+        if (idx < 0) {
+            qDebug("%s : got result of property %d (array idx %d) of object 0x%x, which was not requested!", __PRETTY_FUNCTION__,
+                   result.reference.propertyId, result.reference.arrayIndex, objId);
+            continue;
+        }
+
+        ExternalPropertyMapping *mapping = _mappings.at(idx);
+        //mark it done
+        _mappings[idx] = 0;
+        searchIdx = idx + 1;
+        ++doneCount;
+
+        ExternalObjectReadStrategy::FinishStatus status(ExternalObjectReadStrategy::FinishedOk);
+        if (result.hasError()) {
+            qDebug("%s : property %d of object 0x%x read with error (%d, %d)", __PRETTY_FUNCTION__, mapping->propertyId, objId,
+                   result.errorClass, result.errorCode);
+            status = ExternalObjectReadStrategy::FinishedWithError;
+            finishAttached_hlpr(idx, 0);
+        } else {
+            Q_CHECK_PTR(mapping->mappedProperty);
+            QVariant internalValue = result.data->toInternal();
+            mapping->mappedProperty->setValue(internalValue);
+            finishAttached_hlpr(idx, &internalValue);
+        }
+        if (0 != mapping->readAccessStrategy)
+            mapping->readAccessStrategy->actionFinished(status);
+    }
+
+    //the ones, which were not answered
+    if (doneCount != _mappings.count())
+        finishWithError_hlpr();
+
+    return DeleteServiceHandler;//we are done - parent may delete us
+}
+
+ExternalConfirmedServiceHandler::ActionToExecute ReadPropertyMultipleServiceHandler::handleError(Error &error)
+{
+    Q_UNUSED(error);
+    //! \todo parse Error message.
+    finishWithError_hlpr();
+    return DeleteServiceHandler;
+}
+
+ExternalConfirmedServiceHandler::ActionToExecute ReadPropertyMultipleServiceHandler::handleAbort()
+{
+    //most likely the response was too long to be sent - next time the device gets smaller batches, this time try singly
+    _externalHandler->shrinkBatchedReads(_deviceId, _mappings.count());
+    readSingly_hlpr();
+    return DeleteServiceHandler;
+}
+
+ExternalConfirmedServiceHandler::ActionToExecute ReadPropertyMultipleServiceHandler::handleReject(BacnetRejectNS::RejectReason rejectReason)
+{
+    qDebug("%s : device 0x%x rejected ReadPropertyMultiple (%d), it will be read with ReadProperty.", __PRETTY_FUNCTION__, _deviceId, rejectReason);
+    _externalHandler->setBatchedReadsUnsupported(_deviceId);
+    readSingly_hlpr();
+    return DeleteServiceHandler;
+}
+
+ExternalConfirmedServiceHandler::ActionToExecute ReadPropertyMultipleServiceHandler::handleTimeout()
+{
+    finishWithError_hlpr();
+    return DeleteServiceHandler;
+}
+
+BacnetServicesNS::BacnetConfirmedServiceChoice ReadPropertyMultipleServiceHandler::serviceChoice()
+{
+    return BacnetServicesNS::ReadPropertyMultiple;
+}
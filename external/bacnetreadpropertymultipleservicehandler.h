@@ -0,0 +1,71 @@
+#ifndef BACNETREADPROPERTYMULTIPLESERVICEHANDLER_H
+#define BACNETREADPROPERTYMULTIPLESERVICEHANDLER_H
+
+#include "externalconfirmedservicehandler.h"
+
+namespace Bacnet {
+
+    class ExternalPropertyMapping;
+    class ExternalObjectsHandler;
+    class ReadPropertyMultipleServiceData;
+
+    /**
+      Reads polled properties of one remote device with a single ReadPropertyMultiple request (batches are made
+      by \sa ExternalObjectsHandler). Results are handed back to mappings of the references - mappings are in the same order as
+      references of the request.
+
+      If the device rejects the request, it's considered not to support the service - all the mappings are read with ReadProperty,
+      which is used for that device from now on. On abort (e.g. the response didn't fit) they are read singly this time only.
+
+      While the request is in flight, reads of the same properties are attached to it by \sa ExternalObjectsHandler (as with
+      \sa ReadPropertyServiceHandler) and complete from the result of their reference.
+      */
+    class ReadPropertyMultipleServiceHandler:
+            public ExternalConfirmedServiceHandler
+    {
+    public:
+        ReadPropertyMultipleServiceHandler(ReadPropertyMultipleServiceData *rpmData, const QList<ExternalPropertyMapping*> &mappings,
+                                           ObjIdNum deviceId, ExternalObjectsHandler *externalHandler);
+        virtual ~ReadPropertyMultipleServiceHandler();
+
+        //! Adds the waiter for one of the properties read. Returns false, if the property is not read by us (or was answered already).
+        bool attach(int asynchId, ExternalPropertyMapping *propertyMapping);
+
+    public://functions overridden from BacnetConfirmedServiceHandler
+        virtual qint32 toRaw(quint8 *buffer, quint16 length);
+        virtual BacnetServicesNS::BacnetConfirmedServiceChoice serviceChoice();
+
+        virtual ActionToExecute handleAck(quint8 *ackPtr, quint16 length);
+        virtual ActionToExecute handleError(Error &error);
+        virtual ActionToExecute handleReject(BacnetRejectNS::RejectReason rejectReason);
+        virtual ActionToExecute handleAbort();
+        virtual ActionToExecute handleTimeout();
+
+    private:
+        //! Tells read strategies of the mappings not answered yet (and their attached waiters), the read has failed.
+        void finishWithError_hlpr();
+        //! Reads each of the mappings not answered yet with ReadProperty - attached waiters are moved to these reads.
+        void readSingly_hlpr();
+        //! Tells external handler, the reads are no longer in flight - no one may be attached from now on.
+        void detach_hlpr();
+        //! Completes waiters attached to the reference idx - with the value, or with an error if it's 0.
+        void finishAttached_hlpr(int idx, const QVariant *value);
+
+    private:
+        ReadPropertyMultipleServiceData *_rpmData;
+        //! Mapping of each reference, 0 once it's answered.
+        QList<ExternalPropertyMapping*> _mappings;
+        ObjIdNum _deviceId;
+        ExternalObjectsHandler *_externalHandler;
+        //! Set, until the external handler is told we are done (\sa detach_hlpr()).
+        bool _inFlight;
+
+        //! Asynchronous id (0 when there is none) and mapping of the attached requester.
+        typedef QPair<int, ExternalPropertyMapping*> TWaiter;
+        //! Index of the reference -> its attached waiters.
+        QMultiHash<int, TWaiter> _attached;
+    };
+
+}
+
+#endif // BACNETREADPROPERTYMULTIPLESERVICEHANDLER_H
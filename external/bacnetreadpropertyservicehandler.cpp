@@ -5,24 +5,61 @@
 #include "error.h"
 #include "externalpropertymapping.h"
 #include "propertysubject.h"
-#include "externalobjectreadstrategy.h"
+#include "externalobjectshandler.h"
 
 using namespace Bacnet;
 
-ReadPropertyServiceHandler::ReadPropertyServiceHandler(ReadPropertyServiceData *rpData, int asynchId, ExternalPropertyMapping *propertyMapping):
+ReadPropertyServiceHandler::ReadPropertyServiceHandler(ReadPropertyServiceData *rpData, int asynchId, ExternalPropertyMapping *propertyMapping,
+                                                       ExternalObjectsHandler *externalHandler):
     _rpData(rpData),
-    _asynchId(asynchId),
-    _propertyMapping(propertyMapping)
+    _externalHandler(externalHandler)
 {
     Q_CHECK_PTR(_rpData);
-    Q_CHECK_PTR(_propertyMapping);
+    Q_CHECK_PTR(propertyMapping);
+    _waiters.append(qMakePair(asynchId, propertyMapping));
 }
 
 ReadPropertyServiceHandler::~ReadPropertyServiceHandler()
 {
+    //in case we are deleted without being answered
+    detach_hlpr();
     delete _rpData;
 }
 
+void ReadPropertyServiceHandler::attach(int asynchId, ExternalPropertyMapping *propertyMapping)
+{
+    Q_CHECK_PTR(propertyMapping);
+    //requesters without asynch id (polling) just want the value to be updated - once is enough
+    if ( (asynchId <= 0) && _waiters.contains(qMakePair(asynchId, propertyMapping)) )
+        return;
+    _waiters.append(qMakePair(asynchId, propertyMapping));
+}
+
+ExternalPropertyMapping *ReadPropertyServiceHandler::propertyMapping()
+{
+    Q_ASSERT(!_waiters.isEmpty());
+    return _waiters.first().second;
+}
+
+void ReadPropertyServiceHandler::detach_hlpr()
+{
+    if (0 != _externalHandler) {
+        _externalHandler->readFinished(this);
+        _externalHandler = 0;
+    }
+}
+
+void ReadPropertyServiceHandler::finishWithError_hlpr(Property::ActiontResult result, ExternalObjectReadStrategy::FinishStatus status)
+{
+    detach_hlpr();
+    foreach (const TWaiter &waiter, _waiters) {
+        if (waiter.first > 0)
+            waiter.second->mappedProperty->asynchActionFinished(waiter.first, result);
+        if (0 != waiter.second->readAccessStrategy)
+            waiter.second->readAccessStrategy->actionFinished(status);
+    }
+}
+
 qint32 ReadPropertyServiceHandler::toRaw(quint8 *buffer, quint16 length)
 {
     if (0 == _rpData)
@@ -32,21 +69,23 @@ qint32 ReadPropertyServiceHandler::toRaw(quint8 *buffer, quint16 length)
 
 ExternalConfirmedServiceHandler::ActionToExecute ReadPropertyServiceHandler::handleTimeout()
 {
-    if (_asynchId > 0)
-        _propertyMapping->mappedProperty->asynchActionFinished(_asynchId, Property::Timeout);
-    if (0 != _propertyMapping->readAccessStrategy)
-        _propertyMapping->readAccessStrategy->actionFinished(ExternalObjectReadStrategy::FinishedWithError);
+    finishWithError_hlpr(Property::Timeout, ExternalObjectReadStrategy::FinishedWithError);
     return ExternalConfirmedServiceHandler::DeleteServiceHandler;
 }
 
 ExternalConfirmedServiceHandler::ActionToExecute ReadPropertyServiceHandler::handleAck(quint8 *ackPtr, quint16 length)
 {
+    //waiters may want to read again, when notified - that has to be a new request
+    detach_hlpr();
+
     BacnetReadPropertyAck ack;
     qint32 ret = ack.fromRaw(ackPtr, length);
     if (ret < 0) {
         qWarning("ReadPropertyServiceHandler::handleAck() - ack received, but problem on parsing %d", ret);
-        if (_asynchId > 0)
-            _propertyMapping->mappedProperty->asynchActionFinished(_asynchId, Property::UnknownError);
+        foreach (const TWaiter &waiter, _waiters) {
+            if (waiter.first > 0)
+                waiter.second->mappedProperty->asynchActionFinished(waiter.first, Property::UnknownError);
+        }
     } else {
         Q_ASSERT(_rpData->objId.instanceNum == ack._readData.objId.instanceNum);
         Q_ASSERT(_rpData->objId.objectType == ack._readData.objId.objectType);
@@ -54,18 +93,20 @@ ExternalConfirmedServiceHandler::ActionToExecute ReadPropertyServiceHandler::han
         Q_ASSERT(_rpData->arrayIndex == ack._readData.arrayIndex);
         delete _rpData; _rpData = 0;
 
-        Q_CHECK_PTR(_propertyMapping->mappedProperty);
-
         BacnetDataInterfaceShared value = ack._data;
         QVariant internalValue = value->toInternal();
-        if (_asynchId > 0) {
-            _propertyMapping->mappedProperty->setValueSilent(internalValue);
-            _propertyMapping->mappedProperty->asynchActionFinished(_asynchId, Property::ResultOk);
-        } else
-            _propertyMapping->mappedProperty->setValue(internalValue);
-
-        if (0 != _propertyMapping->readAccessStrategy)
-            _propertyMapping->readAccessStrategy->actionFinished(ExternalObjectReadStrategy::FinishedOk);
+        foreach (const TWaiter &waiter, _waiters) {
+            ExternalPropertyMapping *mapping = waiter.second;
+            Q_CHECK_PTR(mapping->mappedProperty);
+            if (waiter.first > 0) {
+                mapping->mappedProperty->setValueSilent(internalValue);
+                mapping->mappedProperty->asynchActionFinished(waiter.first, Property::ResultOk);
+            } else
+                mapping->mappedProperty->setValue(internalValue);
+
+            if (0 != mapping->readAccessStrategy)
+                mapping->readAccessStrategy->actionFinished(ExternalObjectReadStrategy::FinishedOk);
+        }
     }
 
     return DeleteServiceHandler;//we are done - parent may delete us
@@ -75,30 +116,21 @@ ExternalConfirmedServiceHandler::ActionToExecute ReadPropertyServiceHandler::han
 {
     Q_UNUSED(error);
     //! \todo parse Error message.
-    if (_asynchId > 0)
-        _propertyMapping->mappedProperty->asynchActionFinished(_asynchId, Property::UnknownError);
-    if (0 != _propertyMapping->readAccessStrategy)
-        _propertyMapping->readAccessStrategy->actionFinished(ExternalObjectReadStrategy::FinishedWithError);
+    finishWithError_hlpr(Property::UnknownError, ExternalObjectReadStrategy::FinishedWithError);
     return DeleteServiceHandler;
 }
 
 ExternalConfirmedServiceHandler::ActionToExecute ReadPropertyServiceHandler::handleAbort()
 {
     //! \todo parse Abort message.
-    if (_asynchId > 0)
-        _propertyMapping->mappedProperty->asynchActionFinished(_asynchId, Property::UnknownError);
-    if (0 != _propertyMapping->readAccessStrategy)
-        _propertyMapping->readAccessStrategy->actionFinished(ExternalObjectReadStrategy::FinishedCritical);
+    finishWithError_hlpr(Property::UnknownError, ExternalObjectReadStrategy::FinishedCritical);
     return DeleteServiceHandler;
 }
 
 ExternalConfirmedServiceHandler::ActionToExecute ReadPropertyServiceHandler::handleReject(BacnetRejectNS::RejectReason rejectReason)
 {
     Q_UNUSED(rejectReason);
-    if (_asynchId > 0)
-        _propertyMapping->mappedProperty->asynchActionFinished(_asynchId, Property::UnknownError);
-    if (0 != _propertyMapping->readAccessStrategy)
-        _propertyMapping->readAccessStrategy->actionFinished(ExternalObjectReadStrategy::FinishedWithError);
+    finishWithError_hlpr(Property::UnknownError, ExternalObjectReadStrategy::FinishedWithError);
     return DeleteServiceHandler;
 }
 
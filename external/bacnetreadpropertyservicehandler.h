@@ -2,22 +2,35 @@
 #define BACNETREADPROPERTYSERVICEHANDLER_H
 
 #include "externalconfirmedservicehandler.h"
-
+#include "property.h"
+#include "externalobjectreadstrategy.h"
 
 class PropertySubject;
 
 namespace Bacnet {
 
     class ExternalPropertyMapping;
+    class ExternalObjectsHandler;
     class ReadPropertyServiceData;
 
+    /**
+      Reads the remote property for all the waiters attached to it. The first one is the requester, others are attached
+      by \sa ExternalObjectsHandler, when they want the same property (object, property and array index), while this request
+      is still in flight - there is no point in asking slow device twice. All of them complete from the one response.
+      */
     class ReadPropertyServiceHandler:
             public ExternalConfirmedServiceHandler
     {
     public:
-        ReadPropertyServiceHandler(ReadPropertyServiceData *rpData, int asynchId, ExternalPropertyMapping *propertyMapping);
+        ReadPropertyServiceHandler(ReadPropertyServiceData *rpData, int asynchId, ExternalPropertyMapping *propertyMapping,
+                                   ExternalObjectsHandler *externalHandler = 0);
         virtual ~ReadPropertyServiceHandler();
 
+        //! Adds the waiter, which completes together with the ones being here already.
+        void attach(int asynchId, ExternalPropertyMapping *propertyMapping);
+        //! Mapping of the first waiter - it identifies the property read.
+        ExternalPropertyMapping *propertyMapping();
+
     public://functions overridden from BacnetConfirmedServiceHandler
         virtual qint32 toRaw(quint8 *buffer, quint16 length);
         virtual BacnetServicesNS::BacnetConfirmedServiceChoice serviceChoice();
@@ -28,12 +41,20 @@ namespace Bacnet {
         virtual ActionToExecute handleAbort();
         virtual ActionToExecute handleTimeout();
 
+    private:
+        //! Tells external handler, the read is no longer in flight - no one may be attached from now on.
+        void detach_hlpr();
+        //! Finishes all the waiters with an error.
+        void finishWithError_hlpr(Property::ActiontResult result, ExternalObjectReadStrategy::FinishStatus status);
+
     private:
         //BACnet specific
         ReadPropertyServiceData *_rpData;
 
-        int _asynchId;
-        ExternalPropertyMapping *_propertyMapping;
+        //! Asynchronous id (0 when there is none) and mapping of each requester.
+        typedef QPair<int, ExternalPropertyMapping*> TWaiter;
+        QList<TWaiter> _waiters;
+        ExternalObjectsHandler *_externalHandler;
     };
 
 }
@@ -0,0 +1,117 @@
+#include "bacnetwritepropertymultipleservicehandler.h"
+
+#include "writepropertymultipleservicedata.h"
+#include "error.h"
+#include "externalpropertymapping.h"
+#include "propertysubject.h"
+#include "externalobjectshandler.h"
+
+using namespace Bacnet;
+
+WritePropertyMultipleServiceHandler::WritePropertyMultipleServiceHandler(WritePropertyMultipleServiceData *wpmData, const QList<TWriter> &writers,
+                                                                         ObjIdNum deviceId, ExternalObjectsHandler *externalHandler):
+    _wpmData(wpmData),
+    _writers(writers),
+    _deviceId(deviceId),
+    _externalHandler(externalHandler)
+{
+    Q_CHECK_PTR(_wpmData);
+    Q_CHECK_PTR(_externalHandler);
+    Q_ASSERT(_wpmData->writes.count() == _writers.count());
+}
+
+WritePropertyMultipleServiceHandler::~WritePropertyMultipleServiceHandler()
+{
+    delete _wpmData;
+}
+
+qint32 WritePropertyMultipleServiceHandler::toRaw(quint8 *buffer, quint16 length)
+{
+    if (0 == _wpmData)
+        return -1;
+    return _wpmData->toRaw(buffer, length);
+}
+
+void WritePropertyMultipleServiceHandler::finish_hlpr(int fromIdx, int toIdx, Property::ActiontResult result, ExternalObjectWriteStrategy::FinishStatus status)
+{
+    for (int i = fromIdx; i < toIdx; ++i) {
+        ExternalPropertyMapping *mapping = _writers.at(i).first;
+        int asynchId = _writers.at(i).second;
+        Q_CHECK_PTR(mapping->mappedProperty);
+        if (asynchId > 0)
+            mapping->mappedProperty->asynchActionFinished(asynchId, result);
+        if (0 != mapping->writeStrategy)
+            mapping->writeStrategy->actionFinished(status);
+    }
+}
+
+void WritePropertyMultipleServiceHandler::writeSingly_hlpr()
+{
+    for (int i = 0; i < _writers.count(); ++i)
+        _externalHandler->sendSingleWrite(_writers.at(i).first, _wpmData->writes.at(i)._propValue._value, _writers.at(i).second);
+}
+
+ExternalConfirmedServiceHandler::ActionToExecute WritePropertyMultipleServiceHandler::handleAck(quint8 *ackPtr, quint16 length)
+{
+    Q_CHECK_PTR(ackPtr);
+    Q_ASSERT(0 == length);
+    Q_UNUSED(ackPtr);
+
+    if (length > 0) {
+        qWarning("WritePropertyMultipleServiceHandler::handleAck() - ack received, but has some additional data");
+        finish_hlpr(0, _writers.count(), Property::UnknownError, ExternalObjectWriteStrategy::FinishedWithError);
+        return DeleteServiceHandler;//we are done - parent may delete us
+    }
+
+    finish_hlpr(0, _writers.count(), Property::ResultOk, ExternalObjectWriteStrategy::FinishedOk);
+    return DeleteServiceHandler;//we are done - parent may delete us
+}
+
+ExternalConfirmedServiceHandler::ActionToExecute WritePropertyMultipleServiceHandler::handleError(Error &error)
+{
+    //writes are executed in order, until the first one fails - find out which one it was
+    int failedIdx(0);
+    if (BacnetPropertyNS::UndefinedProperty != error.firstFailedPropertyId) {
+        for (int i = 0; i < _wpmData->writes.count(); ++i) {
+            const WritePropertyServiceData &write = _wpmData->writes.at(i);
+            if ( (write._objectId.objectIdNum() == error.firstFailedObjectId) && (write._propValue._propertyId == error.firstFailedPropertyId) &&
+                 (write._propValue._arrayIndex == error.firstFailedArrayIndex) ) {
+                failedIdx = i;
+                break;
+            }
+        }
+    }
+    qDebug("%s : write %d of %d to device 0x%x failed (%d, %d)", __PRETTY_FUNCTION__, failedIdx, _writers.count(), _deviceId,
+           error.errorClass, error.errorCode);
+
+    finish_hlpr(0, failedIdx, Property::ResultOk, ExternalObjectWriteStrategy::FinishedOk);
+    //! \todo translate error and tell strategy what to do!
+    finish_hlpr(failedIdx, _writers.count(), Property::UnknownError, ExternalObjectWriteStrategy::FinishedWithError);
+    return DeleteServiceHandler;
+}
+
+ExternalConfirmedServiceHandler::ActionToExecute WritePropertyMultipleServiceHandler::handleAbort()
+{
+    //most likely the request was too long for the device - try singly
+    writeSingly_hlpr();
+    return DeleteServiceHandler;
+}
+
+ExternalConfirmedServiceHandler::ActionToExecute WritePropertyMultipleServiceHandler::handleReject(BacnetRejectNS::RejectReason rejectReason)
+{
+    qDebug("%s : device 0x%x rejected WritePropertyMultiple (%d), it will be written with WriteProperty.", __PRETTY_FUNCTION__, _deviceId, rejectReason);
+    _externalHandler->setBatchedWritesUnsupported(_deviceId);
+    writeSingly_hlpr();
+    return DeleteServiceHandler;
+}
+
+ExternalConfirmedServiceHandler::ActionToExecute WritePropertyMultipleServiceHandler::handleTimeout()
+{
+    finish_hlpr(0, _writers.count(), Property::Timeout, ExternalObjectWriteStrategy::FinishedWithError);
+    return DeleteServiceHandler;
+}
+
+BacnetServicesNS::BacnetConfirmedServiceChoice WritePropertyMultipleServiceHandler::serviceChoice()
+{
+    return BacnetServicesNS::WritePropertyMultiple;
+}
@@ -0,0 +1,58 @@
+#ifndef BACNETWRITEPROPERTYMULTIPLESERVICEHANDLER_H
+#define BACNETWRITEPROPERTYMULTIPLESERVICEHANDLER_H
+
+#include "externalconfirmedservicehandler.h"
+#include "property.h"
+#include "externalobjectwritestrategy.h"
+
+namespace Bacnet {
+
+    class ExternalPropertyMapping;
+    class ExternalObjectsHandler;
+    class WritePropertyMultipleServiceData;
+
+    /**
+      Writes properties of one remote device with a single WritePropertyMultiple request (batches are made by \sa ExternalObjectsHandler).
+      Each write is finished separately - writers are in the same order as writes of the request. When the device answers with error,
+      writes before the first failed one are done, the rest is not.
+
+      If the device rejects the request, it's considered not to support the service - all the writes are sent with WriteProperty,
+      which is used for that device from now on. On abort they are written singly this time only.
+      */
+    class WritePropertyMultipleServiceHandler:
+            public ExternalConfirmedServiceHandler
+    {
+    public:
+        //! Mapping written and asynchronous id of the write.
+        typedef QPair<ExternalPropertyMapping*, int> TWriter;
+
+        WritePropertyMultipleServiceHandler(WritePropertyMultipleServiceData *wpmData, const QList<TWriter> &writers,
+                                            ObjIdNum deviceId, ExternalObjectsHandler *externalHandler);
+        virtual ~WritePropertyMultipleServiceHandler();
+
+    public://functions overridden from BacnetConfirmedServiceHandler
+        virtual qint32 toRaw(quint8 *buffer, quint16 length);
+        virtual BacnetServicesNS::BacnetConfirmedServiceChoice serviceChoice();
+
+        virtual ActionToExecute handleAck(quint8 *ackPtr, quint16 length);
+        virtual ActionToExecute handleError(Error &error);
+        virtual ActionToExecute handleReject(BacnetRejectNS::RejectReason rejectReason);
+        virtual ActionToExecute handleAbort();
+        virtual ActionToExecute handleTimeout();
+
+    private:
+        //! Tells the writers from fromIdx up to (not including) toIdx, their writes are finished with the result.
+        void finish_hlpr(int fromIdx, int toIdx, Property::ActiontResult result, ExternalObjectWriteStrategy::FinishStatus status);
+        //! Writes each of the values with WriteProperty.
+        void writeSingly_hlpr();
+
+    private:
+        WritePropertyMultipleServiceData *_wpmData;
+        QList<TWriter> _writers;
+        ObjIdNum _deviceId;
+        ExternalObjectsHandler *_externalHandler;
+    };
+
+}
+
+#endif // BACNETWRITEPROPERTYMULTIPLESERVICEHANDLER_H
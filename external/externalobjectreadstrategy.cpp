@@ -53,15 +53,23 @@ int ExternalObjectReadStrategy::readProperty(ExternalPropertyMapping *propertyMa
         return Property::UnknownError;
     }
 
+    //the same property is being read already - we'll get its answer
+    if (externalHandler->attachToPendingRead(propertyMapping, asynchId))
+        return asynchId;
+
     //! \todo Itroduce BacnetObjId class with conversion functions
     ReadPropertyServiceData *service =
             new ReadPropertyServiceData(numToObjId(propertyMapping->objectId),
                                         propertyMapping->propertyId, propertyMapping->propertyArrayIdx);
     Q_CHECK_PTR(service);
-    ExternalConfirmedServiceHandler *serviceHandler =
-            new ReadPropertyServiceHandler(service, asynchId, propertyMapping);
+    ReadPropertyServiceHandler *serviceHandler =
+            new ReadPropertyServiceHandler(service, asynchId, propertyMapping, externalHandler);
     Q_CHECK_PTR(serviceHandler);
-    externalHandler->send(serviceHandler, propertyMapping->objectId);
+    if (!externalHandler->sendRead(serviceHandler)) {
+        if (asynchId > 0)
+            propertyMapping->mappedProperty->releaseId(asynchId);
+        return Property::UnknownError;
+    }
     return asynchId;
 }
 
@@ -126,6 +134,24 @@ int SimpleWithTimeReadStrategy::interval()
     return _interval_ms;
 }
 
+////////////////////////////////////////////////////
+///////////ReadPropertyMultipleStrategy/////////////
+////////////////////////////////////////////////////
+
+ReadPropertyMultipleStrategy::ReadPropertyMultipleStrategy(int interval_ms):
+    SimpleWithTimeReadStrategy(interval_ms)
+{
+}
+
+void ReadPropertyMultipleStrategy::doAction(ExternalPropertyMapping *propertyMapping, ExternalObjectsHandler *externalHandler)
+{
+    Q_CHECK_PTR(propertyMapping);
+    Q_CHECK_PTR(externalHandler);
+
+    externalHandler->queueBatchedRead(propertyMapping);
+    _timeToAction_ms = _interval_ms;
+}
+
 ////////////////////////////////////////////////////
 ////////////////CovReadStrategy/////////////////////
 ////////////////////////////////////////////////////
@@ -63,12 +63,31 @@ public:
     void setInterval(int interval_ms);
     int interval();
 
-private:
+protected:
     static const int DefaultInterval = 10000;
     int _interval_ms;
     int _timeToAction_ms;
 };
 
+/**
+    This strategy polls like SimpleWithTimeReadStrategy does, but reads are not sent at once - they are queued in the external
+    handler, which sends reads of the same device due in the same poll round with as few ReadPropertyMultiple requests as possible.
+    If the device doesn't support the service, properties are read with ReadProperty.
+  */
+
+class ReadPropertyMultipleStrategy:
+        public SimpleWithTimeReadStrategy
+{
+public:
+    ReadPropertyMultipleStrategy(int interval_ms = DefaultInterval);
+
+public://time-dependant behaviour
+    //! executes action
+    virtual void doAction(ExternalPropertyMapping *propertyMapping, ExternalObjectsHandler *externalHandler);
+
+    //readProperty() is taken from ExternalObjectReadStrategy - it's used also when the batched read falls back to single reads.
+};
+
 /**
     This strategy supports COV notifications. That means, if the subscription is successful it allows for instant read.
     If subscription was aborted and we have hints we have no chances to subscribe it can behave like SimpleWithTimeReadStrategy
@@ -15,6 +15,12 @@
 #include "subscribecovservicehandler.h"
 #include "externalobjectreadstrategy.h"
 #include "externalobjectwritestrategy.h"
+#include "bacnetreadpropertyservicehandler.h"
+#include "bacnetreadpropertymultipleservicehandler.h"
+#include "readpropertymultipleservicedata.h"
+#include "bacnetwritepropertymultipleservicehandler.h"
+#include "writepropertymultipleservicedata.h"
+#include "propertyvalue.h"
 
 using namespace Bacnet;
 
@@ -113,7 +119,69 @@ bool ExternalObjectsHandler::send(ExternalConfirmedServiceHandler *serviceHandle
 
     ObjectIdentifier objId(destinedObject);
     BacnetAddress fromAddr = BacnetInternalAddressHelper::toBacnetAddress(_registeredAddresses.first());
-    return _appLayer->send(objId.objIdStruct(), fromAddr, serviceHandler);
+    //request queued behind the device discovery goes out later - it's not a failure
+    return (BacnetApplicationLayerHandler::RequestFailed != _appLayer->send(objId.objIdStruct(), fromAddr, serviceHandler));
+}
+
+void ExternalObjectsHandler::sendFailed_hlpr(ExternalConfirmedServiceHandler *serviceHandler)
+{
+    Q_CHECK_PTR(serviceHandler);
+    if (ExternalConfirmedServiceHandler::DeleteServiceHandler == serviceHandler->handleTimeout())
+        delete serviceHandler;
+}
+
+ExternalObjectsHandler::TReadKey ExternalObjectsHandler::readKey(ExternalPropertyMapping *propertyMapping)
+{
+    //object id determines the device, requests are routed to
+    return qMakePair(propertyMapping->objectId, qMakePair((int)propertyMapping->propertyId, propertyMapping->propertyArrayIdx));
+}
+
+bool ExternalObjectsHandler::attachToPendingRead(ExternalPropertyMapping *propertyMapping, int asynchId)
+{
+    Q_CHECK_PTR(propertyMapping);
+    TReadKey key = readKey(propertyMapping);
+    ReadPropertyServiceHandler *pending = _pendingReads.value(key);
+    if (0 != pending) {
+        pending->attach(asynchId, propertyMapping);
+        return true;
+    }
+
+    ReadPropertyMultipleServiceHandler *batched = _pendingBatchedReads.value(key);
+    return ( (0 != batched) && batched->attach(asynchId, propertyMapping) );
+}
+
+bool ExternalObjectsHandler::sendRead(ReadPropertyServiceHandler *serviceHandler)
+{
+    Q_CHECK_PTR(serviceHandler);
+    ExternalPropertyMapping *propertyMapping = serviceHandler->propertyMapping();
+    TReadKey key = readKey(propertyMapping);
+    Q_ASSERT(!_pendingReads.contains(key));
+    //inserted before sending - request may be answered at once (e.g. when the device is known and timeouts happen on sending)
+    _pendingReads.insert(key, serviceHandler);
+    if (!send(serviceHandler, propertyMapping->objectId)) {
+        //nobody could attach to it yet - deleting unregisters it
+        delete serviceHandler;
+        return false;
+    }
+    return true;
+}
+
+void ExternalObjectsHandler::readFinished(ReadPropertyServiceHandler *serviceHandler)
+{
+    QHash<TReadKey, ReadPropertyServiceHandler*>::Iterator it = _pendingReads.find(readKey(serviceHandler->propertyMapping()));
+    if ( (_pendingReads.end() != it) && (it.value() == serviceHandler) )
+        _pendingReads.erase(it);
+}
+
+void ExternalObjectsHandler::batchedReadFinished(ReadPropertyMultipleServiceHandler *serviceHandler)
+{
+    QHash<TReadKey, ReadPropertyMultipleServiceHandler*>::Iterator it = _pendingBatchedReads.begin();
+    while (it != _pendingBatchedReads.end()) {
+        if (it.value() == serviceHandler)
+            it = _pendingBatchedReads.erase(it);
+        else
+            ++it;
+    }
 }
 
 bool ExternalObjectsHandler::isRegisteredAddress(InternalAddress &address)
@@ -309,8 +377,14 @@ void ExternalObjectsHandler::covSubscriptionProcessFinished(int subscribeProcId,
     readStrategy->setSubscriptionInitiated(ok, subscribeProcId, isCritical);
 }
 
-void ExternalObjectsHandler::timerEvent(QTimerEvent *)
+void ExternalObjectsHandler::timerEvent(QTimerEvent *e)
 {
+    if (e->timerId() == _batchedWritesTimer.timerId()) {
+        _batchedWritesTimer.stop();
+        flushBatchedWrites_hlpr();
+        return;
+    }
+
     //iterate over jobs and tell then the time has passed
     QList<TTimeDependantPair>::Iterator it = _timeDependantJobs.begin();
     QList<TTimeDependantPair>::Iterator itEnd = _timeDependantJobs.end();
@@ -319,6 +393,279 @@ void ExternalObjectsHandler::timerEvent(QTimerEvent *)
         if (it->first->timePassed(_interval_ms))
             it->first->doAction(it->second, this);
     }
+
+    //jobs might have queued reads to be batched
+    if (!_batchedReads.isEmpty())
+        flushBatchedReads_hlpr();
+}
+
+void ExternalObjectsHandler::queueBatchedRead(ExternalPropertyMapping *propertyMapping)
+{
+    Q_CHECK_PTR(propertyMapping);
+    Q_CHECK_PTR(propertyMapping->readAccessStrategy);
+    _batchedReads.append(propertyMapping);
+}
+
+void ExternalObjectsHandler::setBatchedReadsUnsupported(ObjIdNum deviceId)
+{
+    _batchedReadsUnsupported.insert(deviceId);
+}
+
+void ExternalObjectsHandler::shrinkBatchedReads(ObjIdNum deviceId, int batchSize)
+{
+    int limit = qMax(1, batchSize / 2);
+    qDebug("%s : device 0x%x aborted ReadPropertyMultiple of %d references, it gets %d at most.", __PRETTY_FUNCTION__, deviceId, batchSize, limit);
+    _batchedReadsLimit.insert(deviceId, limit);
+}
+
+int ExternalObjectsHandler::ackPropertyLength_hlpr(ExternalPropertyMapping *mapping)
+{
+    const bool hasArrayIdx = (ArrayIndexNotPresent != mapping->propertyArrayIdx);
+    int length = AckPropertyHeaderLength + (hasArrayIdx ? AckArrayIndexLength : 0);
+
+    BacnetObjectTypeNS::ObjectType objectType = numToObjId(mapping->objectId).objectType;
+    QPair<int, int> key(objectType, (mapping->propertyId << 1) | (hasArrayIdx ? 1 : 0));
+    QHash<QPair<int, int>, int>::ConstIterator it = _valueLengthEstimates.constFind(key);
+    if (_valueLengthEstimates.constEnd() != it)
+        return length + it.value();
+
+    int valueLength(UnknownValueEstimatedLength);
+    BacnetDataInterface *data = BacnetDefaultObject::createDataForObjectProperty(objectType, mapping->propertyId, mapping->propertyArrayIdx);
+    if (0 != data) {
+        DataType::DataType type = data->typeId();
+        delete data;
+        if (type & (DataType::BACnetArray | DataType::BACnetList))
+            valueLength = ListValueEstimatedLength;
+        else {
+            switch (type)
+            {
+            case (DataType::Null):
+            case (DataType::BOOLEAN):
+                valueLength = 1;
+                break;
+            case (DataType::Double):
+                valueLength = 9;
+                break;
+            case (DataType::OctetString):
+            case (DataType::CharacterString):
+            case (DataType::BitString):
+            case (DataType::BACnetServicesSupported):
+            case (DataType::BACnetObjectTypesSupported):
+                valueLength = StringValueEstimatedLength;
+                break;
+            case (DataType::Unsigned):
+            case (DataType::Signed):
+            case (DataType::Real):
+            case (DataType::Enumerated):
+            case (DataType::Date):
+            case (DataType::Time):
+            case (DataType::BACnetObjectIdentifier):
+            case (DataType::BACnetObjectType):
+            case (DataType::BACnetDeviceStatus):
+            case (DataType::Unsigned16):
+            case (DataType::BACnetSegmentation):
+                //tag and 4 octets at most
+                valueLength = 5;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+    _valueLengthEstimates.insert(key, valueLength);
+    return length + valueLength;
+}
+
+static bool objectIdLessThan(const ExternalPropertyMapping *first, const ExternalPropertyMapping *second)
+{
+    return first->objectId < second->objectId;
+}
+
+void ExternalObjectsHandler::flushBatchedReads_hlpr()
+{
+    //group reads by devices
+    QHash<ObjIdNum, QList<ExternalPropertyMapping*> > deviceReads;
+    QHash<ObjIdNum, int> deviceMaxApdu;
+    foreach (ExternalPropertyMapping *mapping, _batchedReads) {
+        //the property is being read already (asked by the client, or in the batch not answered yet) - its answer will do
+        if (attachToPendingRead(mapping, 0))
+            continue;
+        ObjIdNum deviceId;
+        int maxApduLength;
+        if (!_appLayer->remoteDevice(mapping->objectId, &deviceId, &maxApduLength) || _batchedReadsUnsupported.contains(deviceId)) {
+            //device isn't known yet (ReadProperty gets it discovered), or doesn't support ReadPropertyMultiple
+            mapping->readAccessStrategy->readProperty(mapping, this, false);
+            continue;
+        }
+        deviceReads[deviceId].append(mapping);
+        deviceMaxApdu.insert(deviceId, maxApduLength);
+    }
+    _batchedReads.clear();
+
+    QHash<ObjIdNum, QList<ExternalPropertyMapping*> >::Iterator it = deviceReads.begin();
+    QHash<ObjIdNum, QList<ExternalPropertyMapping*> >::Iterator itEnd = deviceReads.end();
+    for (; it != itEnd; ++it) {
+        QList<ExternalPropertyMapping*> &reads = it.value();
+        //references of the same object go together - object part is encoded once for them
+        qStableSort(reads.begin(), reads.end(), objectIdLessThan);
+
+        //the whole ack has to fit into one APDU of the device - and no more references than it managed to answer, if it aborted before
+        const int maxLength = deviceMaxApdu.value(it.key()) - AckHeaderLength;
+        const int maxCount = _batchedReadsLimit.value(it.key(), reads.count());
+        QList<ExternalPropertyMapping*> batch;
+        int batchLength(0);
+        foreach (ExternalPropertyMapping *mapping, reads) {
+            bool objectStarts = batch.isEmpty() || (batch.last()->objectId != mapping->objectId);
+            int propertyLength = ackPropertyLength_hlpr(mapping);
+            int length = propertyLength + (objectStarts ? AckObjectLength : 0);
+            if (!batch.isEmpty() && ( (batchLength + length > maxLength) || (batch.count() >= maxCount) )) {
+                sendBatch_hlpr(it.key(), batch);
+                batch.clear();
+                batchLength = 0;
+                length = propertyLength + AckObjectLength;
+            }
+            batch.append(mapping);
+            batchLength += length;
+        }
+        if (!batch.isEmpty())
+            sendBatch_hlpr(it.key(), batch);
+    }
+}
+
+void ExternalObjectsHandler::sendBatch_hlpr(ObjIdNum deviceId, const QList<ExternalPropertyMapping*> &mappings)
+{
+    Q_ASSERT(!mappings.isEmpty());
+    //there is no point in ReadPropertyMultiple for a single property
+    if (1 == mappings.count()) {
+        mappings.first()->readAccessStrategy->readProperty(mappings.first(), this, false);
+        return;
+    }
+
+    ReadPropertyMultipleServiceData *service = new ReadPropertyMultipleServiceData();
+    Q_CHECK_PTR(service);
+    foreach (ExternalPropertyMapping *mapping, mappings)
+        service->append(numToObjId(mapping->objectId), mapping->propertyId, mapping->propertyArrayIdx);
+
+    ReadPropertyMultipleServiceHandler *serviceHandler = new ReadPropertyMultipleServiceHandler(service, mappings, deviceId, this);
+    Q_CHECK_PTR(serviceHandler);
+    //registered before sending, as in sendRead() - reads of these properties requested meanwhile are attached to the batch
+    foreach (ExternalPropertyMapping *mapping, mappings) {
+        TReadKey key = readKey(mapping);
+        if (!_pendingBatchedReads.contains(key))
+            _pendingBatchedReads.insert(key, serviceHandler);
+    }
+    //device itself is the destination - it's known, so the request is sent at once
+    if (!send(serviceHandler, deviceId))
+        sendFailed_hlpr(serviceHandler);
+}
+
+ExternalObjectsHandler::BatchedWrite::BatchedWrite(ExternalPropertyMapping *mapping, BacnetDataInterfaceShared data, int asynchId):
+    mapping(mapping),
+    data(data),
+    asynchId(asynchId)
+{
+    //encoded aside once, just to know how much of the request it takes - what doesn't fit into one APDU, is written singly
+    quint8 scratch[Bacnet::ApduMaxSize];
+    PropertyValue value(mapping->propertyId, data, mapping->propertyArrayIdx);
+    qint32 ret = value.toRaw(scratch, sizeof(scratch));
+    encodedLength = (ret > 0) ? ret : -1;
+}
+
+void ExternalObjectsHandler::queueBatchedWrite(ExternalPropertyMapping *propertyMapping, BacnetDataInterface *writeData, int asynchId)
+{
+    Q_CHECK_PTR(propertyMapping);
+    Q_CHECK_PTR(writeData);
+    _batchedWrites.append(BatchedWrite(propertyMapping, BacnetDataInterfaceShared(writeData), asynchId));
+    if (!_batchedWritesTimer.isActive())
+        _batchedWritesTimer.start(0, this);
+}
+
+void ExternalObjectsHandler::setBatchedWritesUnsupported(ObjIdNum deviceId)
+{
+    _batchedWritesUnsupported.insert(deviceId);
+}
+
+void ExternalObjectsHandler::sendSingleWrite(ExternalPropertyMapping *propertyMapping, BacnetDataInterfaceShared writeData, int asynchId)
+{
+    Q_CHECK_PTR(propertyMapping);
+    WritePropertyServiceData *serviceData = new WritePropertyServiceData();
+    Q_CHECK_PTR(serviceData);
+    serviceData->_objectId = ObjectIdentifier(propertyMapping->objectId);
+    serviceData->_propValue = PropertyValue(propertyMapping->propertyId, writeData, propertyMapping->propertyArrayIdx);
+
+    BacnetWritePropertyServiceHandler *serviceHandler =
+            new BacnetWritePropertyServiceHandler(serviceData, asynchId, propertyMapping);
+    Q_CHECK_PTR(serviceHandler);
+    if (!send(serviceHandler, propertyMapping->objectId))
+        sendFailed_hlpr(serviceHandler);
+}
+
+void ExternalObjectsHandler::flushBatchedWrites_hlpr()
+{
+    //group writes by devices - they are not reordered, since writes to the same property have to be executed in the order requested
+    QHash<ObjIdNum, QList<BatchedWrite> > deviceWrites;
+    QHash<ObjIdNum, int> deviceMaxApdu;
+    foreach (const BatchedWrite &write, _batchedWrites) {
+        ObjIdNum deviceId;
+        int maxApduLength;
+        if ( (write.encodedLength < 0) || !_appLayer->remoteDevice(write.mapping->objectId, &deviceId, &maxApduLength) ||
+             _batchedWritesUnsupported.contains(deviceId) ) {
+            //value too long for a batch, device isn't known yet (WriteProperty gets it discovered), or doesn't support WritePropertyMultiple
+            sendSingleWrite(write.mapping, write.data, write.asynchId);
+            continue;
+        }
+        deviceWrites[deviceId].append(write);
+        deviceMaxApdu.insert(deviceId, maxApduLength);
+    }
+    _batchedWrites.clear();
+
+    QHash<ObjIdNum, QList<BatchedWrite> >::Iterator it = deviceWrites.begin();
+    QHash<ObjIdNum, QList<BatchedWrite> >::Iterator itEnd = deviceWrites.end();
+    for (; it != itEnd; ++it) {
+        //the whole request has to fit into one APDU of the device
+        const int maxLength = deviceMaxApdu.value(it.key()) - RequestHeaderLength;
+        QList<BatchedWrite> batch;
+        int batchLength(0);
+        foreach (const BatchedWrite &write, it.value()) {
+            bool objectStarts = batch.isEmpty() || (batch.last().mapping->objectId != write.mapping->objectId);
+            int length = write.encodedLength + (objectStarts ? WriteObjectLength : 0);
+            if (!batch.isEmpty() && (batchLength + length > maxLength)) {
+                sendWriteBatch_hlpr(it.key(), batch);
+                batch.clear();
+                batchLength = 0;
+                length = write.encodedLength + WriteObjectLength;
+            }
+            batch.append(write);
+            batchLength += length;
+        }
+        if (!batch.isEmpty())
+            sendWriteBatch_hlpr(it.key(), batch);
+    }
+}
+
+void ExternalObjectsHandler::sendWriteBatch_hlpr(ObjIdNum deviceId, const QList<BatchedWrite> &writes)
+{
+    Q_ASSERT(!writes.isEmpty());
+    //there is no point in WritePropertyMultiple for a single property
+    if (1 == writes.count()) {
+        sendSingleWrite(writes.first().mapping, writes.first().data, writes.first().asynchId);
+        return;
+    }
+
+    WritePropertyMultipleServiceData *service = new WritePropertyMultipleServiceData();
+    Q_CHECK_PTR(service);
+    QList<WritePropertyMultipleServiceHandler::TWriter> writers;
+    foreach (const BatchedWrite &write, writes) {
+        ObjectIdentifier objectId(write.mapping->objectId);
+        service->append(objectId, write.mapping->propertyId, write.data, write.mapping->propertyArrayIdx);
+        writers.append(qMakePair(write.mapping, write.asynchId));
+    }
+
+    WritePropertyMultipleServiceHandler *serviceHandler = new WritePropertyMultipleServiceHandler(service, writers, deviceId, this);
+    Q_CHECK_PTR(serviceHandler);
+    //device itself is the destination - it's known, so the request is sent at once
+    if (!send(serviceHandler, deviceId))
+        sendFailed_hlpr(serviceHandler);
 }
 
 #include "bacnetarrayvisitor.h"
@@ -8,6 +8,7 @@
 #include "propertysubject.h"
 #include "externalpropertymapping.h"
 #include "bacnetcommon.h"
+#include "bacnetdata.h"
 #include "bacnetinternaladdresshelper.h"
 
 #include "covnotificationrequestdata.h"
@@ -23,6 +24,8 @@ namespace Bacnet {
     class ExternalObjectReadStrategy;
     class ExternalObjectWriteStrategy;
     class ExternalTimeDepJob;
+    class ReadPropertyServiceHandler;
+    class ReadPropertyMultipleServiceHandler;
 
     class ExternalObjectsHandler:
             public QObject,
@@ -60,11 +63,59 @@ namespace Bacnet {
         virtual void propertyValueChanged(Property *property);
 
     public:
+        /**
+          Sends the request to the device the object is in. Returns false, only if the request couldn't be sent - then the handler is given
+          back to the caller. If the device is not known yet, request waits for its discovery and true is returned.
+          */
         bool send(ExternalConfirmedServiceHandler *serviceHandler, ObjIdNum destinedObject);
 
+        /**
+          Reads of the same remote property (object, property and array index) are coalesced - while one is in flight, others
+          are attached to it and complete from its response. It may be ReadProperty, or one of the references of batched
+          ReadPropertyMultiple. Returns true, if there was such a read and requester was attached.
+          */
+        bool attachToPendingRead(ExternalPropertyMapping *propertyMapping, int asynchId);
+        /**
+          Sends the read and remembers it's in flight, until \sa readFinished() is called - also while it waits for the device discovery.
+          Returns false, if it couldn't be sent - then the handler is deleted without notifying anyone.
+          */
+        bool sendRead(ReadPropertyServiceHandler *serviceHandler);
+        //! Called by the read handler, when it's answered (or dropped) - no one may be attached to it anymore.
+        void readFinished(ReadPropertyServiceHandler *serviceHandler);
+        //! Same as above, but for all the references of the ReadPropertyMultiple request.
+        void batchedReadFinished(ReadPropertyMultipleServiceHandler *serviceHandler);
+
+        /**
+          Queues the polled read to be sent with ReadPropertyMultiple, together with the other reads of the same device queued in
+          the same poll round. They are sent at the end of the round, in as few requests as the device max APDU allows.
+          \sa ReadPropertyMultipleStrategy
+          */
+        void queueBatchedRead(ExternalPropertyMapping *propertyMapping);
+        //! The device rejected ReadPropertyMultiple - its properties are read with ReadProperty from now on.
+        void setBatchedReadsUnsupported(ObjIdNum deviceId);
+        //! The device aborted ReadPropertyMultiple of batchSize references (most likely its ack was too long) - next batches get half of that.
+        void shrinkBatchedReads(ObjIdNum deviceId, int batchSize);
+
+        /**
+          Queues the write to be sent with WritePropertyMultiple, together with the other writes to the same device requested meanwhile -
+          queued writes are sent, as soon as the control gets back to the event loop. Takes ownership of the write data.
+          \sa WritePropertyMultipleStrategy
+          */
+        void queueBatchedWrite(ExternalPropertyMapping *propertyMapping, BacnetDataInterface *writeData, int asynchId);
+        //! The device rejected WritePropertyMultiple - its properties are written with WriteProperty from now on.
+        void setBatchedWritesUnsupported(ObjIdNum deviceId);
+        //! Writes the value with WriteProperty - used, when the write can't be sent with WritePropertyMultiple.
+        void sendSingleWrite(ExternalPropertyMapping *propertyMapping, BacnetDataInterfaceShared writeData, int asynchId);
+
     private:
         QHash<Property*, ExternalPropertyMapping*> _mappingTable;
 
+        typedef QPair<Bacnet::ObjIdNum, QPair<int, quint32> > TReadKey;
+        static TReadKey readKey(ExternalPropertyMapping *propertyMapping);
+        QHash<TReadKey, ReadPropertyServiceHandler*> _pendingReads;
+        //! References of ReadPropertyMultiple requests in flight - a few requests, each with its batch of references.
+        QHash<TReadKey, ReadPropertyMultipleServiceHandler*> _pendingBatchedReads;
+
     protected:
         void timerEvent(QTimerEvent *);
     private:
@@ -75,6 +126,51 @@ namespace Bacnet {
         static const int DefaultInterval_ms = 500;
         int _interval_ms;
 
+        QList<ExternalPropertyMapping*> _batchedReads;
+        QSet<ObjIdNum> _batchedReadsUnsupported;
+        //! Maximum number of references in one ReadPropertyMultiple to the device - set, when the device aborted the longer one.
+        QHash<ObjIdNum, int> _batchedReadsLimit;
+        //! Estimates of ReadPropertyMultiple ack length - its header, object part (id and list tags) and a result of a property.
+        static const int AckHeaderLength = 3;
+        static const int AckObjectLength = 7;
+        //! Property identifier and opening/closing tags of the value (array index is added, if present).
+        static const int AckPropertyHeaderLength = 5;
+        static const int AckArrayIndexLength = 5;
+        //! Values, which length is not known in advance - strings, bit strings, constructed ones.
+        static const int StringValueEstimatedLength = 64;
+        static const int ListValueEstimatedLength = 256;
+        static const int UnknownValueEstimatedLength = 16;
+        //! Estimated length of the property result - by the datatype, which the property of that object type has.
+        int ackPropertyLength_hlpr(ExternalPropertyMapping *mapping);
+        //! Value length estimates cache - key is object type and property identifier (with the array index presence in the lowest bit).
+        QHash<QPair<int, int>, int> _valueLengthEstimates;
+        void flushBatchedReads_hlpr();
+        void sendBatch_hlpr(ObjIdNum deviceId, const QList<ExternalPropertyMapping*> &mappings);
+        //! Completes the request, that couldn't be sent, as if it timed out. Used where requesters have already been told to wait.
+        void sendFailed_hlpr(ExternalConfirmedServiceHandler *serviceHandler);
+
+        class BatchedWrite
+        {
+        public:
+            BatchedWrite(ExternalPropertyMapping *mapping, BacnetDataInterfaceShared data, int asynchId);
+
+        public:
+            ExternalPropertyMapping *mapping;
+            BacnetDataInterfaceShared data;
+            int asynchId;
+            //! Length of the encoded property value (identifier, array index and the value itself) or -1, if it can't be encoded.
+            int encodedLength;
+        };
+        QList<BatchedWrite> _batchedWrites;
+        QSet<ObjIdNum> _batchedWritesUnsupported;
+        //! Zero timer - writes requested until it fires go together.
+        QBasicTimer _batchedWritesTimer;
+        //! WritePropertyMultiple request length - its header and object part (id and list tags); property values are encoded to be measured.
+        static const int RequestHeaderLength = 4;
+        static const int WriteObjectLength = 7;
+        void flushBatchedWrites_hlpr();
+        void sendWriteBatch_hlpr(ObjIdNum deviceId, const QList<BatchedWrite> &writes);
+
     public:
         //! Method to call subscription/resubscription requests. In the latter case, resubId should be the same, as earlier subscription processId.
         static const int NotAResubscription = -1;
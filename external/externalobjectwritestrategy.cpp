@@ -10,6 +10,38 @@
 using namespace Bacnet;
 
 int Bacnet::ExternalObjectWriteStrategy::writeProperty(ExternalPropertyMapping *propertyMapping, ExternalObjectsHandler *externalHandler, QVariant &valueToWrite, bool generateAsynchId)
+{
+    int asynchId = writeAsynchId(propertyMapping, generateAsynchId);
+    if (asynchId < 0)
+        return asynchId;
+
+    int result;
+    BacnetDataInterface *writeData = createWriteData(propertyMapping, valueToWrite, &result);
+    if (0 == writeData) {
+        if (asynchId > 0)
+            propertyMapping->mappedProperty->releaseId(asynchId);
+        return result;
+    }
+
+    ObjectIdentifier objectId(propertyMapping->objectId);
+    WritePropertyServiceData *serviceData =
+            new WritePropertyServiceData(objectId, propertyMapping->propertyId, writeData, propertyMapping->propertyArrayIdx);
+    Q_CHECK_PTR(serviceData);
+    BacnetWritePropertyServiceHandler *serviceHandler =
+            new BacnetWritePropertyServiceHandler(serviceData, asynchId, propertyMapping);
+    Q_CHECK_PTR(serviceHandler);
+
+    //the ownership isgiven to AppLayer. We just use pointers as Asynchronous tokens.
+    if (!externalHandler->send(serviceHandler, propertyMapping->objectId)) {
+        delete serviceHandler;
+        if (asynchId > 0)
+            propertyMapping->mappedProperty->releaseId(asynchId);
+        return Property::UnknownError;
+    }
+    return asynchId;
+}
+
+int ExternalObjectWriteStrategy::writeAsynchId(ExternalPropertyMapping *propertyMapping, bool generateAsynchId)
 {
     Q_CHECK_PTR(propertyMapping);
     Q_CHECK_PTR(propertyMapping->mappedProperty);
@@ -22,36 +54,31 @@ int Bacnet::ExternalObjectWriteStrategy::writeProperty(ExternalPropertyMapping *
         qWarning("Can't generate asynchronous id.");
         return Property::UnknownError;
     }
+    return asynchId;
+}
 
+BacnetDataInterface *ExternalObjectWriteStrategy::createWriteData(ExternalPropertyMapping *propertyMapping, QVariant &valueToWrite, int *result)
+{
+    Q_CHECK_PTR(result);
     ObjectIdentifier objectId(propertyMapping->objectId);
     BacnetDataInterface *writeData = BacnetDefaultObject::createDataForObjectProperty(objectId.type(), propertyMapping->propertyId, propertyMapping->propertyArrayIdx);
     Q_CHECK_PTR(writeData);
     if (0 == writeData) {
         qWarning("Can't create appropriate value isntance for %d, %d", objectId.type(), propertyMapping->propertyId);
-        if (asynchId > 0)
-            propertyMapping->mappedProperty->releaseId(asynchId);
-        return Property::UnknownError;
+        *result = Property::UnknownError;
+        return 0;
     }
 
     if (!writeData->setInternal(valueToWrite)) {
         qDebug("ExternalObjectsHandler::setPropertyRequest() : Can't convert variant type %d, to bacnet type %d",
                valueToWrite.type(), writeData->typeId());
         delete writeData;
-        if (asynchId > 0)
-            propertyMapping->mappedProperty->releaseId(asynchId);
-        return Property::TypeMismatch;
+        *result = Property::TypeMismatch;
+        return 0;
     }
 
-    WritePropertyServiceData *serviceData =
-            new WritePropertyServiceData(objectId, propertyMapping->propertyId, writeData, propertyMapping->propertyArrayIdx);
-    Q_CHECK_PTR(serviceData);
-    BacnetWritePropertyServiceHandler *serviceHandler =
-            new BacnetWritePropertyServiceHandler(serviceData, asynchId, propertyMapping);
-    Q_CHECK_PTR(serviceHandler);
-
-    //the ownership isgiven to AppLayer. We just use pointers as Asynchronous tokens.
-    externalHandler->send(serviceHandler, propertyMapping->objectId);
-    return asynchId;
+    *result = Property::ResultOk;
+    return writeData;
 }
 
 bool ExternalObjectWriteStrategy::isPeriodic()
@@ -79,3 +106,27 @@ void ExternalObjectWriteStrategy::actionFinished(ExternalObjectWriteStrategy::Fi
 {
     Q_UNUSED(finishStatus);
 }
+
+////////////////////////////////////////////////////
+/////////WritePropertyMultipleStrategy//////////////
+////////////////////////////////////////////////////
+
+int WritePropertyMultipleStrategy::writeProperty(ExternalPropertyMapping *propertyMapping, ExternalObjectsHandler *externalHandler, QVariant &valueToWrite, bool generateAsynchId)
+{
+    Q_CHECK_PTR(externalHandler);
+    int asynchId = writeAsynchId(propertyMapping, generateAsynchId);
+    if (asynchId < 0)
+        return asynchId;
+
+    int result;
+    BacnetDataInterface *writeData = createWriteData(propertyMapping, valueToWrite, &result);
+    if (0 == writeData) {
+        if (asynchId > 0)
+            propertyMapping->mappedProperty->releaseId(asynchId);
+        return result;
+    }
+
+    //handler takes care of the value and finishes the write, when batch is answered
+    externalHandler->queueBatchedWrite(propertyMapping, writeData, asynchId);
+    return asynchId;
+}
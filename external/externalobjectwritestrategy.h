@@ -8,6 +8,7 @@ namespace Bacnet {
 
 class ExternalPropertyMapping;
 class ExternalObjectsHandler;
+class BacnetDataInterface;
 
 
 class ExternalObjectWriteStrategy:
@@ -31,6 +32,25 @@ public:
         FinishedCritical
     };
     virtual void actionFinished(FinishStatus finishStatus);
+
+protected:
+    //! Returns asynchronous id of the write (or ResultOk, if not generated). Negative value is an error.
+    int writeAsynchId(ExternalPropertyMapping *propertyMapping, bool generateAsynchId);
+    //! Creates BACnet value of the mapped property from the internal one. Returns 0 and sets result to the error, if it can't.
+    BacnetDataInterface *createWriteData(ExternalPropertyMapping *propertyMapping, QVariant &valueToWrite, int *result);
+};
+
+/**
+    Writes are not sent at once - they are queued in the external handler, which sends writes to the same device requested meanwhile
+    (before the control returns to the event loop) with as few WritePropertyMultiple requests as possible. Handy for mass writes,
+    like switching the whole building to night mode. If the device doesn't support the service, properties are written with
+    WriteProperty.
+  */
+class WritePropertyMultipleStrategy:
+        public ExternalObjectWriteStrategy
+{
+public:
+    virtual int writeProperty(ExternalPropertyMapping *propertyMapping, ExternalObjectsHandler *externalHandler, QVariant &valueToWrite, bool generateAsynchId = false);
 };
 
 } // namespace Bacnet
@@ -42,6 +42,9 @@ static const char *BacnetDeviceNetworkAttribute     = "bac-network";
 static const char *BacnetDeviceSegmentationAttribute= "bac-segmentation";
 static const char *BacnetDeviceMaxApduAttribute     = "bac-max-apdu";
 
+static const char *MaxDeviceRequestsAttribute       = "max-device-requests";
+static const char *MaxOutstandingRequestsAttribute  = "max-outstanding-requests";
+
 void BacnetConfigurator::configureInternalHandler(QDomElement &devicesConfig, DataModel *dataModel, InternalObjectsHandler *intHandler)
 {
     _dataModel = dataModel;
@@ -96,6 +99,22 @@ void BacnetConfigurator::configureExternalHandler(QDomElement extPropsConfig, Da
     }
     extHandler->addRegisteredAddress(extAddress);
 
+    //how hard external devices may be polled - requests over the limits are queued
+    if (extPropsConfig.hasAttribute(MaxDeviceRequestsAttribute)) {
+        int window = extPropsConfig.attribute(MaxDeviceRequestsAttribute).toInt(&ok);
+        if (ok && (window > 0))
+            appLayer->_tsm->setMaxPeerWindow(window);
+        else
+            ConfiguratorHelper::elementError(extPropsConfig, MaxDeviceRequestsAttribute, "Default one is used.");
+    }
+    if (extPropsConfig.hasAttribute(MaxOutstandingRequestsAttribute)) {
+        int count = extPropsConfig.attribute(MaxOutstandingRequestsAttribute).toInt(&ok);
+        if (ok && (count > 0))
+            appLayer->_tsm->setMaxOutstandingRequests(count);
+        else
+            ConfiguratorHelper::elementError(extPropsConfig, MaxOutstandingRequestsAttribute, "Default one is used.");
+    }
+
     QDomNodeList devicesList = extPropsConfig.elementsByTagName(DevicesListTagName).at(0).toElement().elementsByTagName(BacnetDeviceTagName);
     int devicesNumber = devicesList.count();
     QDomElement deviceElement;
@@ -175,11 +194,13 @@ void BacnetConfigurator::populatePropertyMappings(ObjectIdentifier &deviceId, Ob
 const char *ReadStrategyAttribute       = "read-strategy";
 const char *SimpleReadStrategyName      = "simple";
 const char *SimpleTimeReadStrategyName  = "simple-time";
+const char *RpmTimeReadStrategyName     = "rpm-time";
 const char *CovReadStrategyName         = "cov";
 const char *CovPollReadStrategyName     = "cov-poll";
 const char *ReadStrategyIntervalAttribute   = "read-interval";
 const char *CovConfirmedAttribute       = "cov-confirmed";
 const char *SimpleWriteStrategyName      = "simple";
+const char *WpmWriteStrategyName         = "wpm";
 const char *WriteStrategyAttribute      = "write-strategy";
 
 ExternalObjectWriteStrategy *BacnetConfigurator::createWriteStrategy(QDomElement &pElem)
@@ -187,6 +208,8 @@ ExternalObjectWriteStrategy *BacnetConfigurator::createWriteStrategy(QDomElement
     QString str = pElem.attribute(WriteStrategyAttribute);
     if (SimpleWriteStrategyName == str)
         return new ExternalObjectWriteStrategy();
+    else if (WpmWriteStrategyName == str)
+        return new WritePropertyMultipleStrategy();
     else
         return 0;
 }
@@ -214,6 +237,8 @@ ExternalObjectReadStrategy *BacnetConfigurator::createReadStrategy(QDomElement &
 
         if (SimpleTimeReadStrategyName == str) {
             return new SimpleWithTimeReadStrategy(interval);
+        } else if (RpmTimeReadStrategyName == str) {
+            return new ReadPropertyMultipleStrategy(interval);
         } else if (CovReadStrategyName == str || CovPollReadStrategyName == str) {
             //optional - confirmed, interval (resubscription or reading on error), reading on error. If not provided, by default is false, 60000ms, false.
             bool confirmed(false);
@@ -17,6 +17,10 @@ static const char *ReachableNetworkTag              = "reachableNet";
 static const char *BacnetAddrTypeAttr               = "bac-addr-type";
 static const char *BacnetAddrRawTypeValue           = "raw";
 static const char *BacnetAddrBipTypeValue           = "ip";
+static const char *PendingRouteTimeoutAttribute     = "pending-route-timeout-ms";
+static const char *PendingRouteQueueSizeAttribute   = "pending-route-queue-size";
+static const char *BusyLoadAttribute                = "busy-load-percent";
+static const char *AvailableLoadAttribute           = "available-load-percent";
 
 BacnetNetworkLayerHandler *NetworkLayerConfigurator::createNetworkLayer(QHash<quint8, BacnetTransportLayerHandler*> &ports, QDomElement &netCfgElement)
 {
@@ -24,12 +28,42 @@ BacnetNetworkLayerHandler *NetworkLayerConfigurator::createNetworkLayer(QHash<qu
     BacnetNetworkLayerHandler *netLayer = new ::BacnetNetworkLayerHandler();
     netLayer->addPorts(ports);
 
+    //APDUs waiting for route discovery
+    bool ok;
+    int pendingTimeout_ms = netCfgElement.attribute(PendingRouteTimeoutAttribute).toInt(&ok);
+    if (!ok || (pendingTimeout_ms <= 0)) {
+        if (netCfgElement.hasAttribute(PendingRouteTimeoutAttribute))
+            ConfiguratorHelper::elementError(netCfgElement, PendingRouteTimeoutAttribute);
+        pendingTimeout_ms = BacnetNetworkLayerHandler::DefaultPendingRouteTimeout_ms;
+    }
+    int pendingQueueSize = netCfgElement.attribute(PendingRouteQueueSizeAttribute).toInt(&ok);
+    if (!ok || (pendingQueueSize < 0)) {
+        if (netCfgElement.hasAttribute(PendingRouteQueueSizeAttribute))
+            ConfiguratorHelper::elementError(netCfgElement, PendingRouteQueueSizeAttribute);
+        pendingQueueSize = BacnetNetworkLayerHandler::DefaultMaxPendingPerNetwork;
+    }
+    netLayer->setPendingRouteLimits(pendingTimeout_ms, pendingQueueSize);
+
+    //congestion control - busy threshold has to be above the available one
+    int busyLoad = netCfgElement.attribute(BusyLoadAttribute).toInt(&ok);
+    if (!ok || (busyLoad <= 0)) {
+        if (netCfgElement.hasAttribute(BusyLoadAttribute))
+            ConfiguratorHelper::elementError(netCfgElement, BusyLoadAttribute);
+        busyLoad = BacnetNetworkLayerHandler::DefaultBusyLoad_percent;
+    }
+    int availableLoad = netCfgElement.attribute(AvailableLoadAttribute).toInt(&ok);
+    if (!ok || (availableLoad < 0) || (availableLoad >= busyLoad)) {
+        if (netCfgElement.hasAttribute(AvailableLoadAttribute))
+            ConfiguratorHelper::elementError(netCfgElement, AvailableLoadAttribute);
+        availableLoad = qMin((int)BacnetNetworkLayerHandler::DefaultAvailableLoad_percent, busyLoad - 1);
+    }
+    netLayer->setCongestionThresholds(busyLoad, availableLoad);
+
     QList<quint16> networksUsed;
     QDomElement rTableElement = netCfgElement.firstChildElement(RoutingTableTag);
 
     quint8 portId;
     quint16 network;
-    bool ok;
 
     QDomElement routeElement;
     QDomElement routeTabElem;
@@ -4,6 +4,10 @@
 
 #include "bacnettransportlayer.h"
 #include "bacnetbiptransportlayer.h"
+#include "bacnetpcapreplaytransportlayer.h"
+#include "bacnetloopbacktransportlayer.h"
+#include "bacnetbbmdhandler.h"
+#include "bacnetvirtuallinklayer.h"
 #include "bacnetaddress.h"
 
 #include "configuratorhelper.h"
@@ -17,6 +21,55 @@ static const char *TransportLayerTypeAttr   = "type";
 static const char *BacnetAddressAttribute   = "address";
 static const char *PortTagName              = "port";
 static const char *PortIdAttribute          = "port-id";
+static const char *RxWorkersAttribute       = "rx-workers";
+static const char *TxQueueDepthAttribute    = "tx-queue-depth";
+static const char *TxPacingAttribute        = "tx-pacing-ms";
+
+//capture replay port settings
+static const char *PcapReplayValue              = "pcap-replay";
+static const char *ReplayFileAttribute          = "file";
+static const char *ReplaySpeedAttribute         = "speed";
+static const char *ReplayMaxSpeedValue          = "max";
+static const char *ReplayRepeatAttribute        = "repeat";
+static const char *ReplayRepliesFileAttribute   = "replies-file";
+static const char *ReplayQuitAttribute          = "quit-when-done";
+static const char *ReplayStartDelayAttribute    = "start-delay-ms";
+static const int ReplayDefaultStartDelay_ms     = 1000;
+
+//in-memory loopback port settings
+static const char *LoopbackValue                = "loopback";
+static const char *LoopbackSegmentAttribute     = "segment";
+static const char *LoopbackNameAttribute        = "name";
+
+//BBMD settings (B/IP and loopback ports)
+static const char *BbmdAttribute                = "bbmd";
+static const char *BdtEntryTagName              = "bdt-entry";
+static const char *BdtMaskAttribute             = "mask";
+static const char *MaxForeignDevicesAttribute   = "max-foreign-devices";
+
+//broadcast storm suppression (B/IP and loopback ports)
+static const char *BcastDedupAttribute          = "bcast-dedup-ms";
+static const char *BcastRateLimitAttribute      = "bcast-rate-limit";
+static const char *BcastRateBurstAttribute      = "bcast-rate-burst";
+
+/**
+  Returns value of the port setting. The port element may specify it, otherwise the value from transportLayer element is used (so that
+  it may be set for all the ports at once). If none of them has it (or it's not correct), defaultValue is returned.
+  */
+static int portSetting_hlpr(QDomElement &portCfg, QDomElement &transportLayCfg, const char *attrName, int defaultValue, int minValue)
+{
+    QDomElement *elements[] = {&portCfg, &transportLayCfg};
+    for (int i = 0; i < 2; ++i) {
+        if (!elements[i]->hasAttribute(attrName))
+            continue;
+        bool ok;
+        int value = elements[i]->attribute(attrName).toInt(&ok);
+        if (ok && (value >= minValue))
+            return value;
+        ConfiguratorHelper::elementError(*elements[i], attrName);
+    }
+    return defaultValue;
+}
 
 QHash<quint8, BacnetTransportLayerHandler*> TransportLayerConfigurator::createTransportLayer(QDomElement &transportLayCfg)
 {
@@ -25,6 +78,7 @@ QHash<quint8, BacnetTransportLayerHandler*> TransportLayerConfigurator::createTr
     QHash<quint8, BacnetTransportLayerHandler*> createdPorts;
     bool ok;
     quint8 portId;
+
     for (QDomElement portElement = transportLayCfg.firstChildElement(PortTagName); !portElement.isNull(); portElement = portElement.nextSiblingElement(PortTagName)) {
         //get port id
         portId = portElement.attribute(PortIdAttribute).toUInt(&ok);
@@ -45,7 +99,11 @@ QHash<quint8, BacnetTransportLayerHandler*> TransportLayerConfigurator::createTr
 
         BacnetTransportLayerHandler *tLayer(0);
         if (BacnetIpAddressValue == str) {
-            tLayer = createBipTransportLayer(portElement);
+            tLayer = createBipTransportLayer(portElement, transportLayCfg);
+        } else if (PcapReplayValue == str) {
+            tLayer = createPcapReplayTransportLayer(portElement);
+        } else if (LoopbackValue == str) {
+            tLayer = createLoopbackTransportLayer(portElement, transportLayCfg);
         } else {
             //there weas an error/. Don;t have to continue or break, since 0 != tLayer takes care of that.
             ConfiguratorHelper::elementError(portElement, TransportLayerTypeAttr);
@@ -59,43 +117,184 @@ QHash<quint8, BacnetTransportLayerHandler*> TransportLayerConfigurator::createTr
     return createdPorts;
 }
 
-BacnetBipTransportLayer *TransportLayerConfigurator::createBipTransportLayer(QDomElement &bipLayCfg)
+bool TransportLayerConfigurator::parseBipAddress(QDomElement &bipLayCfg, QHostAddress &ipAddress, quint16 &port)
 {
     QString addrStr = bipLayCfg.attribute(BacnetAddressAttribute);
     if (addrStr.isEmpty()) {
         ConfiguratorHelper::elementError(bipLayCfg, BacnetAddressAttribute, "No address provided!");
-        return 0;
+        return false;
     }
 
     QString addressType = bipLayCfg.attribute(BacnetAddressTypeAttr);
 
-    QHostAddress ipAddress;
-    quint64 port(0);
+    quint64 portNum(0);
     if (BacnetRawAddressValue == addressType) {
         //expected format is xx:xx:xx:xx:pp:pp, all numbers in hexadecimal
         BacnetAddress address;
         if (!address.macAddressFromString(addrStr)) {
             ConfiguratorHelper::elementError(bipLayCfg, BacnetAddressTypeAttr);
-            return 0;
+            return false;
         }
         ipAddress = BacnetBipAddressHelper::ipAddress(address);
-        port = BacnetBipAddressHelper::ipPort(address);
+        portNum = BacnetBipAddressHelper::ipPort(address);
     } else { //assume default is ip-like address
         //expected format is xxx.xxx.xxx.xxx:<port-num>, all numbers in decimal
 
-        if (!BacnetBipAddressHelper::macAddressFromString(addrStr, &ipAddress, &port)) {
+        if (!BacnetBipAddressHelper::macAddressFromString(addrStr, &ipAddress, &portNum)) {
             ConfiguratorHelper::elementError(bipLayCfg, BacnetAddressTypeAttr);
-            return 0;
+            return false;
         }
     }
 
-    if ( ipAddress.isNull() || (0 == port) ) {
+    if ( ipAddress.isNull() || (0 == portNum) ) {
         qDebug("%s : Can't parse address.", __PRETTY_FUNCTION__);
-        return 0;
+        return false;
     }
+    port = portNum;
+    return true;
+}
+
+BacnetBipTransportLayer *TransportLayerConfigurator::createBipTransportLayer(QDomElement &bipLayCfg, QDomElement &transportLayCfg)
+{
+    QHostAddress ipAddress;
+    quint16 port(0);
+    if (!parseBipAddress(bipLayCfg, ipAddress, port))
+        return 0;
 
     BacnetBipTransportLayer *bip = new BacnetBipTransportLayer();
-    bip->transportLayer()->setAddress(ipAddress, port);    
+    BacnetUdpTransportLayerHandler *udpLayer = bip->transportLayer();
+    //has to be set before the socket is bound
+    udpLayer->setReceiveWorkersCount(portSetting_hlpr(bipLayCfg, transportLayCfg, RxWorkersAttribute, 1, 1));
+    udpLayer->setTxQueueDepth(portSetting_hlpr(bipLayCfg, transportLayCfg, TxQueueDepthAttribute, BacnetUdpTransportLayerHandler::DefaultTxQueueDepth, 1));
+    udpLayer->setTxPacingInterval(portSetting_hlpr(bipLayCfg, transportLayCfg, TxPacingAttribute, 0, 0));
+    udpLayer->setAddress(ipAddress, port);
+    configureBbmd(bipLayCfg, bip->bvllHandler());
+    configureBroadcastFilter(bipLayCfg, transportLayCfg, bip->bvllHandler());
 
     return bip;
 }
+
+BacnetPcapReplayTransportLayer *TransportLayerConfigurator::createPcapReplayTransportLayer(QDomElement &replayCfg)
+{
+    //our address is needed to tell our own (captured) frames from the ones we should get
+    QHostAddress ipAddress;
+    quint16 port(0);
+    if (!parseBipAddress(replayCfg, ipAddress, port))
+        return 0;
+
+    QString fileName = replayCfg.attribute(ReplayFileAttribute);
+    if (fileName.isEmpty()) {
+        ConfiguratorHelper::elementError(replayCfg, ReplayFileAttribute, "No capture file provided!");
+        return 0;
+    }
+
+    BacnetPcapReplayTransportLayer *replay = new BacnetPcapReplayTransportLayer();
+    replay->setAddress(ipAddress, port);
+    if (!replay->loadCapture(fileName)) {
+        ConfiguratorHelper::elementError(replayCfg, ReplayFileAttribute, "Can't read capture!");
+        delete replay;
+        return 0;
+    }
+
+    //speed is either "max" or a factor of original timing
+    QString speedStr = replayCfg.attribute(ReplaySpeedAttribute);
+    if (ReplayMaxSpeedValue == speedStr) {
+        replay->setSpeed(0);
+    } else if (!speedStr.isEmpty()) {
+        bool ok;
+        double speed = speedStr.toDouble(&ok);
+        if (ok && (speed > 0))
+            replay->setSpeed(speed);
+        else
+            ConfiguratorHelper::elementError(replayCfg, ReplaySpeedAttribute);
+    }
+
+    bool ok;
+    if (replayCfg.hasAttribute(ReplayRepeatAttribute)) {
+        int repeatCount = replayCfg.attribute(ReplayRepeatAttribute).toInt(&ok);
+        if (ok && (repeatCount > 0))
+            replay->setRepeatCount(repeatCount);
+        else
+            ConfiguratorHelper::elementError(replayCfg, ReplayRepeatAttribute);
+    }
+
+    QString repliesFile = replayCfg.attribute(ReplayRepliesFileAttribute);
+    if (!repliesFile.isEmpty() && !replay->setRepliesFile(repliesFile))
+        ConfiguratorHelper::elementError(replayCfg, ReplayRepliesFileAttribute, "Can't open the file!");
+
+    replay->setQuitWhenFinished("true" == replayCfg.attribute(ReplayQuitAttribute).toLower());
+
+    int startDelay_ms = replayCfg.attribute(ReplayStartDelayAttribute).toInt(&ok);
+    replay->start(ok ? startDelay_ms : ReplayDefaultStartDelay_ms);
+
+    return replay;
+}
+
+BacnetLoopbackTransportLayer *TransportLayerConfigurator::createLoopbackTransportLayer(QDomElement &loopbackCfg, QDomElement &transportLayCfg)
+{
+    QHostAddress ipAddress;
+    quint16 port(0);
+    if (!parseBipAddress(loopbackCfg, ipAddress, port))
+        return 0;
+
+    QString segment = loopbackCfg.attribute(LoopbackSegmentAttribute);
+    if (segment.isEmpty()) {
+        ConfiguratorHelper::elementError(loopbackCfg, LoopbackSegmentAttribute, "No segment provided!");
+        return 0;
+    }
+    QString name = loopbackCfg.attribute(LoopbackNameAttribute, loopbackCfg.attribute(BacnetAddressAttribute));
+
+    BacnetLoopbackTransportLayer *loopback = new BacnetLoopbackTransportLayer();
+    if (!loopback->attach(name, segment, ipAddress, port)) {
+        ConfiguratorHelper::elementError(loopbackCfg, LoopbackSegmentAttribute, "Can't attach to the segment!");
+        delete loopback;
+        return 0;
+    }
+    configureBbmd(loopbackCfg, loopback->bvllHandler());
+    configureBroadcastFilter(loopbackCfg, transportLayCfg, loopback->bvllHandler());
+
+    return loopback;
+}
+
+void TransportLayerConfigurator::configureBbmd(QDomElement &portCfg, BacnetBvllHandler *bvllHndlr)
+{
+    Q_CHECK_PTR(bvllHndlr);
+    if ("true" != portCfg.attribute(BbmdAttribute).toLower())
+        return;
+
+    BacnetBbmdHandler *bbmd = new BacnetBbmdHandler(bvllHndlr);
+    if (portCfg.hasAttribute(MaxForeignDevicesAttribute)) {
+        bool ok;
+        int maxFdCount = portCfg.attribute(MaxForeignDevicesAttribute).toInt(&ok);
+        if (ok && (maxFdCount >= 0))
+            bbmd->setMaxForeignDevicesCount(maxFdCount);
+        else
+            ConfiguratorHelper::elementError(portCfg, MaxForeignDevicesAttribute);
+    }
+    for (QDomElement entryElement = portCfg.firstChildElement(BdtEntryTagName); !entryElement.isNull(); entryElement = entryElement.nextSiblingElement(BdtEntryTagName)) {
+        QHostAddress ipAddress;
+        quint16 port(0);
+        if (!parseBipAddress(entryElement, ipAddress, port))
+            continue;
+        //by default messages are sent directly to the other BBMD
+        QHostAddress mask(QString("255.255.255.255"));
+        if (entryElement.hasAttribute(BdtMaskAttribute) && !mask.setAddress(entryElement.attribute(BdtMaskAttribute))) {
+            ConfiguratorHelper::elementError(entryElement, BdtMaskAttribute);
+            continue;
+        }
+
+        BacnetAddress address;
+        BacnetBipAddressHelper::setMacAddress(ipAddress, port, &address);
+        bbmd->addBroadcastTableEntry(address, mask.toIPv4Address());
+    }
+    bvllHndlr->setBbmdHndlr(bbmd);
+}
+
+void TransportLayerConfigurator::configureBroadcastFilter(QDomElement &portCfg, QDomElement &transportLayCfg, BacnetBvllHandler *bvllHndlr)
+{
+    Q_CHECK_PTR(bvllHndlr);
+    BacnetBroadcastFilter &filter = bvllHndlr->broadcastFilter();
+    filter.setDedupWindow(portSetting_hlpr(portCfg, transportLayCfg, BcastDedupAttribute, BacnetBroadcastFilter::DefaultDedupWindow_ms, 0));
+    filter.setRateLimit(portSetting_hlpr(portCfg, transportLayCfg, BcastRateLimitAttribute, 0, 0),
+                        portSetting_hlpr(portCfg, transportLayCfg, BcastRateBurstAttribute, 0, 0));
+}
@@ -3,10 +3,14 @@
 
 #include <QDomDocument>
 #include <QHash>
+#include <QHostAddress>
 
 class BacnetTransportLayerHandler;
 class BacnetNetworkLayerHandler;
 class BacnetBipTransportLayer;
+class BacnetPcapReplayTransportLayer;
+class BacnetLoopbackTransportLayer;
+class BacnetBvllHandler;
 
 namespace Bacnet {
 
@@ -16,7 +20,18 @@ public:
     static QHash<quint8, BacnetTransportLayerHandler*> createTransportLayer(QDomElement &transportLayCfg);
 
 private:
-    static BacnetBipTransportLayer *createBipTransportLayer(QDomElement &bipLayCfg);
+    //! transportLayCfg is used for the settings, which are common for all the ports (port element may override them).
+    static BacnetBipTransportLayer *createBipTransportLayer(QDomElement &bipLayCfg, QDomElement &transportLayCfg);
+    static BacnetPcapReplayTransportLayer *createPcapReplayTransportLayer(QDomElement &replayCfg);
+    static BacnetLoopbackTransportLayer *createLoopbackTransportLayer(QDomElement &loopbackCfg, QDomElement &transportLayCfg);
+
+    //! If port element has bbmd="true", creates BBMD handler with BDT from bdt-entry children (and FDT limited by max-foreign-devices) and sets it to the BVLL.
+    static void configureBbmd(QDomElement &portCfg, BacnetBvllHandler *bvllHndlr);
+    //! Sets broadcast deduplication window and per source rate limit (bcast-dedup-ms, bcast-rate-limit and bcast-rate-burst attributes).
+    static void configureBroadcastFilter(QDomElement &portCfg, QDomElement &transportLayCfg, BacnetBvllHandler *bvllHndlr);
+
+    //! Reads B/IP address (address and bac-addr-type attributes) of the port element.
+    static bool parseBipAddress(QDomElement &bipLayCfg, QHostAddress &ipAddress, quint16 &port);
 };
 
 } // namespace Bacnet
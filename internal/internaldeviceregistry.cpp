@@ -0,0 +1,53 @@
+#include "internaldeviceregistry.h"
+
+#include <QtAlgorithms>
+
+#include "bacnetdeviceobject.h"
+#include "bacnetcommon.h"
+
+using namespace Bacnet;
+
+quint32 InternalDeviceRegistry::instanceNumber(const BacnetDeviceObject *device)
+{
+    return device->objectIdNum() & ObjectInstanceMask;
+}
+
+bool InternalDeviceRegistry::instanceLessThan_hlpr(const BacnetDeviceObject *device, quint32 instanceNumber)
+{
+    return InternalDeviceRegistry::instanceNumber(device) < instanceNumber;
+}
+
+bool InternalDeviceRegistry::instanceGreaterThan_hlpr(quint32 instanceNumber, const BacnetDeviceObject *device)
+{
+    return instanceNumber < InternalDeviceRegistry::instanceNumber(device);
+}
+
+bool InternalDeviceRegistry::addDevice(InternalAddress address, BacnetDeviceObject *device)
+{
+    Q_CHECK_PTR(device);
+    quint32 instance = instanceNumber(device);
+    if ( (BacnetInternalAddressHelper::InvalidInternalAddress == address) || _byAddress.contains(address) ) {
+        qDebug("%s : address %d is invalid or already taken!", __PRETTY_FUNCTION__, address);
+        return false;
+    }
+    if (_byInstance.contains(instance)) {
+        qDebug("%s : device instance %d is already registered!", __PRETTY_FUNCTION__, instance);
+        return false;
+    }
+
+    _byAddress.insert(address, device);
+    _byInstance.insert(instance, device);
+    //devices are added only at startup, so keeping the vector sorted on insertion is cheap enough
+    QVector<BacnetDeviceObject*>::Iterator it = qLowerBound(_sorted.begin(), _sorted.end(), instance, instanceLessThan_hlpr);
+    _sorted.insert(it, device);
+    return true;
+}
+
+void InternalDeviceRegistry::instanceRange(quint32 lowInstance, quint32 highInstance, ConstIterator &begin, ConstIterator &end) const
+{
+    begin = qLowerBound(_sorted.constBegin(), _sorted.constEnd(), lowInstance, instanceLessThan_hlpr);
+    if (highInstance < lowInstance)
+        end = begin;
+    else
+        end = qUpperBound(begin, _sorted.constEnd(), highInstance, instanceGreaterThan_hlpr);
+}
@@ -0,0 +1,57 @@
+#ifndef INTERNALDEVICEREGISTRY_H
+#define INTERNALDEVICEREGISTRY_H
+
+#include <QHash>
+#include <QVector>
+
+#include "bacnetinternaladdresshelper.h"
+
+namespace Bacnet {
+
+class BacnetDeviceObject;
+
+/**
+  Virtual devices of the gateway (there may be thousands of them - one per SNG room controller). Each device is indexed by its internal
+  address (requests dispatch) and by its instance number - both lookups are single hash accesses. Devices are also kept in a vector sorted
+  by instance number, so that they may be iterated without copying and Who-Is/Who-Has range is found with binary search.
+  \note Registry doesn't own devices.
+  */
+class InternalDeviceRegistry
+{
+public:
+    typedef QVector<BacnetDeviceObject*>::ConstIterator ConstIterator;
+
+    //! Returns false, if the address is invalid, or there is already device with such address or instance number.
+    bool addDevice(InternalAddress address, BacnetDeviceObject *device);
+
+    //! Returns device at the internal address, 0 if there is none.
+    inline BacnetDeviceObject *device(InternalAddress address) const {return _byAddress.value(address, 0);}
+    //! Returns device of the instance number, 0 if there is none.
+    inline BacnetDeviceObject *deviceByInstance(quint32 instanceNumber) const {return _byInstance.value(instanceNumber, 0);}
+    inline bool contains(InternalAddress address) const {return _byAddress.contains(address);}
+    inline int count() const {return _sorted.count();}
+
+    //! All the devices, sorted by instance number.
+    inline const QVector<BacnetDeviceObject*> &devices() const {return _sorted;}
+
+    /**
+      Sets begin and end to the devices which instance numbers are within [lowInstance, highInstance] (sorted, as in devices()).
+      If there are none, begin == end.
+      */
+    void instanceRange(quint32 lowInstance, quint32 highInstance, ConstIterator &begin, ConstIterator &end) const;
+
+private:
+    static quint32 instanceNumber(const BacnetDeviceObject *device);
+    //! Comparators for binary search over _sorted.
+    static bool instanceLessThan_hlpr(const BacnetDeviceObject *device, quint32 instanceNumber);
+    static bool instanceGreaterThan_hlpr(quint32 instanceNumber, const BacnetDeviceObject *device);
+
+private:
+    QHash<InternalAddress, BacnetDeviceObject*> _byAddress;
+    QHash<quint32, BacnetDeviceObject*> _byInstance;
+    QVector<BacnetDeviceObject*> _sorted;
+};
+
+}
+
+#endif // INTERNALDEVICEREGISTRY_H
@@ -33,15 +33,18 @@ void InternalObjectsHandler::propertyIoFinished(int asynchId, int result, Bacnet
     Q_CHECK_PTR(device);
     Q_CHECK_PTR(object);
 
-    InternalRequestHandler *serviceActHndlr = _asynchRequests.take(asynchId);
-    if (!serviceActHndlr->asynchActionFinished(asynchId, result, object, device)) {
-        return;
-    }
-
-    bool deleteHandler(true);
-    serviceActHndlr->finalize(&deleteHandler);
-    if (deleteHandler) {
-        delete serviceActHndlr;
+    //taken out first - handlers notified may start new actions
+    QList<InternalRequestHandler*> serviceActHndlrs = _asynchRequests.values(asynchId);
+    _asynchRequests.remove(asynchId);
+    foreach (InternalRequestHandler *serviceActHndlr, serviceActHndlrs) {
+        if (!serviceActHndlr->asynchActionFinished(asynchId, result, object, device))
+            continue;
+
+        bool deleteHandler(true);
+        serviceActHndlr->finalize(&deleteHandler);
+        if (deleteHandler) {
+            delete serviceActHndlr;
+        }
     }
 }
 
@@ -66,7 +69,8 @@ void InternalObjectsHandler::propertyValueChanged(BacnetObject *object, BacnetDe
     //send it
     if (subscription.isIssueConfirmedNotifications()) {
         CovConfNotificationServiceHandler *hndlr = new CovConfNotificationServiceHandler(covData);//takes ownership
-        _appLayer->send(subscription.recipientAddress()->address(), devAddress, hndlr);
+        if (BacnetApplicationLayerHandler::RequestFailed == _appLayer->send(subscription.recipientAddress()->address(), devAddress, hndlr))
+            delete hndlr;
 //        if (subscription.recipientHasAddress()) {
 //            _appLayer->send(subscription.recipientAddress()->address(), devAddress, BacnetServicesNS::ConfirmedCOVNotification, hndlr);
 //        } else {
@@ -133,7 +137,7 @@ void InternalObjectsHandler::propertyValueChanged(BacnetObject *object, BacnetDe
 void InternalObjectsHandler::addAsynchronousHandler(QList<int> asynchIds, InternalRequestHandler *handler)
 {
     foreach (int asynchId, asynchIds) {
-        Q_ASSERT(!_asynchRequests.contains(asynchId));
+        Q_ASSERT(!_asynchRequests.contains(asynchId, handler));
         _asynchRequests.insert(asynchId, handler);
     }
 }
@@ -143,24 +147,13 @@ bool InternalObjectsHandler::addDevice(BacnetAddress &address, BacnetDeviceObjec
     InternalAddress intAddress = BacnetInternalAddressHelper::internalAddress(address);
     Q_ASSERT(!_devices.contains(intAddress));
     Q_CHECK_PTR(device);
-    if ( (BacnetInternalAddressHelper::InvalidInternalAddress == intAddress) || _devices.contains(intAddress))
+    if (!_devices.addDevice(intAddress, device))
         return false;
 
-    _devices.insert(intAddress, device);
     device->setHandler(this);
     return true;
 }
 
-QMap<quint32, Bacnet::BacnetDeviceObject*> &InternalObjectsHandler::virtualDevices()
-{
-    return _devices;
-}
-
-QList<Bacnet::BacnetDeviceObject*> InternalObjectsHandler::devices()
-{
-    return _devices.values();
-}
-
 InternalObjectsHandler::InternalObjectsHandler(BacnetApplicationLayerHandler *appLayer):
     _appLayer(appLayer)
 {
@@ -6,6 +6,7 @@
 #include "bacnetaddress.h"
 #include "bacnetinternaladdresshelper.h"
 #include "externalobjectshandler.h"
+#include "internaldeviceregistry.h"
 
 class BacnetService;
 class Property;
@@ -30,19 +31,22 @@ public:
 public://interface for BacnetObject-Internal interaction
     void propertyIoFinished(int asynchId, int result, BacnetObject *object, BacnetDeviceObject *device);
     void addAsynchronousHandler(QList<int> asynchIds, InternalRequestHandler *handler);
+    //! Number of asynchronous actions requests are waiting for.
+    inline int pendingActionsCount() {return _asynchRequests.count();}
 
     void propertyValueChanged(BacnetObject *object, BacnetDeviceObject *device, CovSubscription &subscription, QList<PropertyValueShared> &propertiesValues);
 
 public:
     bool addDevice(BacnetAddress &address, BacnetDeviceObject *device);
-    QMap<quint32, BacnetDeviceObject*> &virtualDevices();
+    inline const InternalDeviceRegistry &virtualDevices() {return _devices;}
 
-    //! \todo If performance here is bad, just return reference to QMap, as is stored.
-    QList<BacnetDeviceObject*> devices();
+    //! Devices sorted by instance number. \sa InternalDeviceRegistry::instanceRange() for Who-Is like queries.
+    inline const QVector<BacnetDeviceObject*> &devices() {return _devices.devices();}
 
 public:
-    QMap<InternalAddress, BacnetDeviceObject*> _devices;
-    QHash<int, InternalRequestHandler*> _asynchRequests;
+    InternalDeviceRegistry _devices;
+    //! Requests may wait for the same asynchronous action (e.g. property being read from CDM already) - each of them is notified.
+    QMultiHash<int, InternalRequestHandler*> _asynchRequests;
     BacnetApplicationLayerHandler *_appLayer;
 
 //    /****************************
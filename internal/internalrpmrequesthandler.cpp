@@ -0,0 +1,179 @@
+#include "internalrpmrequesthandler.h"
+
+#include "bacnetdeviceobject.h"
+#include "bacnetdefaultobject.h"
+#include "internalobjectshandler.h"
+#include "bacnetapplicationlayer.h"
+
+using namespace Bacnet;
+
+typedef BacnetReadPropertyMultipleAck::ReadResult ReadResult;
+
+InternalRPMRequestHandler::InternalRPMRequestHandler(BacnetConfirmedRequestData *crData, BacnetAddress &requester, BacnetAddress &destination,
+                                                     BacnetDeviceObject *device,
+                                                     BacnetApplicationLayerHandler *appLayer):
+    InternalConfirmedRequestHandler(crData, requester, destination),
+    _device(device),
+    _appLayer(appLayer),
+    _error(BacnetServicesNS::ReadPropertyMultiple),
+    _response(0)
+{
+}
+
+InternalRPMRequestHandler::~InternalRPMRequestHandler()
+{
+    delete _response;
+    _response = 0;
+}
+
+qint32 InternalRPMRequestHandler::fromRaw(quint8 *servicePtr, quint16 length)
+{
+    return _data.fromRaw(servicePtr, length);
+}
+
+void InternalRPMRequestHandler::expandAll_hlpr(BacnetObject *object, QList<ReadPropertyServiceData> &references)
+{
+    ObjectIdStruct objId = numToObjId(object->objectIdNum());
+    //these are not kept as properties - see BacnetObject::readClassDataHelper()
+    references.append(ReadPropertyServiceData(objId, BacnetPropertyNS::ObjectIdentifier));
+    references.append(ReadPropertyServiceData(objId, BacnetPropertyNS::ObjectName));
+    references.append(ReadPropertyServiceData(objId, BacnetPropertyNS::ObjectType));
+
+    QList<BacnetPropertyNS::Identifier> propertyIds = object->objProperties().keys();
+    //default properties are the ones of the object, if it has not overridden them
+    foreach (BacnetPropertyNS::Identifier propertyId, BacnetDefaultObject::instance()->defaultProperties(objId.objectType).keys()) {
+        if (!propertyIds.contains(propertyId))
+            propertyIds.append(propertyId);
+    }
+    foreach (BacnetPropertyNS::Identifier propertyId, propertyIds) {
+        if ( (BacnetPropertyNS::ObjectIdentifier != propertyId) && (BacnetPropertyNS::ObjectName != propertyId) &&
+             (BacnetPropertyNS::ObjectType != propertyId) )
+            references.append(ReadPropertyServiceData(objId, propertyId));
+    }
+}
+
+void InternalRPMRequestHandler::readTry_hlpr(BacnetObject *object, const ReadPropertyServiceData &reference)
+{
+    Error error(BacnetServicesNS::ReadPropertyMultiple);
+    BacnetDataInterfaceShared data;
+    int readyness = object->propertyReadTry(reference.propertyId, reference.arrayIndex, data, &error);
+
+    if (readyness < 0) {
+        if (!error.hasError())
+            error.setError(BacnetErrorNS::ClassProperty, BacnetErrorNS::CodeUnknownProperty);
+        _response->results.append(ReadResult(reference, error.errorClass, error.errorCode));
+    } else if (Property::ResultOk == readyness) {
+        if (data.isNull())
+            _response->results.append(ReadResult(reference, BacnetErrorNS::ClassDevice, BacnetErrorNS::CodeOperationalProblem));
+        else
+            _response->results.append(ReadResult(reference, data));
+    } else {
+        //placeholder, filled in asynchActionFinished() - if the same property is asked twice, both wait for the same id
+        _pendingReads.insert(readyness, _response->results.count());
+        _response->results.append(ReadResult(reference, BacnetErrorNS::ClassDevice, BacnetErrorNS::CodeOperationalProblem));
+    }
+}
+
+bool InternalRPMRequestHandler::execute()
+{
+    Q_CHECK_PTR(_device);
+    Q_ASSERT(!_error.hasError());
+    if (0 == _device) {
+        _error.setError(BacnetErrorNS::ClassObject, BacnetErrorNS::CodeUnknownObject);
+        finalizeInstant(_appLayer);
+        return true;//am done, delete me
+    }
+
+    _response = new BacnetReadPropertyMultipleAck();
+    Q_CHECK_PTR(_response);
+
+    foreach (const ReadPropertyServiceData &reference, _data.references) {
+        BacnetObject *object = _device->bacnetObject(objIdToNum(reference.objId));
+        if (0 == object) {
+            _response->results.append(ReadResult(reference, BacnetErrorNS::ClassObject, BacnetErrorNS::CodeUnknownObject));
+            continue;
+        }
+
+        if ( (BacnetPropertyNS::All == reference.propertyId) || (BacnetPropertyNS::Required == reference.propertyId) ) {
+            QList<ReadPropertyServiceData> references;
+            expandAll_hlpr(object, references);
+            foreach (const ReadPropertyServiceData &expanded, references)
+                readTry_hlpr(object, expanded);
+        } else if (BacnetPropertyNS::Optional == reference.propertyId) {
+            _response->results.append(ReadResult(reference, BacnetErrorNS::ClassServices, BacnetErrorNS::CodeOther));
+        } else
+            readTry_hlpr(object, reference);
+    }
+
+    if (_pendingReads.isEmpty()) {
+        finalizeInstant(_appLayer);
+        return true;//am done, delete me
+    }
+
+    //all the reads are waited for at once
+    Q_ASSERT(_appLayer->internalHandler());
+    _appLayer->internalHandler()->addAsynchronousHandler(_pendingReads.uniqueKeys(), this);
+    return false;//not done, yet - don't delete me
+}
+
+bool InternalRPMRequestHandler::asynchActionFinished(int asynchId, int result, BacnetObject *object, BacnetDeviceObject *device)
+{
+    Q_UNUSED(device);
+    Q_CHECK_PTR(object);
+    Q_ASSERT(_pendingReads.contains(asynchId));
+    QList<int> indexes = _pendingReads.values(asynchId);
+    _pendingReads.remove(asynchId);
+
+    foreach (int idx, indexes) {
+        Q_ASSERT(idx >= 0 && idx < _response->results.count());
+        ReadResult &readResult = _response->results[idx];
+        if (result < 0) {
+            //! \todo translate error to bacnet error
+            readResult.errorClass = BacnetErrorNS::ClassProperty;
+            readResult.errorCode = BacnetErrorNS::CodeUnknownProperty;
+        } else {
+            Error error(BacnetServicesNS::ReadPropertyMultiple);
+            BacnetDataInterfaceShared value = object->propertyReadInstantly(readResult.reference.propertyId, readResult.reference.arrayIndex, &error);
+            if (value.isNull()) {
+                if (error.hasError()) {
+                    readResult.errorClass = error.errorClass;
+                    readResult.errorCode = error.errorCode;
+                }
+            } else
+                readResult.data = value;
+        }
+    }
+
+    //finished when the last one is done
+    return _pendingReads.isEmpty();
+}
+
+bool InternalRPMRequestHandler::isFinished()
+{
+    return _pendingReads.isEmpty();
+}
+
+void InternalRPMRequestHandler::finalize(bool *deleteAfter)
+{
+    Q_CHECK_PTR(deleteAfter);
+    finalizeInstant(_appLayer);
+    if (deleteAfter)
+        *deleteAfter = true;
+}
+
+bool InternalRPMRequestHandler::hasError()
+{
+    return _error.hasError();
+}
+
+Error &InternalRPMRequestHandler::error()
+{
+    return _error;
+}
+
+BacnetServiceData *InternalRPMRequestHandler::takeResponseData()
+{
+    BacnetServiceData *tmp = _response;
+    _response = 0;//we set to zero, since caller takes ownership over the response.
+    return tmp;
+}
@@ -0,0 +1,63 @@
+#ifndef INTERNALRPMREQUESTHANDLER_H
+#define INTERNALRPMREQUESTHANDLER_H
+
+#include "internalconfirmedrequesthandler.h"
+#include "readpropertymultipleservicedata.h"
+#include "bacnetreadpropertymultipleack.h"
+
+namespace Bacnet {
+
+class BacnetApplicationLayerHandler;
+class BacnetObject;
+
+    /**
+      Handles ReadPropertyMultiple request to one of our virtual devices. All the properties are asked for at once - the ones which
+      are not ready (e.g. they are read from CDM) are waited for concurrently, each with its own asynchronous id, and the ack is
+      sent when the last one is done. Each property is answered separately - with its value or with error it was read with.
+
+      Properties All and Required are expanded into all the properties the object has - objects don't tell required ones from optional
+      ones, and all they have are required for their type. Optional is answered with an error, since we can't tell which ones those are.
+      */
+    class InternalRPMRequestHandler:
+        public ::InternalConfirmedRequestHandler
+    {
+    public:
+        InternalRPMRequestHandler(BacnetConfirmedRequestData *crData, BacnetAddress &requester, BacnetAddress &destination,
+                                  BacnetDeviceObject *device,
+                                  BacnetApplicationLayerHandler *appLayer);
+        virtual ~InternalRPMRequestHandler();
+
+    public:
+        virtual qint32 fromRaw(quint8 *servicePtr, quint16 length);
+
+    public://overriden InternalRequestHandler methods.
+        virtual bool asynchActionFinished(int asynchId, int result, BacnetObject *object, BacnetDeviceObject *device);
+        virtual bool isFinished();
+        virtual void finalize(bool *deleteAfter);
+        virtual bool execute();
+
+    public://overriden InternalConfirmedRequestHandler methods.
+        virtual bool hasError();
+        virtual Error &error();
+        virtual Bacnet::BacnetServiceData *takeResponseData();
+
+    private:
+        //! Starts reading of the property - appends its result (or its placeholder, when it's to be read asynchronously).
+        void readTry_hlpr(BacnetObject *object, const ReadPropertyServiceData &reference);
+        //! Appends references of all the properties of the object.
+        void expandAll_hlpr(BacnetObject *object, QList<ReadPropertyServiceData> &references);
+
+    private:
+        BacnetDeviceObject *_device;
+        BacnetApplicationLayerHandler *_appLayer;
+
+        ReadPropertyMultipleServiceData _data;
+        //! Results being waited for - asynch id and index of the result in the response. Reads of the same property may share the id.
+        QMultiHash<int, int> _pendingReads;
+        Error _error;
+        BacnetReadPropertyMultipleAck *_response;
+    };
+
+}
+
+#endif // INTERNALRPMREQUESTHANDLER_H
@@ -77,10 +77,6 @@ bool InternalWhoHasRequestHandler::execute()
 
     //    return QList<int>();
 
-    QList<BacnetDeviceObject*> devs = _appLayer->devices();
-    QList<BacnetDeviceObject*>::iterator devIt = devs.begin();
-    QList<BacnetDeviceObject*>::iterator devListEnd = devs.end();
-
     //! \todo If not all the responses fit in the buffer divide it in some chunks and get asynchIds
     quint32 devInstanceNum;
     IHaveServiceData iHaveData;
@@ -94,28 +90,29 @@ bool InternalWhoHasRequestHandler::execute()
         minDevId = 0;
         maxDevId = MaximumInstanceNumber;
     }
+    //devices are sorted by instance number - only those within the range are visited
+    InternalDeviceRegistry::ConstIterator devIt;
+    InternalDeviceRegistry::ConstIterator devListEnd;
+    _appLayer->internalHandler()->virtualDevices().instanceRange(minDevId, maxDevId, devIt, devListEnd);
 
     QMap<quint32, BacnetObject*>::ConstIterator objIt;
     QMap<quint32, BacnetObject*>::ConstIterator objMapEnd;
 
     for (; devIt != devListEnd; ++devIt) {
         devInstanceNum = (*devIt)->objectIdNum() & ObjectInstanceMask;
-        if ( (minDevId <= devInstanceNum) &&
-             (devInstanceNum <= maxDevId) ) {
-            //iterate over device's child objects
-            objIt = (*devIt)->childObjects().begin();
-            objMapEnd = (*devIt)->childObjects().end();
-            for (; objIt != objMapEnd; ++objIt) {
-                if ( ( (0 != _data._objidentifier) && ((*objIt)->objectIdNum() == searchedObjInstance) ) ||
-                     ( (0 != _data._objName) && ((*objIt)->objectName() == (_data._objName->value())) ) ) {
-                    //manipulate object data.
-                    iHaveData._devId.setObjectIdNum(devInstanceNum | BacnetObjectTypeNS::Device << 22);
-                    iHaveData._objId = (*objIt)->objectId();
-                    iHaveData._objName = (*objIt)->objectName();
-                    _appLayer->sendUnconfirmed(_requester, (*devIt)->address(), iHaveData, BacnetServicesNS::I_Have);
-                    //we can stop here, since no two objects internetowrk-wide may have the same instance numbers or names.
-                    return true;
-                }
+        //iterate over device's child objects
+        objIt = (*devIt)->childObjects().begin();
+        objMapEnd = (*devIt)->childObjects().end();
+        for (; objIt != objMapEnd; ++objIt) {
+            if ( ( (0 != _data._objidentifier) && ((*objIt)->objectIdNum() == searchedObjInstance) ) ||
+                 ( (0 != _data._objName) && ((*objIt)->objectName() == (_data._objName->value())) ) ) {
+                //manipulate object data.
+                iHaveData._devId.setObjectIdNum(devInstanceNum | BacnetObjectTypeNS::Device << 22);
+                iHaveData._objId = (*objIt)->objectId();
+                iHaveData._objName = (*objIt)->objectName();
+                _appLayer->sendUnconfirmed(_requester, (*devIt)->address(), iHaveData, BacnetServicesNS::I_Have);
+                //we can stop here, since no two objects internetowrk-wide may have the same instance numbers or names.
+                return true;
             }
         }
     }
@@ -45,26 +45,18 @@ void InternalWhoIsRequestHandler::finalize(bool *deleteAfter)
 
 bool InternalWhoIsRequestHandler::execute()
 {
-    //! \todo Hange the way it calculates limits - there should be function for that.
-    quint32 lowLimit = _data._rangeLowLimit | (BacnetObjectTypeNS::Device << 22);
-    quint32 highLimit = _data._rangeHighLimit | (BacnetObjectTypeNS::Device << 22);
-
-    QList<BacnetDeviceObject*> devs = _appLayer->devices();
-    QList<BacnetDeviceObject*>::iterator devIt = devs.begin();
-    QList<BacnetDeviceObject*>::iterator devListEnd = devs.end();
+    //devices are sorted by instance number - only those within the range are visited
+    InternalDeviceRegistry::ConstIterator devIt;
+    InternalDeviceRegistry::ConstIterator devListEnd;
+    _appLayer->internalHandler()->virtualDevices().instanceRange(_data._rangeLowLimit, _data._rangeHighLimit, devIt, devListEnd);
 
     //! \todo If not all the responses fit in the buffer divide it in some chunks and get asynchIds
-    quint32 objIdNum;
     ObjectIdentifier tmp(BacnetObjectTypeNS::Undefined, 0);
-    IAmServiceData iAmData(tmp, Bacnet::ApduMaxSize, SegmentedNOT, SNGVendorIdentifier);
+    IAmServiceData iAmData(tmp, Bacnet::ApduMaxSize, SegmentedBoth, SNGVendorIdentifier);
 
     for (; devIt != devListEnd; ++devIt) {
-        objIdNum = (*devIt)->objectIdNum();
-        if ( (lowLimit <= objIdNum) &&
-             (objIdNum <= highLimit) ) {
-            iAmData._devObjId = (*devIt)->objectIdNum();
-            _appLayer->sendUnconfirmed(_requester, (*devIt)->address(), iAmData, BacnetServicesNS::I_Am);
-        }
+        iAmData._devObjId = (*devIt)->objectIdNum();
+        _appLayer->sendUnconfirmed(_requester, (*devIt)->address(), iAmData, BacnetServicesNS::I_Am);
     }
 
     //all is sent - am ready to be deleted!
@@ -0,0 +1,130 @@
+#include "internalwpmrequesthandler.h"
+
+#include "bacnetdeviceobject.h"
+#include "internalobjectshandler.h"
+#include "bacnetapplicationlayer.h"
+
+using namespace Bacnet;
+
+InternalWPMRequestHandler::InternalWPMRequestHandler(BacnetConfirmedRequestData *crData, BacnetAddress &requester, BacnetAddress &destination,
+                                                     BacnetDeviceObject *device,
+                                                     BacnetApplicationLayerHandler *appLayer):
+    InternalConfirmedRequestHandler(crData, requester, destination),
+    _device(device),
+    _appLayer(appLayer),
+    _firstFailedIdx(-1),
+    _error(BacnetServicesNS::WritePropertyMultiple)
+{
+}
+
+InternalWPMRequestHandler::~InternalWPMRequestHandler()
+{
+}
+
+qint32 InternalWPMRequestHandler::fromRaw(quint8 *servicePtr, quint16 length)
+{
+    return _data.fromRaw(servicePtr, length);
+}
+
+void InternalWPMRequestHandler::writeFailed_hlpr(int writeIdx, BacnetErrorNS::ErrorClass errorClass, BacnetErrorNS::ErrorCode errorCode)
+{
+    Q_ASSERT(writeIdx >= 0 && writeIdx < _data.writes.count());
+    if ( (_firstFailedIdx >= 0) && (_firstFailedIdx < writeIdx) )
+        return;
+
+    _firstFailedIdx = writeIdx;
+    const WritePropertyServiceData &write = _data.writes.at(writeIdx);
+    _error.setError(errorClass, errorCode);
+    _error.setFirstFailedWrite(write._objectId.objectIdNum(), write._propValue._propertyId, write._propValue._arrayIndex);
+}
+
+bool InternalWPMRequestHandler::execute()
+{
+    Q_CHECK_PTR(_device);
+    Q_ASSERT(!_error.hasError());
+    Q_ASSERT(!_data.writes.isEmpty());
+    if (0 == _device) {
+        writeFailed_hlpr(0, BacnetErrorNS::ClassObject, BacnetErrorNS::CodeUnknownObject);
+        finalizeInstant(_appLayer);
+        return true;//am done, delete me
+    }
+
+    for (int i = 0; i < _data.writes.count(); ++i) {
+        WritePropertyServiceData &write = _data.writes[i];
+        BacnetObject *object = _device->bacnetObject(write._objectId.objectIdNum());
+        if (0 == object) {
+            writeFailed_hlpr(i, BacnetErrorNS::ClassObject, BacnetErrorNS::CodeUnknownObject);
+            break;
+        }
+
+        Error error(BacnetServicesNS::WritePropertyMultiple);
+        int readyness = object->propertySet(write._propValue._propertyId, write._propValue._arrayIndex,
+                                            write._propValue._value, &error);
+        if (readyness < 0) {
+            if (!error.hasError())
+                error.setError(BacnetErrorNS::ClassProperty, BacnetErrorNS::CodeUnknownProperty);
+            writeFailed_hlpr(i, error.errorClass, error.errorCode);
+            break;
+        } else if (Property::ResultOk != readyness) {
+            _pendingWrites.insert(readyness, i);
+        }
+    }
+
+    if (_pendingWrites.isEmpty()) {
+        finalizeInstant(_appLayer);
+        return true;//am done, delete me
+    }
+
+    //all the writes are waited for at once
+    Q_ASSERT(_appLayer->internalHandler());
+    _appLayer->internalHandler()->addAsynchronousHandler(_pendingWrites.uniqueKeys(), this);
+    return false;//not done, yet - don't delete me
+}
+
+bool InternalWPMRequestHandler::asynchActionFinished(int asynchId, int result, BacnetObject *object, BacnetDeviceObject *device)
+{
+    Q_UNUSED(object);
+    Q_UNUSED(device);
+    Q_ASSERT(_pendingWrites.contains(asynchId));
+    QList<int> indexes = _pendingWrites.values(asynchId);
+    _pendingWrites.remove(asynchId);
+    Q_ASSERT(result <= 0);
+
+    if (result < 0) {
+        //! \todo translate error to bacnet error
+        foreach (int idx, indexes)
+            writeFailed_hlpr(idx, BacnetErrorNS::ClassProperty, BacnetErrorNS::CodeUnknownProperty);
+    }
+
+    //finished when the last one is done
+    return _pendingWrites.isEmpty();
+}
+
+bool InternalWPMRequestHandler::isFinished()
+{
+    return _pendingWrites.isEmpty();
+}
+
+void InternalWPMRequestHandler::finalize(bool *deleteAfter)
+{
+    Q_CHECK_PTR(deleteAfter);
+    finalizeInstant(_appLayer);
+    if (deleteAfter)
+        *deleteAfter = true;
+}
+
+bool InternalWPMRequestHandler::hasError()
+{
+    return _error.hasError();
+}
+
+Error &InternalWPMRequestHandler::error()
+{
+    return _error;
+}
+
+Bacnet::BacnetServiceData *InternalWPMRequestHandler::takeResponseData()
+{
+    //response 0 will result in the simple ACK sent.
+    return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef INTERNALWPMREQUESTHANDLER_H
+#define INTERNALWPMREQUESTHANDLER_H
+
+#include "internalconfirmedrequesthandler.h"
+#include "writepropertymultipleservicedata.h"
+
+namespace Bacnet {
+
+class BacnetApplicationLayerHandler;
+
+    /**
+      Handles WritePropertyMultiple request to one of our virtual devices. Writes are started in the order of the request and the
+      ones, which are not done at once (e.g. they are written to CDM), are waited for concurrently, each with its own asynchronous id.
+      The request is answered once, when the last of them is done - with simple ack, or with error telling the first write that failed.
+
+      \note Writing stops at the first write failing at once. Writes failing asynchronously are found out later, so writes
+      following them may have already been done by then (the standard expects them not to be attempted).
+      */
+    class InternalWPMRequestHandler:
+        public ::InternalConfirmedRequestHandler
+    {
+    public:
+        InternalWPMRequestHandler(BacnetConfirmedRequestData *crData, BacnetAddress &requester, BacnetAddress &destination,
+                                  BacnetDeviceObject *device,
+                                  BacnetApplicationLayerHandler *appLayer);
+        virtual ~InternalWPMRequestHandler();
+
+    public:
+        virtual qint32 fromRaw(quint8 *servicePtr, quint16 length);
+
+    public://overriden InternalRequestHandler methods.
+        virtual bool asynchActionFinished(int asynchId, int result, BacnetObject *object, BacnetDeviceObject *device);
+        virtual bool isFinished();
+        virtual void finalize(bool *deleteAfter);
+        virtual bool execute();
+
+    public://overriden InternalConfirmedRequestHandler methods.
+        virtual bool hasError();
+        virtual Error &error();
+        virtual Bacnet::BacnetServiceData *takeResponseData();
+
+    private:
+        //! Notes the write failed - error of the request is the one of the first write (in the request order), that failed.
+        void writeFailed_hlpr(int writeIdx, BacnetErrorNS::ErrorClass errorClass, BacnetErrorNS::ErrorCode errorCode);
+
+    private:
+        BacnetDeviceObject *_device;
+        BacnetApplicationLayerHandler *_appLayer;
+
+        WritePropertyMultipleServiceData _data;
+        //! Writes being waited for - asynch id and index of the write in the request. Writes of the same property may share the id.
+        QMultiHash<int, int> _pendingWrites;
+        int _firstFailedIdx;
+        Error _error;
+    };
+
+}
+
+#endif // INTERNALWPMREQUESTHANDLER_H
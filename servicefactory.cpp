@@ -2,6 +2,8 @@
 
 #include "internalwprequesthandler.h"
 #include "internalrprequesthandler.h"
+#include "internalrpmrequesthandler.h"
+#include "internalwpmrequesthandler.h"
 #include "internalwhoisrequesthandler.h"
 #include "internalwhohasrequesthandler.h"
 #include "internalsubscribecovrequesthandler.h"
@@ -27,6 +29,12 @@
     case (BacnetServicesNS::ReadProperty) : {
         return new Bacnet::InternalRPRequestHandler(pciData, requester, destination, device, appLayer);
     }
+    case (BacnetServicesNS::ReadPropertyMultiple) : {
+        return new Bacnet::InternalRPMRequestHandler(pciData, requester, destination, device, appLayer);
+    }
+    case (BacnetServicesNS::WritePropertyMultiple) : {
+        return new Bacnet::InternalWPMRequestHandler(pciData, requester, destination, device, appLayer);
+    }
     case (BacnetServicesNS::SubscribeCOV)://fall through
     case (BacnetServicesNS::SubscribeCOVProperty):
     {
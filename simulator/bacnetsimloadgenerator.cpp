@@ -0,0 +1,251 @@
+#include "bacnetsimloadgenerator.h"
+
+#include <QTimerEvent>
+#include <QtEndian>
+
+#include "buffer.h"
+
+//encoding constants - kept here, so that generator doesn't depend on the stack it loads
+static const quint8 BvllType                    = 0x81;
+static const quint8 BvllOriginalUnicast         = 0x0a;
+static const quint8 BvllForwarded               = 0x04;
+static const int BvllHeaderSize                 = 4;
+static const int BvllForwardedAddressSize       = 6;
+static const quint8 NpduVersion                 = 0x01;
+static const quint8 NpciNetworkMessage          = 0x80;
+static const quint8 NpciDestinationPresent      = 0x20;
+static const quint8 NpciSourcePresent           = 0x08;
+static const quint8 NpciExpectingReply          = 0x04;
+static const quint8 NpduMaxHopCount             = 0xff;
+static const quint8 ApduConfirmedRequest        = 0x00;
+static const quint8 ApduMaxSegsMaxApdu          = 0x05;//no segmentation, up to 1476 bytes
+static const quint8 ServiceReadProperty         = 0x0c;
+static const quint8 ContextTag0Length4          = 0x0c;
+static const quint8 ContextTag1Length1          = 0x19;
+static const quint8 ContextTag1Length2          = 0x1a;
+static const quint8 PduTypeComplexAck           = 0x3;
+static const quint8 PduTypeError                = 0x5;
+static const quint8 PduTypeReject               = 0x6;
+static const quint8 PduTypeAbort                = 0x7;
+
+BacnetSimLoadGenerator::BacnetSimLoadGenerator(const Settings &settings, QObject *parent):
+    QObject(parent),
+    _settings(settings),
+    _invokeIdPosition(0),
+    _nextInvokeId(0),
+    _finished(false),
+    _sentCount(0),
+    _ackCount(0),
+    _errorCount(0),
+    _timeoutCount(0),
+    _totalLatency_ns(0),
+    _maxLatency_ns(0)
+{
+    _settings.window = qBound(1, _settings.window, 255);
+    encodeRequest_hlpr();
+}
+
+BacnetSimLoadGenerator::~BacnetSimLoadGenerator()
+{
+    BacnetLoopbackNetwork::instance()->detach(this);
+}
+
+void BacnetSimLoadGenerator::encodeRequest_hlpr()
+{
+    _request.clear();
+    //BVLL
+    _request.append((char)BvllType);
+    _request.append((char)BvllOriginalUnicast);
+    _request.append((char)0);//length is set at the end
+    _request.append((char)0);
+
+    //NPDU
+    _request.append((char)NpduVersion);
+    if (_settings.dnet >= 0) {
+        _request.append((char)(NpciExpectingReply | NpciDestinationPresent));
+        _request.append((char)(_settings.dnet >> 8));
+        _request.append((char)(_settings.dnet & 0xff));
+        _request.append((char)_settings.dadr.size());
+        _request.append(_settings.dadr);
+        _request.append((char)NpduMaxHopCount);
+    } else {
+        _request.append((char)NpciExpectingReply);
+    }
+
+    //APDU - ReadProperty
+    _request.append((char)ApduConfirmedRequest);
+    _request.append((char)ApduMaxSegsMaxApdu);
+    _invokeIdPosition = _request.size();
+    _request.append((char)0);
+    _request.append((char)ServiceReadProperty);
+    _request.append((char)ContextTag0Length4);
+    quint8 objId[4];
+    qToBigEndian<quint32>(_settings.objectId, objId);
+    _request.append((const char*)objId, sizeof(objId));
+    if (_settings.propertyId <= 0xff) {
+        _request.append((char)ContextTag1Length1);
+        _request.append((char)_settings.propertyId);
+    } else {
+        _request.append((char)ContextTag1Length2);
+        _request.append((char)(_settings.propertyId >> 8));
+        _request.append((char)(_settings.propertyId & 0xff));
+    }
+
+    qToBigEndian<quint16>(_request.size(), (uchar*)_request.data() + 2);
+}
+
+bool BacnetSimLoadGenerator::start()
+{
+    if (!BacnetLoopbackNetwork::instance()->attach(this, _settings.name, _settings.segment, _settings.address, _settings.port))
+        return false;
+    _clock.start();
+    _timer.start(TimerInterval_ms, this);
+    return true;
+}
+
+void BacnetSimLoadGenerator::stop()
+{
+    _timer.stop();
+}
+
+bool BacnetSimLoadGenerator::isFinished()
+{
+    return _finished;
+}
+
+void BacnetSimLoadGenerator::timerEvent(QTimerEvent *event)
+{
+    if (event->timerId() != _timer.timerId()) {
+        QObject::timerEvent(event);
+        return;
+    }
+
+    checkTimeouts_hlpr();
+
+    //how many we may send now - limited by rate, window and total count
+    quint64 allowed = (quint64)-1;
+    if (_settings.rate > 0) {
+        quint64 due = (quint64)(_clock.elapsed() * _settings.rate / 1000);
+        allowed = (due > _sentCount) ? (due - _sentCount) : 0;
+    }
+    while ( (allowed > 0) && (_outstanding.count() < _settings.window) &&
+            ( (0 == _settings.requestsCount) || (_sentCount < _settings.requestsCount) ) ) {
+        sendRequest_hlpr();
+        --allowed;
+    }
+
+    checkFinished_hlpr();
+}
+
+void BacnetSimLoadGenerator::sendRequest_hlpr()
+{
+    //find invoke id not used by outstanding requests (there is always one - window is smaller than 256)
+    while (_outstanding.contains(_nextInvokeId))
+        ++_nextInvokeId;
+    quint8 invokeId = _nextInvokeId++;
+
+    _request[_invokeIdPosition] = invokeId;
+    _outstanding.insert(invokeId, _clock.nsecsElapsed());
+    ++_sentCount;
+    BacnetLoopbackNetwork::instance()->send(this, (const quint8*)_request.constData(), _request.size(), _settings.targetAddress, _settings.targetPort);
+}
+
+void BacnetSimLoadGenerator::checkTimeouts_hlpr()
+{
+    qint64 timeout_ns = (qint64)_settings.timeout_ms * 1000000;
+    qint64 now_ns = _clock.nsecsElapsed();
+    QHash<quint8, qint64>::Iterator it = _outstanding.begin();
+    while (it != _outstanding.end()) {
+        if (now_ns - it.value() > timeout_ns) {
+            ++_timeoutCount;
+            it = _outstanding.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void BacnetSimLoadGenerator::checkFinished_hlpr()
+{
+    if ( !_finished && (0 != _settings.requestsCount) && (_sentCount >= _settings.requestsCount) && _outstanding.isEmpty() ) {
+        _finished = true;
+        _timer.stop();
+        emit finished();
+    }
+}
+
+void BacnetSimLoadGenerator::deliverDatagram(Buffer &frame, const QHostAddress &srcAddr, quint16 srcPort)
+{
+    Q_UNUSED(srcAddr);
+    Q_UNUSED(srcPort);
+    const quint8 *data = frame.bodyPtr();
+    int length = frame.bodyLength();
+
+    //BVLL
+    if ( (length < BvllHeaderSize) || (BvllType != data[0]) )
+        return;
+    int offset = BvllHeaderSize;
+    if (BvllForwarded == data[1])
+        offset += BvllForwardedAddressSize;
+
+    //NPDU
+    if (offset + 2 > length)
+        return;
+    quint8 control = data[offset + 1];
+    offset += 2;
+    if (control & NpciNetworkMessage)
+        return;
+    if (control & NpciDestinationPresent) {
+        if (offset + 3 > length)
+            return;
+        offset += 3 + data[offset + 2];
+    }
+    if (control & NpciSourcePresent) {
+        if (offset + 3 > length)
+            return;
+        offset += 3 + data[offset + 2];
+    }
+    if (control & NpciDestinationPresent)
+        offset += 1;//hop count
+
+    //APDU - we are interested only in answers to confirmed requests
+    if (offset + 2 > length)
+        return;
+    quint8 pduType = data[offset] >> 4;
+    quint8 invokeId = data[offset + 1];
+    switch (pduType) {
+    case (PduTypeComplexAck):
+    case (PduTypeError):
+    case (PduTypeReject):
+    case (PduTypeAbort):
+        break;
+    default:
+        return;
+    }
+
+    QHash<quint8, qint64>::Iterator it = _outstanding.find(invokeId);
+    if (_outstanding.end() == it)//timed out already (or not ours)
+        return;
+
+    qint64 latency_ns = _clock.nsecsElapsed() - it.value();
+    _outstanding.erase(it);
+    if (PduTypeComplexAck == pduType)
+        ++_ackCount;
+    else
+        ++_errorCount;
+    _totalLatency_ns += latency_ns;
+    if (latency_ns > _maxLatency_ns)
+        _maxLatency_ns = latency_ns;
+
+    checkFinished_hlpr();
+}
+
+void BacnetSimLoadGenerator::printReport()
+{
+    quint64 answered = _ackCount + _errorCount;
+    qint64 elapsed_ms = _clock.elapsed();
+    qDebug("%s: sent %llu, acked %llu, errors %llu, timeouts %llu, outstanding %d; %.1f answers/s; latency avg %.1f us, max %.1f us",
+           qPrintable(_settings.name), _sentCount, _ackCount, _errorCount, _timeoutCount, _outstanding.count(),
+           (0 == elapsed_ms) ? 0.0 : (1000.0 * answered / elapsed_ms),
+           (0 == answered) ? 0.0 : (_totalLatency_ns / 1000.0 / answered), _maxLatency_ns / 1000.0);
+}
@@ -0,0 +1,92 @@
+#ifndef BACNETSIMLOADGENERATOR_H
+#define BACNETSIMLOADGENERATOR_H
+
+#include <QObject>
+#include <QBasicTimer>
+#include <QElapsedTimer>
+#include <QHostAddress>
+
+#include "bacnetloopbacknetwork.h"
+
+/**
+  Simple BACnet client attached to the loopback network, that keeps sending ReadProperty requests to one device (directly or
+  through routers, when DNET is given) and measures how long it takes to get the answer. It's not a stack - requests are encoded
+  once and only invoke id changes, answers are only matched by invoke id, so it doesn't add its own overhead to what is measured.
+  */
+class BacnetSimLoadGenerator:
+        public QObject,
+        public BacnetLoopbackEndpoint
+{
+    Q_OBJECT
+public:
+    struct Settings {
+        QString name;
+        QString segment;
+        QHostAddress address;
+        quint16 port;
+        QHostAddress targetAddress;
+        quint16 targetPort;
+        //! Destination network and address, if device is behind router (-1 for local device).
+        qint32 dnet;
+        QByteArray dadr;
+        quint32 objectId;
+        quint32 propertyId;
+        //! Requests per second, 0 - as fast as window lets.
+        double rate;
+        //! Maximum number of outstanding requests (at most 255).
+        int window;
+        //! Total number of requests to send, 0 - no limit.
+        quint64 requestsCount;
+        int timeout_ms;
+    };
+
+    BacnetSimLoadGenerator(const Settings &settings, QObject *parent = 0);
+    virtual ~BacnetSimLoadGenerator();
+
+    //! Attaches to the loopback network and starts sending. Returns false if attaching failed.
+    bool start();
+    void stop();
+    bool isFinished();
+
+    //! Implementation of BacnetLoopbackEndpoint - matches the answer with request.
+    virtual void deliverDatagram(Buffer &frame, const QHostAddress &srcAddr, quint16 srcPort);
+
+    void printReport();
+
+signals:
+    //! Emitted, when all the requests (if their count was limited) are answered or timed out.
+    void finished();
+
+protected:
+    void timerEvent(QTimerEvent *);
+
+private:
+    void encodeRequest_hlpr();
+    void sendRequest_hlpr();
+    void checkTimeouts_hlpr();
+    void checkFinished_hlpr();
+
+private:
+    static const int TimerInterval_ms = 1;
+
+    Settings _settings;
+    QByteArray _request;
+    int _invokeIdPosition;
+    quint8 _nextInvokeId;
+
+    QBasicTimer _timer;
+    QElapsedTimer _clock;
+    bool _finished;
+    //! Invoke id -> time the request was sent.
+    QHash<quint8, qint64> _outstanding;
+
+    //statistics
+    quint64 _sentCount;
+    quint64 _ackCount;
+    quint64 _errorCount;
+    quint64 _timeoutCount;
+    qint64 _totalLatency_ns;
+    qint64 _maxLatency_ns;
+};
+
+#endif // BACNETSIMLOADGENERATOR_H
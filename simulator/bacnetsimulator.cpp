@@ -0,0 +1,252 @@
+#include "bacnetsimulator.h"
+
+#include <QCoreApplication>
+#include <QDomDocument>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QTimerEvent>
+
+#include "bacnetsimloadgenerator.h"
+#include "bacnetloopbacknetwork.h"
+#include "bacnetbuffermanager.h"
+#include "bacnetbipaddress.h"
+#include "bacnetaddress.h"
+#include "bacnetprotocolinterface.h"
+#include "configuratorhelper.h"
+#include "cdm.h"
+
+static const char *SegmentTagName           = "segment";
+static const char *NodeTagName              = "node";
+static const char *LoadTagName              = "load";
+static const char *DurationAttribute        = "duration-ms";
+static const char *ReportIntervalAttribute  = "report-interval-ms";
+static const char *NameAttribute            = "name";
+static const char *NetworkAttribute         = "network";
+static const char *PrefixAttribute          = "prefix";
+static const char *ConfigAttribute          = "config";
+static const char *SegmentAttribute         = "segment";
+static const char *AddressAttribute         = "address";
+static const char *TargetAttribute          = "target";
+static const char *DnetAttribute            = "dnet";
+static const char *DadrAttribute            = "dadr";
+static const char *ObjectTypeAttribute      = "object-type";
+static const char *ObjectInstanceAttribute  = "object-instance";
+static const char *PropertyAttribute        = "property";
+static const char *RateAttribute            = "rate";
+static const char *WindowAttribute          = "window";
+static const char *CountAttribute           = "count";
+static const char *TimeoutAttribute         = "timeout-ms";
+
+static const int DefaultWindow              = 1;
+static const int DefaultTimeout_ms          = 3000;
+static const quint32 PresentValueProperty   = 85;
+
+//! Reads "ip:port" attribute.
+static bool addressAttribute_hlpr(QDomElement &element, const char *attrName, QHostAddress &address, quint16 &port)
+{
+    QString addrStr = element.attribute(attrName);
+    quint64 portNum(0);
+    if (addrStr.isEmpty() || !BacnetBipAddressHelper::macAddressFromString(addrStr, &address, &portNum) || (0 == portNum)) {
+        ConfiguratorHelper::elementError(element, attrName);
+        return false;
+    }
+    port = portNum;
+    return true;
+}
+
+BacnetSimulator::BacnetSimulator(QObject *parent):
+    QObject(parent),
+    _duration_ms(0),
+    _reportInterval_ms(DefaultReportInterval_ms)
+{
+}
+
+bool BacnetSimulator::load(const QString &configPath)
+{
+    QFile f(configPath);
+    if (!f.open(QIODevice::ReadOnly)) {
+        qDebug("Can't open a simulator config file %s!", qPrintable(configPath));
+        return false;
+    }
+    QDomDocument doc;
+    if (!doc.setContent(&f)) {
+        qDebug("Simulator config (%s) is malformed", qPrintable(configPath));
+        return false;
+    }
+    //node configs are relative to the simulator config
+    QString configDir = QFileInfo(configPath).absolutePath();
+
+    QDomElement mainElement = doc.documentElement();
+    bool ok;
+    _duration_ms = mainElement.attribute(DurationAttribute).toInt(&ok);
+    if (!ok)
+        _duration_ms = 0;
+    int reportInterval_ms = mainElement.attribute(ReportIntervalAttribute).toInt(&ok);
+    if (ok && (reportInterval_ms > 0))
+        _reportInterval_ms = reportInterval_ms;
+
+    for (QDomElement element = mainElement.firstChildElement(SegmentTagName); !element.isNull(); element = element.nextSiblingElement(SegmentTagName)) {
+        if (!createSegment_hlpr(element))
+            return false;
+    }
+
+    //stacks take their properties from the data model, as in the gateway
+    DataModel::instance()->startFactory();
+    for (QDomElement element = mainElement.firstChildElement(NodeTagName); !element.isNull(); element = element.nextSiblingElement(NodeTagName)) {
+        if (!createNode_hlpr(element, configDir)) {
+            DataModel::instance()->stopFactory();
+            return false;
+        }
+    }
+    DataModel::instance()->stopFactory();
+
+    for (QDomElement element = mainElement.firstChildElement(LoadTagName); !element.isNull(); element = element.nextSiblingElement(LoadTagName)) {
+        if (!createLoadGenerator_hlpr(element))
+            return false;
+    }
+
+    return true;
+}
+
+bool BacnetSimulator::createSegment_hlpr(QDomElement &segmentCfg)
+{
+    QString name = segmentCfg.attribute(NameAttribute);
+    QHostAddress network;
+    if (name.isEmpty() || !network.setAddress(segmentCfg.attribute(NetworkAttribute))) {
+        ConfiguratorHelper::elementError(segmentCfg, NetworkAttribute);
+        return false;
+    }
+    bool ok;
+    int prefix = segmentCfg.attribute(PrefixAttribute, "24").toInt(&ok);
+    if (!ok || (prefix < 0) || (prefix > 32)) {
+        ConfiguratorHelper::elementError(segmentCfg, PrefixAttribute);
+        return false;
+    }
+    return BacnetLoopbackNetwork::instance()->addSegment(name, network, prefix);
+}
+
+bool BacnetSimulator::createNode_hlpr(QDomElement &nodeCfg, const QString &configDir)
+{
+    QString configPath = nodeCfg.attribute(ConfigAttribute);
+    if (configPath.isEmpty()) {
+        ConfiguratorHelper::elementError(nodeCfg, ConfigAttribute);
+        return false;
+    }
+    configPath = QDir(configDir).absoluteFilePath(configPath);
+
+    GatewayApplicationNS::BacnetProtocolInterface protocol;
+    QString validation;
+    if (!protocol.createProtocol(configPath, validation)) {
+        qDebug("%s : node %s can't be created!", __PRETTY_FUNCTION__, qPrintable(configPath));
+        return false;
+    }
+    return true;
+}
+
+bool BacnetSimulator::createLoadGenerator_hlpr(QDomElement &loadCfg)
+{
+    BacnetSimLoadGenerator::Settings settings;
+    settings.name = loadCfg.attribute(NameAttribute, QString("load%1").arg(_generators.count()));
+    settings.segment = loadCfg.attribute(SegmentAttribute);
+    if (!addressAttribute_hlpr(loadCfg, AddressAttribute, settings.address, settings.port) ||
+        !addressAttribute_hlpr(loadCfg, TargetAttribute, settings.targetAddress, settings.targetPort))
+        return false;
+
+    bool ok;
+    settings.dnet = loadCfg.attribute(DnetAttribute).toInt(&ok);
+    if (!ok)
+        settings.dnet = -1;
+    if (settings.dnet >= 0) {
+        QString dadrStr = loadCfg.attribute(DadrAttribute);
+        BacnetAddress dadr;
+        if (!dadrStr.isEmpty()) {
+            if (!dadr.macAddressFromString(dadrStr)) {
+                ConfiguratorHelper::elementError(loadCfg, DadrAttribute);
+                return false;
+            }
+            settings.dadr = QByteArray((const char*)dadr.macPtr(), dadr.macAddrLength());
+        }
+    }
+
+    quint32 objectType = loadCfg.attribute(ObjectTypeAttribute, "0").toUInt();
+    quint32 objectInstance = loadCfg.attribute(ObjectInstanceAttribute, "0").toUInt();
+    settings.objectId = ((objectType & 0x3ff) << 22) | (objectInstance & 0x3fffff);
+    settings.propertyId = loadCfg.attribute(PropertyAttribute).toUInt(&ok);
+    if (!ok)
+        settings.propertyId = PresentValueProperty;
+    settings.rate = loadCfg.attribute(RateAttribute, "0").toDouble();
+    settings.window = loadCfg.attribute(WindowAttribute).toInt(&ok);
+    if (!ok)
+        settings.window = DefaultWindow;
+    settings.requestsCount = loadCfg.attribute(CountAttribute, "0").toULongLong();
+    settings.timeout_ms = loadCfg.attribute(TimeoutAttribute).toInt(&ok);
+    if (!ok)
+        settings.timeout_ms = DefaultTimeout_ms;
+
+    BacnetSimLoadGenerator *generator = new BacnetSimLoadGenerator(settings, this);
+    connect(generator, SIGNAL(finished()), this, SLOT(generatorFinished()));
+    _generators.append(generator);
+    return true;
+}
+
+void BacnetSimulator::start()
+{
+    foreach (BacnetSimLoadGenerator *generator, _generators) {
+        if (!generator->start())
+            qDebug("%s : load generator couldn't be attached!", __PRETTY_FUNCTION__);
+    }
+    if (_duration_ms > 0)
+        _durationTimer.start(_duration_ms, this);
+    _reportTimer.start(_reportInterval_ms, this);
+}
+
+void BacnetSimulator::timerEvent(QTimerEvent *event)
+{
+    if (event->timerId() == _reportTimer.timerId())
+        report();
+    else if (event->timerId() == _durationTimer.timerId())
+        finish();
+    else
+        QObject::timerEvent(event);
+}
+
+void BacnetSimulator::generatorFinished()
+{
+    foreach (BacnetSimLoadGenerator *generator, _generators) {
+        if (!generator->isFinished())
+            return;
+    }
+    finish();
+}
+
+void BacnetSimulator::report()
+{
+    qDebug("---- Simulation report ----");
+    foreach (BacnetSimLoadGenerator *generator, _generators)
+        generator->printReport();
+
+    BacnetLoopbackNetwork *network = BacnetLoopbackNetwork::instance();
+    foreach (const BacnetLoopbackNetwork::HopStatistics &hop, network->hopStatistics()) {
+        qDebug("hop %s -> %s: %llu datagrams, %llu bytes, latency avg %.1f us, max %.1f us",
+               qPrintable(hop.fromName), qPrintable(hop.toName), hop.datagramsCount, hop.bytesCount,
+               (0 == hop.datagramsCount) ? 0.0 : (hop.totalLatency_ns / 1000.0 / hop.datagramsCount), hop.maxLatency_ns / 1000.0);
+    }
+    qDebug("datagrams dropped by loopback network: %llu", network->droppedCount());
+
+    for (int i = 0; i < BacnetBufferManager::SizeClassesCount; ++i) {
+        BacnetBufferManager::Statistics stats = BacnetBufferManager::instance()->statistics((BacnetBufferManager::SizeClass)i);
+        qDebug("buffers class %d: allocated %d, in use %d, high water mark %d, exhausted %llu times",
+               i, stats.allocatedCount, stats.inUseCount, stats.highWaterMark, stats.exhaustedCount);
+    }
+}
+
+void BacnetSimulator::finish()
+{
+    _durationTimer.stop();
+    _reportTimer.stop();
+    foreach (BacnetSimLoadGenerator *generator, _generators)
+        generator->stop();
+    report();
+    QMetaObject::invokeMethod(QCoreApplication::instance(), "quit", Qt::QueuedConnection);
+}
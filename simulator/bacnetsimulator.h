@@ -0,0 +1,60 @@
+#ifndef BACNETSIMULATOR_H
+#define BACNETSIMULATOR_H
+
+#include <QObject>
+#include <QDomElement>
+#include <QBasicTimer>
+
+class BacnetSimLoadGenerator;
+
+/**
+  Builds a topology of gateway stacks connected with \sa BacnetLoopbackNetwork, drives load through it and reports what happened.
+  Topology is read from XML:
+
+  <simulator duration-ms="30000" report-interval-ms="5000">
+      <segment name="lan1" network="10.0.1.0" prefix="24"/>
+      <node config="gw1.xml"/>
+      <load name="client1" segment="lan1" address="10.0.1.100:47808" target="10.0.1.1:47808" dnet="5" dadr="00:00:00:01"
+            object-type="0" object-instance="1" property="85" rate="100" window="16" count="10000" timeout-ms="3000"/>
+  </simulator>
+
+  Each node is a usual BACnet config (transportLayer, networkLayer, appLayer), which ports are of type="loopback" and point to the
+  segments - so N ports per node, BBMDs (bbmd="true" ports) and remote networks are set the same way as for the real gateway.
+  */
+class BacnetSimulator:
+        public QObject
+{
+    Q_OBJECT
+public:
+    BacnetSimulator(QObject *parent = 0);
+
+    //! Reads topology and creates all the nodes. Returns false, if anything failed.
+    bool load(const QString &configPath);
+    //! Starts load generators. Simulation ends when all of them are done or duration elapses - application quits then.
+    void start();
+
+protected:
+    void timerEvent(QTimerEvent *);
+
+private slots:
+    void generatorFinished();
+
+private:
+    bool createSegment_hlpr(QDomElement &segmentCfg);
+    bool createNode_hlpr(QDomElement &nodeCfg, const QString &configDir);
+    bool createLoadGenerator_hlpr(QDomElement &loadCfg);
+
+    void report();
+    void finish();
+
+private:
+    static const int DefaultReportInterval_ms = 5000;
+
+    QList<BacnetSimLoadGenerator*> _generators;
+    int _duration_ms;
+    int _reportInterval_ms;
+    QBasicTimer _durationTimer;
+    QBasicTimer _reportTimer;
+};
+
+#endif // BACNETSIMULATOR_H
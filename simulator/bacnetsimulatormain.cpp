@@ -0,0 +1,26 @@
+#include <QtCore/QCoreApplication>
+
+#include "bacnetsimulator.h"
+
+/**
+  Multi-node simulator harness - several gateway stacks connected in memory (\sa BacnetLoopbackNetwork), loaded with requests.
+  Usage: BACnet_Sim <simulator-config.xml>
+  */
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+
+    if (argc < 2) {
+        qDebug("Usage: %s <simulator-config.xml>", argv[0]);
+        return 1;
+    }
+
+    BacnetSimulator simulator;
+    if (!simulator.load(QString::fromLocal8Bit(argv[1]))) {
+        qDebug("Simulation couldn't be set up, terminate!");
+        return 1;
+    }
+    simulator.start();
+
+    return a.exec();
+}
@@ -0,0 +1,307 @@
+#include "timingwheel.h"
+
+#include <QThread>
+#include <QTimerEvent>
+
+TimingWheel *TimingWheel::_instance = 0;
+
+//! Returns index of the lowest bit set. Value must not be 0.
+static int lowestBitSet(quint64 value)
+{
+    Q_ASSERT(0 != value);
+    int bit = 0;
+    if (0 == (value & Q_UINT64_C(0xffffffff))) {value >>= 32; bit += 32;}
+    if (0 == (value & 0xffff)) {value >>= 16; bit += 16;}
+    if (0 == (value & 0xff)) {value >>= 8; bit += 8;}
+    if (0 == (value & 0xf)) {value >>= 4; bit += 4;}
+    if (0 == (value & 0x3)) {value >>= 2; bit += 2;}
+    if (0 == (value & 0x1)) {bit += 1;}
+    return bit;
+}
+
+TimingWheel::Node::Node():
+    prev(-1),
+    next(-1),
+    list(-1),
+    expires(0),
+    client(0),
+    cookie(0),
+    generation(1)
+{
+}
+
+TimingWheel::TimingWheel(QObject *parent):
+    QObject(parent),
+    _freeHead(-1),
+    _pendingCount(0),
+    _currentTick(0),
+    _scheduledTick(0)
+{
+    //list heads point to themselves, when the list is empty
+    _nodes.resize(FirstTimerNode);
+    for (int i = 0; i < FirstTimerNode; ++i) {
+        _nodes[i].prev = i;
+        _nodes[i].next = i;
+    }
+    for (int level = 0; level < LevelsCount; ++level)
+        _occupied[level] = 0;
+    _clock.start();
+}
+
+TimingWheel *TimingWheel::instance()
+{
+    if (0 == _instance)
+        _instance = new TimingWheel();
+
+    return _instance;
+}
+
+quint32 TimingWheel::now_hlpr() const
+{
+    //ticks are compared by their difference only, so it's fine when they wrap
+    return (quint32)_clock.elapsed();
+}
+
+TimingWheel::TimerId TimingWheel::arm(int timeout_ms, TimingWheelClient *client, quintptr cookie)
+{
+    Q_CHECK_PTR(client);
+    Q_ASSERT(QThread::currentThread() == thread());
+    if (0 == client)
+        return InvalidTimerId;
+
+    int nodeIdx = allocNode_hlpr();
+    if (nodeIdx < 0) {
+        qDebug("%s : no more timers may be armed!", __PRETTY_FUNCTION__);
+        return InvalidTimerId;
+    }
+
+    quint32 now = now_hlpr();
+    //wheel doesn't tick when empty - it's just moved to the present
+    if ( (0 == _pendingCount) && ((qint32)(now - _currentTick) > 0) )
+        _currentTick = now;
+    ++_pendingCount;
+
+    Node &node = _nodes[nodeIdx];
+    node.expires = now + qBound(0, timeout_ms, (int)MaxTimeout_ms);
+    node.client = client;
+    node.cookie = cookie;
+    place_hlpr(nodeIdx);
+
+    if ( !_timer.isActive() || ((qint32)(_nodes[nodeIdx].expires - _scheduledTick) < 0) )
+        reschedule_hlpr();
+
+    return ((TimerId)_nodes[nodeIdx].generation << IndexBits) | nodeIdx;
+}
+
+bool TimingWheel::cancel(TimerId id)
+{
+    int nodeIdx = id & IndexMask;
+    if ( (nodeIdx < FirstTimerNode) || (nodeIdx >= _nodes.size()) )
+        return false;
+    const Node &node = _nodes.at(nodeIdx);
+    if ( (node.generation != (id >> IndexBits)) || (node.list < 0) )
+        return false;
+
+    //timer is left running - waking up for nothing once is cheaper than finding the next slot
+    freeNode_hlpr(nodeIdx);
+    return true;
+}
+
+void TimingWheel::restart(TimerId &id, int timeout_ms, TimingWheelClient *client, quintptr cookie)
+{
+    cancel(id);
+    id = arm(timeout_ms, client, cookie);
+}
+
+int TimingWheel::pendingCount() const
+{
+    return _pendingCount;
+}
+
+int TimingWheel::allocNode_hlpr()
+{
+    if (_freeHead >= 0) {
+        int nodeIdx = _freeHead;
+        _freeHead = _nodes.at(nodeIdx).next;
+        return nodeIdx;
+    }
+
+    if (_nodes.size() > IndexMask)
+        return -1;
+    _nodes.append(Node());
+    return _nodes.size() - 1;
+}
+
+void TimingWheel::freeNode_hlpr(int nodeIdx)
+{
+    unlink_hlpr(nodeIdx);
+    Node &node = _nodes[nodeIdx];
+    node.client = 0;
+    //old ids of the node become stale - generation is never 0, so neither is a timer id
+    node.generation = (node.generation < GenerationMask) ? (node.generation + 1) : 1;
+    node.next = _freeHead;
+    _freeHead = nodeIdx;
+
+    --_pendingCount;
+    Q_ASSERT(_pendingCount >= 0);
+    if (0 == _pendingCount)
+        _timer.stop();
+}
+
+void TimingWheel::link_hlpr(int nodeIdx, int list)
+{
+    Node &node = _nodes[nodeIdx];
+    Node &head = _nodes[list];
+    node.prev = head.prev;
+    node.next = list;
+    node.list = list;
+    _nodes[head.prev].next = nodeIdx;
+    head.prev = nodeIdx;
+
+    if (list < ExpiringList)
+        _occupied[list >> SlotBits] |= (Q_UINT64_C(1) << (list & SlotMask));
+}
+
+void TimingWheel::unlink_hlpr(int nodeIdx)
+{
+    Node &node = _nodes[nodeIdx];
+    int list = node.list;
+    Q_ASSERT(list >= 0);
+    _nodes[node.prev].next = node.next;
+    _nodes[node.next].prev = node.prev;
+    node.list = -1;
+
+    if ( (list < ExpiringList) && (_nodes.at(list).next == list) )
+        _occupied[list >> SlotBits] &= ~(Q_UINT64_C(1) << (list & SlotMask));
+}
+
+void TimingWheel::place_hlpr(int nodeIdx)
+{
+    Node &node = _nodes[nodeIdx];
+    qint32 delta = (qint32)(node.expires - _currentTick);
+    int list;
+    if (delta < 0) {
+        //it's overdue (wheel lags behind the clock) - the next tick processed fires it
+        node.expires = _currentTick;
+        list = _currentTick & SlotMask;
+    } else {
+        if (delta > MaxTimeout_ms) {
+            delta = MaxTimeout_ms;
+            node.expires = _currentTick + delta;
+        }
+        int level = 0;
+        while (delta >= (1 << ((level + 1) * SlotBits)))
+            ++level;
+        Q_ASSERT(level < LevelsCount);
+        list = (level << SlotBits) + ((node.expires >> (level * SlotBits)) & SlotMask);
+    }
+    link_hlpr(nodeIdx, list);
+}
+
+int TimingWheel::cascade_hlpr(int level)
+{
+    int slot = (_currentTick >> (level * SlotBits)) & SlotMask;
+    int list = (level << SlotBits) + slot;
+    if (_nodes.at(list).next == list)
+        return slot;
+
+    //list is detached first - none of its timers goes back there, but it's cheap to be sure
+    int nodeIdx = _nodes.at(list).next;
+    _nodes[_nodes.at(list).prev].next = -1;
+    _nodes[list].next = list;
+    _nodes[list].prev = list;
+    _occupied[level] &= ~(Q_UINT64_C(1) << slot);
+
+    while (nodeIdx >= 0) {
+        int nextIdx = _nodes.at(nodeIdx).next;
+        _nodes[nodeIdx].list = -1;
+        place_hlpr(nodeIdx);
+        nodeIdx = nextIdx;
+    }
+    return slot;
+}
+
+void TimingWheel::processTick_hlpr()
+{
+    int slot = _currentTick & SlotMask;
+    if (0 == slot) {
+        //the first level wrapped - fill it from the higher ones
+        for (int level = 1; level < LevelsCount; ++level) {
+            if (0 != cascade_hlpr(level))
+                break;
+        }
+    }
+
+    //timers armed by clients, while others are fired, mustn't go to the list being fired
+    while (_nodes.at(slot).next != slot) {
+        int nodeIdx = _nodes.at(slot).next;
+        unlink_hlpr(nodeIdx);
+        link_hlpr(nodeIdx, ExpiringList);
+    }
+    ++_currentTick;
+
+    while (_nodes.at(ExpiringList).next != ExpiringList) {
+        int nodeIdx = _nodes.at(ExpiringList).next;
+        TimingWheelClient *client = _nodes.at(nodeIdx).client;
+        quintptr cookie = _nodes.at(nodeIdx).cookie;
+        freeNode_hlpr(nodeIdx);
+        client->timerExpired(cookie);
+    }
+}
+
+quint32 TimingWheel::nextEventTick_hlpr() const
+{
+    Q_ASSERT(_pendingCount > 0);
+    quint32 nearest = 0;
+    bool found = false;
+    for (int level = 0; level < LevelsCount; ++level) {
+        quint64 occupied = _occupied[level];
+        if (0 == occupied)
+            continue;
+
+        //slots of the level are visited on its boundaries only - find the first occupied one from the next boundary on
+        int shift = level * SlotBits;
+        quint32 period = 1u << shift;
+        quint32 boundary = (_currentTick + period - 1) & ~(period - 1);
+        int slot = (boundary >> shift) & SlotMask;
+        if (0 != slot)
+            occupied = (occupied >> slot) | (occupied << (SlotsCount - slot));
+        quint32 tick = boundary + (quint32)lowestBitSet(occupied) * period;
+
+        if (!found || ((qint32)(tick - nearest) < 0)) {
+            nearest = tick;
+            found = true;
+        }
+    }
+    Q_ASSERT(found);
+    return nearest;
+}
+
+void TimingWheel::reschedule_hlpr()
+{
+    Q_ASSERT(_pendingCount > 0);
+    _scheduledTick = nextEventTick_hlpr();
+    qint32 delay = (qint32)(_scheduledTick - now_hlpr());
+    _timer.start(qMax(0, delay), this);
+}
+
+void TimingWheel::timerEvent(QTimerEvent *e)
+{
+    Q_UNUSED(e);
+    Q_ASSERT(e->timerId() == _timer.timerId());
+
+    quint32 now = now_hlpr();
+    while (_pendingCount > 0) {
+        quint32 tick = nextEventTick_hlpr();
+        if ((qint32)(tick - now) > 0)
+            break;
+        //nothing happens on ticks in between
+        _currentTick = tick;
+        processTick_hlpr();
+    }
+
+    if (_pendingCount > 0)
+        reschedule_hlpr();
+    else
+        _timer.stop();
+}
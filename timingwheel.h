@@ -0,0 +1,121 @@
+#ifndef TIMINGWHEEL_H
+#define TIMINGWHEEL_H
+
+#include <QObject>
+#include <QBasicTimer>
+#include <QElapsedTimer>
+#include <QVector>
+
+/**
+  Interface of objects scheduling timeouts on \sa TimingWheel.
+  */
+class TimingWheelClient
+{
+public:
+    virtual ~TimingWheelClient() {}
+    //! Called when timer armed with the cookie expires. The timer is already released then - it may be armed again at once.
+    virtual void timerExpired(quintptr cookie) = 0;
+};
+
+/**
+  Hierarchical timing wheel, shared by everything waiting for a timeout (transactions, segments, discoveries, asynchronous actions).
+  Arming and cancelling a timer is O(1) - timer sits in a list of the slot it expires in. Wheel has four levels of 64 slots each,
+  ticking every millisecond: the first level covers the following 64 ms, each further one is 64 times coarser. Timers of higher
+  levels are cascaded down, when lower level wraps (Linux kernel timer wheel does the same), so the work done on a tick is proportional
+  to the number of timers expiring, not to the number of timers pending.
+
+  Wheel doesn't tick, if there is nothing to be done - its timer is started for the nearest slot holding anything, and stopped when
+  no timer is pending.
+
+  \note Timers are kept in one vector and linked by indices, so nothing is allocated once the vector has grown to the peak number of
+  timers. Timer ids carry generation of the node, so cancelling the timer which has already expired (or was cancelled) is harmless.
+  \note It's meant to be used in the main thread only.
+  */
+class TimingWheel:
+        public QObject
+{
+    Q_OBJECT
+public:
+    typedef quint32 TimerId;
+    static const TimerId InvalidTimerId = 0;
+    //! Longer timeouts are shortened to that one (it's over 4.5 hour).
+    static const int MaxTimeout_ms = (1 << 24) - 1;
+
+    static TimingWheel *instance();
+
+    /**
+      Arms timer expiring in timeout_ms milliseconds - then client's \sa TimingWheelClient::timerExpired() is called with the cookie.
+      Returns id of the timer or \sa InvalidTimerId, if it couldn't be armed.
+      */
+    TimerId arm(int timeout_ms, TimingWheelClient *client, quintptr cookie = 0);
+    //! Cancels the timer. Returns false, if it has already expired, was cancelled before, or id is invalid.
+    bool cancel(TimerId id);
+    //! Cancels the timer and arms it again with the new timeout. Id is updated.
+    void restart(TimerId &id, int timeout_ms, TimingWheelClient *client, quintptr cookie = 0);
+
+    int pendingCount() const;
+
+protected:
+    void timerEvent(QTimerEvent *);
+
+private:
+    TimingWheel(QObject *parent = 0);
+    static TimingWheel *_instance;
+
+    enum {
+        LevelsCount = 4,
+        SlotBits = 6,
+        SlotsCount = 1 << SlotBits,
+        SlotMask = SlotsCount - 1,
+        //! Node of the list timers are moved to, just before they are fired.
+        ExpiringList = LevelsCount * SlotsCount,
+        FirstTimerNode = ExpiringList + 1,
+        IndexBits = 16,
+        IndexMask = (1 << IndexBits) - 1,
+        GenerationMask = (1 << (32 - IndexBits)) - 1
+    };
+
+    //! Timer or the list head (these are the first nodes - one per slot and \sa ExpiringList).
+    class Node
+    {
+    public:
+        Node();
+
+    public:
+        int prev;
+        int next;
+        //! List the node is on, -1 when it's free.
+        int list;
+        quint32 expires;
+        TimingWheelClient *client;
+        quintptr cookie;
+        quint16 generation;
+    };
+    QVector<Node> _nodes;
+    int _freeHead;
+    int _pendingCount;
+    //! Bit is set, when the slot of the level is not empty.
+    quint64 _occupied[LevelsCount];
+
+    //! The next tick to be processed.
+    quint32 _currentTick;
+    QElapsedTimer _clock;
+    QBasicTimer _timer;
+    quint32 _scheduledTick;
+
+    quint32 now_hlpr() const;
+    int allocNode_hlpr();
+    void freeNode_hlpr(int nodeIdx);
+    void link_hlpr(int nodeIdx, int list);
+    void unlink_hlpr(int nodeIdx);
+    //! Puts the timer into the slot, it belongs to - relatively to the current tick.
+    void place_hlpr(int nodeIdx);
+    //! Moves timers of the level slot one level down (or wherever they belong now). Returns slot index.
+    int cascade_hlpr(int level);
+    void processTick_hlpr();
+    //! Returns the nearest tick, when any timer expires or has to be cascaded. Wheel must not be empty.
+    quint32 nextEventTick_hlpr() const;
+    void reschedule_hlpr();
+};
+
+#endif // TIMINGWHEEL_H